@@ -0,0 +1,347 @@
+/******************************************************************************
+ * @file            badblocks.c
+ *****************************************************************************/
+#if     defined (__linux__)
+# define    _GNU_SOURCE
+#elif   !defined (__PDOS__) && !defined (_WIN32)
+# define    _POSIX_C_SOURCE             200112L
+#endif
+
+#include    <errno.h>
+#include    <stddef.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+
+#if     defined (__GNUC__) && !defined (__PDOS__) && !defined (_WIN32)
+# define    BADBLOCKS_POSIX
+# include   <fcntl.h>
+# include   <unistd.h>
+#endif
+
+#include    "badblocks.h"
+
+/**
+ * O_DIRECT wants the buffer, the offsets and the lengths aligned to the
+ * device's logical block size; 4096 covers every device in use.
+ */
+#define     BADBLOCKS_ALIGN             4096
+
+struct scan_state {
+
+    unsigned long start, unit;
+    int flags;
+    
+    unsigned char *buffer, *pattern;
+    
+    unsigned long *bad;
+    size_t nb_bad, nb_alloc;
+    
+#if     defined (BADBLOCKS_POSIX)
+    int fd;
+#else
+    FILE *fp;
+#endif
+
+};
+
+static int add_bad (struct scan_state *s, unsigned long index) {
+
+    unsigned long *bad;
+    
+    if (s->nb_bad == s->nb_alloc) {
+    
+        s->nb_alloc = (s->nb_alloc ? s->nb_alloc * 2 : 64);
+        
+        if (!(bad = realloc (s->bad, s->nb_alloc * sizeof (*bad)))) {
+            return -1;
+        }
+        
+        s->bad = bad;
+    
+    }
+    
+    s->bad[s->nb_bad++] = index;
+    return 0;
+
+}
+
+/** Move size bytes between the buffer and the target at the given unit; 0 only if all of them went. */
+static int transfer (struct scan_state *s, unsigned char *buffer, unsigned long index, unsigned long size, int write) {
+
+#if     defined (BADBLOCKS_POSIX)
+
+    off_t offset = (off_t) s->start + (off_t) index * s->unit;
+    ssize_t n;
+    
+    while (size > 0) {
+    
+        n = (write ? pwrite (s->fd, buffer, size, offset) : pread (s->fd, buffer, size, offset));
+        
+        if (n <= 0) {
+        
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            
+            return -1;
+        
+        }
+        
+        buffer += n;
+        offset += n;
+        
+        size -= (unsigned long) n;
+    
+    }
+    
+    return 0;
+
+#else
+
+    if (fseek (s->fp, (long) (s->start + index * s->unit), SEEK_SET)) {
+        return -1;
+    }
+    
+    if (write) {
+        return (fwrite (buffer, 1, size, s->fp) == size && fflush (s->fp) == 0) ? 0 : -1;
+    }
+    
+    return (fread (buffer, 1, size, s->fp) == size) ? 0 : -1;
+
+#endif
+
+}
+
+/**
+ * The write test pattern for a unit: alternating bits, with the unit's
+ * own index at the start so that a card which wraps its writes around
+ * (as fake-capacity media do) reads back the wrong unit and is caught.
+ */
+static void fill_pattern (struct scan_state *s, unsigned char *p, unsigned long index) {
+
+    memset (p, (index & 1) ? 0x55 : 0xAA, s->unit);
+    
+    p[0] = (unsigned char) (index & 0xFF);
+    p[1] = (unsigned char) ((index >> 8) & 0xFF);
+    p[2] = (unsigned char) ((index >> 16) & 0xFF);
+    p[3] = (unsigned char) ((index >> 24) & 0xFF);
+
+}
+
+/** Write the pattern over n units from first and make sure what is read next comes from the medium. */
+static void write_pattern (struct scan_state *s, unsigned long first, unsigned long n) {
+
+    unsigned long i;
+    
+    for (i = 0; i < n; i++) {
+        fill_pattern (s, s->buffer + (i * s->unit), first + i);
+    }
+    
+    if (transfer (s, s->buffer, first, n * s->unit, 1) < 0) {
+    
+        /** Units that fail on their own show up when they are read back. */
+        for (i = 0; i < n; i++) {
+            transfer (s, s->buffer + (i * s->unit), first + i, s->unit, 1);
+        }
+    
+    }
+    
+#if     defined (BADBLOCKS_POSIX)
+    
+    fsync (s->fd);
+    
+    if (!(s->flags & BADBLOCKS_DIRECT)) {
+        posix_fadvise (s->fd, (off_t) s->start + (off_t) first * s->unit, (off_t) n * s->unit, POSIX_FADV_DONTNEED);
+    }
+
+#endif
+
+}
+
+/** Check one unit on its own, after a large read covering it failed or did not match. */
+static int check_unit (struct scan_state *s, unsigned long index) {
+
+    if (transfer (s, s->buffer, index, s->unit, 0) < 0) {
+        return 1;
+    }
+    
+    if (s->flags & BADBLOCKS_WRITE) {
+    
+        fill_pattern (s, s->pattern, index);
+        return (memcmp (s->buffer, s->pattern, s->unit) != 0);
+    
+    }
+    
+    return 0;
+
+}
+
+static int check_chunk (struct scan_state *s, unsigned long first, unsigned long n) {
+
+    unsigned long i;
+    int failed = 0;
+    
+    if (s->flags & BADBLOCKS_WRITE) {
+        write_pattern (s, first, n);
+    }
+    
+    if (transfer (s, s->buffer, first, n * s->unit, 0) < 0) {
+        failed = 1;
+    } else if (s->flags & BADBLOCKS_WRITE) {
+    
+        for (i = 0; i < n && !failed; i++) {
+        
+            fill_pattern (s, s->pattern, first + i);
+            failed = (memcmp (s->buffer + (i * s->unit), s->pattern, s->unit) != 0);
+        
+        }
+    
+    }
+    
+    /** The large transfer only says something in the chunk is bad; find out which units. */
+    for (i = 0; failed && i < n; i++) {
+    
+        if (check_unit (s, first + i) && add_bad (s, first + i) < 0) {
+            return -1;
+        }
+    
+    }
+    
+    return 0;
+
+}
+
+static int open_target (struct scan_state *s, const char *path) {
+
+#if     defined (BADBLOCKS_POSIX)
+
+    int flags = ((s->flags & BADBLOCKS_WRITE) ? O_RDWR : O_RDONLY);
+    
+# if    defined (O_DIRECT)
+    
+    if ((s->flags & BADBLOCKS_DIRECT) && s->start % BADBLOCKS_ALIGN == 0 && s->unit % BADBLOCKS_ALIGN == 0) {
+    
+        if ((s->fd = open (path, flags | O_DIRECT)) >= 0) {
+            return 0;
+        }
+    
+    }
+
+# endif
+    
+    /** Without O_DIRECT (or where the layout is not aligned for it) the page cache is told to expect a straight run. */
+    s->flags &= ~BADBLOCKS_DIRECT;
+    
+    if ((s->fd = open (path, flags)) < 0) {
+        return -1;
+    }
+    
+    posix_fadvise (s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return 0;
+
+#else
+
+    s->flags &= ~BADBLOCKS_DIRECT;
+    
+    if (!(s->fp = fopen (path, (s->flags & BADBLOCKS_WRITE) ? "r+b" : "rb"))) {
+        return -1;
+    }
+    
+    return 0;
+
+#endif
+
+}
+
+static void close_target (struct scan_state *s) {
+
+#if     defined (BADBLOCKS_POSIX)
+    close (s->fd);
+#else
+    fclose (s->fp);
+#endif
+
+}
+
+/**
+ * Check count units of unit bytes, starting start bytes into path, and
+ * return the index of every unit that could not be read (or, with
+ * BADBLOCKS_WRITE, did not read back the test pattern written to it) in
+ * *pbad.  The target is read BADBLOCKS_CHUNK bytes at a time, straight
+ * from the device with BADBLOCKS_DIRECT where the system allows it, and
+ * only a chunk that fails is gone over again one unit at a time.
+ *
+ * BADBLOCKS_WRITE destroys whatever was in the range.
+ */
+int badblocks_scan (const char *path, unsigned long start, unsigned long count, unsigned long unit, int flags, unsigned long **pbad, size_t *pnb_bad) {
+
+    struct scan_state s;
+    
+    unsigned long per_chunk, first, n;
+    void *memory = 0;
+    
+    if (unit == 0 || unit > BADBLOCKS_CHUNK) {
+        return -1;
+    }
+    
+    memset (&s, 0, sizeof (s));
+    
+    s.start = start;
+    s.unit = unit;
+    s.flags = flags;
+    
+    per_chunk = BADBLOCKS_CHUNK / unit;
+    
+#if     defined (BADBLOCKS_POSIX)
+    
+    if (posix_memalign (&memory, BADBLOCKS_ALIGN, (per_chunk * unit) + unit) != 0) {
+        return -1;
+    }
+
+#else
+
+    if (!(memory = malloc ((per_chunk * unit) + unit))) {
+        return -1;
+    }
+
+#endif
+    
+    s.buffer = memory;
+    s.pattern = s.buffer + (per_chunk * unit);
+    
+    if (open_target (&s, path) < 0) {
+    
+        free (memory);
+        return -1;
+    
+    }
+    
+    for (first = 0; first < count; first += n) {
+    
+        if ((n = count - first) > per_chunk) {
+            n = per_chunk;
+        }
+        
+        if (check_chunk (&s, first, n) < 0) {
+        
+            close_target (&s);
+            
+            free (s.bad);
+            free (memory);
+            
+            return -1;
+        
+        }
+    
+    }
+    
+    close_target (&s);
+    free (memory);
+    
+    *pbad = s.bad;
+    *pnb_bad = s.nb_bad;
+    
+    return 0;
+
+}
@@ -0,0 +1,16 @@
+/******************************************************************************
+ * @file            badblocks.h
+ *****************************************************************************/
+#ifndef     _BADBLOCKS_H
+#define     _BADBLOCKS_H
+
+#include    <stddef.h>
+
+#define     BADBLOCKS_DIRECT            0x0001
+#define     BADBLOCKS_WRITE             0x0002
+
+#define     BADBLOCKS_CHUNK             (1024UL * 1024)
+
+int badblocks_scan (const char *path, unsigned long start, unsigned long count, unsigned long unit, int flags, unsigned long **pbad, size_t *pnb_bad);
+
+#endif      /* _BADBLOCKS_H */
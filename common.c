@@ -1,6 +1,11 @@
 /******************************************************************************
  * @file            common.c
  *****************************************************************************/
+#if     !defined (__PDOS__) && !defined (_WIN32)
+# define    _POSIX_C_SOURCE             200112L
+#endif
+
+#include    <ctype.h>
 #include    <errno.h>
 #include    <stdarg.h>
 #include    <stdio.h>
@@ -19,39 +24,64 @@
 
 #include    "common.h"
 
-unsigned short generate_datestamp (void) {
-
-#if     defined (__GNUC__) && !defined (__PDOS__)
-    struct timeval create_timeval;
-#else
-    time_t create_time;
-#endif
+/** Read str, a count of seconds since the epoch as in SOURCE_DATE_EPOCH, into *pdate. */
+int parse_source_date (const char *str, time_t *pdate) {
 
-    struct tm *ctime = NULL;
+    unsigned long conversion;
+    char *temp;
     
-#if     defined (__GNUC__) && !defined (__PDOS__)
+    errno = 0;
+    conversion = strtoul (str, &temp, 10);
     
-    if (gettimeofday (&create_timeval, 0) == 0 && create_timeval.tv_sec != (time_t) -1) {
-        ctime = localtime ((time_t *) &create_timeval.tv_sec);
+    if (!isdigit ((int) *str) || errno || *temp || (time_t) conversion < 0) {
+        return -1;
     }
+    
+    *pdate = (time_t) conversion;
+    return 0;
 
-#else
+}
 
-    if (time (&create_time) != 0 && create_time != 0) {
-        ctime = localtime (&create_time);
+/** Read SOURCE_DATE_EPOCH into *pdate.  Returns 1 if it is set, 0 if not and -1 if it is malformed. */
+int source_date_from_env (time_t *pdate) {
+
+    const char *p;
+    
+    if (!(p = getenv ("SOURCE_DATE_EPOCH")) || *p == '\0') {
+        return 0;
     }
+    
+    return (parse_source_date (p, pdate) < 0 ? -1 : 1);
 
-#endif
+}
+
+static struct tm *break_down (const time_t *t, int utc, struct tm *buf) {
+
+#if     !defined (__PDOS__) && !defined (_WIN32)
+
+    return (utc ? gmtime_r (t, buf) : localtime_r (t, buf));
+
+#else
+
+    struct tm *tm = (utc ? gmtime (t) : localtime (t));
     
-    if (ctime != NULL && ctime->tm_year >= 80 && ctime->tm_year <= 207) {
-        return (unsigned short) (ctime->tm_mday + ((ctime->tm_mon + 1) << 5) + ((ctime->tm_year - 80) << 9));
+    if (tm == NULL) {
+        return NULL;
     }
     
-    return 1 + (1 << 5);
+    *buf = *tm;
+    return buf;
+
+#endif
 
 }
 
-unsigned short generate_timestamp (void) {
+/**
+ * The time new entries are stamped with, broken down into buf.  With a
+ * source_date every stamp is taken from it (read as UTC) instead of the
+ * clock, so the same inputs always give the same image.
+ */
+static struct tm *stamp_time (const time_t *source_date, struct tm *buf) {
 
 #if     defined (__GNUC__) && !defined (__PDOS__)
     struct timeval create_timeval;
@@ -59,22 +89,47 @@ unsigned short generate_timestamp (void) {
     time_t create_time;
 #endif
 
-    struct tm *ctime = NULL;
+    if (source_date) {
+        return break_down (source_date, 1, buf);
+    }
     
 #if     defined (__GNUC__) && !defined (__PDOS__)
     
     if (gettimeofday (&create_timeval, 0) == 0 && create_timeval.tv_sec != (time_t) -1) {
-        ctime = localtime ((time_t *) &create_timeval.tv_sec);
+    
+        time_t t = create_timeval.tv_sec;
+        return break_down (&t, 0, buf);
+    
     }
 
 #else
 
     if (time (&create_time) != 0 && create_time != 0) {
-        ctime = localtime (&create_time);
+        return break_down (&create_time, 0, buf);
     }
 
 #endif
     
+    return NULL;
+
+}
+
+unsigned short generate_datestamp (const time_t *source_date) {
+
+    struct tm buf, *ctime = stamp_time (source_date, &buf);
+    
+    if (ctime != NULL && ctime->tm_year >= 80 && ctime->tm_year <= 207) {
+        return (unsigned short) (ctime->tm_mday + ((ctime->tm_mon + 1) << 5) + ((ctime->tm_year - 80) << 9));
+    }
+    
+    return 1 + (1 << 5);
+
+}
+
+unsigned short generate_timestamp (const time_t *source_date) {
+
+    struct tm buf, *ctime = stamp_time (source_date, &buf);
+    
     if (ctime != NULL && ctime->tm_year >= 80 && ctime->tm_year <= 207) {
         return (unsigned short) ((ctime->tm_sec >> 1) + (ctime->tm_min << 5) + (ctime->tm_hour << 11));
     }
@@ -82,3 +137,28 @@ unsigned short generate_timestamp (void) {
     return 0;
 
 }
+
+/** Convert a host time to the DOS date and time of a directory entry; host times later than a source_date are clamped to it. */
+void dos_stamp_from_time (time_t t, const time_t *source_date, unsigned short *pdate, unsigned short *ptime) {
+
+    struct tm buf, *ctime;
+    
+    if (source_date) {
+        ctime = break_down (t > *source_date ? source_date : &t, 1, &buf);
+    } else {
+        ctime = break_down (&t, 0, &buf);
+    }
+    
+    if (ctime != NULL && ctime->tm_year >= 80 && ctime->tm_year <= 207) {
+    
+        *pdate = (unsigned short) (ctime->tm_mday + ((ctime->tm_mon + 1) << 5) + ((ctime->tm_year - 80) << 9));
+        *ptime = (unsigned short) ((ctime->tm_sec >> 1) + (ctime->tm_min << 5) + (ctime->tm_hour << 11));
+        
+        return;
+    
+    }
+    
+    *pdate = 1 + (1 << 5);
+    *ptime = 0;
+
+}
@@ -4,7 +4,14 @@
 #ifndef     _COMMON_H
 #define     _COMMON_H
 
-extern unsigned short generate_datestamp (void);
-extern unsigned short generate_timestamp (void);
+#include    <time.h>
+
+extern int parse_source_date (const char *str, time_t *pdate);
+extern int source_date_from_env (time_t *pdate);
+
+extern unsigned short generate_datestamp (const time_t *source_date);
+extern unsigned short generate_timestamp (const time_t *source_date);
+
+extern void dos_stamp_from_time (time_t t, const time_t *source_date, unsigned short *pdate, unsigned short *ptime);
 
 #endif      /* _COMMON_H */
@@ -0,0 +1,5353 @@
+/******************************************************************************
+ * @file            dosfs.c
+ *****************************************************************************/
+#if     !defined (__PDOS__) && !defined (_WIN32)
+# define    _POSIX_C_SOURCE             200809L
+#endif
+
+#include    <limits.h>
+#include    <stddef.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+
+#include    "common.h"
+#include    "dosfs.h"
+#include    "fatscan.h"
+#include    "msdos.h"
+#include    "write7x.h"
+
+#ifndef     __PDOS__
+# include   <sys/stat.h>
+#endif
+
+#ifndef     PATH_MAX
+# define    PATH_MAX                    2048
+#endif
+
+#define     DOSFS_COPY_SIZE             65536
+
+#define     DOSFS_INDEX_MAGIC           "DOSFSIX2"
+#define     DOSFS_INDEX_HEADER          64
+#define     DOSFS_INDEX_ID              32
+#define     DOSFS_INDEX_DEPTH           64
+
+/**
+ * Access to the FAT for one entry width.  dosfs_open picks the table for
+ * the image once, so nothing below it tests size_fat entry by entry.  read
+ * takes a raw FAT buffer; the others work on the handle's own FAT.
+ */
+struct dosfs_fat_ops {
+
+    unsigned int (*read) (const unsigned char *fat, unsigned int cluster);
+    unsigned int (*get) (struct dosfs_image *img, unsigned int cluster);
+    unsigned int (*set) (struct dosfs_image *img, unsigned int cluster, unsigned int value);
+    
+    unsigned int (*chain_length) (struct dosfs_image *img, unsigned int cluster);
+    unsigned int (*find_free) (struct dosfs_image *img, unsigned int cluster, unsigned int last);
+    unsigned int (*find_run) (struct dosfs_image *img, unsigned int cluster, unsigned int count);
+    
+    void (*clear_run) (struct dosfs_image *img, unsigned int first, unsigned int count);
+    
+    unsigned int end_of_chain;
+
+};
+
+static unsigned int read721 (const unsigned char *src) {
+    return (unsigned int) src[0] | (((unsigned int) src[1]) << 8);
+}
+
+static unsigned int read741 (const unsigned char *src) {
+    return (unsigned int) src[0] | (((unsigned int) src[1]) << 8) | (((unsigned int) src[2]) << 16) | (((unsigned int) src[3]) << 24);
+}
+
+static int seekto (struct dosfs_image *img, unsigned long offset) {
+    return fseek (img->fp, (long) ((img->offset * 512) + offset), SEEK_SET);
+}
+
+static int read_sectors (struct dosfs_image *img, unsigned long sector, unsigned long count, void *buffer) {
+
+    if (seekto (img, sector * 512) || fread (buffer, 512, count, img->fp) != count) {
+    
+        img->error = DOSFS_ERR_IO;
+        return -1;
+    
+    }
+    
+    return 0;
+
+}
+
+static int write_sectors (struct dosfs_image *img, unsigned long sector, unsigned long count, const void *buffer) {
+
+    if (img->flags & DOSFS_READONLY) {
+    
+        img->error = DOSFS_ERR_ROFS;
+        return -1;
+    
+    }
+    
+    img->written = 1;
+    
+    if (seekto (img, sector * 512) || fwrite (buffer, 512, count, img->fp) != count) {
+    
+        img->error = DOSFS_ERR_IO;
+        return -1;
+    
+    }
+    
+    return 0;
+
+}
+
+static unsigned long cluster_to_sector (struct dosfs_image *img, unsigned int cluster) {
+    return (unsigned long) img->data_area + ((unsigned long) (cluster - 2) * img->sectors_per_cluster);
+}
+
+static unsigned int end_of_chain (struct dosfs_image *img) {
+    return img->fat_ops->end_of_chain;
+}
+
+static int is_valid_cluster (struct dosfs_image *img, unsigned int cluster) {
+    return (cluster >= 2 && cluster <= img->cluster_count + 1);
+}
+
+static int canonical_to_dir (char *dest, const char *src) {
+
+    static const char invalid_chars[] = "\"*+,./:;<=>?[\\]|";
+    
+    int i, j;
+    int namelen = 0, dots = 0, extlen = 0;
+    
+    memset (dest, ' ', 11);
+    
+    if (*src == '\0' || *src == '.') {
+        return -1;
+    }
+    
+    for (j = i = 0; *src != '\0'; i++) {
+    
+        int c = (unsigned char) *src++;
+        
+        if (c == '/' || c == '\\') {
+            break;
+        }
+        
+        if (i >= 12) {
+            return -1;
+        }
+        
+        if (i == 0 && c == 0xE5) {
+        
+            /**
+             * 0xE5 in the first character of the name is a marker for delected files,
+             * it needs to be translated to 0x05.
+             */
+            c = 0x05;
+        
+        } else if (c == '.') {
+        
+            if (dots++) {
+                return -1;
+            }
+            
+            j = 8;
+            continue;
+        
+        }
+        
+        if (c <= 0x20 || strchr (invalid_chars, c)) {
+            return -1;
+        }
+        
+        if (dots) {
+        
+            if (++extlen > 3) {
+                return -1;
+            }
+        
+        } else {
+        
+            if (++namelen > 8) {
+                return -1;
+            }
+        
+        }
+        
+        if (c >= 'a' && c <= 'z') {
+            c -= 'a' - 'A';
+        }
+        
+        dest[j++] = c;
+    
+    }
+    
+    return 0;
+
+}
+
+static void dir_to_canonical (char *dest, const unsigned char *name) {
+
+    int i, k = 0;
+    
+    for (i = 0; i < 8 && name[i] != ' '; i++) {
+        dest[k++] = (i == 0 && name[i] == 0x05) ? (char) 0xE5 : (char) name[i];
+    }
+    
+    if (name[8] != ' ') {
+    
+        dest[k++] = '.';
+        
+        for (i = 8; i < 11 && name[i] != ' '; i++) {
+            dest[k++] = (char) name[i];
+        }
+    
+    }
+    
+    dest[k] = '\0';
+
+}
+
+static unsigned int read_fat12 (const unsigned char *fat, unsigned int cluster) {
+
+    unsigned int value = read721 (fat + cluster + (cluster / 2));
+    return (cluster & 1) ? (value >> 4) : (value & 0x0FFF);
+
+}
+
+static unsigned int read_fat16 (const unsigned char *fat, unsigned int cluster) {
+    return read721 (fat + ((unsigned long) cluster * 2));
+}
+
+static unsigned int read_fat32 (const unsigned char *fat, unsigned int cluster) {
+    return read741 (fat + ((unsigned long) cluster * 4)) & 0x0FFFFFFF;
+}
+
+static unsigned int get_fat12 (struct dosfs_image *img, unsigned int cluster) {
+    return img->fat12[cluster];
+}
+
+static unsigned int get_fat16 (struct dosfs_image *img, unsigned int cluster) {
+    return read_fat16 (img->fat, cluster);
+}
+
+static unsigned int get_fat32 (struct dosfs_image *img, unsigned int cluster) {
+    return read_fat32 (img->fat, cluster);
+}
+
+static void mark_fat_dirty (struct dosfs_image *img, unsigned long offset, unsigned long last) {
+
+    if (img->fat_dirty_hi < img->fat_dirty_lo) {
+    
+        img->fat_dirty_lo = offset;
+        img->fat_dirty_hi = last;
+    
+    } else {
+    
+        if (offset < img->fat_dirty_lo) {
+            img->fat_dirty_lo = offset;
+        }
+        
+        if (last > img->fat_dirty_hi) {
+            img->fat_dirty_hi = last;
+        }
+    
+    }
+
+}
+
+/** The setters return the value as stored, so callers can tell whether the entry became free. */
+static unsigned int set_fat12 (struct dosfs_image *img, unsigned int cluster, unsigned int value) {
+
+    unsigned long offset = cluster + (cluster / 2);
+    
+    img->fat12[cluster] = (unsigned short) (value & 0x0FFF);
+    mark_fat_dirty (img, offset, offset + 1);
+    
+    return value & 0x0FFF;
+
+}
+
+static unsigned int set_fat16 (struct dosfs_image *img, unsigned int cluster, unsigned int value) {
+
+    unsigned long offset = (unsigned long) cluster * 2;
+    
+    write721_to_byte_array (img->fat + offset, (unsigned short) (value & 0xFFFF));
+    mark_fat_dirty (img, offset, offset + 1);
+    
+    return value & 0xFFFF;
+
+}
+
+static unsigned int set_fat32 (struct dosfs_image *img, unsigned int cluster, unsigned int value) {
+
+    unsigned long offset = (unsigned long) cluster * 4;
+    
+    /** The high 4 bits of a FAT32 entry are reserved and must be preserved. */
+    write741_to_byte_array (img->fat + offset, (value & 0x0FFFFFFF) | (read741 (img->fat + offset) & 0xF0000000));
+    mark_fat_dirty (img, offset, offset + 3);
+    
+    return value & 0x0FFFFFFF;
+
+}
+
+/**
+ * A FAT12 table is worked on unpacked, one entry to an element of fat12,
+ * so no entry ever has to be pieced together from two bytes (or two
+ * sectors).  The packed copy in fat is brought up to date a sector range
+ * at a time by pack_fat12 just before it is written.  Three bytes hold
+ * two entries; a table whose size is not a multiple of three ends part
+ * way through a pair.
+ */
+static unsigned long fat12_entries (unsigned long size) {
+    return ((size + 2) / 3) * 2;
+}
+
+static void unpack_fat12 (unsigned short *entries, const unsigned char *fat, unsigned long size) {
+
+    unsigned long i, j;
+    
+    for (i = 0, j = 0; i + 2 < size; i += 3, j += 2) {
+    
+        entries[j] = (unsigned short) (fat[i] | ((fat[i + 1] & 0x0F) << 8));
+        entries[j + 1] = (unsigned short) ((fat[i + 1] >> 4) | (fat[i + 2] << 4));
+    
+    }
+    
+    if (i < size) {
+    
+        entries[j] = (unsigned short) (fat[i] | (i + 1 < size ? (fat[i + 1] & 0x0F) << 8 : 0));
+        entries[j + 1] = (unsigned short) (i + 1 < size ? fat[i + 1] >> 4 : 0);
+    
+    }
+
+}
+
+/** Pack the entries that make up bytes lo to hi of the table back into fat. */
+static void pack_fat12 (struct dosfs_image *img, unsigned long lo, unsigned long hi) {
+
+    unsigned long size = (unsigned long) img->sectors_per_fat * 512, i, j;
+    
+    for (i = (lo / 3) * 3, j = (lo / 3) * 2; i <= hi && i < size; i += 3, j += 2) {
+    
+        img->fat[i] = (unsigned char) (img->fat12[j] & 0xFF);
+        
+        if (i + 1 < size) {
+            img->fat[i + 1] = (unsigned char) ((img->fat12[j] >> 8) | ((img->fat12[j + 1] & 0x0F) << 4));
+        }
+        
+        if (i + 2 < size) {
+            img->fat[i + 2] = (unsigned char) (img->fat12[j + 1] >> 4);
+        }
+    
+    }
+
+}
+
+/**
+ * Mark count entries starting at first free, without touching the free
+ * count.  FAT16 and FAT32 runs are cleared in a single pass over the table.
+ */
+static void clear_run12 (struct dosfs_image *img, unsigned int first, unsigned int count) {
+
+    unsigned int last = first + count - 1;
+    
+    memset (img->fat12 + first, 0, (size_t) count * sizeof (*img->fat12));
+    mark_fat_dirty (img, first + (first / 2), last + (last / 2) + 1);
+
+}
+
+static void clear_run16 (struct dosfs_image *img, unsigned int first, unsigned int count) {
+
+    unsigned long offset = (unsigned long) first * 2;
+    
+    memset (img->fat + offset, 0, (size_t) count * 2);
+    mark_fat_dirty (img, offset, offset + (unsigned long) count * 2 - 1);
+
+}
+
+static void clear_run32 (struct dosfs_image *img, unsigned int first, unsigned int count) {
+
+    unsigned long offset = (unsigned long) first * 4;
+    unsigned int i;
+    
+    /** Keep the reserved high 4 bits of every entry. */
+    for (i = 0; i < count; i++) {
+    
+        memset (img->fat + offset + (unsigned long) i * 4, 0, 3);
+        img->fat[offset + (unsigned long) i * 4 + 3] &= 0xF0;
+    
+    }
+    
+    mark_fat_dirty (img, offset, offset + (unsigned long) count * 4 - 1);
+
+}
+
+/**
+ * Stamp out the loops that visit many entries for one FAT width.  Each
+ * instance calls its width's accessor directly, so the compiler can inline
+ * it and the loop body carries no test of the FAT type or its end-of-chain
+ * marker.
+ */
+#define     FAT_KERNELS(bits, eoc) \
+    \
+    static unsigned int chain_length##bits (struct dosfs_image *img, unsigned int cluster) { \
+        \
+        unsigned int count = 0, last = img->cluster_count + 1; \
+        \
+        while (cluster >= 2 && cluster <= last && count < img->cluster_count) { \
+        \
+            cluster = get_fat##bits (img, cluster); \
+            count++; \
+        \
+        } \
+        \
+        return count; \
+    \
+    } \
+    \
+    static unsigned int find_free##bits (struct dosfs_image *img, unsigned int cluster, unsigned int last) { \
+        \
+        for (; cluster <= last; cluster++) { \
+        \
+            if (get_fat##bits (img, cluster) == 0) { \
+                return cluster; \
+            } \
+        \
+        } \
+        \
+        return 0; \
+    \
+    } \
+    \
+    static unsigned int find_run##bits (struct dosfs_image *img, unsigned int cluster, unsigned int count) { \
+        \
+        unsigned int run = 0, i; \
+        \
+        for (i = 0; i < img->cluster_count; i++, cluster++) { \
+        \
+            if (cluster > img->cluster_count + 1) { \
+            \
+                cluster = 2; \
+                run = 0; \
+            \
+            } \
+            \
+            if (get_fat##bits (img, cluster) != 0) { \
+            \
+                run = 0; \
+                continue; \
+            \
+            } \
+            \
+            if (++run == count) { \
+                return cluster - count + 1; \
+            } \
+        \
+        } \
+        \
+        return 0; \
+    \
+    } \
+    \
+    static const struct dosfs_fat_ops fat_ops##bits = { read_fat##bits, get_fat##bits, set_fat##bits, chain_length##bits, find_free##bits, find_run##bits, clear_run##bits, eoc }
+
+FAT_KERNELS (12, 0x0FF8);
+FAT_KERNELS (16, 0xFFF8);
+FAT_KERNELS (32, 0x0FFFFFF8);
+
+static unsigned int fat_entry (struct dosfs_image *img, const unsigned char *fat, unsigned int cluster) {
+    return img->fat_ops->read (fat, cluster);
+}
+
+unsigned int dosfs_get_fat (struct dosfs_image *img, unsigned int cluster) {
+    return img->fat_ops->get (img, cluster);
+}
+
+void dosfs_set_fat (struct dosfs_image *img, unsigned int cluster, unsigned int value) {
+
+    unsigned int old = img->fat_ops->get (img, cluster);
+    value = img->fat_ops->set (img, cluster, value);
+    
+    if (cluster >= 2) {
+    
+        if (old == 0 && value != 0) {
+            img->free_clusters--;
+        } else if (old != 0 && value == 0) {
+            img->free_clusters++;
+        }
+    
+    }
+
+}
+
+/**
+ * Allocate a free cluster, preferring the one directly after prev so that
+ * files written in one go end up contiguous.  The new cluster is marked as
+ * the end of its chain and, if prev is non-zero, linked after prev.
+ */
+static unsigned int alloc_cluster (struct dosfs_image *img, unsigned int prev) {
+
+    unsigned int cluster = 0;
+    
+    if (!img->free_clusters) {
+    
+        img->error = DOSFS_ERR_NOSPC;
+        return 0;
+    
+    }
+    
+    if (prev && is_valid_cluster (img, prev + 1) && dosfs_get_fat (img, prev + 1) == 0) {
+        cluster = prev + 1;
+    } else {
+    
+        if (!is_valid_cluster (img, img->next_free)) {
+            img->next_free = 2;
+        }
+        
+        /** Search from the hint to the end of the FAT, then wrap around to the start. */
+        if (!(cluster = img->fat_ops->find_free (img, img->next_free, img->cluster_count + 1)) && img->next_free > 2) {
+            cluster = img->fat_ops->find_free (img, 2, img->next_free - 1);
+        }
+    
+    }
+    
+    if (!cluster) {
+    
+        img->error = DOSFS_ERR_NOSPC;
+        return 0;
+    
+    }
+    
+    dosfs_set_fat (img, cluster, end_of_chain (img));
+    
+    if (prev) {
+        dosfs_set_fat (img, prev, cluster);
+    }
+    
+    img->next_free = cluster + 1;
+    return cluster;
+
+}
+
+/**
+ * Allocate count physically contiguous clusters, each marked as the end of
+ * its own chain, and return the first.  Returns 0 without setting an error
+ * when no free run is long enough so the caller can fall back to
+ * alloc_cluster.
+ */
+static unsigned int alloc_run (struct dosfs_image *img, unsigned int count) {
+
+    unsigned int first, i;
+    
+    if (!count || count > img->free_clusters) {
+        return 0;
+    }
+    
+    /** The search starts over at cluster 2 when it reaches the end, since a run cannot wrap around the end of the FAT. */
+    if (!(first = img->fat_ops->find_run (img, is_valid_cluster (img, img->next_free) ? img->next_free : 2, count))) {
+        return 0;
+    }
+    
+    for (i = 0; i < count; i++) {
+        img->fat_ops->set (img, first + i, img->fat_ops->end_of_chain);
+    }
+    
+    img->free_clusters -= count;
+    img->next_free = first + count;
+    
+    return first;
+
+}
+
+static unsigned int chain_length (struct dosfs_image *img, unsigned int cluster) {
+    return img->fat_ops->chain_length (img, cluster);
+}
+
+/** Mark count clusters starting at first free.  Every one of them must be in use. */
+static void clear_fat_run (struct dosfs_image *img, unsigned int first, unsigned int count) {
+
+    img->fat_ops->clear_run (img, first, count);
+    img->free_clusters += count;
+
+}
+
+/** Free a chain a physically contiguous run at a time. */
+static void free_chain (struct dosfs_image *img, unsigned int cluster) {
+
+    unsigned int count = 0, first, run, next;
+    
+    while (is_valid_cluster (img, cluster) && count < img->cluster_count) {
+    
+        first = cluster;
+        run = 0;
+        
+        for (;;) {
+        
+            /** A free entry inside a chain means it is damaged; stop there. */
+            if ((next = dosfs_get_fat (img, cluster)) == 0) {
+                break;
+            }
+            
+            run++;
+            
+            if (++count >= img->cluster_count || next != cluster + 1) {
+                break;
+            }
+            
+            cluster = next;
+        
+        }
+        
+        if (run) {
+        
+            clear_fat_run (img, first, run);
+            
+            if (first < img->next_free) {
+                img->next_free = first;
+            }
+        
+        }
+        
+        if (next == 0) {
+            break;
+        }
+        
+        cluster = next;
+    
+    }
+
+}
+
+/** Chain count clusters starting at first together, in order. */
+static void link_run (struct dosfs_image *img, unsigned int first, unsigned int count) {
+
+    unsigned int i;
+    
+    for (i = 0; i + 1 < count; i++) {
+        dosfs_set_fat (img, first + i, first + i + 1);
+    }
+    
+    dosfs_set_fat (img, first + count - 1, end_of_chain (img));
+
+}
+
+/**
+ * Allocate a chain of count clusters into chain[], as one contiguous run if
+ * there is one and cluster by cluster otherwise.
+ */
+static int alloc_chain (struct dosfs_image *img, unsigned int count, unsigned int *chain) {
+
+    unsigned int first, i;
+    
+    if ((first = alloc_run (img, count))) {
+    
+        link_run (img, first, count);
+        
+        for (i = 0; i < count; i++) {
+            chain[i] = first + i;
+        }
+        
+        return 0;
+    
+    }
+    
+    for (i = 0; i < count; i++) {
+    
+        if (!(chain[i] = alloc_cluster (img, i ? chain[i - 1] : 0))) {
+        
+            if (i) {
+                free_chain (img, chain[0]);
+            }
+            
+            return -1;
+        
+        }
+    
+    }
+    
+    return 0;
+
+}
+
+/** The number of clusters a directory needs to hold entries entries besides "." and "..". */
+static unsigned int dir_clusters (struct dosfs_image *img, size_t entries) {
+
+    size_t per_cluster = img->cluster_size / sizeof (struct msdos_dirent);
+    size_t count = (entries + 2 + per_cluster - 1) / per_cluster;
+    
+    if (count > img->cluster_count) {
+        count = img->cluster_count;
+    }
+    
+    return (count ? (unsigned int) count : 1);
+
+}
+
+static unsigned int entry_cluster (const struct msdos_dirent *de) {
+    return read721 (de->startlo) | (read721 (de->starthi) << 16);
+}
+
+static void set_entry_cluster (struct msdos_dirent *de, unsigned int cluster) {
+
+    write721_to_byte_array (de->startlo, (unsigned short) (cluster & 0xFFFF));
+    write721_to_byte_array (de->starthi, (unsigned short) (cluster >> 16));
+
+}
+
+static void init_entry (struct dosfs_image *img, struct msdos_dirent *de, const char *name, unsigned char attr, unsigned int cluster) {
+
+    unsigned short date = generate_datestamp (dosfs_source_date (img));
+    unsigned short time = generate_timestamp (dosfs_source_date (img));
+    
+    memset (de, 0, sizeof (*de));
+    memcpy (de->name, name, 11);
+    
+    de->attr = attr;
+    set_entry_cluster (de, cluster);
+    
+    write721_to_byte_array (de->ctime, time);
+    write721_to_byte_array (de->cdate, date);
+    write721_to_byte_array (de->adate, date);
+    write721_to_byte_array (de->time, time);
+    write721_to_byte_array (de->date, date);
+
+}
+
+static struct dosfs_dir *find_cached_dir (struct dosfs_image *img, unsigned int cluster) {
+
+    struct dosfs_dir *dir;
+    
+    for (dir = img->dirs[cluster % DOSFS_DIR_HASH]; dir; dir = dir->next) {
+    
+        if (dir->cluster == cluster) {
+            return dir;
+        }
+    
+    }
+    
+    return 0;
+
+}
+
+static void cache_dir (struct dosfs_image *img, struct dosfs_dir *dir) {
+
+    dir->next = img->dirs[dir->cluster % DOSFS_DIR_HASH];
+    img->dirs[dir->cluster % DOSFS_DIR_HASH] = dir;
+
+}
+
+static void free_dir (struct dosfs_dir *dir) {
+
+    free (dir->chain);
+    free (dir->data);
+    free (dir);
+
+}
+
+static struct dosfs_dir *load_dir (struct dosfs_image *img, unsigned int cluster) {
+
+    struct dosfs_dir *dir;
+    unsigned int i;
+    
+    if ((dir = find_cached_dir (img, cluster))) {
+        return dir;
+    }
+    
+    if (!(dir = malloc (sizeof (*dir)))) {
+    
+        img->error = DOSFS_ERR_NOMEM;
+        return 0;
+    
+    }
+    
+    memset (dir, 0, sizeof (*dir));
+    dir->cluster = cluster;
+    
+    if (cluster == 0) {
+    
+        unsigned long sectors = ((unsigned long) img->root_entries * 32 + 511) / 512;
+        dir->size = sectors * 512;
+        
+        if (!(dir->data = malloc (dir->size))) {
+        
+            img->error = DOSFS_ERR_NOMEM;
+            
+            free_dir (dir);
+            return 0;
+        
+        }
+        
+        if (read_sectors (img, img->root_dir, sectors, dir->data) < 0) {
+        
+            free_dir (dir);
+            return 0;
+        
+        }
+        
+        cache_dir (img, dir);
+        return dir;
+    
+    }
+    
+    if (!is_valid_cluster (img, cluster)) {
+    
+        img->error = DOSFS_ERR_INVALID;
+        
+        free_dir (dir);
+        return 0;
+    
+    }
+    
+    dir->nb_chain = chain_length (img, cluster);
+    dir->size = dir->nb_chain * img->cluster_size;
+    
+    if (!(dir->chain = malloc (dir->nb_chain * sizeof (*dir->chain))) || !(dir->data = malloc (dir->size))) {
+    
+        img->error = DOSFS_ERR_NOMEM;
+        
+        free_dir (dir);
+        return 0;
+    
+    }
+    
+    for (i = 0; i < dir->nb_chain; i++) {
+    
+        dir->chain[i] = cluster;
+        
+        if (read_sectors (img, cluster_to_sector (img, cluster), img->sectors_per_cluster, dir->data + (unsigned long) i * img->cluster_size) < 0) {
+        
+            free_dir (dir);
+            return 0;
+        
+        }
+        
+        cluster = dosfs_get_fat (img, cluster);
+    
+    }
+    
+    cache_dir (img, dir);
+    return dir;
+
+}
+
+static struct dosfs_dir *load_root (struct dosfs_image *img) {
+    return load_dir (img, img->size_fat == 32 ? img->root_cluster : 0);
+}
+
+static int flush_dir (struct dosfs_image *img, struct dosfs_dir *dir) {
+
+    size_t i, j;
+    
+    if (!dir->dirty) {
+        return 0;
+    }
+    
+    if (dir->cluster == 0) {
+    
+        if (write_sectors (img, img->root_dir, dir->size / 512, dir->data) < 0) {
+            return -1;
+        }
+        
+        dir->dirty = 0;
+        return 0;
+    
+    }
+    
+    /** Write runs of physically contiguous clusters with a single call. */
+    for (i = 0; i < dir->nb_chain; i = j) {
+    
+        for (j = i + 1; j < dir->nb_chain && dir->chain[j] == dir->chain[j - 1] + 1; j++) {
+            ;
+        }
+        
+        if (write_sectors (img, cluster_to_sector (img, dir->chain[i]), (unsigned long) (j - i) * img->sectors_per_cluster, dir->data + i * img->cluster_size) < 0) {
+            return -1;
+        }
+    
+    }
+    
+    dir->dirty = 0;
+    return 0;
+
+}
+
+static struct msdos_dirent *dir_entry (struct dosfs_dir *dir, size_t index) {
+    return ((struct msdos_dirent *) dir->data) + index;
+}
+
+static size_t dir_entries (struct dosfs_dir *dir) {
+    return dir->size / sizeof (struct msdos_dirent);
+}
+
+static long find_entry (struct dosfs_dir *dir, const char *name) {
+
+    struct msdos_dirent *de;
+    size_t i;
+    
+    for (i = 0; i < dir_entries (dir); i++) {
+    
+        de = dir_entry (dir, i);
+        
+        if (de->name[0] == 0) {
+            break;
+        }
+        
+        if (de->name[0] == 0xE5 || (de->attr & ATTR_VOLUME_ID)) {
+            continue;
+        }
+        
+        if (!memcmp (de->name, name, 11)) {
+            return (long) i;
+        }
+    
+    }
+    
+    return -1;
+
+}
+
+/**
+ * Grow dir by count zeroed clusters, allocated after its last cluster so the
+ * directory stays contiguous where the FAT allows.
+ */
+static int grow_dir (struct dosfs_image *img, struct dosfs_dir *dir, size_t count) {
+
+    unsigned int cluster;
+    unsigned int *chain;
+    unsigned char *data;
+    
+    size_t i;
+    
+    if (dir->cluster == 0) {
+    
+        img->error = DOSFS_ERR_NOSPC;
+        return -1;
+    
+    }
+    
+    if (!(chain = realloc (dir->chain, (dir->nb_chain + count) * sizeof (*chain)))) {
+    
+        img->error = DOSFS_ERR_NOMEM;
+        return -1;
+    
+    }
+    
+    dir->chain = chain;
+    
+    if (!(data = realloc (dir->data, dir->size + count * img->cluster_size))) {
+    
+        img->error = DOSFS_ERR_NOMEM;
+        return -1;
+    
+    }
+    
+    dir->data = data;
+    
+    for (i = 0; i < count; i++) {
+    
+        if (!(cluster = alloc_cluster (img, dir->chain[dir->nb_chain - 1]))) {
+            return -1;
+        }
+        
+        memset (dir->data + dir->size, 0, img->cluster_size);
+        
+        dir->chain[dir->nb_chain++] = cluster;
+        dir->size += img->cluster_size;
+    
+    }
+    
+    dir->dirty = 1;
+    return 0;
+
+}
+
+/** Make sure dir has at least count free entries, growing it once if not. */
+static int reserve_entries (struct dosfs_image *img, struct dosfs_dir *dir, size_t count) {
+
+    struct msdos_dirent *de;
+    size_t i, nb_free = 0, per_cluster;
+    
+    for (i = dir->free_hint; i < dir_entries (dir) && nb_free < count; i++) {
+    
+        de = dir_entry (dir, i);
+        
+        if (de->name[0] == 0 || de->name[0] == 0xE5) {
+            nb_free++;
+        }
+    
+    }
+    
+    if (nb_free >= count) {
+        return 0;
+    }
+    
+    per_cluster = img->cluster_size / sizeof (struct msdos_dirent);
+    return grow_dir (img, dir, (count - nb_free + per_cluster - 1) / per_cluster);
+
+}
+
+/**
+ * Find a free slot in dir, growing the directory by one cluster if it is
+ * full.  The fixed FAT12/16 root directory cannot grow.
+ */
+static long alloc_entry (struct dosfs_image *img, struct dosfs_dir *dir) {
+
+    struct msdos_dirent *de;
+    size_t i;
+    
+    for (i = dir->free_hint; i < dir_entries (dir); i++) {
+    
+        de = dir_entry (dir, i);
+        
+        if (de->name[0] == 0 || de->name[0] == 0xE5) {
+        
+            dir->free_hint = i + 1;
+            return (long) i;
+        
+        }
+    
+    }
+    
+    if (grow_dir (img, dir, 1) < 0) {
+        return -1;
+    }
+    
+    dir->free_hint = i + 1;
+    return (long) i;
+
+}
+
+/**
+ * Walk path down from the root directory.  On success *pdir is the directory
+ * containing the last component and *pindex its entry, or -1 if path names
+ * the root directory itself.
+ */
+static int lookup_path (struct dosfs_image *img, const char *path, struct dosfs_dir **pdir, long *pindex) {
+
+    struct dosfs_dir *dir;
+    struct msdos_dirent *de;
+    
+    char name[11];
+    long index = -1;
+    
+    if (!(dir = load_root (img))) {
+        return -1;
+    }
+    
+    while (*path == '/' || *path == '\\') {
+        path++;
+    }
+    
+    while (*path) {
+    
+        if (index >= 0) {
+        
+            de = dir_entry (dir, index);
+            
+            if (!(de->attr & ATTR_DIR)) {
+            
+                img->error = DOSFS_ERR_NOTDIR;
+                return -1;
+            
+            }
+            
+            if (entry_cluster (de) == 0) {
+                dir = load_root (img);
+            } else {
+                dir = load_dir (img, entry_cluster (de));
+            }
+            
+            if (!dir) {
+                return -1;
+            }
+        
+        }
+        
+        if (canonical_to_dir (name, path) < 0) {
+        
+            img->error = DOSFS_ERR_NAME;
+            return -1;
+        
+        }
+        
+        if ((index = find_entry (dir, name)) < 0) {
+        
+            img->error = DOSFS_ERR_NOENT;
+            return -1;
+        
+        }
+        
+        while (*path && *path != '/' && *path != '\\') {
+            path++;
+        }
+        
+        while (*path == '/' || *path == '\\') {
+            path++;
+        }
+    
+    }
+    
+    *pdir = dir;
+    *pindex = index;
+    
+    return 0;
+
+}
+
+static struct dosfs_dir *open_entry_dir (struct dosfs_image *img, struct dosfs_dir *dir, long index) {
+
+    struct msdos_dirent *de;
+    
+    if (index < 0) {
+        return dir;
+    }
+    
+    de = dir_entry (dir, index);
+    
+    if (!(de->attr & ATTR_DIR)) {
+    
+        img->error = DOSFS_ERR_NOTDIR;
+        return 0;
+    
+    }
+    
+    if (entry_cluster (de) == 0) {
+        return load_root (img);
+    }
+    
+    return load_dir (img, entry_cluster (de));
+
+}
+
+/**
+ * Split path into its parent directory, which must exist, and the 8.3 form
+ * of its last component.
+ */
+static struct dosfs_dir *lookup_parent (struct dosfs_image *img, const char *path, char *name) {
+
+    char tmppath[PATH_MAX];
+    char *p;
+    
+    struct dosfs_dir *dir;
+    long index;
+    
+    if (strlen (path) >= sizeof (tmppath)) {
+    
+        img->error = DOSFS_ERR_NAME;
+        return 0;
+    
+    }
+    
+    strcpy (tmppath, path);
+    p = tmppath + strlen (tmppath);
+    
+    while (p > tmppath && (p[-1] == '/' || p[-1] == '\\')) {
+        *--p = '\0';
+    }
+    
+    while (p > tmppath && p[-1] != '/' && p[-1] != '\\') {
+        p--;
+    }
+    
+    if (canonical_to_dir (name, p) < 0) {
+    
+        img->error = DOSFS_ERR_NAME;
+        return 0;
+    
+    }
+    
+    *p = '\0';
+    
+    if (lookup_path (img, tmppath, &dir, &index) < 0) {
+        return 0;
+    }
+    
+    return open_entry_dir (img, dir, index);
+
+}
+
+/**
+ * Create directory name in parent, count clusters long.  first is the start
+ * of a run of count clusters already allocated to it, or 0 to allocate here.
+ */
+static struct dosfs_dir *create_dir (struct dosfs_image *img, struct dosfs_dir *parent, const char *name, unsigned int first, unsigned int count) {
+
+    struct dosfs_dir *dir;
+    struct msdos_dirent *de;
+    
+    unsigned int parent_cluster, i;
+    long index;
+    
+    if ((index = alloc_entry (img, parent)) < 0) {
+        return 0;
+    }
+    
+    if (!(dir = malloc (sizeof (*dir)))) {
+    
+        img->error = DOSFS_ERR_NOMEM;
+        return 0;
+    
+    }
+    
+    memset (dir, 0, sizeof (*dir));
+    dir->size = (size_t) count * img->cluster_size;
+    
+    if (!(dir->chain = malloc (count * sizeof (*dir->chain))) || !(dir->data = malloc (dir->size))) {
+    
+        img->error = DOSFS_ERR_NOMEM;
+        
+        free_dir (dir);
+        return 0;
+    
+    }
+    
+    if (first) {
+    
+        link_run (img, first, count);
+        
+        for (i = 0; i < count; i++) {
+            dir->chain[i] = first + i;
+        }
+    
+    } else if (alloc_chain (img, count, dir->chain) < 0) {
+    
+        free_dir (dir);
+        return 0;
+    
+    }
+    
+    memset (dir->data, 0, dir->size);
+    
+    dir->cluster = dir->chain[0];
+    dir->nb_chain = count;
+    
+    /** The root directory is always referred to as cluster 0 by "..". */
+    parent_cluster = parent->cluster;
+    
+    if (img->size_fat == 32 && parent_cluster == img->root_cluster) {
+        parent_cluster = 0;
+    }
+    
+    init_entry (img, dir_entry (dir, 0), ".          ", ATTR_DIR, dir->cluster);
+    init_entry (img, dir_entry (dir, 1), "..         ", ATTR_DIR, parent_cluster);
+    
+    de = dir_entry (parent, index);
+    init_entry (img, de, name, ATTR_DIR, dir->cluster);
+    
+    dir->dirty = 1;
+    parent->dirty = 1;
+    
+    cache_dir (img, dir);
+    return dir;
+
+}
+
+int dosfs_mkdir (struct dosfs_image *img, const char *path, int flags) {
+
+    struct dosfs_dir *dir, *next;
+    
+    char name[11];
+    long index;
+    
+    if (!(dir = load_root (img))) {
+        return -1;
+    }
+    
+    while (*path == '/' || *path == '\\') {
+        path++;
+    }
+    
+    if (!*path) {
+    
+        if (flags & DOSFS_MKDIR_PARENTS) {
+            return 0;
+        }
+        
+        img->error = DOSFS_ERR_EXIST;
+        return -1;
+    
+    }
+    
+    while (*path) {
+    
+        const char *p = path;
+        int last;
+        
+        while (*p && *p != '/' && *p != '\\') {
+            p++;
+        }
+        
+        while (*p == '/' || *p == '\\') {
+            p++;
+        }
+        
+        last = (*p == '\0');
+        
+        if (canonical_to_dir (name, path) < 0) {
+        
+            img->error = DOSFS_ERR_NAME;
+            return -1;
+        
+        }
+        
+        if ((index = find_entry (dir, name)) >= 0) {
+        
+            if (last && !(flags & DOSFS_MKDIR_PARENTS)) {
+            
+                img->error = DOSFS_ERR_EXIST;
+                return -1;
+            
+            }
+            
+            if (!(next = open_entry_dir (img, dir, index))) {
+                return -1;
+            }
+        
+        } else {
+        
+            if (!last && !(flags & DOSFS_MKDIR_PARENTS)) {
+            
+                img->error = DOSFS_ERR_NOENT;
+                return -1;
+            
+            }
+            
+            if (!(next = create_dir (img, dir, name, 0, 1))) {
+                return -1;
+            }
+        
+        }
+        
+        dir = next;
+        path = p;
+    
+    }
+    
+    return 0;
+
+}
+
+struct mkdir_item {
+
+    char *path;
+    size_t parent_len, origin;
+    
+    int depth, implied;
+    char name[11];
+
+};
+
+/** Order by depth, then parent path, then 8.3 name so siblings end up together. */
+static int compare_mkdir_items (const void *a, const void *b) {
+
+    const struct mkdir_item *x = a, *y = b;
+    size_t len;
+    int cmp;
+    
+    if (x->depth != y->depth) {
+        return x->depth - y->depth;
+    }
+    
+    len = (x->parent_len < y->parent_len ? x->parent_len : y->parent_len);
+    
+    if ((cmp = strncmp (x->path, y->path, len)) != 0) {
+        return cmp;
+    }
+    
+    if (x->parent_len != y->parent_len) {
+        return (x->parent_len < y->parent_len ? -1 : 1);
+    }
+    
+    return memcmp (x->name, y->name, 11);
+
+}
+
+static int compare_names (const void *a, const void *b) {
+    return memcmp (a, b, 11);
+}
+
+static int same_parent (const struct mkdir_item *x, const struct mkdir_item *y) {
+    return (x->depth == y->depth && x->parent_len == y->parent_len && !strncmp (x->path, y->path, x->parent_len));
+}
+
+/**
+ * Queue path, and with DOSFS_MKDIR_PARENTS every ancestor of it, as items.
+ * Separators are collapsed so each item's parent is a plain prefix of it.
+ */
+static int add_mkdir_items (struct dosfs_image *img, struct mkdir_item **pitems, size_t *pnb, size_t *palloc, const char *path, size_t origin, int flags) {
+
+    struct mkdir_item *item;
+    
+    char *copy, *q;
+    size_t len;
+    
+    int depth = 0;
+    
+    if (!(copy = malloc (strlen (path) + 1))) {
+    
+        img->error = DOSFS_ERR_NOMEM;
+        return -1;
+    
+    }
+    
+    for (q = copy; *path; ) {
+    
+        while (*path == '/' || *path == '\\') {
+            path++;
+        }
+        
+        if (!*path) {
+            break;
+        }
+        
+        if (q > copy) {
+            *q++ = '/';
+        }
+        
+        while (*path && *path != '/' && *path != '\\') {
+            *q++ = *path++;
+        }
+    
+    }
+    
+    *q = '\0';
+    
+    if (!*copy) {
+    
+        free (copy);
+        
+        if (flags & DOSFS_MKDIR_PARENTS) {
+            return 0;
+        }
+        
+        img->error = DOSFS_ERR_EXIST;
+        return -1;
+    
+    }
+    
+    for (len = 0; ; len++) {
+    
+        if (copy[len] != '/' && copy[len] != '\0') {
+            continue;
+        }
+        
+        depth++;
+        
+        if (copy[len] == '\0' || (flags & DOSFS_MKDIR_PARENTS)) {
+        
+            if (*pnb == *palloc) {
+            
+                struct mkdir_item *items;
+                size_t nb_alloc = (*palloc ? *palloc * 2 : 64);
+                
+                if (!(items = realloc (*pitems, nb_alloc * sizeof (*items)))) {
+                
+                    free (copy);
+                    
+                    img->error = DOSFS_ERR_NOMEM;
+                    return -1;
+                
+                }
+                
+                *pitems = items;
+                *palloc = nb_alloc;
+            
+            }
+            
+            item = &(*pitems)[(*pnb)++];
+            item->path = 0;
+            
+            if (!(item->path = malloc (len + 1))) {
+            
+                (*pnb)--;
+                free (copy);
+                
+                img->error = DOSFS_ERR_NOMEM;
+                return -1;
+            
+            }
+            
+            memcpy (item->path, copy, len);
+            item->path[len] = '\0';
+            
+            for (item->parent_len = len; item->parent_len > 0 && item->path[item->parent_len - 1] != '/'; item->parent_len--) {
+                ;
+            }
+            
+            if (canonical_to_dir (item->name, item->path + item->parent_len) < 0) {
+            
+                free (copy);
+                
+                img->error = DOSFS_ERR_NAME;
+                return -1;
+            
+            }
+            
+            if (item->parent_len > 0) {
+                item->parent_len--;
+            }
+            
+            item->origin = origin;
+            item->depth = depth;
+            item->implied = (copy[len] != '\0');
+        
+        }
+        
+        if (copy[len] == '\0') {
+            break;
+        }
+    
+    }
+    
+    free (copy);
+    return 0;
+
+}
+
+/**
+ * Create one group of siblings.  The parent is scanned once for the names it
+ * already holds, grown once to fit every new entry and the new directories
+ * are given a contiguous run of clusters where one is free.
+ */
+static int create_siblings (struct dosfs_image *img, struct mkdir_item *items, size_t nb_items, int flags, size_t entries, size_t *pfailed) {
+
+    struct dosfs_dir *parent, *dir;
+    struct msdos_dirent *de;
+    
+    char *names = 0, *found;
+    size_t nb_names = 0, nb_new = 0, i;
+    
+    unsigned int first = 0, size, nb_clusters = 0, used = 0;
+    long index;
+    
+    int duplicate;
+    char saved = items[0].path[items[0].parent_len];
+    items[0].path[items[0].parent_len] = '\0';
+    
+    *pfailed = items[0].origin;
+    
+    if (lookup_path (img, items[0].path, &dir, &index) < 0 || !(parent = open_entry_dir (img, dir, index))) {
+    
+        items[0].path[items[0].parent_len] = saved;
+        return -1;
+    
+    }
+    
+    items[0].path[items[0].parent_len] = saved;
+    
+    if (!(names = malloc ((dir_entries (parent) + 1) * 12))) {
+    
+        img->error = DOSFS_ERR_NOMEM;
+        return -1;
+    
+    }
+    
+    /** Each name is followed by a flag saying whether it is a directory. */
+    for (i = 0; i < dir_entries (parent); i++) {
+    
+        de = dir_entry (parent, i);
+        
+        if (de->name[0] == 0) {
+            break;
+        }
+        
+        if (de->name[0] == 0xE5 || (de->attr & ATTR_VOLUME_ID)) {
+            continue;
+        }
+        
+        memcpy (names + nb_names * 12, de->name, 11);
+        names[nb_names++ * 12 + 11] = (char) ((de->attr & ATTR_DIR) != 0);
+    
+    }
+    
+    qsort (names, nb_names, 12, compare_names);
+    
+    for (i = 0; i < nb_items; i++) {
+    
+        *pfailed = items[i].origin;
+        
+        /** A name repeated within the group refers to the directory made (or found) for the first. */
+        duplicate = (i > 0 && !memcmp (items[i].name, items[i - 1].name, 11));
+        
+        if (duplicate || (found = bsearch (items[i].name, names, nb_names, 12, compare_names))) {
+        
+            if (!duplicate && !found[11]) {
+            
+                img->error = DOSFS_ERR_NOTDIR;
+                goto fail;
+            
+            }
+            
+            if (!items[i].implied && !(flags & DOSFS_MKDIR_PARENTS)) {
+            
+                img->error = DOSFS_ERR_EXIST;
+                goto fail;
+            
+            }
+            
+            items[i].depth = -1;
+            continue;
+        
+        }
+        
+        nb_new++;
+        nb_clusters += (items[i].implied ? 1 : dir_clusters (img, entries));
+    
+    }
+    
+    if (reserve_entries (img, parent, nb_new) < 0) {
+        goto fail;
+    }
+    
+    first = alloc_run (img, nb_clusters);
+    
+    for (i = 0; i < nb_items; i++) {
+    
+        if (items[i].depth < 0) {
+            continue;
+        }
+        
+        *pfailed = items[i].origin;
+        size = (items[i].implied ? 1 : dir_clusters (img, entries));
+        
+        if (!create_dir (img, parent, items[i].name, first ? first + used : 0, size)) {
+            goto fail;
+        }
+        
+        used += size;
+    
+    }
+    
+    free (names);
+    return 0;
+
+fail:
+
+    /** Hand back any of the run that was not used. */
+    if (first) {
+    
+        for (; used < nb_clusters; used++) {
+            dosfs_set_fat (img, first + used, 0);
+        }
+    
+    }
+    
+    free (names);
+    return -1;
+
+}
+
+/**
+ * Create every directory in paths in a single traversal.  Siblings are
+ * created together (see create_siblings) and parents are always created
+ * before their children, so a list may name both.  With DOSFS_MKDIR_PARENTS
+ * missing ancestors are created and existing directories are not an error.
+ * Each directory named in paths is made big enough for entries entries (as
+ * one contiguous, zeroed extent) so filling it never has to extend it.  On
+ * failure *pfailed, if given, is the index of the path that failed.
+ */
+int dosfs_mkdirs (struct dosfs_image *img, const char *const *paths, size_t nb_paths, int flags, size_t entries, size_t *pfailed) {
+
+    struct mkdir_item *items = 0;
+    size_t nb_items = 0, nb_alloc = 0, failed = 0, i, j;
+    
+    int result = 0;
+    
+    if (img->flags & DOSFS_READONLY) {
+    
+        img->error = DOSFS_ERR_ROFS;
+        return -1;
+    
+    }
+    
+    if (!load_root (img)) {
+        return -1;
+    }
+    
+    for (i = 0; i < nb_paths; i++) {
+    
+        if (add_mkdir_items (img, &items, &nb_items, &nb_alloc, paths[i], i, flags) < 0) {
+        
+            failed = i;
+            result = -1;
+            
+            goto out;
+        
+        }
+    
+    }
+    
+    qsort (items, nb_items, sizeof (*items), compare_mkdir_items);
+    
+    for (i = 0; i < nb_items; i = j) {
+    
+        for (j = i + 1; j < nb_items && same_parent (&items[i], &items[j]); j++) {
+            ;
+        }
+        
+        if (create_siblings (img, items + i, j - i, flags, entries, &failed) < 0) {
+        
+            result = -1;
+            break;
+        
+        }
+    
+    }
+
+out:
+
+    for (i = 0; i < nb_items; i++) {
+        free (items[i].path);
+    }
+    
+    free (items);
+    
+    if (result < 0 && pfailed) {
+        *pfailed = failed;
+    }
+    
+    return result;
+
+}
+
+static void unhash_dir (struct dosfs_image *img, struct dosfs_dir *dir) {
+
+    struct dosfs_dir **pp;
+    
+    for (pp = &img->dirs[dir->cluster % DOSFS_DIR_HASH]; *pp; pp = &(*pp)->next) {
+    
+        if (*pp == dir) {
+        
+            *pp = dir->next;
+            break;
+        
+        }
+    
+    }
+
+}
+
+static void uncache_dir (struct dosfs_image *img, struct dosfs_dir *dir) {
+
+    unhash_dir (img, dir);
+    free_dir (dir);
+
+}
+
+/** Mark entry index of dir deleted, along with any long name entries before it. */
+static void delete_entry (struct dosfs_dir *dir, long index) {
+
+    struct msdos_dirent *de;
+    
+    dir_entry (dir, index)->name[0] = 0xE5;
+    
+    if ((size_t) index < dir->free_hint) {
+        dir->free_hint = (size_t) index;
+    }
+    
+    while (--index >= 0) {
+    
+        de = dir_entry (dir, index);
+        
+        if (de->name[0] == 0xE5 || (de->attr & 0x0F) != 0x0F) {
+            break;
+        }
+        
+        de->name[0] = 0xE5;
+        dir->free_hint = (size_t) index;
+    
+    }
+    
+    dir->dirty = 1;
+
+}
+
+static int is_dot_entry (const struct msdos_dirent *de) {
+    return (de->name[0] == '.' && (de->name[1] == ' ' || (de->name[1] == '.' && de->name[2] == ' ')));
+}
+
+/**
+ * Make room for entries more entries in directory path.  The clusters are
+ * taken straight after the directory where they are free; otherwise a
+ * directory holding nothing but "." and ".." is moved to a run big enough
+ * for all of it.  Either way it stays in one piece and is written, zeroed,
+ * in a single write on commit.
+ */
+int dosfs_reserve_dir (struct dosfs_image *img, const char *path, size_t entries) {
+
+    struct dosfs_dir *parent, *dir;
+    struct msdos_dirent *de;
+    
+    unsigned int *chain, first, last, extra, count, i;
+    unsigned char *data;
+    
+    size_t nb_free = 0, per_cluster, k;
+    long index;
+    
+    int empty = 1;
+    
+    if (img->flags & DOSFS_READONLY) {
+    
+        img->error = DOSFS_ERR_ROFS;
+        return -1;
+    
+    }
+    
+    if (lookup_path (img, path, &parent, &index) < 0 || !(dir = open_entry_dir (img, parent, index))) {
+        return -1;
+    }
+    
+    for (k = 0; k < dir_entries (dir); k++) {
+    
+        de = dir_entry (dir, k);
+        
+        if (de->name[0] == 0 || de->name[0] == 0xE5) {
+            nb_free++;
+        } else if (!is_dot_entry (de)) {
+            empty = 0;
+        }
+    
+    }
+    
+    if (nb_free >= entries) {
+        return 0;
+    }
+    
+    if (dir->cluster == 0) {
+    
+        img->error = DOSFS_ERR_NOSPC;
+        return -1;
+    
+    }
+    
+    per_cluster = img->cluster_size / sizeof (struct msdos_dirent);
+    extra = (unsigned int) ((entries - nb_free + per_cluster - 1) / per_cluster);
+    
+    last = dir->chain[dir->nb_chain - 1];
+    
+    for (i = 1; i <= extra; i++) {
+    
+        if (!is_valid_cluster (img, last + i) || dosfs_get_fat (img, last + i) != 0) {
+            break;
+        }
+    
+    }
+    
+    /** The root directory is referred to by the boot sector, so it is never moved. */
+    if (i > extra || !empty || index < 0) {
+        return grow_dir (img, dir, extra);
+    }
+    
+    count = (unsigned int) dir->nb_chain + extra;
+    
+    if (!(first = alloc_run (img, count))) {
+        return grow_dir (img, dir, extra);
+    }
+    
+    chain = realloc (dir->chain, count * sizeof (*chain));
+    data = (chain ? realloc (dir->data, (size_t) count * img->cluster_size) : 0);
+    
+    if (chain) {
+        dir->chain = chain;
+    }
+    
+    if (!data) {
+    
+        for (i = 0; i < count; i++) {
+            dosfs_set_fat (img, first + i, 0);
+        }
+        
+        img->error = DOSFS_ERR_NOMEM;
+        return -1;
+    
+    }
+    
+    dir->data = data;
+    
+    link_run (img, first, count);
+    free_chain (img, dir->cluster);
+    
+    unhash_dir (img, dir);
+    
+    for (i = 0; i < count; i++) {
+        dir->chain[i] = first + i;
+    }
+    
+    memset (dir->data + dir->size, 0, (size_t) count * img->cluster_size - dir->size);
+    
+    dir->cluster = first;
+    dir->nb_chain = count;
+    dir->size = (size_t) count * img->cluster_size;
+    
+    set_entry_cluster (dir_entry (dir, 0), first);
+    set_entry_cluster (dir_entry (parent, index), first);
+    
+    dir->dirty = 1;
+    parent->dirty = 1;
+    
+    cache_dir (img, dir);
+    return 0;
+
+}
+
+/**
+ * Delete everything in dir, freeing the chains of its files and
+ * subdirectories.  Subdirectories are dropped from the cache without being
+ * written back since their clusters are no longer in use.
+ */
+static int remove_contents (struct dosfs_image *img, struct dosfs_dir *dir, int depth) {
+
+    struct dosfs_dir *subdir;
+    struct msdos_dirent *de;
+    
+    unsigned int cluster;
+    size_t i;
+    
+    if (depth > DOSFS_INDEX_DEPTH) {
+    
+        img->error = DOSFS_ERR_INVALID;
+        return -1;
+    
+    }
+    
+    for (i = 0; i < dir_entries (dir); i++) {
+    
+        de = dir_entry (dir, i);
+        
+        if (de->name[0] == 0) {
+            break;
+        }
+        
+        if (de->name[0] == 0xE5 || (de->attr & ATTR_VOLUME_ID) || is_dot_entry (de)) {
+            continue;
+        }
+        
+        cluster = entry_cluster (de);
+        
+        if ((de->attr & ATTR_DIR) && is_valid_cluster (img, cluster)) {
+        
+            if (!(subdir = load_dir (img, cluster)) || remove_contents (img, subdir, depth + 1) < 0) {
+                return -1;
+            }
+            
+            uncache_dir (img, subdir);
+        
+        }
+        
+        free_chain (img, cluster);
+        delete_entry (dir, (long) i);
+    
+    }
+    
+    return 0;
+
+}
+
+int dosfs_unlink (struct dosfs_image *img, const char *path) {
+
+    struct dosfs_dir *dir;
+    struct msdos_dirent *de;
+    
+    long index;
+    
+    if (img->flags & DOSFS_READONLY) {
+    
+        img->error = DOSFS_ERR_ROFS;
+        return -1;
+    
+    }
+    
+    if (lookup_path (img, path, &dir, &index) < 0) {
+        return -1;
+    }
+    
+    if (index < 0 || (dir_entry (dir, index)->attr & ATTR_DIR)) {
+    
+        img->error = DOSFS_ERR_ISDIR;
+        return -1;
+    
+    }
+    
+    de = dir_entry (dir, index);
+    
+    free_chain (img, entry_cluster (de));
+    delete_entry (dir, index);
+    
+    return 0;
+
+}
+
+int dosfs_rmdir (struct dosfs_image *img, const char *path, int flags) {
+
+    struct dosfs_dir *dir, *subdir;
+    struct msdos_dirent *de;
+    
+    long index;
+    size_t i;
+    
+    if (img->flags & DOSFS_READONLY) {
+    
+        img->error = DOSFS_ERR_ROFS;
+        return -1;
+    
+    }
+    
+    if (lookup_path (img, path, &dir, &index) < 0) {
+        return -1;
+    }
+    
+    /** The root directory can be emptied but never removed. */
+    if (index < 0) {
+    
+        if (!(flags & DOSFS_RMDIR_RECURSIVE)) {
+        
+            img->error = DOSFS_ERR_INVALID;
+            return -1;
+        
+        }
+        
+        return remove_contents (img, dir, 0);
+    
+    }
+    
+    if (!(subdir = open_entry_dir (img, dir, index))) {
+        return -1;
+    }
+    
+    if (subdir->cluster == 0 || subdir->cluster == img->root_cluster) {
+    
+        img->error = DOSFS_ERR_INVALID;
+        return -1;
+    
+    }
+    
+    if (flags & DOSFS_RMDIR_RECURSIVE) {
+    
+        if (remove_contents (img, subdir, 0) < 0) {
+            return -1;
+        }
+    
+    } else {
+    
+        for (i = 0; i < dir_entries (subdir); i++) {
+        
+            de = dir_entry (subdir, i);
+            
+            if (de->name[0] == 0) {
+                break;
+            }
+            
+            if (de->name[0] != 0xE5 && !(de->attr & ATTR_VOLUME_ID) && !is_dot_entry (de)) {
+            
+                img->error = DOSFS_ERR_NOTEMPTY;
+                return -1;
+            
+            }
+        
+        }
+    
+    }
+    
+    free_chain (img, subdir->cluster);
+    uncache_dir (img, subdir);
+    
+    delete_entry (dir, index);
+    return 0;
+
+}
+
+/**
+ * One entry of a directory being compacted: its long name slots, if any,
+ * followed by its short entry.  rank decides the new order; seq is the old
+ * position and keeps the order stable.
+ */
+struct compact_group {
+
+    size_t first, count, seq;
+    long rank;
+    
+    unsigned char name[11];
+
+};
+
+struct compact_hot {
+
+    struct dosfs_dir *dir;
+    unsigned char name[11];
+
+};
+
+static int compare_groups_by_rank (const void *a, const void *b) {
+
+    const struct compact_group *x = a, *y = b;
+    
+    if (x->rank != y->rank) {
+        return (x->rank < y->rank ? -1 : 1);
+    }
+    
+    return (x->seq < y->seq ? -1 : (x->seq > y->seq));
+
+}
+
+static int compare_groups_by_name (const void *a, const void *b) {
+
+    const struct compact_group *x = a, *y = b;
+    int cmp;
+    
+    if (x->rank != y->rank) {
+        return (x->rank < y->rank ? -1 : 1);
+    }
+    
+    if ((cmp = memcmp (x->name, y->name, 11)) != 0) {
+        return cmp;
+    }
+    
+    return (x->seq < y->seq ? -1 : (x->seq > y->seq));
+
+}
+
+static int compact_dir (struct dosfs_image *img, struct dosfs_dir *dir, int flags, struct compact_hot *hot, size_t nb_hot, struct dosfs_compact_stats *stats, int depth) {
+
+    struct compact_group *groups;
+    struct msdos_dirent *de;
+    struct dosfs_dir *subdir;
+    
+    unsigned char *data;
+    size_t nb_groups = 0, used = 0, i, j, k, need;
+    
+    if (depth > DOSFS_INDEX_DEPTH) {
+    
+        img->error = DOSFS_ERR_INVALID;
+        return -1;
+    
+    }
+    
+    if (!(groups = malloc ((dir_entries (dir) + 1) * sizeof (*groups))) || !(data = malloc (dir->size))) {
+    
+        free (groups);
+        
+        img->error = DOSFS_ERR_NOMEM;
+        return -1;
+    
+    }
+    
+    for (i = 0; i < dir_entries (dir); ) {
+    
+        de = dir_entry (dir, i);
+        
+        if (de->name[0] == 0) {
+            break;
+        }
+        
+        if (de->name[0] == 0xE5) {
+        
+            stats->dropped++;
+            i++;
+            
+            continue;
+        
+        }
+        
+        /** Long name slots belong to the short entry that follows them. */
+        for (j = i; j < dir_entries (dir) && dir_entry (dir, j)->name[0] != 0 && dir_entry (dir, j)->name[0] != 0xE5 && (dir_entry (dir, j)->attr & 0x0F) == 0x0F; j++) {
+            ;
+        }
+        
+        if (j >= dir_entries (dir) || dir_entry (dir, j)->name[0] == 0 || dir_entry (dir, j)->name[0] == 0xE5) {
+        
+            /** Long name slots with no short entry are orphans; drop them. */
+            stats->dropped += j - i;
+            i = j;
+            
+            continue;
+        
+        }
+        
+        de = dir_entry (dir, j);
+        
+        groups[nb_groups].first = i;
+        groups[nb_groups].count = j - i + 1;
+        groups[nb_groups].seq = nb_groups;
+        
+        memcpy (groups[nb_groups].name, de->name, 11);
+        
+        if (is_dot_entry (de)) {
+            groups[nb_groups].rank = -2;
+        } else if (de->attr & ATTR_VOLUME_ID) {
+            groups[nb_groups].rank = -1;
+        } else {
+        
+            groups[nb_groups].rank = (long) nb_hot;
+            
+            for (k = 0; k < nb_hot; k++) {
+            
+                if (hot[k].dir == dir && !memcmp (hot[k].name, de->name, 11)) {
+                
+                    groups[nb_groups].rank = (long) k;
+                    break;
+                
+                }
+            
+            }
+        
+        }
+        
+        nb_groups++;
+        i = j + 1;
+    
+    }
+    
+    qsort (groups, nb_groups, sizeof (*groups), (flags & DOSFS_COMPACT_SORT) ? compare_groups_by_name : compare_groups_by_rank);
+    memset (data, 0, dir->size);
+    
+    for (i = 0; i < nb_groups; i++) {
+    
+        memcpy (data + used * sizeof (*de), dir->data + groups[i].first * sizeof (*de), groups[i].count * sizeof (*de));
+        used += groups[i].count;
+    
+    }
+    
+    stats->entries += nb_groups;
+    
+    if (memcmp (data, dir->data, dir->size)) {
+    
+        memcpy (dir->data, data, dir->size);
+        
+        dir->free_hint = used;
+        dir->dirty = 1;
+        
+        stats->dirs++;
+    
+    }
+    
+    /** Give back whatever clusters are left empty at the end. */
+    if (dir->cluster != 0) {
+    
+        need = (used * sizeof (*de) + img->cluster_size - 1) / img->cluster_size;
+        
+        if (need < 1) {
+            need = 1;
+        }
+        
+        if (need < dir->nb_chain) {
+        
+            free_chain (img, dir->chain[need]);
+            dosfs_set_fat (img, dir->chain[need - 1], end_of_chain (img));
+            
+            stats->clusters += (unsigned long) (dir->nb_chain - need);
+            
+            dir->nb_chain = need;
+            dir->size = need * img->cluster_size;
+        
+        }
+    
+    }
+    
+    free (data);
+    
+    if (flags & DOSFS_COMPACT_RECURSIVE) {
+    
+        for (i = 0; i < used; i++) {
+        
+            de = dir_entry (dir, i);
+            
+            if ((de->attr & 0x0F) == 0x0F || !(de->attr & ATTR_DIR) || (de->attr & ATTR_VOLUME_ID) || is_dot_entry (de) || !is_valid_cluster (img, entry_cluster (de))) {
+                continue;
+            }
+            
+            if (!(subdir = load_dir (img, entry_cluster (de))) || compact_dir (img, subdir, flags, hot, nb_hot, stats, depth + 1) < 0) {
+            
+                free (groups);
+                return -1;
+            
+            }
+        
+        }
+    
+    }
+    
+    free (groups);
+    return 0;
+
+}
+
+/**
+ * Rewrite directory path, and with DOSFS_COMPACT_RECURSIVE everything below
+ * it, without deleted or orphaned slots.  "." and ".." and the volume label
+ * stay first, followed by the entries named in hot (in that order), then the
+ * rest in their old order or, with DOSFS_COMPACT_SORT, by name.  Clusters
+ * left empty at the end of a directory are freed.  No file in the image may
+ * be open while this runs since entries change position.
+ */
+int dosfs_compact (struct dosfs_image *img, const char *path, int flags, const char *const *hot, size_t nb_hot, struct dosfs_compact_stats *stats) {
+
+    struct dosfs_compact_stats local;
+    struct compact_hot *resolved = 0;
+    struct dosfs_dir *parent, *dir;
+    
+    size_t nb_resolved = 0, i;
+    long index;
+    
+    int result;
+    
+    if (img->flags & DOSFS_READONLY) {
+    
+        img->error = DOSFS_ERR_ROFS;
+        return -1;
+    
+    }
+    
+    if (!stats) {
+        stats = &local;
+    }
+    
+    memset (stats, 0, sizeof (*stats));
+    
+    if (lookup_path (img, path, &parent, &index) < 0 || !(dir = open_entry_dir (img, parent, index))) {
+        return -1;
+    }
+    
+    if (nb_hot && !(resolved = malloc (nb_hot * sizeof (*resolved)))) {
+    
+        img->error = DOSFS_ERR_NOMEM;
+        return -1;
+    
+    }
+    
+    /** Paths in the hot list that do not exist are simply ignored. */
+    for (i = 0; i < nb_hot; i++) {
+    
+        if (lookup_path (img, hot[i], &parent, &index) < 0 || index < 0) {
+            continue;
+        }
+        
+        resolved[nb_resolved].dir = parent;
+        memcpy (resolved[nb_resolved++].name, dir_entry (parent, index)->name, 11);
+    
+    }
+    
+    img->error = DOSFS_OK;
+    
+    result = compact_dir (img, dir, flags, resolved, nb_resolved, stats, 0);
+    free (resolved);
+    
+    return result;
+
+}
+
+int dosfs_set_time (struct dosfs_image *img, const char *path, unsigned short date, unsigned short time) {
+
+    struct dosfs_dir *dir;
+    struct msdos_dirent *de;
+    
+    long index;
+    
+    if (img->flags & DOSFS_READONLY) {
+    
+        img->error = DOSFS_ERR_ROFS;
+        return -1;
+    
+    }
+    
+    if (lookup_path (img, path, &dir, &index) < 0) {
+        return -1;
+    }
+    
+    if (index < 0) {
+    
+        img->error = DOSFS_ERR_INVALID;
+        return -1;
+    
+    }
+    
+    de = dir_entry (dir, index);
+    
+    write721_to_byte_array (de->date, date);
+    write721_to_byte_array (de->time, time);
+    write721_to_byte_array (de->adate, date);
+    
+    dir->dirty = 1;
+    return 0;
+
+}
+
+/**
+ * Describe the first size bytes of the chain starting at cluster as runs
+ * of physically contiguous clusters.
+ */
+static int chain_extents (struct dosfs_image *img, unsigned int cluster, unsigned long size, struct dosfs_extent **pextents, size_t *pnb_extents) {
+
+    struct dosfs_extent *extents = 0, *new_extents, *ext;
+    size_t nb_extents = 0, nb_alloc = 0;
+    
+    unsigned long needed, logical = 0;
+    unsigned int visited = 0;
+    
+    *pextents = 0;
+    *pnb_extents = 0;
+    
+    needed = (size + img->cluster_size - 1) / img->cluster_size;
+    
+    while (needed > 0) {
+    
+        if (!is_valid_cluster (img, cluster) || visited++ >= img->cluster_count) {
+        
+            img->error = DOSFS_ERR_INVALID;
+            
+            free (extents);
+            return -1;
+        
+        }
+        
+        ext = (nb_extents ? &extents[nb_extents - 1] : 0);
+        
+        if (ext && cluster == ext->cluster + ext->count) {
+            ext->count++;
+        } else {
+        
+            if (nb_extents == nb_alloc) {
+            
+                nb_alloc = (nb_alloc ? nb_alloc * 2 : 8);
+                
+                if (!(new_extents = realloc (extents, nb_alloc * sizeof (*extents)))) {
+                
+                    img->error = DOSFS_ERR_NOMEM;
+                    
+                    free (extents);
+                    return -1;
+                
+                }
+                
+                extents = new_extents;
+            
+            }
+            
+            ext = &extents[nb_extents++];
+            
+            ext->logical = logical;
+            ext->physical = (img->offset + cluster_to_sector (img, cluster)) * 512;
+            ext->length = 0;
+            ext->cluster = cluster;
+            ext->count = 1;
+        
+        }
+        
+        ext->length += (size - logical < img->cluster_size ? size - logical : img->cluster_size);
+        logical += img->cluster_size;
+        
+        needed--;
+        cluster = dosfs_get_fat (img, cluster);
+    
+    }
+    
+    *pextents = extents;
+    *pnb_extents = nb_extents;
+    
+    return 0;
+
+}
+
+int dosfs_extents (struct dosfs_image *img, const char *path, struct dosfs_extent **pextents, size_t *pnb_extents) {
+
+    struct dosfs_dir *dir;
+    struct msdos_dirent *de;
+    
+    unsigned int cluster;
+    long index;
+    
+    *pextents = 0;
+    *pnb_extents = 0;
+    
+    if (lookup_path (img, path, &dir, &index) < 0) {
+        return -1;
+    }
+    
+    cluster = (index < 0 ? dir->cluster : entry_cluster (dir_entry (dir, index)));
+    
+    /** The FAT12/16 root directory lives outside the data area as one run. */
+    if (index < 0 && cluster == 0) {
+    
+        if (!(*pextents = malloc (sizeof (**pextents)))) {
+        
+            img->error = DOSFS_ERR_NOMEM;
+            return -1;
+        
+        }
+        
+        (*pextents)->logical = 0;
+        (*pextents)->physical = (img->offset + img->root_dir) * 512;
+        (*pextents)->length = dir->size;
+        (*pextents)->cluster = 0;
+        (*pextents)->count = 0;
+        
+        *pnb_extents = 1;
+        return 0;
+    
+    }
+    
+    de = (index < 0 ? 0 : dir_entry (dir, index));
+    
+    if (!de || (de->attr & ATTR_DIR)) {
+        return chain_extents (img, cluster, (unsigned long) chain_length (img, cluster) * img->cluster_size, pextents, pnb_extents);
+    }
+    
+    return chain_extents (img, cluster, read741 (de->size), pextents, pnb_extents);
+
+}
+
+int dosfs_stat (struct dosfs_image *img, const char *path, struct dosfs_stat *st) {
+
+    struct dosfs_dir *dir;
+    struct msdos_dirent *de;
+    
+    long index;
+    
+    if (lookup_path (img, path, &dir, &index) < 0) {
+        return -1;
+    }
+    
+    memset (st, 0, sizeof (*st));
+    
+    if (index < 0) {
+    
+        strcpy (st->name, "/");
+        
+        st->attr = ATTR_DIR;
+        st->cluster = dir->cluster;
+        
+        return 0;
+    
+    }
+    
+    de = dir_entry (dir, index);
+    dir_to_canonical (st->name, de->name);
+    
+    st->attr = de->attr;
+    st->cluster = entry_cluster (de);
+    st->size = read741 (de->size);
+    st->date = read721 (de->date);
+    st->time = read721 (de->time);
+    
+    return 0;
+
+}
+
+int dosfs_set_label (struct dosfs_image *img, const char *label) {
+
+    struct msdos_volume_info *vi;
+    struct msdos_dirent *de;
+    struct dosfs_dir *root;
+    
+    char name[11];
+    size_t i;
+    long index = -1;
+    
+    memset (name, ' ', 11);
+    
+    for (i = 0; i < 11 && label[i]; i++) {
+        name[i] = (label[i] >= 'a' && label[i] <= 'z') ? (label[i] - 'a' + 'A') : label[i];
+    }
+    
+    if (label[i]) {
+    
+        img->error = DOSFS_ERR_NAME;
+        return -1;
+    
+    }
+    
+    if (!(root = load_root (img))) {
+        return -1;
+    }
+    
+    for (i = 0; i < dir_entries (root); i++) {
+    
+        de = dir_entry (root, i);
+        
+        if (de->name[0] == 0) {
+            break;
+        }
+        
+        if (de->name[0] != 0xE5 && (de->attr & ATTR_VOLUME_ID)) {
+        
+            index = (long) i;
+            break;
+        
+        }
+    
+    }
+    
+    if (index < 0 && (index = alloc_entry (img, root)) < 0) {
+        return -1;
+    }
+    
+    init_entry (img, dir_entry (root, index), name, ATTR_VOLUME_ID, 0);
+    root->dirty = 1;
+    
+    vi = (img->size_fat == 32 ? &img->bs.fstype._fat32.vi : &img->bs.fstype._oldfat.vi);
+    
+    if (vi->ext_boot_sign == 0x29) {
+    
+        memcpy (vi->volume_label, name, 11);
+        img->bs_dirty = 1;
+    
+    }
+    
+    return 0;
+
+}
+
+struct dosfs_dirstream *dosfs_opendir (struct dosfs_image *img, const char *path) {
+
+    struct dosfs_dirstream *ds;
+    struct dosfs_dir *dir;
+    
+    long index;
+    
+    if (lookup_path (img, path, &dir, &index) < 0 || !(dir = open_entry_dir (img, dir, index))) {
+        return 0;
+    }
+    
+    if (!(ds = malloc (sizeof (*ds)))) {
+    
+        img->error = DOSFS_ERR_NOMEM;
+        return 0;
+    
+    }
+    
+    ds->img = img;
+    ds->dir = dir;
+    ds->index = 0;
+    
+    return ds;
+
+}
+
+int dosfs_readdir (struct dosfs_dirstream *ds, struct dosfs_stat *st) {
+
+    struct msdos_dirent *de;
+    
+    while (ds->index < dir_entries (ds->dir)) {
+    
+        de = dir_entry (ds->dir, ds->index++);
+        
+        if (de->name[0] == 0) {
+        
+            ds->index = dir_entries (ds->dir);
+            break;
+        
+        }
+        
+        if (de->name[0] == 0xE5 || (de->attr & ATTR_VOLUME_ID)) {
+            continue;
+        }
+        
+        memset (st, 0, sizeof (*st));
+        dir_to_canonical (st->name, de->name);
+        
+        st->attr = de->attr;
+        st->cluster = entry_cluster (de);
+        st->size = read741 (de->size);
+        st->date = read721 (de->date);
+        st->time = read721 (de->time);
+        
+        return 1;
+    
+    }
+    
+    return 0;
+
+}
+
+void dosfs_closedir (struct dosfs_dirstream *ds) {
+    free (ds);
+}
+
+static void sync_entry (struct dosfs_file *f) {
+
+    struct msdos_dirent *de = dir_entry (f->dir, f->index);
+    
+    unsigned short date = generate_datestamp (dosfs_source_date (f->img));
+    unsigned short time = generate_timestamp (dosfs_source_date (f->img));
+    
+    set_entry_cluster (de, f->start);
+    write741_to_byte_array (de->size, f->size);
+    
+    write721_to_byte_array (de->adate, date);
+    write721_to_byte_array (de->time, time);
+    write721_to_byte_array (de->date, date);
+    
+    f->dir->dirty = 1;
+
+}
+
+/**
+ * Position a read-only file at the cluster holding pos using its extent
+ * index, built from the FAT on first use, in O(log extents).
+ */
+static int seek_extent (struct dosfs_file *f, unsigned long pos) {
+
+    struct dosfs_image *img = f->img;
+    struct dosfs_extent *ext;
+    
+    size_t lo = 0, hi, mid;
+    
+    if (!f->extents && chain_extents (img, f->start, f->size, &f->extents, &f->nb_extents) < 0) {
+        return -1;
+    }
+    
+    hi = f->nb_extents;
+    
+    while (hi - lo > 1) {
+    
+        mid = lo + (hi - lo) / 2;
+        
+        if (f->extents[mid].logical <= pos) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    
+    }
+    
+    if (!f->nb_extents || pos - f->extents[lo].logical >= (unsigned long) f->extents[lo].count * img->cluster_size) {
+    
+        img->error = DOSFS_ERR_INVALID;
+        return -1;
+    
+    }
+    
+    ext = &f->extents[lo];
+    
+    f->cluster = ext->cluster + (unsigned int) ((pos - ext->logical) / img->cluster_size);
+    f->cluster_pos = ext->logical + (pos - ext->logical) / img->cluster_size * img->cluster_size;
+    
+    return 0;
+
+}
+
+/**
+ * Make f->cluster the cluster holding byte pos of the file.  Walking starts
+ * from the current cluster when possible so sequential access never rescans
+ * the chain.  With extend set, missing clusters are allocated on the way.
+ */
+static int seek_cluster (struct dosfs_file *f, unsigned long pos, int extend) {
+
+    struct dosfs_image *img = f->img;
+    unsigned int next;
+    
+    /** Anything but a step to the next cluster goes through the extent index. */
+    if (!extend && !(f->flags & DOSFS_O_WRITE) && f->start && (!f->cluster || pos < f->cluster_pos || pos >= f->cluster_pos + 2 * (unsigned long) img->cluster_size)) {
+        return seek_extent (f, pos);
+    }
+    
+    if (!f->cluster || pos < f->cluster_pos) {
+    
+        if (!f->start) {
+        
+            if (!extend) {
+            
+                img->error = DOSFS_ERR_INVALID;
+                return -1;
+            
+            }
+            
+            if (!(f->start = alloc_cluster (img, 0))) {
+                return -1;
+            }
+        
+        }
+        
+        f->cluster = f->start;
+        f->cluster_pos = 0;
+    
+    }
+    
+    while (pos >= f->cluster_pos + img->cluster_size) {
+    
+        next = dosfs_get_fat (img, f->cluster);
+        
+        if (!is_valid_cluster (img, next)) {
+        
+            if (!extend) {
+            
+                img->error = DOSFS_ERR_INVALID;
+                return -1;
+            
+            }
+            
+            if (!(next = alloc_cluster (img, f->cluster))) {
+                return -1;
+            }
+        
+        }
+        
+        f->cluster = next;
+        f->cluster_pos += img->cluster_size;
+    
+    }
+    
+    return 0;
+
+}
+
+struct dosfs_file *dosfs_fopen (struct dosfs_image *img, const char *path, int flags) {
+
+    struct dosfs_file *f;
+    struct dosfs_dir *dir;
+    struct msdos_dirent *de;
+    
+    char name[11];
+    long index;
+    
+    if ((flags & DOSFS_O_WRITE) && (img->flags & DOSFS_READONLY)) {
+    
+        img->error = DOSFS_ERR_ROFS;
+        return 0;
+    
+    }
+    
+    if (!(dir = lookup_parent (img, path, name))) {
+        return 0;
+    }
+    
+    if ((index = find_entry (dir, name)) < 0) {
+    
+        if (!(flags & DOSFS_O_CREAT)) {
+        
+            img->error = DOSFS_ERR_NOENT;
+            return 0;
+        
+        }
+        
+        if ((index = alloc_entry (img, dir)) < 0) {
+            return 0;
+        }
+        
+        init_entry (img, dir_entry (dir, index), name, ATTR_ARCHIVE, 0);
+        dir->dirty = 1;
+    
+    }
+    
+    de = dir_entry (dir, index);
+    
+    if (de->attr & ATTR_DIR) {
+    
+        img->error = DOSFS_ERR_ISDIR;
+        return 0;
+    
+    }
+    
+    if (!(f = malloc (sizeof (*f)))) {
+    
+        img->error = DOSFS_ERR_NOMEM;
+        return 0;
+    
+    }
+    
+    memset (f, 0, sizeof (*f));
+    
+    f->img = img;
+    f->dir = dir;
+    f->index = index;
+    f->flags = flags;
+    
+    f->start = entry_cluster (de);
+    f->size = read741 (de->size);
+    
+    if ((flags & DOSFS_O_OVERWRITE) && (flags & DOSFS_O_WRITE)) {
+    
+        f->compare_size = (DOSFS_COPY_SIZE / img->cluster_size) * img->cluster_size;
+        
+        if (f->compare_size < img->cluster_size) {
+            f->compare_size = img->cluster_size;
+        }
+        
+        if (!(f->compare = malloc (f->compare_size))) {
+        
+            img->error = DOSFS_ERR_NOMEM;
+            
+            free (f);
+            return 0;
+        
+        }
+    
+    }
+    
+    if ((flags & DOSFS_O_TRUNC) && (flags & DOSFS_O_WRITE)) {
+    
+        free_chain (img, f->start);
+        
+        f->start = 0;
+        f->size = 0;
+        
+        sync_entry (f);
+    
+    }
+    
+    return f;
+
+}
+
+long dosfs_fread (struct dosfs_file *f, void *buffer, unsigned long len) {
+
+    struct dosfs_image *img = f->img;
+    unsigned char *dest = buffer;
+    
+    unsigned long offset, first, bytes, done = 0;
+    unsigned int count, last, next;
+    
+    if (f->pos >= f->size) {
+        return 0;
+    }
+    
+    if (len > f->size - f->pos) {
+        len = f->size - f->pos;
+    }
+    
+    while (done < len) {
+    
+        if (seek_cluster (f, f->pos, 0) < 0) {
+            return -1;
+        }
+        
+        offset = f->pos - f->cluster_pos;
+        
+        if (offset == 0 && len - done >= img->cluster_size) {
+        
+            /** Read physically contiguous clusters straight into the caller's buffer. */
+            count = 1;
+            last = f->cluster;
+            
+            while ((unsigned long) (count + 1) * img->cluster_size <= len - done) {
+            
+                if ((next = dosfs_get_fat (img, last)) != last + 1 || !is_valid_cluster (img, next)) {
+                    break;
+                }
+                
+                last = next;
+                count++;
+            
+            }
+            
+            if (read_sectors (img, cluster_to_sector (img, f->cluster), (unsigned long) count * img->sectors_per_cluster, dest + done) < 0) {
+                return -1;
+            }
+            
+            bytes = (unsigned long) count * img->cluster_size;
+            
+            f->cluster = last;
+            f->cluster_pos += bytes - img->cluster_size;
+        
+        } else {
+        
+            bytes = img->cluster_size - offset;
+            
+            if (bytes > len - done) {
+                bytes = len - done;
+            }
+            
+            /** Only the sectors covering the requested bytes are read. */
+            first = offset / 512;
+            
+            if (read_sectors (img, cluster_to_sector (img, f->cluster) + first, (offset + bytes - 1) / 512 - first + 1, img->buffer) < 0) {
+                return -1;
+            }
+            
+            memcpy (dest + done, img->buffer + (offset - first * 512), bytes);
+        
+        }
+        
+        done += bytes;
+        f->pos += bytes;
+    
+    }
+    
+    return (long) done;
+
+}
+
+/**
+ * Write count contiguous clusters of an existing chain, skipping clusters
+ * that already hold exactly the data being written.
+ */
+static int write_changed (struct dosfs_file *f, unsigned int cluster, unsigned int count, const unsigned char *src) {
+
+    struct dosfs_image *img = f->img;
+    unsigned int per = (unsigned int) (f->compare_size / img->cluster_size), n, i, j;
+    
+    while (count > 0) {
+    
+        n = (count < per ? count : per);
+        
+        if (read_sectors (img, cluster_to_sector (img, cluster), (unsigned long) n * img->sectors_per_cluster, f->compare) < 0) {
+            return -1;
+        }
+        
+        for (i = 0; i < n; i = j) {
+        
+            j = i + 1;
+            
+            if (!memcmp (f->compare + (unsigned long) i * img->cluster_size, src + (unsigned long) i * img->cluster_size, img->cluster_size)) {
+                continue;
+            }
+            
+            while (j < n && memcmp (f->compare + (unsigned long) j * img->cluster_size, src + (unsigned long) j * img->cluster_size, img->cluster_size)) {
+                j++;
+            }
+            
+            if (write_sectors (img, cluster_to_sector (img, cluster + i), (unsigned long) (j - i) * img->sectors_per_cluster, src + (unsigned long) i * img->cluster_size) < 0) {
+                return -1;
+            }
+        
+        }
+        
+        cluster += n;
+        count -= n;
+        src += (unsigned long) n * img->cluster_size;
+    
+    }
+    
+    return 0;
+
+}
+
+long dosfs_fwrite (struct dosfs_file *f, const void *buffer, unsigned long len) {
+
+    struct dosfs_image *img = f->img;
+    const unsigned char *src = buffer;
+    
+    unsigned long offset, first, end, bytes, done = 0;
+    unsigned int count, last, next;
+    
+    if (!(f->flags & DOSFS_O_WRITE)) {
+    
+        img->error = DOSFS_ERR_ROFS;
+        return -1;
+    
+    }
+    
+    if (f->flags & DOSFS_O_APPEND) {
+        f->pos = f->size;
+    }
+    
+    /** Only the end of the write matters; overwriting in place can stay inside the current size. */
+    if (f->pos + len < f->pos || f->pos + len > 0xFFFFFFFFUL) {
+    
+        img->error = DOSFS_ERR_NOSPC;
+        return -1;
+    
+    }
+    
+    while (done < len) {
+    
+        if (seek_cluster (f, f->pos, 1) < 0) {
+            break;
+        }
+        
+        offset = f->pos - f->cluster_pos;
+        
+        if (offset == 0 && len - done >= img->cluster_size) {
+        
+            /** Extend the chain ahead of us and write each contiguous run at once. */
+            count = 1;
+            last = f->cluster;
+            
+            while ((unsigned long) (count + 1) * img->cluster_size <= len - done) {
+            
+                next = dosfs_get_fat (img, last);
+                
+                if (!is_valid_cluster (img, next) && !(next = alloc_cluster (img, last))) {
+                    break;
+                }
+                
+                if (next != last + 1) {
+                    break;
+                }
+                
+                last = next;
+                count++;
+            
+            }
+            
+            if ((f->flags & DOSFS_O_OVERWRITE) && f->cluster_pos < f->size) {
+            
+                if (write_changed (f, f->cluster, count, src + done) < 0) {
+                    break;
+                }
+            
+            } else if (write_sectors (img, cluster_to_sector (img, f->cluster), (unsigned long) count * img->sectors_per_cluster, src + done) < 0) {
+                break;
+            }
+            
+            bytes = (unsigned long) count * img->cluster_size;
+            
+            f->cluster = last;
+            f->cluster_pos += bytes - img->cluster_size;
+        
+        } else {
+        
+            bytes = img->cluster_size - offset;
+            
+            if (bytes > len - done) {
+                bytes = len - done;
+            }
+            
+            /**
+             * Only the sectors being changed are written, and of those only
+             * a partly covered first or last sector that already holds file
+             * data is read back first, so filling the slack at the end of a
+             * file touches just the tail sectors.  A cluster new to the file
+             * is written whole so its slack is zeroed.
+             */
+            first = offset / 512;
+            end = (offset + bytes + 511) / 512;
+            
+            if (f->cluster_pos >= f->size) {
+            
+                first = 0;
+                end = img->sectors_per_cluster;
+            
+            }
+            
+            memset (img->buffer, 0, (end - first) * 512);
+            
+            if ((f->flags & DOSFS_O_OVERWRITE) && f->cluster_pos < f->size) {
+            
+                if (read_sectors (img, cluster_to_sector (img, f->cluster) + first, end - first, img->buffer) < 0) {
+                    break;
+                }
+                
+                if (!memcmp (img->buffer + (offset - first * 512), src + done, bytes)) {
+                    goto _next;
+                }
+            
+            } else {
+            
+                if ((offset % 512) && f->cluster_pos + first * 512 < f->size) {
+                
+                    if (read_sectors (img, cluster_to_sector (img, f->cluster) + first, 1, img->buffer) < 0) {
+                        break;
+                    }
+                
+                }
+                
+                if (((offset + bytes) % 512) && f->cluster_pos + (end - 1) * 512 < f->size && (end - 1 > first || !(offset % 512))) {
+                
+                    if (read_sectors (img, cluster_to_sector (img, f->cluster) + end - 1, 1, img->buffer + (end - 1 - first) * 512) < 0) {
+                        break;
+                    }
+                
+                }
+            
+            }
+            
+            memcpy (img->buffer + (offset - first * 512), src + done, bytes);
+            
+            if (write_sectors (img, cluster_to_sector (img, f->cluster) + first, end - first, img->buffer) < 0) {
+                break;
+            }
+        
+        }
+    
+    _next:
+        
+        done += bytes;
+        f->pos += bytes;
+        
+        if (f->pos > f->size) {
+            f->size = f->pos;
+        }
+    
+    }
+    
+    sync_entry (f);
+    return (done || !len) ? (long) done : -1;
+
+}
+
+int dosfs_fseek (struct dosfs_file *f, unsigned long pos) {
+
+    if (pos > f->size) {
+    
+        f->img->error = DOSFS_ERR_INVALID;
+        return -1;
+    
+    }
+    
+    f->pos = pos;
+    return 0;
+
+}
+
+int dosfs_ftruncate (struct dosfs_file *f, unsigned long size) {
+
+    struct dosfs_image *img = f->img;
+    unsigned int next;
+    
+    if (!(f->flags & DOSFS_O_WRITE)) {
+    
+        img->error = DOSFS_ERR_ROFS;
+        return -1;
+    
+    }
+    
+    if (size > f->size) {
+    
+        img->error = DOSFS_ERR_INVALID;
+        return -1;
+    
+    }
+    
+    if (size == 0) {
+    
+        free_chain (img, f->start);
+        f->start = 0;
+    
+    } else {
+    
+        /** Cut the chain after the cluster holding the last byte kept. */
+        if (seek_cluster (f, size - 1, 0) < 0) {
+            return -1;
+        }
+        
+        next = dosfs_get_fat (img, f->cluster);
+        
+        if (is_valid_cluster (img, next)) {
+        
+            dosfs_set_fat (img, f->cluster, end_of_chain (img));
+            free_chain (img, next);
+        
+        }
+    
+    }
+    
+    f->cluster = 0;
+    f->cluster_pos = 0;
+    f->size = size;
+    
+    if (f->pos > size) {
+        f->pos = size;
+    }
+    
+    sync_entry (f);
+    return 0;
+
+}
+
+unsigned long dosfs_ftell (struct dosfs_file *f) {
+    return f->pos;
+}
+
+long dosfs_pread (struct dosfs_file *f, void *buffer, unsigned long len, unsigned long offset) {
+
+    if (dosfs_fseek (f, offset) < 0) {
+        return -1;
+    }
+    
+    return dosfs_fread (f, buffer, len);
+
+}
+
+void dosfs_fclose (struct dosfs_file *f) {
+
+    free (f->compare);
+    free (f->extents);
+    free (f);
+
+}
+
+/**
+ * Host copies move whole clusters at a time, at least DOSFS_COPY_SIZE bytes
+ * per call, so contiguous files go through in a few large requests.
+ */
+static unsigned char *alloc_copy_buffer (struct dosfs_image *img, size_t *chunk) {
+
+    unsigned char *buffer;
+    
+    *chunk = img->cluster_size;
+    
+    if (*chunk < DOSFS_COPY_SIZE) {
+        *chunk = (DOSFS_COPY_SIZE / img->cluster_size) * img->cluster_size;
+    }
+    
+    if (!(buffer = malloc (*chunk))) {
+        img->error = DOSFS_ERR_NOMEM;
+    }
+    
+    return buffer;
+
+}
+
+int dosfs_copy_in (struct dosfs_image *img, const char *source, const char *target) {
+
+    char tmppath[PATH_MAX];
+    
+    struct dosfs_file *f;
+    struct dosfs_stat st;
+    
+    unsigned char *buffer;
+    unsigned long flen, needed;
+    
+    size_t bytes, chunk;
+    FILE *ifp;
+    
+    /** Copying onto an existing directory puts the file inside it. */
+    if (dosfs_stat (img, target, &st) == 0 && (st.attr & ATTR_DIR)) {
+    
+        const char *base = source + strlen (source);
+        
+        while (base > source && base[-1] != '/' && base[-1] != '\\') {
+            base--;
+        }
+        
+        if (strlen (target) + strlen (base) + 2 > sizeof (tmppath)) {
+        
+            img->error = DOSFS_ERR_NAME;
+            return -1;
+        
+        }
+        
+        sprintf (tmppath, "%s/%s", target, base);
+        target = tmppath;
+    
+    }
+    
+    if ((ifp = fopen (source, "rb")) == NULL) {
+    
+        img->error = DOSFS_ERR_NOENT;
+        return -1;
+    
+    }
+    
+    fseek (ifp, 0, SEEK_END);
+    
+    if ((flen = ftell (ifp)) > 0xFFFFFFFFUL) {
+    
+        img->error = DOSFS_ERR_NOSPC;
+        
+        fclose (ifp);
+        return -1;
+    
+    }
+    
+    fseek (ifp, 0, SEEK_SET);
+    needed = (flen + img->cluster_size - 1) / img->cluster_size;
+    
+    /** Check for space up front so a failed copy leaves any existing file intact. */
+    if (dosfs_stat (img, target, &st) == 0 && !(st.attr & ATTR_DIR)) {
+        needed -= (needed < chain_length (img, st.cluster) ? needed : chain_length (img, st.cluster));
+    }
+    
+    if (needed > img->free_clusters) {
+    
+        img->error = DOSFS_ERR_NOSPC;
+        
+        fclose (ifp);
+        return -1;
+    
+    }
+    
+    if (!(buffer = alloc_copy_buffer (img, &chunk))) {
+    
+        fclose (ifp);
+        return -1;
+    
+    }
+    
+    if (!(f = dosfs_fopen (img, target, DOSFS_O_WRITE | DOSFS_O_CREAT | DOSFS_O_TRUNC))) {
+    
+        free (buffer);
+        fclose (ifp);
+        
+        return -1;
+    
+    }
+    
+    while ((bytes = fread (buffer, 1, chunk, ifp)) > 0) {
+    
+        if (dosfs_fwrite (f, buffer, bytes) != (long) bytes) {
+        
+            dosfs_fclose (f);
+            free (buffer);
+            
+            fclose (ifp);
+            return -1;
+        
+        }
+    
+    }
+    
+    dosfs_fclose (f);
+    free (buffer);
+    
+    fclose (ifp);
+    return 0;
+
+}
+
+int dosfs_copy_out (struct dosfs_image *img, const char *source, const char *target) {
+
+    struct dosfs_file *f;
+    unsigned char *buffer;
+    
+    size_t chunk;
+    long bytes;
+    
+    FILE *ofp;
+    
+    if (!(f = dosfs_fopen (img, source, DOSFS_O_READ))) {
+        return -1;
+    }
+    
+    if (!(buffer = alloc_copy_buffer (img, &chunk))) {
+    
+        dosfs_fclose (f);
+        return -1;
+    
+    }
+    
+    if ((ofp = fopen (target, "wb")) == NULL) {
+    
+        img->error = DOSFS_ERR_IO;
+        
+        dosfs_fclose (f);
+        free (buffer);
+        
+        return -1;
+    
+    }
+    
+    while ((bytes = dosfs_fread (f, buffer, chunk)) > 0) {
+    
+        if (fwrite (buffer, 1, bytes, ofp) != (size_t) bytes) {
+        
+            img->error = DOSFS_ERR_IO;
+            break;
+        
+        }
+    
+    }
+    
+    dosfs_fclose (f);
+    free (buffer);
+    
+    if (fclose (ofp) || bytes != 0) {
+    
+        remove (target);
+        return -1;
+    
+    }
+    
+    return 0;
+
+}
+
+static int parse_boot_sector (struct dosfs_image *img) {
+
+    struct msdos_boot_sector *bs = &img->bs;
+    unsigned long entries;
+    
+    if (bs->boot_jump[0] != 0xEB || bs->boot_jump[1] < 0x16 || bs->boot_jump[2] != 0x90) {
+        return -1;
+    }
+    
+    if (read721 (bs->bytes_per_sector) != 512) {
+        return -1;
+    }
+    
+    img->sectors_per_cluster = (unsigned int) bs->sectors_per_cluster;
+    img->reserved_sectors = read721 (bs->reserved_sectors);
+    img->number_of_fats = (unsigned int) bs->no_fats;
+    img->root_entries = read721 (bs->root_entries);
+    img->total_sectors = read721 (bs->total_sectors16);
+    img->sectors_per_fat = read721 (bs->sectors_per_fat16);
+    
+    if (!img->sectors_per_cluster || !img->reserved_sectors || !img->number_of_fats) {
+        return -1;
+    }
+    
+    if (!img->total_sectors) {
+    
+        if (bs->boot_jump[1] < 0x22 || !(img->total_sectors = read741 (bs->total_sectors32))) {
+            return -1;
+        }
+    
+    }
+    
+    if (!img->sectors_per_fat) {
+    
+        if (bs->boot_jump[1] < 0x58 || img->root_entries) {
+            return -1;
+        }
+        
+        img->sectors_per_fat = read741 (bs->fstype._fat32.sectors_per_fat32);
+        img->root_cluster = read741 (bs->fstype._fat32.root_cluster);
+        img->info_sector = read721 (bs->fstype._fat32.info_sector);
+        
+        if (!img->sectors_per_fat || !img->root_cluster) {
+            return -1;
+        }
+        
+        img->size_fat = 32;
+    
+    }
+    
+    img->root_dir = img->reserved_sectors + (img->sectors_per_fat * img->number_of_fats);
+    img->data_area = img->root_dir + (((img->root_entries * 32) + (512 - 1)) / 512);
+    
+    if (img->data_area >= img->total_sectors) {
+        return -1;
+    }
+    
+    img->cluster_count = (img->total_sectors - img->data_area) / img->sectors_per_cluster;
+    img->cluster_size = img->sectors_per_cluster * 512;
+    
+    if (!img->size_fat) {
+    
+        if (img->cluster_count <= MAX_CLUST_12) {
+            img->size_fat = 12;
+        } else if (img->cluster_count <= MAX_CLUST_16) {
+            img->size_fat = 16;
+        } else {
+            return -1;
+        }
+    
+    }
+    
+    /** Never trust the cluster count further than the FAT can describe. */
+    entries = ((unsigned long) img->sectors_per_fat * 512 * 8) / img->size_fat;
+    
+    if (entries < 3) {
+        return -1;
+    }
+    
+    if ((unsigned long) img->cluster_count + 2 > entries) {
+        img->cluster_count = (unsigned int) (entries - 2);
+    }
+    
+    if (img->size_fat == 32 && !is_valid_cluster (img, img->root_cluster)) {
+        return -1;
+    }
+    
+    img->fat_ops = (img->size_fat == 12 ? &fat_ops12 : (img->size_fat == 16 ? &fat_ops16 : &fat_ops32));
+    return 0;
+
+}
+
+/**
+ * The sidecar index.  It is keyed to the image by the image's size, inode
+ * and modification and change times, the partition offset and a copy of
+ * the boot sector (which carries the volume id), and holds the FAT stored
+ * as runs along with every directory in the tree.  A read-only handle whose
+ * index matches never reads the FAT or any directory from the image.
+ *
+ * Layout, all values little-endian:
+ *
+ *     header (DOSFS_INDEX_HEADER bytes)
+ *         magic[8], offset, size lo, size hi, mtime, mtime ns, ctime,
+ *         ctime ns, inode, generation, free clusters, next free,
+ *         run count, directory count
+ *     boot sector (512 bytes)
+ *     runs, 16 bytes each: start, count, value, type
+ *     directories: cluster, chain length, size, chain[], data[]
+ *
+ * A run of type 0 is count clusters that all hold value (free space, bad
+ * clusters); a run of type 1 is a contiguous extent where every cluster
+ * points to the next and the last holds value.
+ */
+static int image_identity (struct dosfs_image *img, unsigned char *id) {
+
+#ifndef     __PDOS__
+
+    struct stat sb;
+    
+    if (stat (img->filename, &sb)) {
+        return -1;
+    }
+    
+    memset (id, 0, DOSFS_INDEX_ID);
+    write741_to_byte_array (id, (unsigned int) img->offset);
+    write741_to_byte_array (id + 4, (unsigned int) sb.st_size);
+    write741_to_byte_array (id + 8, (unsigned int) (sb.st_size / 65536 / 65536));
+    write741_to_byte_array (id + 12, (unsigned int) sb.st_mtime);
+    write741_to_byte_array (id + 20, (unsigned int) sb.st_ctime);
+    write741_to_byte_array (id + 28, (unsigned int) sb.st_ino);
+
+#if     !defined (_WIN32)
+
+    write741_to_byte_array (id + 16, (unsigned int) sb.st_mtim.tv_nsec);
+    write741_to_byte_array (id + 24, (unsigned int) sb.st_ctim.tv_nsec);
+
+#endif
+
+    return 0;
+
+#else
+
+    (void) img;
+    (void) id;
+    
+    return -1;
+
+#endif
+
+}
+
+/**
+ * A write that lands in the same clock tick as the last one leaves the
+ * image's times as they were, so an index is only trusted if it was
+ * written in a later tick than the image it describes.
+ */
+static int index_is_racy (struct dosfs_image *img, const unsigned char *id) {
+
+#ifndef     __PDOS__
+
+    struct stat sb;
+    unsigned long nsec = 0;
+    
+    if (stat (img->index_path, &sb)) {
+        return 1;
+    }
+
+#if     !defined (_WIN32)
+
+    nsec = (unsigned long) sb.st_mtim.tv_nsec;
+
+#endif
+
+    if ((unsigned long) sb.st_mtime != read741 (id + 12)) {
+        return ((unsigned long) sb.st_mtime < read741 (id + 12));
+    }
+    
+    return (nsec <= read741 (id + 16));
+
+#else
+
+    (void) img;
+    (void) id;
+    
+    return 1;
+
+#endif
+
+}
+
+static int read_index_u32 (FILE *fp, unsigned int *value) {
+
+    unsigned char temp[4];
+    
+    if (fread (temp, 4, 1, fp) != 1) {
+        return -1;
+    }
+    
+    *value = read741 (temp);
+    return 0;
+
+}
+
+static int write_index_u32 (FILE *fp, unsigned int value) {
+
+    unsigned char temp[4];
+    write741_to_byte_array (temp, value);
+    
+    return (fwrite (temp, 4, 1, fp) == 1 ? 0 : -1);
+
+}
+
+static struct dosfs_dir *load_index_dir (struct dosfs_image *img, FILE *fp) {
+
+    struct dosfs_dir *dir;
+    unsigned int cluster, nb_chain, size, i;
+    
+    if (read_index_u32 (fp, &cluster) || read_index_u32 (fp, &nb_chain) || read_index_u32 (fp, &size)) {
+        return 0;
+    }
+    
+    if (cluster == 0 ? (img->size_fat == 32 || nb_chain != 0 || size != ((unsigned long) img->root_entries * 32 + 511) / 512 * 512) : (!is_valid_cluster (img, cluster) || nb_chain == 0 || nb_chain > img->cluster_count || size != nb_chain * img->cluster_size)) {
+        return 0;
+    }
+    
+    if (find_cached_dir (img, cluster) || !(dir = malloc (sizeof (*dir)))) {
+        return 0;
+    }
+    
+    memset (dir, 0, sizeof (*dir));
+    
+    dir->cluster = cluster;
+    dir->nb_chain = nb_chain;
+    dir->size = size;
+    
+    if ((nb_chain && !(dir->chain = malloc (nb_chain * sizeof (*dir->chain)))) || !(dir->data = malloc (size))) {
+    
+        free_dir (dir);
+        return 0;
+    
+    }
+    
+    for (i = 0; i < nb_chain; i++) {
+    
+        if (read_index_u32 (fp, &dir->chain[i]) || !is_valid_cluster (img, dir->chain[i])) {
+        
+            free_dir (dir);
+            return 0;
+        
+        }
+    
+    }
+    
+    if (fread (dir->data, size, 1, fp) != 1) {
+    
+        free_dir (dir);
+        return 0;
+    
+    }
+    
+    return dir;
+
+}
+
+/**
+ * Check the index against the image and, for a read-only handle, fill the
+ * FAT and directory cache from it.  Returns 1 if the FAT was loaded.
+ */
+static int load_index (struct dosfs_image *img) {
+
+    unsigned char header[DOSFS_INDEX_HEADER], id[DOSFS_INDEX_ID];
+    unsigned char bs[512];
+    
+    unsigned int nb_runs, nb_dirs, i, j;
+    unsigned int start, count, value, type;
+    
+    struct dosfs_dir *dir;
+    FILE *fp;
+    
+    if (image_identity (img, id) || !(fp = fopen (img->index_path, "rb"))) {
+        return 0;
+    }
+    
+    if (fread (header, sizeof (header), 1, fp) != 1 || fread (bs, sizeof (bs), 1, fp) != 1) {
+        goto _invalid;
+    }
+    
+    if (memcmp (header, DOSFS_INDEX_MAGIC, 8) || memcmp (header + 8, id, DOSFS_INDEX_ID) || memcmp (bs, &img->bs, sizeof (bs)) || index_is_racy (img, id)) {
+        goto _invalid;
+    }
+    
+    img->generation = read741 (header + 40);
+    img->index_valid = 1;
+    
+    if (!(img->flags & DOSFS_READONLY)) {
+    
+        fclose (fp);
+        return 0;
+    
+    }
+    
+    nb_runs = read741 (header + 52);
+    nb_dirs = read741 (header + 56);
+    
+    memset (img->fat, 0, (unsigned long) img->sectors_per_fat * 512);
+    
+    for (i = 0; i < nb_runs; i++) {
+    
+        if (read_index_u32 (fp, &start) || read_index_u32 (fp, &count) || read_index_u32 (fp, &value) || read_index_u32 (fp, &type)) {
+            goto _invalid;
+        }
+        
+        if (!is_valid_cluster (img, start) || count == 0 || count > img->cluster_count + 2 - start || type > 1) {
+            goto _invalid;
+        }
+        
+        for (j = start; j < start + count - 1; j++) {
+            dosfs_set_fat (img, j, type ? j + 1 : value);
+        }
+        
+        dosfs_set_fat (img, j, value);
+    
+    }
+    
+    img->free_clusters = read741 (header + 44);
+    img->next_free = read741 (header + 48);
+    
+    img->fat_dirty_lo = 1;
+    img->fat_dirty_hi = 0;
+    
+    /** The FAT is complete at this point; a short directory list only costs reads later. */
+    for (i = 0; i < nb_dirs; i++) {
+    
+        if (!(dir = load_index_dir (img, fp))) {
+        
+            img->index_valid = 0;
+            break;
+        
+        }
+        
+        cache_dir (img, dir);
+    
+    }
+    
+    fclose (fp);
+    return 1;
+
+_invalid:
+
+    img->index_valid = 0;
+    
+    fclose (fp);
+    return 0;
+
+}
+
+static int load_tree (struct dosfs_image *img, struct dosfs_dir *dir, int depth) {
+
+    struct dosfs_dir *subdir;
+    struct msdos_dirent *de;
+    
+    unsigned int cluster;
+    size_t i;
+    
+    if (depth > DOSFS_INDEX_DEPTH) {
+        return 0;
+    }
+    
+    for (i = 0; i < dir_entries (dir); i++) {
+    
+        de = dir_entry (dir, i);
+        
+        if (de->name[0] == 0) {
+            break;
+        }
+        
+        if (de->name[0] == 0xE5 || de->name[0] == '.' || !(de->attr & ATTR_DIR) || (de->attr & ATTR_VOLUME_ID)) {
+            continue;
+        }
+        
+        cluster = entry_cluster (de);
+        
+        if (!is_valid_cluster (img, cluster) || find_cached_dir (img, cluster)) {
+            continue;
+        }
+        
+        if (!(subdir = load_dir (img, cluster)) || load_tree (img, subdir, depth + 1) < 0) {
+            return -1;
+        }
+    
+    }
+    
+    return 0;
+
+}
+
+static int save_index_dir (FILE *fp, struct dosfs_dir *dir) {
+
+    size_t i;
+    
+    if (write_index_u32 (fp, dir->cluster) || write_index_u32 (fp, (unsigned int) dir->nb_chain) || write_index_u32 (fp, (unsigned int) dir->size)) {
+        return -1;
+    }
+    
+    for (i = 0; i < dir->nb_chain; i++) {
+    
+        if (write_index_u32 (fp, dir->chain[i])) {
+            return -1;
+        }
+    
+    }
+    
+    return (fwrite (dir->data, dir->size, 1, fp) == 1 ? 0 : -1);
+
+}
+
+/**
+ * Write a fresh index for the image.  The index is only a cache, so any
+ * failure simply leaves no index behind.
+ */
+static void save_index (struct dosfs_image *img) {
+
+    unsigned char header[DOSFS_INDEX_HEADER];
+    unsigned int nb_runs = 0, nb_dirs = 0;
+    
+    unsigned int cluster, next, value, last;
+    unsigned int i;
+    
+    struct dosfs_dir *dir;
+    char *temp;
+    
+    FILE *fp;
+    
+    if (!(dir = load_root (img)) || load_tree (img, dir, 0) < 0) {
+        return;
+    }
+    
+    memset (header, 0, sizeof (header));
+    memcpy (header, DOSFS_INDEX_MAGIC, 8);
+    
+    if (image_identity (img, header + 8)) {
+        return;
+    }
+    
+    if (img->written) {
+        img->generation++;
+    }
+    
+    write741_to_byte_array (header + 40, img->generation);
+    write741_to_byte_array (header + 44, img->free_clusters);
+    write741_to_byte_array (header + 48, img->next_free);
+    
+    if (!(temp = malloc (strlen (img->index_path) + 5))) {
+        return;
+    }
+    
+    sprintf (temp, "%s.tmp", img->index_path);
+    
+    if (!(fp = fopen (temp, "wb"))) {
+    
+        free (temp);
+        return;
+    
+    }
+    
+    if (fwrite (header, sizeof (header), 1, fp) != 1 || fwrite (&img->bs, 512, 1, fp) != 1) {
+        goto _error;
+    }
+    
+    last = img->cluster_count + 1;
+    
+    for (cluster = 2; cluster <= last; cluster = next + 1, nb_runs++) {
+    
+        value = dosfs_get_fat (img, cluster);
+        
+        if (value == cluster + 1 && value <= last) {
+        
+            for (next = cluster + 1; next < last && dosfs_get_fat (img, next) == next + 1; next++) {
+                ;
+            }
+            
+            value = dosfs_get_fat (img, next);
+        
+        } else {
+        
+            for (next = cluster; next < last && dosfs_get_fat (img, next + 1) == value && value != next + 2; next++) {
+                ;
+            }
+        
+        }
+        
+        if (write_index_u32 (fp, cluster) || write_index_u32 (fp, next - cluster + 1) || write_index_u32 (fp, value) || write_index_u32 (fp, next > cluster && dosfs_get_fat (img, cluster) == cluster + 1)) {
+            goto _error;
+        }
+    
+    }
+    
+    for (i = 0; i < DOSFS_DIR_HASH; i++) {
+    
+        for (dir = img->dirs[i]; dir; dir = dir->next, nb_dirs++) {
+        
+            if (save_index_dir (fp, dir) < 0) {
+                goto _error;
+            }
+        
+        }
+    
+    }
+    
+    write741_to_byte_array (header + 52, nb_runs);
+    write741_to_byte_array (header + 56, nb_dirs);
+    
+    if (fseek (fp, 0, SEEK_SET) || fwrite (header, sizeof (header), 1, fp) != 1) {
+        goto _error;
+    }
+    
+    if (fclose (fp)) {
+    
+        remove (temp);
+        
+        free (temp);
+        return;
+    
+    }
+    
+    remove (img->index_path);
+    
+    if (rename (temp, img->index_path)) {
+        remove (temp);
+    }
+    
+    free (temp);
+    return;
+
+_error:
+
+    fclose (fp);
+    remove (temp);
+    
+    free (temp);
+
+}
+
+struct dosfs_image *dosfs_open (const char *filename, unsigned long offset, int flags, int *error) {
+
+    struct dosfs_image *img;
+    struct fatscan_stats scan;
+    
+    if (!(img = malloc (sizeof (*img)))) {
+    
+        if (error) {
+            *error = DOSFS_ERR_NOMEM;
+        }
+        
+        return 0;
+    
+    }
+    
+    memset (img, 0, sizeof (*img));
+    
+    /** A SOURCE_DATE_EPOCH in the environment fixes every stamp and the allocation order, for reproducible images. */
+    if (flags & DOSFS_SOURCE_DATE) {
+    
+        if ((img->source_date_set = source_date_from_env (&img->source_date)) < 0) {
+        
+            img->error = DOSFS_ERR_SOURCE_DATE;
+            goto _error;
+        
+        }
+        
+        if (img->source_date_set) {
+            flags |= DOSFS_FIXED_ORDER;
+        }
+    
+    }
+    
+    img->offset = offset;
+    img->flags = flags;
+    
+    if ((img->fp = fopen (filename, (flags & DOSFS_READONLY) ? "rb" : "r+b")) == NULL) {
+    
+        img->error = DOSFS_ERR_IO;
+        goto _error;
+    
+    }
+    
+    if (read_sectors (img, 0, 1, &img->bs) < 0) {
+        goto _error;
+    }
+    
+    if (parse_boot_sector (img) < 0) {
+    
+        img->error = DOSFS_ERR_INVALID;
+        goto _error;
+    
+    }
+    
+    if (!(img->fat = malloc ((unsigned long) img->sectors_per_fat * 512)) || !(img->buffer = malloc (img->cluster_size))) {
+    
+        img->error = DOSFS_ERR_NOMEM;
+        goto _error;
+    
+    }
+    
+    if (img->size_fat == 12) {
+    
+        if (!(img->fat12 = malloc (fat12_entries ((unsigned long) img->sectors_per_fat * 512) * sizeof (*img->fat12)))) {
+        
+            img->error = DOSFS_ERR_NOMEM;
+            goto _error;
+        
+        }
+        
+        memset (img->fat12, 0, fat12_entries ((unsigned long) img->sectors_per_fat * 512) * sizeof (*img->fat12));
+    
+    }
+    
+    if (flags & DOSFS_INDEX) {
+    
+        if (!(img->filename = malloc (strlen (filename) + 1)) || !(img->index_path = malloc (strlen (filename) + sizeof (DOSFS_INDEX_SUFFIX)))) {
+        
+            img->error = DOSFS_ERR_NOMEM;
+            goto _error;
+        
+        }
+        
+        strcpy (img->filename, filename);
+        sprintf (img->index_path, "%s%s", filename, DOSFS_INDEX_SUFFIX);
+        
+        if (load_index (img)) {
+        
+            /** The index fills in the unpacked table; the packed copy has to match it outside the dirty range. */
+            if (img->fat12) {
+                pack_fat12 (img, 0, (unsigned long) img->sectors_per_fat * 512 - 1);
+            }
+            
+            /** The index keeps the allocation hint of the last session; a fixed order always starts from the first free cluster. */
+            if (flags & DOSFS_FIXED_ORDER) {
+                img->next_free = img->fat_ops->find_free (img, 2, img->cluster_count + 1);
+            }
+            
+            return img;
+        
+        }
+    
+    }
+    
+    if (read_sectors (img, img->reserved_sectors, img->sectors_per_fat, img->fat) < 0) {
+        goto _error;
+    }
+    
+    if (img->fat12) {
+        unpack_fat12 (img->fat12, img->fat, (unsigned long) img->sectors_per_fat * 512);
+    }
+    
+    if (!(flags & DOSFS_NO_COUNT)) {
+    
+        fatscan (img->fat, img->size_fat, 2, img->cluster_count, &scan);
+        
+        img->free_clusters = (unsigned int) scan.free_clusters;
+        img->next_free = scan.first_free;
+    
+    }
+    
+    img->fat_dirty_lo = 1;
+    img->fat_dirty_hi = 0;
+    
+    return img;
+
+_error:
+
+    if (error) {
+        *error = img->error;
+    }
+    
+    if (img->fp) {
+        fclose (img->fp);
+    }
+    
+    free (img->index_path);
+    free (img->filename);
+    
+    free (img->buffer);
+    free (img->fat12);
+    free (img->fat);
+    free (img);
+    
+    return 0;
+
+}
+
+int dosfs_commit (struct dosfs_image *img) {
+
+    struct dosfs_dir *dir;
+    unsigned long first, count;
+    unsigned int i;
+    
+    if (img->flags & DOSFS_READONLY) {
+        return 0;
+    }
+    
+    for (i = 0; i < DOSFS_DIR_HASH; i++) {
+    
+        for (dir = img->dirs[i]; dir; dir = dir->next) {
+        
+            if (flush_dir (img, dir) < 0) {
+                return -1;
+            }
+        
+        }
+    
+    }
+    
+    if (img->fat_dirty_lo <= img->fat_dirty_hi) {
+    
+        first = img->fat_dirty_lo / 512;
+        count = (img->fat_dirty_hi / 512) - first + 1;
+        
+        if (img->fat12) {
+            pack_fat12 (img, first * 512, (first + count) * 512 - 1);
+        }
+        
+        for (i = 0; i < img->number_of_fats; i++) {
+        
+            if (write_sectors (img, img->reserved_sectors + ((unsigned long) i * img->sectors_per_fat) + first, count, img->fat + first * 512) < 0) {
+                return -1;
+            }
+        
+        }
+        
+        img->fat_dirty_lo = 1;
+        img->fat_dirty_hi = 0;
+    
+    }
+    
+    if (img->size_fat == 32 && img->info_sector) {
+    
+        struct fat32_fsinfo *info = (struct fat32_fsinfo *) (img->buffer + 0x1e0);
+        
+        if (read_sectors (img, img->info_sector, 1, img->buffer) < 0) {
+            return -1;
+        }
+        
+        if (read741 (info->signature) == 0x61417272 && (read741 (info->free_clusters) != img->free_clusters || read741 (info->next_cluster) != img->next_free)) {
+        
+            write741_to_byte_array (info->free_clusters, img->free_clusters);
+            write741_to_byte_array (info->next_cluster, img->next_free);
+            
+            if (write_sectors (img, img->info_sector, 1, img->buffer) < 0) {
+                return -1;
+            }
+        
+        }
+    
+    }
+    
+    if (img->bs_dirty) {
+    
+        if (write_sectors (img, 0, 1, &img->bs) < 0) {
+            return -1;
+        }
+        
+        if (img->size_fat == 32 && read721 (img->bs.fstype._fat32.backup_boot)) {
+        
+            if (write_sectors (img, read721 (img->bs.fstype._fat32.backup_boot), 1, &img->bs) < 0) {
+                return -1;
+            }
+        
+        }
+        
+        img->bs_dirty = 0;
+    
+    }
+    
+    if (fflush (img->fp)) {
+    
+        img->error = DOSFS_ERR_IO;
+        return -1;
+    
+    }
+    
+    return 0;
+
+}
+
+int dosfs_close (struct dosfs_image *img) {
+
+    struct dosfs_dir *dir, *next;
+    
+    unsigned int i;
+    int result;
+    
+    result = dosfs_commit (img);
+    
+    if ((img->flags & DOSFS_INDEX) && result == 0 && (img->written || !img->index_valid)) {
+        save_index (img);
+    }
+    
+    for (i = 0; i < DOSFS_DIR_HASH; i++) {
+    
+        for (dir = img->dirs[i]; dir; dir = next) {
+        
+            next = dir->next;
+            free_dir (dir);
+        
+        }
+    
+    }
+    
+    if (fclose (img->fp)) {
+        result = -1;
+    }
+    
+    free (img->index_path);
+    free (img->filename);
+    
+    free (img->buffer);
+    free (img->fat12);
+    free (img->fat);
+    free (img);
+    
+    return result;
+
+}
+
+/**
+ * A file or directory that a defragmenting pass may move.  It is found
+ * through entry index of parent; dir is its cached copy if it is a
+ * directory.
+ */
+struct defrag_object {
+
+    struct dosfs_dir *parent, *dir;
+    size_t index;
+    
+    unsigned int cluster, count, runs;
+
+};
+
+struct defrag_run {
+
+    unsigned int start, count;
+
+};
+
+struct defrag_state {
+
+    struct dosfs_defrag_stats *stats;
+    
+    dosfs_defrag_callback callback;
+    void *arg;
+    
+    struct defrag_object *objects;
+    size_t nb_objects, nb_alloc;
+    
+    char path[PATH_MAX];
+
+};
+
+/** Count the clusters of a chain and the physically contiguous runs they form. */
+static unsigned int chain_runs (struct dosfs_image *img, unsigned int cluster, unsigned int *pcount) {
+
+    unsigned int count = 0, runs = 0, prev = 0;
+    
+    while (is_valid_cluster (img, cluster) && count < img->cluster_count) {
+    
+        if (!count || cluster != prev + 1) {
+            runs++;
+        }
+        
+        prev = cluster;
+        cluster = dosfs_get_fat (img, cluster);
+        
+        count++;
+    
+    }
+    
+    *pcount = count;
+    return runs;
+
+}
+
+/**
+ * Walk the tree below dir, adding up the statistics and remembering every
+ * fragmented file and directory (the root excepted) in ds->objects.
+ */
+static int defrag_walk (struct dosfs_image *img, struct defrag_state *ds, struct dosfs_dir *dir, size_t len, int depth) {
+
+    struct defrag_object *objects, *obj;
+    struct dosfs_dir *subdir = 0;
+    struct msdos_dirent *de;
+    
+    unsigned int cluster, count, runs;
+    size_t i, k;
+    
+    if (depth > DOSFS_INDEX_DEPTH) {
+    
+        img->error = DOSFS_ERR_INVALID;
+        return -1;
+    
+    }
+    
+    for (i = 0; i < dir_entries (dir); i++) {
+    
+        de = dir_entry (dir, i);
+        
+        if (de->name[0] == 0) {
+            break;
+        }
+        
+        if (de->name[0] == 0xE5 || (de->attr & ATTR_VOLUME_ID) || is_dot_entry (de)) {
+            continue;
+        }
+        
+        if (!is_valid_cluster (img, cluster = entry_cluster (de))) {
+            continue;
+        }
+        
+        if ((de->attr & ATTR_DIR) && !(subdir = load_dir (img, cluster))) {
+            return -1;
+        }
+        
+        runs = chain_runs (img, cluster, &count);
+        
+        ds->stats->files++;
+        ds->stats->extents += runs;
+        
+        if (len + 14 >= sizeof (ds->path)) {
+        
+            img->error = DOSFS_ERR_NAME;
+            return -1;
+        
+        }
+        
+        k = len;
+        
+        if (k) {
+            ds->path[k++] = '/';
+        }
+        
+        dir_to_canonical (ds->path + k, de->name);
+        
+        if (runs > 1) {
+        
+            ds->stats->fragmented++;
+            
+            if (ds->callback) {
+                ds->callback (ds->path, runs, count, ds->arg);
+            }
+            
+            if (ds->nb_objects == ds->nb_alloc) {
+            
+                ds->nb_alloc = (ds->nb_alloc ? ds->nb_alloc * 2 : 64);
+                
+                if (!(objects = realloc (ds->objects, ds->nb_alloc * sizeof (*objects)))) {
+                
+                    img->error = DOSFS_ERR_NOMEM;
+                    return -1;
+                
+                }
+                
+                ds->objects = objects;
+            
+            }
+            
+            obj = &ds->objects[ds->nb_objects++];
+            
+            obj->parent = dir;
+            obj->dir = ((de->attr & ATTR_DIR) ? subdir : 0);
+            obj->index = i;
+            obj->cluster = cluster;
+            obj->count = count;
+            obj->runs = runs;
+        
+        }
+        
+        if ((de->attr & ATTR_DIR) && defrag_walk (img, ds, subdir, k + strlen (ds->path + k), depth + 1) < 0) {
+            return -1;
+        }
+        
+        ds->path[len] = '\0';
+    
+    }
+    
+    return 0;
+
+}
+
+/** Build the free-extent map: every run of free clusters, in disk order. */
+static int free_runs (struct dosfs_image *img, struct defrag_run **pruns, size_t *pnb_runs) {
+
+    struct defrag_run *runs = 0, *new_runs;
+    size_t nb_runs = 0, nb_alloc = 0;
+    
+    unsigned int cluster, start;
+    
+    for (cluster = 2; cluster < img->cluster_count + 2; cluster++) {
+    
+        if (dosfs_get_fat (img, cluster) != 0) {
+            continue;
+        }
+        
+        for (start = cluster; cluster + 1 < img->cluster_count + 2 && dosfs_get_fat (img, cluster + 1) == 0; cluster++) {
+            ;
+        }
+        
+        if (nb_runs == nb_alloc) {
+        
+            nb_alloc = (nb_alloc ? nb_alloc * 2 : 64);
+            
+            if (!(new_runs = realloc (runs, nb_alloc * sizeof (*runs)))) {
+            
+                free (runs);
+                
+                img->error = DOSFS_ERR_NOMEM;
+                return -1;
+            
+            }
+            
+            runs = new_runs;
+        
+        }
+        
+        runs[nb_runs].start = start;
+        runs[nb_runs++].count = cluster - start + 1;
+    
+    }
+    
+    *pruns = runs;
+    *pnb_runs = nb_runs;
+    
+    return 0;
+
+}
+
+/** Largest first, so the hardest objects to place get first pick of the free runs. */
+static int compare_objects (const void *a, const void *b) {
+
+    const struct defrag_object *x = a, *y = b;
+    
+    if (x->count != y->count) {
+        return (x->count > y->count ? -1 : 1);
+    }
+    
+    return (x->cluster < y->cluster ? -1 : (x->cluster > y->cluster));
+
+}
+
+/**
+ * Copy the data of a file's chain to the run starting at dest, one extent
+ * (or buffer full) at a time, then point the file at its new clusters and
+ * free the old ones.  Directories are resident, so only their chain and the
+ * entries that refer to them change; the data is written on commit.
+ */
+static int move_object (struct dosfs_image *img, struct defrag_object *obj, unsigned int dest, unsigned char *buffer, size_t chunk) {
+
+    struct dosfs_dir *dir = obj->dir, *child;
+    struct msdos_dirent *de;
+    
+    unsigned int cluster = obj->cluster, start, run, done = 0, part, next, i;
+    unsigned int per_chunk = (unsigned int) (chunk / img->cluster_size);
+    
+    size_t k;
+    
+    if (!dir) {
+    
+        while (done < obj->count) {
+        
+            for (start = cluster, run = 1; run < obj->count - done && (next = dosfs_get_fat (img, start + run - 1)) == start + run; run++) {
+                ;
+            }
+            
+            for (i = 0; i < run; i += part) {
+            
+                part = (run - i < per_chunk ? run - i : per_chunk);
+                
+                if (read_sectors (img, cluster_to_sector (img, start + i), (unsigned long) part * img->sectors_per_cluster, buffer) < 0) {
+                    return -1;
+                }
+                
+                if (write_sectors (img, cluster_to_sector (img, dest + done + i), (unsigned long) part * img->sectors_per_cluster, buffer) < 0) {
+                    return -1;
+                }
+            
+            }
+            
+            done += run;
+            cluster = dosfs_get_fat (img, start + run - 1);
+        
+        }
+    
+    }
+    
+    free_chain (img, obj->cluster);
+    link_run (img, dest, obj->count);
+    
+    set_entry_cluster (dir_entry (obj->parent, obj->index), dest);
+    obj->parent->dirty = 1;
+    
+    if (dir) {
+    
+        unhash_dir (img, dir);
+        
+        for (i = 0; i < obj->count && i < dir->nb_chain; i++) {
+            dir->chain[i] = dest + i;
+        }
+        
+        dir->cluster = dest;
+        set_entry_cluster (dir_entry (dir, 0), dest);
+        
+        /** Every subdirectory's ".." entry names this directory by cluster. */
+        for (k = 0; k < dir_entries (dir); k++) {
+        
+            de = dir_entry (dir, k);
+            
+            if (de->name[0] == 0) {
+                break;
+            }
+            
+            if (de->name[0] == 0xE5 || !(de->attr & ATTR_DIR) || (de->attr & ATTR_VOLUME_ID) || is_dot_entry (de) || !is_valid_cluster (img, entry_cluster (de))) {
+                continue;
+            }
+            
+            if (!(child = load_dir (img, entry_cluster (de)))) {
+                return -1;
+            }
+            
+            set_entry_cluster (dir_entry (child, 1), dest);
+            child->dirty = 1;
+        
+        }
+        
+        dir->dirty = 1;
+        cache_dir (img, dir);
+    
+    }
+    
+    obj->cluster = dest;
+    obj->runs = 1;
+    
+    return 0;
+
+}
+
+#define     DOSFS_DEFRAG_PASSES         8
+
+/**
+ * Report on, and unless DOSFS_DEFRAG_REPORT is given reduce, fragmentation.
+ * Each pass plans moves against a map of the free runs taken at its start:
+ * fragmented files and directories, largest first, go to the smallest free
+ * run that holds them whole.  Clusters freed by a pass are only reused after
+ * it has been committed, so data is never copied over clusters the image on
+ * disk still uses.  Anything that fits no free run is left where it is and counted.  The root
+ * directory is never moved.  callback, if given, is called for each
+ * fragmented file found by the first walk.
+ */
+int dosfs_defrag (struct dosfs_image *img, int flags, struct dosfs_defrag_stats *stats, dosfs_defrag_callback callback, void *arg) {
+
+    struct dosfs_defrag_stats local;
+    struct defrag_state ds;
+    struct defrag_run *runs = 0, *best;
+    struct dosfs_dir *root;
+    
+    unsigned char *buffer = 0;
+    size_t nb_runs = 0, chunk, i, j;
+    
+    unsigned long moved;
+    int pass, result = -1;
+    
+    if (!(flags & DOSFS_DEFRAG_REPORT) && (img->flags & DOSFS_READONLY)) {
+    
+        img->error = DOSFS_ERR_ROFS;
+        return -1;
+    
+    }
+    
+    if (!stats) {
+        stats = &local;
+    }
+    
+    memset (stats, 0, sizeof (*stats));
+    memset (&ds, 0, sizeof (ds));
+    
+    ds.stats = stats;
+    ds.callback = callback;
+    ds.arg = arg;
+    
+    if (!(root = load_root (img))) {
+        return -1;
+    }
+    
+    if (root->cluster) {
+    
+        unsigned int count, extents = chain_runs (img, root->cluster, &count);
+        
+        stats->files++;
+        stats->extents += extents;
+        
+        if (extents > 1) {
+            stats->fragmented++;
+        }
+    
+    }
+    
+    if (defrag_walk (img, &ds, root, 0, 0) < 0) {
+        goto out;
+    }
+    
+    if (!(flags & DOSFS_DEFRAG_REPORT) && ds.nb_objects) {
+    
+        if (!(buffer = alloc_copy_buffer (img, &chunk))) {
+            goto out;
+        }
+        
+        qsort (ds.objects, ds.nb_objects, sizeof (*ds.objects), compare_objects);
+        
+        for (pass = 0; pass < DOSFS_DEFRAG_PASSES; pass++) {
+        
+            if (free_runs (img, &runs, &nb_runs) < 0) {
+                goto out;
+            }
+            
+            moved = 0;
+            
+            for (i = 0; i < ds.nb_objects; i++) {
+            
+                if (ds.objects[i].runs <= 1) {
+                    continue;
+                }
+                
+                for (best = 0, j = 0; j < nb_runs; j++) {
+                
+                    if (runs[j].count >= ds.objects[i].count && (!best || runs[j].count < best->count)) {
+                        best = &runs[j];
+                    }
+                
+                }
+                
+                if (!best) {
+                    continue;
+                }
+                
+                if (move_object (img, &ds.objects[i], best->start, buffer, chunk) < 0) {
+                    goto out;
+                }
+                
+                stats->clusters_moved += ds.objects[i].count;
+                
+                best->start += ds.objects[i].count;
+                best->count -= ds.objects[i].count;
+                
+                moved++;
+            
+            }
+            
+            free (runs);
+            runs = 0;
+            
+            if (dosfs_commit (img) < 0) {
+                goto out;
+            }
+            
+            stats->moved += moved;
+            
+            if (!moved) {
+                break;
+            }
+        
+        }
+        
+        for (i = 0; i < ds.nb_objects; i++) {
+        
+            if (ds.objects[i].runs > 1) {
+                stats->unmovable++;
+            }
+        
+        }
+    
+    }
+    
+    if (free_runs (img, &runs, &nb_runs) < 0) {
+        goto out;
+    }
+    
+    for (i = 0; i < nb_runs; i++) {
+    
+        stats->free_clusters += runs[i].count;
+        
+        if (runs[i].count > stats->largest_free) {
+            stats->largest_free = runs[i].count;
+        }
+    
+    }
+    
+    stats->free_extents = nb_runs;
+    result = 0;
+
+out:
+
+    free (runs);
+    free (buffer);
+    free (ds.objects);
+    
+    return result;
+
+}
+
+/**
+ * A resize keeps every cluster it can where it is on disk and only renumbers
+ * it: old cluster c becomes new cluster c - delta for first <= c <= last.
+ * The clusters outside that range (those a larger FAT now covers, or those
+ * past the new end of the volume) are copied to free space and listed in
+ * moves, sorted by their old number.
+ */
+struct resize_move {
+
+    unsigned int from, to;
+
+};
+
+struct resize_plan {
+
+    struct resize_move *moves;
+    size_t nb_moves;
+    
+    long delta;
+    unsigned int first, last;
+    
+    unsigned int reserved_sectors, data_area, cluster_count;
+    unsigned long used;
+
+};
+
+/** The new number of old cluster, or 0 if it does not survive the resize. */
+static unsigned int resize_map (const struct resize_plan *plan, unsigned int cluster) {
+
+    size_t lo = 0, hi = plan->nb_moves, mid;
+    
+    if (cluster >= plan->first && cluster <= plan->last) {
+        return (unsigned int) ((long) cluster - plan->delta);
+    }
+    
+    while (lo < hi) {
+    
+        mid = lo + (hi - lo) / 2;
+        
+        if (plan->moves[mid].from == cluster) {
+            return plan->moves[mid].to;
+        }
+        
+        if (plan->moves[mid].from < cluster) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    
+    }
+    
+    return 0;
+
+}
+
+/**
+ * Work out the layout for total_sectors and sectors_per_fat and where every
+ * cluster in use ends up.  Reserved sectors are added (fewer than a cluster's
+ * worth) so that the data area moves by a whole number of clusters, which is
+ * what lets clusters stay where they are.  Nothing is changed.
+ */
+static int plan_resize (struct dosfs_image *img, unsigned long total_sectors, unsigned int sectors_per_fat, struct resize_plan *plan) {
+
+    struct resize_move *moves;
+    size_t nb_alloc = 0;
+    
+    unsigned long entries;
+    unsigned int cluster, target = 2, value, bad = end_of_chain (img) - 1;
+    
+    long physical, shift = (long) img->number_of_fats * ((long) sectors_per_fat - (long) img->sectors_per_fat);
+    long spc = (long) img->sectors_per_cluster, pad;
+    
+    memset (plan, 0, sizeof (*plan));
+    
+    if (shift >= 0) {
+        pad = (spc - shift % spc) % spc;
+    } else {
+        pad = (-shift) % spc;
+    }
+    
+    plan->reserved_sectors = img->reserved_sectors + (unsigned int) pad;
+    plan->data_area = (unsigned int) ((long) img->data_area + shift + pad);
+    plan->delta = (shift + pad) / spc;
+    
+    if (!sectors_per_fat || plan->reserved_sectors > 0xFFFF || (img->size_fat != 32 && sectors_per_fat > 0xFFFF) || total_sectors > UINT_MAX || total_sectors <= plan->data_area) {
+    
+        img->error = DOSFS_ERR_INVALID;
+        return -1;
+    
+    }
+    
+    if (total_sectors > 0xFFFF && img->bs.boot_jump[1] < 0x22) {
+    
+        img->error = DOSFS_ERR_INVALID;
+        return -1;
+    
+    }
+    
+    plan->cluster_count = (unsigned int) ((total_sectors - plan->data_area) / img->sectors_per_cluster);
+    entries = ((unsigned long) sectors_per_fat * 512 * 8) / img->size_fat;
+    
+    if ((unsigned long) plan->cluster_count + 2 > entries) {
+        plan->cluster_count = (unsigned int) (entries - 2);
+    }
+    
+    /**
+     * The FAT type follows from the cluster count, so it must not change.  A
+     * FAT32 volume made below the FAT32 minimum (mkdosfs -F 32 --fit) is
+     * only held to it once it has reached it.
+     */
+    if ((img->size_fat == 12 && plan->cluster_count > MAX_CLUST_12) || (img->size_fat == 16 && (plan->cluster_count <= MAX_CLUST_12 || plan->cluster_count > MAX_CLUST_16)) || (img->size_fat == 32 && ((plan->cluster_count < MIN_CLUST_32 && img->cluster_count >= MIN_CLUST_32) || plan->cluster_count > MAX_CLUST_32))) {
+    
+        img->error = DOSFS_ERR_INVALID;
+        return -1;
+    
+    }
+    
+    plan->first = (unsigned int) (plan->delta > 0 ? 2 + plan->delta : 2);
+    plan->last = img->cluster_count + 1;
+    
+    /** When the volume shrinks past where its clusters now sit, none stay put and the range is left empty. */
+    if ((long) plan->cluster_count + 1 + plan->delta < (long) plan->last) {
+        plan->last = ((long) plan->cluster_count + 1 + plan->delta < (long) plan->first ? plan->first - 1 : (unsigned int) ((long) plan->cluster_count + 1 + plan->delta));
+    }
+    
+    for (cluster = 2; cluster <= img->cluster_count + 1; cluster++) {
+    
+        if ((value = dosfs_get_fat (img, cluster)) == 0) {
+            continue;
+        }
+        
+        if (cluster >= plan->first && cluster <= plan->last) {
+        
+            plan->used++;
+            continue;
+        
+        }
+        
+        /** A bad cluster has no data worth keeping; it is only carried over if it stays put. */
+        if (value == bad) {
+            continue;
+        }
+        
+        /**
+         * The target must lie on a cluster that is free now, past the old
+         * end of the volume or where a smaller FAT gives space back (the old
+         * FAT is held in memory and rewritten anyway), so no data still in
+         * use is ever written over.
+         */
+        for (; target <= plan->cluster_count + 1; target++) {
+        
+            physical = (long) target + plan->delta;
+            
+            if (physical < 2 || physical > (long) img->cluster_count + 1 || dosfs_get_fat (img, (unsigned int) physical) == 0) {
+                break;
+            }
+        
+        }
+        
+        if (target > plan->cluster_count + 1) {
+        
+            free (plan->moves);
+            plan->moves = 0;
+            
+            img->error = DOSFS_ERR_NOSPC;
+            return -1;
+        
+        }
+        
+        if (plan->nb_moves == nb_alloc) {
+        
+            nb_alloc = (nb_alloc ? nb_alloc * 2 : 64);
+            
+            if (!(moves = realloc (plan->moves, nb_alloc * sizeof (*moves)))) {
+            
+                free (plan->moves);
+                plan->moves = 0;
+                
+                img->error = DOSFS_ERR_NOMEM;
+                return -1;
+            
+            }
+            
+            plan->moves = moves;
+        
+        }
+        
+        plan->moves[plan->nb_moves].from = cluster;
+        plan->moves[plan->nb_moves++].to = target++;
+        
+        plan->used++;
+    
+    }
+    
+    return 0;
+
+}
+
+/** Load every directory below dir so that all of them can be renumbered together. */
+static int resize_load (struct dosfs_image *img, struct dosfs_dir *dir, int depth) {
+
+    struct dosfs_dir *subdir;
+    struct msdos_dirent *de;
+    
+    unsigned int cluster;
+    size_t i;
+    
+    if (depth > DOSFS_INDEX_DEPTH) {
+    
+        img->error = DOSFS_ERR_INVALID;
+        return -1;
+    
+    }
+    
+    for (i = 0; i < dir_entries (dir); i++) {
+    
+        de = dir_entry (dir, i);
+        
+        if (de->name[0] == 0) {
+            break;
+        }
+        
+        if (de->name[0] == 0xE5 || !(de->attr & ATTR_DIR) || (de->attr & ATTR_VOLUME_ID) || is_dot_entry (de)) {
+            continue;
+        }
+        
+        if (!is_valid_cluster (img, cluster = entry_cluster (de)) || find_cached_dir (img, cluster)) {
+            continue;
+        }
+        
+        if (!(subdir = load_dir (img, cluster)) || resize_load (img, subdir, depth + 1) < 0) {
+            return -1;
+        }
+    
+    }
+    
+    return 0;
+
+}
+
+/** Copy the data of every relocated cluster, a run of consecutive clusters at a time. */
+static int resize_copy (struct dosfs_image *img, const struct resize_plan *plan) {
+
+    unsigned char *buffer;
+    size_t chunk, i, j, per_chunk;
+    
+    int result = 0;
+    
+    if (!plan->nb_moves) {
+        return 0;
+    }
+    
+    if (!(buffer = alloc_copy_buffer (img, &chunk))) {
+        return -1;
+    }
+    
+    per_chunk = chunk / img->cluster_size;
+    
+    for (i = 0; i < plan->nb_moves && result == 0; i = j) {
+    
+        for (j = i + 1; j < plan->nb_moves && j - i < per_chunk && plan->moves[j].from == plan->moves[j - 1].from + 1 && plan->moves[j].to == plan->moves[j - 1].to + 1; j++) {
+            ;
+        }
+        
+        if (read_sectors (img, cluster_to_sector (img, plan->moves[i].from), (unsigned long) (j - i) * img->sectors_per_cluster, buffer) < 0) {
+            result = -1;
+        } else if (write_sectors (img, plan->data_area + (unsigned long) (plan->moves[i].to - 2) * img->sectors_per_cluster, (unsigned long) (j - i) * img->sectors_per_cluster, buffer) < 0) {
+            result = -1;
+        }
+    
+    }
+    
+    free (buffer);
+    return result;
+
+}
+
+/** Renumber every cluster a resident directory refers to, and the directory itself. */
+static void resize_dir (struct dosfs_image *img, const struct resize_plan *plan, struct dosfs_dir *dir) {
+
+    struct msdos_dirent *de;
+    
+    unsigned int cluster;
+    size_t i;
+    
+    for (i = 0; i < dir->nb_chain; i++) {
+        dir->chain[i] = resize_map (plan, dir->chain[i]);
+    }
+    
+    if (dir->cluster) {
+        dir->cluster = resize_map (plan, dir->cluster);
+    }
+    
+    for (i = 0; i < dir_entries (dir); i++) {
+    
+        de = dir_entry (dir, i);
+        
+        if (de->name[0] == 0) {
+            break;
+        }
+        
+        if (de->name[0] == 0xE5 || (de->attr & ATTR_VOLUME_ID)) {
+            continue;
+        }
+        
+        if (is_valid_cluster (img, cluster = entry_cluster (de))) {
+            set_entry_cluster (de, resize_map (plan, cluster));
+        }
+    
+    }
+    
+    dir->dirty = 1;
+
+}
+
+/**
+ * Resize the volume to total_sectors with FATs of sectors_per_fat sectors,
+ * keeping the FAT type and cluster size.  Clusters that keep their place on
+ * disk are only renumbered, so the cost is the metadata (the FATs and every
+ * directory are rewritten) plus the clusters a larger FAT covers or that lie
+ * past a smaller volume's end, which are copied into free space first.  The
+ * image file is extended when growing but never truncated.  With
+ * DOSFS_RESIZE_CHECK the resize is only planned and stats filled in.
+ */
+int dosfs_resize (struct dosfs_image *img, unsigned long total_sectors, unsigned int sectors_per_fat, int flags, struct dosfs_resize_stats *stats) {
+
+    struct dosfs_dir *dir, *dirs = 0, *next;
+    struct resize_plan plan;
+    
+    unsigned char *fat = 0, *old_fat;
+    unsigned short *fat12 = 0;
+    
+    unsigned int cluster, value, target, i;
+    
+    unsigned int old_count = img->cluster_count, eoc = end_of_chain (img);
+    int result = -1;
+    
+    if (!(flags & DOSFS_RESIZE_CHECK) && (img->flags & DOSFS_READONLY)) {
+    
+        img->error = DOSFS_ERR_ROFS;
+        return -1;
+    
+    }
+    
+    if (plan_resize (img, total_sectors, sectors_per_fat, &plan) < 0) {
+        return -1;
+    }
+    
+    if (stats) {
+    
+        stats->reserved_sectors = plan.reserved_sectors;
+        stats->cluster_count = plan.cluster_count;
+        stats->free_clusters = plan.cluster_count - plan.used;
+        stats->relocated = plan.nb_moves;
+    
+    }
+    
+    if (flags & DOSFS_RESIZE_CHECK) {
+    
+        free (plan.moves);
+        return 0;
+    
+    }
+    
+    if (dosfs_commit (img) < 0 || !(dir = load_root (img)) || resize_load (img, dir, 0) < 0) {
+        goto out;
+    }
+    
+    if (!(fat = malloc ((unsigned long) sectors_per_fat * 512))) {
+    
+        img->error = DOSFS_ERR_NOMEM;
+        goto out;
+    
+    }
+    
+    memset (fat, 0, (unsigned long) sectors_per_fat * 512);
+    memset (img->buffer, 0, 512);
+    
+    if (img->fat12) {
+    
+        if (!(fat12 = malloc (fat12_entries ((unsigned long) sectors_per_fat * 512) * sizeof (*fat12)))) {
+        
+            img->error = DOSFS_ERR_NOMEM;
+            goto out;
+        
+        }
+        
+        memset (fat12, 0, fat12_entries ((unsigned long) sectors_per_fat * 512) * sizeof (*fat12));
+    
+    }
+    
+    if (total_sectors > img->total_sectors && write_sectors (img, total_sectors - 1, 1, img->buffer) < 0) {
+        goto out;
+    }
+    
+    if (resize_copy (img, &plan) < 0) {
+        goto out;
+    }
+    
+    /** Take every directory out of the cache, renumber it and put it back under its new cluster. */
+    for (i = 0; i < DOSFS_DIR_HASH; i++) {
+    
+        for (dir = img->dirs[i]; dir; dir = next) {
+        
+            next = dir->next;
+            
+            resize_dir (img, &plan, dir);
+            
+            dir->next = dirs;
+            dirs = dir;
+        
+        }
+        
+        img->dirs[i] = 0;
+    
+    }
+    
+    for (dir = dirs; dir; dir = next) {
+    
+        next = dir->next;
+        cache_dir (img, dir);
+    
+    }
+    
+    if (img->size_fat == 32) {
+    
+        img->root_cluster = resize_map (&plan, img->root_cluster);
+        write741_to_byte_array (img->bs.fstype._fat32.root_cluster, img->root_cluster);
+    
+    }
+    
+    /** Rebuild the FAT under the new numbering.  The commit above left the packed table current. */
+    old_fat = img->fat;
+    img->fat = fat;
+    
+    if (fat12) {
+    
+        free (img->fat12);
+        
+        img->fat12 = fat12;
+        fat12 = 0;
+    
+    }
+    
+    dosfs_set_fat (img, 0, fat_entry (img, old_fat, 0));
+    dosfs_set_fat (img, 1, fat_entry (img, old_fat, 1));
+    
+    img->free_clusters = plan.cluster_count;
+    
+    for (cluster = 2; cluster <= old_count + 1; cluster++) {
+    
+        if ((value = fat_entry (img, old_fat, cluster)) == 0 || !(target = resize_map (&plan, cluster))) {
+            continue;
+        }
+        
+        if (value >= 2 && value <= old_count + 1) {
+            value = resize_map (&plan, value);
+        }
+        
+        if (value < 2 || (value > plan.cluster_count + 1 && value < eoc - 1)) {
+            value = eoc;
+        }
+        
+        dosfs_set_fat (img, target, value);
+    
+    }
+    
+    free (old_fat);
+    fat = 0;
+    
+    img->next_free = img->fat_ops->find_free (img, 2, plan.cluster_count + 1);
+    
+    /** The padding sectors join the reserved area. */
+    for (i = img->reserved_sectors; i < plan.reserved_sectors; i++) {
+    
+        if (write_sectors (img, i, 1, img->buffer) < 0) {
+            goto out;
+        }
+    
+    }
+    
+    img->reserved_sectors = plan.reserved_sectors;
+    img->sectors_per_fat = sectors_per_fat;
+    img->root_dir = img->reserved_sectors + (img->sectors_per_fat * img->number_of_fats);
+    img->data_area = plan.data_area;
+    img->cluster_count = plan.cluster_count;
+    img->total_sectors = (unsigned int) total_sectors;
+    
+    img->fat_dirty_lo = 0;
+    img->fat_dirty_hi = (unsigned long) sectors_per_fat * 512 - 1;
+    
+    write721_to_byte_array (img->bs.reserved_sectors, img->reserved_sectors);
+    
+    if (img->size_fat == 32) {
+        write741_to_byte_array (img->bs.fstype._fat32.sectors_per_fat32, img->sectors_per_fat);
+    } else {
+        write721_to_byte_array (img->bs.sectors_per_fat16, img->sectors_per_fat);
+    }
+    
+    if (total_sectors > 0xFFFF) {
+    
+        write721_to_byte_array (img->bs.total_sectors16, 0);
+        write741_to_byte_array (img->bs.total_sectors32, img->total_sectors);
+    
+    } else {
+    
+        write721_to_byte_array (img->bs.total_sectors16, img->total_sectors);
+        
+        if (img->bs.boot_jump[1] >= 0x22) {
+            write741_to_byte_array (img->bs.total_sectors32, 0);
+        }
+    
+    }
+    
+    img->bs_dirty = 1;
+    result = dosfs_commit (img);
+
+out:
+
+    free (plan.moves);
+    free (fat12);
+    free (fat);
+    
+    return result;
+
+}
+
+/** Stamp everything the handle creates or writes from now on with source_date instead of the clock. */
+void dosfs_set_source_date (struct dosfs_image *img, time_t source_date) {
+
+    img->source_date = source_date;
+    img->source_date_set = 1;
+
+}
+
+/** The fixed time set by DOSFS_SOURCE_DATE or dosfs_set_source_date, or null to stamp from the clock. */
+const time_t *dosfs_source_date (struct dosfs_image *img) {
+    return (img->source_date_set ? &img->source_date : 0);
+}
+
+const char *dosfs_strerror (int error) {
+
+    switch (error) {
+    
+        case DOSFS_OK:
+        
+            return "no error";
+        
+        case DOSFS_ERR_IO:
+        
+            return "input/output error";
+        
+        case DOSFS_ERR_NOMEM:
+        
+            return "out of memory";
+        
+        case DOSFS_ERR_INVALID:
+        
+            return "not a valid FAT filesystem";
+        
+        case DOSFS_ERR_NAME:
+        
+            return "name cannot be converted to 8.3";
+        
+        case DOSFS_ERR_NOENT:
+        
+            return "no such file or directory";
+        
+        case DOSFS_ERR_EXIST:
+        
+            return "file exists";
+        
+        case DOSFS_ERR_NOTDIR:
+        
+            return "not a directory";
+        
+        case DOSFS_ERR_ISDIR:
+        
+            return "is a directory";
+        
+        case DOSFS_ERR_NOSPC:
+        
+            return "not enough free space available";
+        
+        case DOSFS_ERR_ROFS:
+        
+            return "image is opened read-only";
+        
+        case DOSFS_ERR_NOTEMPTY:
+        
+            return "directory not empty";
+        
+        case DOSFS_ERR_SOURCE_DATE:
+        
+            return "SOURCE_DATE_EPOCH is not a number of seconds";
+    
+    }
+    
+    return "unknown error";
+
+}
@@ -0,0 +1,289 @@
+/******************************************************************************
+ * @file            dosfs.h
+ *****************************************************************************/
+#ifndef     _DOSFS_H
+#define     _DOSFS_H
+
+#include    <stddef.h>
+#include    <stdio.h>
+#include    <time.h>
+
+#include    "msdos.h"
+
+#define     DOSFS_READONLY              0x0001
+#define     DOSFS_INDEX                 0x0002
+#define     DOSFS_FIXED_ORDER           0x0004
+#define     DOSFS_NO_COUNT              0x0008
+#define     DOSFS_SOURCE_DATE           0x0010
+
+#define     DOSFS_INDEX_SUFFIX          ".idx"
+
+#define     DOSFS_MKDIR_PARENTS         0x0001
+#define     DOSFS_RMDIR_RECURSIVE       0x0001
+
+#define     DOSFS_COMPACT_SORT          0x0001
+#define     DOSFS_COMPACT_RECURSIVE     0x0002
+
+#define     DOSFS_DEFRAG_REPORT         0x0001
+#define     DOSFS_RESIZE_CHECK          0x0001
+
+#define     DOSFS_O_READ                0x0001
+#define     DOSFS_O_WRITE               0x0002
+#define     DOSFS_O_CREAT               0x0004
+#define     DOSFS_O_TRUNC               0x0008
+#define     DOSFS_O_APPEND              0x0010
+#define     DOSFS_O_OVERWRITE           0x0020
+
+enum {
+
+    DOSFS_OK = 0,
+    DOSFS_ERR_IO,
+    DOSFS_ERR_NOMEM,
+    DOSFS_ERR_INVALID,
+    DOSFS_ERR_NAME,
+    DOSFS_ERR_NOENT,
+    DOSFS_ERR_EXIST,
+    DOSFS_ERR_NOTDIR,
+    DOSFS_ERR_ISDIR,
+    DOSFS_ERR_NOSPC,
+    DOSFS_ERR_ROFS,
+    DOSFS_ERR_NOTEMPTY,
+    DOSFS_ERR_SOURCE_DATE
+
+};
+
+/**
+ * A directory that has been read into memory.  Directories are loaded in
+ * full the first time they are referenced and stay resident until the image
+ * is closed, so repeated lookups never touch the image again.  Changes are
+ * made to the copy in memory and written back by dosfs_commit.
+ */
+struct dosfs_dir {
+
+    unsigned int cluster;
+    
+    unsigned int *chain;
+    size_t nb_chain;
+    
+    unsigned char *data;
+    size_t size;
+    
+    /** No entry before free_hint is free; new entries are looked for from here. */
+    size_t free_hint;
+    
+    int dirty;
+    struct dosfs_dir *next;
+
+};
+
+#define     DOSFS_DIR_HASH              256
+
+struct dosfs_fat_ops;
+
+/**
+ * An open image.  All state lives in the handle, so any number of images can
+ * be open at once and separate handles can be used from separate threads.
+ */
+struct dosfs_image {
+
+    FILE *fp;
+    unsigned long offset;
+    
+    int flags, error;
+    
+    struct msdos_boot_sector bs;
+    int bs_dirty, size_fat;
+    
+    /** The FAT accessors for size_fat, chosen once when the image is opened. */
+    const struct dosfs_fat_ops *fat_ops;
+    
+    unsigned int cluster_count;
+    unsigned int cluster_size;
+    unsigned int data_area;
+    unsigned int info_sector;
+    unsigned int number_of_fats;
+    unsigned int reserved_sectors;
+    unsigned int root_cluster;
+    unsigned int root_dir;
+    unsigned int root_entries;
+    unsigned int sectors_per_cluster;
+    unsigned int sectors_per_fat;
+    unsigned int total_sectors;
+    
+    /**
+     * The first FAT is held in memory for the lifetime of the handle.  Only
+     * the byte range between fat_dirty_lo and fat_dirty_hi is written back
+     * (to every copy) when the image is committed.
+     */
+    unsigned char *fat;
+    unsigned long fat_dirty_lo, fat_dirty_hi;
+    
+    /** A FAT12 table unpacked to one entry per element; fat is repacked from it on commit. */
+    unsigned short *fat12;
+    
+    /** Left at 0 by DOSFS_NO_COUNT for a caller that scans the FAT itself. */
+    unsigned int free_clusters;
+    unsigned int next_free;
+    
+    struct dosfs_dir *dirs[DOSFS_DIR_HASH];
+    unsigned char *buffer;
+    
+    /**
+     * With DOSFS_INDEX the handle keeps a sidecar index in index_path.  A
+     * read-only handle with a matching index takes its FAT and directories
+     * from it; any handle rewrites it on close if the image was written
+     * (bumping the generation) or the index was missing or stale.
+     */
+    char *filename, *index_path;
+    unsigned int generation;
+    
+    int index_valid, written;
+    
+    /** With source_date_set new entries are stamped with source_date rather than the clock. */
+    time_t source_date;
+    int source_date_set;
+
+};
+
+struct dosfs_stat {
+
+    char name[13];
+    unsigned char attr;
+    
+    unsigned int cluster;
+    unsigned long size;
+    
+    unsigned short date, time;
+
+};
+
+/**
+ * One physically contiguous run of a file.  physical is the byte offset of
+ * the run within the image file, including the partition offset, so data
+ * can be read or patched there directly.
+ */
+struct dosfs_extent {
+
+    unsigned long logical, physical, length;
+    unsigned int cluster, count;
+
+};
+
+/** What dosfs_compact did: directories rewritten, entries kept, slots dropped and clusters freed. */
+struct dosfs_compact_stats {
+
+    unsigned long dirs, entries, dropped, clusters;
+
+};
+
+/**
+ * Fragmentation figures from dosfs_defrag.  files counts files and
+ * directories with at least one cluster, extents their contiguous runs and
+ * fragmented those with more than one.  moved and unmovable count what a
+ * defragmenting run relocated and what it could find no free run for.
+ */
+struct dosfs_defrag_stats {
+
+    unsigned long files, fragmented, extents;
+    unsigned long moved, unmovable, clusters_moved;
+    
+    unsigned long free_clusters, free_extents, largest_free;
+
+};
+
+/**
+ * The layout a resize gives the volume: the reserved sectors (padded so
+ * clusters keep their place on disk), the cluster count and how many of the
+ * clusters are free.  relocated counts the clusters whose data was copied.
+ */
+struct dosfs_resize_stats {
+
+    unsigned int reserved_sectors, cluster_count;
+    unsigned long free_clusters, relocated;
+
+};
+
+typedef void (*dosfs_defrag_callback) (const char *path, unsigned long extents, unsigned long clusters, void *arg);
+
+struct dosfs_dirstream {
+
+    struct dosfs_image *img;
+    struct dosfs_dir *dir;
+    
+    size_t index;
+
+};
+
+struct dosfs_file {
+
+    struct dosfs_image *img;
+    int flags;
+    
+    struct dosfs_dir *dir;
+    long index;
+    
+    unsigned int start;
+    unsigned long size, pos;
+    
+    /** The cluster holding byte cluster_pos of the file, the last one visited. */
+    unsigned int cluster;
+    unsigned long cluster_pos;
+    
+    /** Extent index of a file opened without DOSFS_O_WRITE, built on the first random seek. */
+    struct dosfs_extent *extents;
+    size_t nb_extents;
+    
+    /**
+     * With DOSFS_O_OVERWRITE, writes over existing data compare it first
+     * (compare_size bytes at a time) and skip clusters that already match.
+     */
+    unsigned char *compare;
+    unsigned long compare_size;
+
+};
+
+struct dosfs_image *dosfs_open (const char *filename, unsigned long offset, int flags, int *error);
+int dosfs_commit (struct dosfs_image *img);
+int dosfs_close (struct dosfs_image *img);
+
+const char *dosfs_strerror (int error);
+void dosfs_set_source_date (struct dosfs_image *img, time_t source_date);
+const time_t *dosfs_source_date (struct dosfs_image *img);
+
+unsigned int dosfs_get_fat (struct dosfs_image *img, unsigned int cluster);
+void dosfs_set_fat (struct dosfs_image *img, unsigned int cluster, unsigned int value);
+
+int dosfs_stat (struct dosfs_image *img, const char *path, struct dosfs_stat *st);
+int dosfs_extents (struct dosfs_image *img, const char *path, struct dosfs_extent **pextents, size_t *pnb_extents);
+int dosfs_mkdir (struct dosfs_image *img, const char *path, int flags);
+int dosfs_mkdirs (struct dosfs_image *img, const char *const *paths, size_t nb_paths, int flags, size_t entries, size_t *pfailed);
+int dosfs_reserve_dir (struct dosfs_image *img, const char *path, size_t entries);
+int dosfs_set_label (struct dosfs_image *img, const char *label);
+int dosfs_set_time (struct dosfs_image *img, const char *path, unsigned short date, unsigned short time);
+
+int dosfs_unlink (struct dosfs_image *img, const char *path);
+int dosfs_rmdir (struct dosfs_image *img, const char *path, int flags);
+
+int dosfs_compact (struct dosfs_image *img, const char *path, int flags, const char *const *hot, size_t nb_hot, struct dosfs_compact_stats *stats);
+
+struct dosfs_dirstream *dosfs_opendir (struct dosfs_image *img, const char *path);
+int dosfs_readdir (struct dosfs_dirstream *ds, struct dosfs_stat *st);
+void dosfs_closedir (struct dosfs_dirstream *ds);
+
+struct dosfs_file *dosfs_fopen (struct dosfs_image *img, const char *path, int flags);
+long dosfs_fread (struct dosfs_file *f, void *buffer, unsigned long len);
+long dosfs_fwrite (struct dosfs_file *f, const void *buffer, unsigned long len);
+long dosfs_pread (struct dosfs_file *f, void *buffer, unsigned long len, unsigned long offset);
+int dosfs_fseek (struct dosfs_file *f, unsigned long pos);
+int dosfs_ftruncate (struct dosfs_file *f, unsigned long size);
+unsigned long dosfs_ftell (struct dosfs_file *f);
+void dosfs_fclose (struct dosfs_file *f);
+
+int dosfs_defrag (struct dosfs_image *img, int flags, struct dosfs_defrag_stats *stats, dosfs_defrag_callback callback, void *arg);
+
+int dosfs_resize (struct dosfs_image *img, unsigned long total_sectors, unsigned int sectors_per_fat, int flags, struct dosfs_resize_stats *stats);
+
+int dosfs_copy_in (struct dosfs_image *img, const char *source, const char *target);
+int dosfs_copy_out (struct dosfs_image *img, const char *source, const char *target);
+
+#endif      /* _DOSFS_H */
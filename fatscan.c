@@ -0,0 +1,388 @@
+/******************************************************************************
+ * @file            fatscan.c
+ *****************************************************************************/
+#include    <stddef.h>
+#include    <string.h>
+
+#include    "fatscan.h"
+
+#if     defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__)) && !defined (__PDOS__)
+# define    FATSCAN_X86
+# include   <immintrin.h>
+#endif
+
+#define     KERNEL_SCALAR               0
+#define     KERNEL_SSE2                 1
+#define     KERNEL_AVX2                 2
+
+/** Where the scan has got to: the next cluster and the free run ending just before it. */
+struct scan_state {
+
+    struct fatscan_stats *stats;
+    unsigned int cluster;
+    
+    unsigned int run_start;
+    unsigned long run;
+    
+    int head;
+
+};
+
+static void end_run (struct scan_state *s) {
+
+    if (s->head) {
+    
+        s->stats->head_free = s->run;
+        s->head = 0;
+    
+    }
+    
+    if (s->run > s->stats->largest_free) {
+    
+        s->stats->largest_free = s->run;
+        s->stats->largest_start = s->run_start;
+    
+    }
+    
+    s->run = 0;
+
+}
+
+static void add_free (struct scan_state *s, unsigned long n) {
+
+    if (!s->run) {
+        s->run_start = s->cluster;
+    }
+    
+    if (!s->stats->first_free) {
+        s->stats->first_free = s->cluster;
+    }
+    
+    s->stats->free_clusters += n;
+    s->run += n;
+    
+    s->cluster += n;
+
+}
+
+static void add_used (struct scan_state *s, unsigned long n) {
+
+    if (s->run || s->head) {
+        end_run (s);
+    }
+    
+    s->cluster += n;
+
+}
+
+static void scan_scalar (const unsigned char *fat, int size_fat, unsigned long n, struct scan_state *s) {
+
+    unsigned int value, bad;
+    const unsigned char *p;
+    
+    bad = (size_fat == 12 ? 0xFF7 : (size_fat == 16 ? 0xFFF7 : 0x0FFFFFF7));
+    
+    for (; n; n--) {
+    
+        if (size_fat == 12) {
+        
+            p = fat + s->cluster + (s->cluster / 2);
+            value = (unsigned int) p[0] | ((unsigned int) p[1] << 8);
+            
+            value = (s->cluster & 1) ? (value >> 4) : (value & 0x0FFF);
+        
+        } else if (size_fat == 16) {
+        
+            p = fat + ((unsigned long) s->cluster * 2);
+            value = (unsigned int) p[0] | ((unsigned int) p[1] << 8);
+        
+        } else {
+        
+            p = fat + ((unsigned long) s->cluster * 4);
+            value = ((unsigned int) p[0] | ((unsigned int) p[1] << 8) | ((unsigned int) p[2] << 16) | ((unsigned int) p[3] << 24)) & 0x0FFFFFFF;
+        
+        }
+        
+        if (value == 0) {
+            add_free (s, 1);
+        } else {
+        
+            if (value == bad) {
+                s->stats->bad_clusters++;
+            }
+            
+            add_used (s, 1);
+        
+        }
+    
+    }
+
+}
+
+#if     defined (FATSCAN_X86)
+
+/**
+ * Account for n entries from a compare mask with one bit every stride bits
+ * set for each free entry.  Blocks that are wholly free or wholly in use,
+ * which is most of them, never look at the entries one at a time.
+ */
+static void add_mask (struct scan_state *s, unsigned long mask, int n, int stride) {
+
+    unsigned long full = ((n * stride) >= 32 ? 0xFFFFFFFFUL : (1UL << (n * stride)) - 1);
+    int i;
+    
+    if (mask == full) {
+        add_free (s, n);
+    } else if (!mask) {
+        add_used (s, n);
+    } else {
+    
+        for (i = 0; i < n; i++) {
+        
+            if ((mask >> (i * stride)) & 1) {
+                add_free (s, 1);
+            } else {
+                add_used (s, 1);
+            }
+        
+        }
+    
+    }
+
+}
+
+__attribute__ ((target ("sse2")))
+static void scan16_sse2 (const unsigned char *fat, unsigned long n, struct scan_state *s) {
+
+    const unsigned char *p = fat + ((unsigned long) s->cluster * 2);
+    __m128i zero = _mm_setzero_si128 (), bad = _mm_set1_epi16 ((short) 0xFFF7), v;
+    
+    unsigned int mask;
+    
+    for (; n >= 8; n -= 8, p += 16) {
+    
+        v = _mm_loadu_si128 ((const __m128i *) p);
+        
+        if ((mask = (unsigned int) _mm_movemask_epi8 (_mm_cmpeq_epi16 (v, bad)))) {
+            s->stats->bad_clusters += __builtin_popcount (mask) / 2;
+        }
+        
+        add_mask (s, (unsigned long) (unsigned int) _mm_movemask_epi8 (_mm_cmpeq_epi16 (v, zero)), 8, 2);
+    
+    }
+    
+    scan_scalar (fat, 16, n, s);
+
+}
+
+__attribute__ ((target ("sse2")))
+static void scan32_sse2 (const unsigned char *fat, unsigned long n, struct scan_state *s) {
+
+    const unsigned char *p = fat + ((unsigned long) s->cluster * 4);
+    __m128i zero = _mm_setzero_si128 (), bad = _mm_set1_epi32 (0x0FFFFFF7), low = _mm_set1_epi32 (0x0FFFFFFF), v;
+    
+    unsigned int mask;
+    
+    for (; n >= 4; n -= 4, p += 16) {
+    
+        v = _mm_and_si128 (_mm_loadu_si128 ((const __m128i *) p), low);
+        
+        if ((mask = (unsigned int) _mm_movemask_ps (_mm_castsi128_ps (_mm_cmpeq_epi32 (v, bad))))) {
+            s->stats->bad_clusters += __builtin_popcount (mask);
+        }
+        
+        add_mask (s, (unsigned long) (unsigned int) _mm_movemask_ps (_mm_castsi128_ps (_mm_cmpeq_epi32 (v, zero))), 4, 1);
+    
+    }
+    
+    scan_scalar (fat, 32, n, s);
+
+}
+
+__attribute__ ((target ("avx2")))
+static void scan16_avx2 (const unsigned char *fat, unsigned long n, struct scan_state *s) {
+
+    const unsigned char *p = fat + ((unsigned long) s->cluster * 2);
+    __m256i zero = _mm256_setzero_si256 (), bad = _mm256_set1_epi16 ((short) 0xFFF7), v;
+    
+    unsigned int mask;
+    
+    for (; n >= 16; n -= 16, p += 32) {
+    
+        v = _mm256_loadu_si256 ((const __m256i *) p);
+        
+        if ((mask = (unsigned int) _mm256_movemask_epi8 (_mm256_cmpeq_epi16 (v, bad)))) {
+            s->stats->bad_clusters += __builtin_popcount (mask) / 2;
+        }
+        
+        add_mask (s, (unsigned long) (unsigned int) _mm256_movemask_epi8 (_mm256_cmpeq_epi16 (v, zero)), 16, 2);
+    
+    }
+    
+    scan_scalar (fat, 16, n, s);
+
+}
+
+__attribute__ ((target ("avx2")))
+static void scan32_avx2 (const unsigned char *fat, unsigned long n, struct scan_state *s) {
+
+    const unsigned char *p = fat + ((unsigned long) s->cluster * 4);
+    __m256i zero = _mm256_setzero_si256 (), bad = _mm256_set1_epi32 (0x0FFFFFF7), low = _mm256_set1_epi32 (0x0FFFFFFF), v;
+    
+    unsigned int mask;
+    
+    for (; n >= 8; n -= 8, p += 32) {
+    
+        v = _mm256_and_si256 (_mm256_loadu_si256 ((const __m256i *) p), low);
+        
+        if ((mask = (unsigned int) _mm256_movemask_ps (_mm256_castsi256_ps (_mm256_cmpeq_epi32 (v, bad))))) {
+            s->stats->bad_clusters += __builtin_popcount (mask);
+        }
+        
+        add_mask (s, (unsigned long) (unsigned int) _mm256_movemask_ps (_mm256_castsi256_ps (_mm256_cmpeq_epi32 (v, zero))), 8, 1);
+    
+    }
+    
+    scan_scalar (fat, 32, n, s);
+
+}
+
+#endif
+
+#if     defined (FATSCAN_X86)
+
+static int kernel = KERNEL_SCALAR;
+
+/**
+ * The scan is chosen once as the program is loaded, before main and so
+ * before any thread can call fatscan; after that kernel is only read.
+ */
+__attribute__ ((constructor))
+static void select_kernel (void) {
+
+    __builtin_cpu_init ();
+    
+    if (__builtin_cpu_supports ("avx2")) {
+        kernel = KERNEL_AVX2;
+    } else if (__builtin_cpu_supports ("sse2")) {
+        kernel = KERNEL_SSE2;
+    }
+
+}
+
+#else
+
+static const int kernel = KERNEL_SCALAR;
+
+#endif
+
+/** The name of the scan the processor was found to support. */
+const char *fatscan_kernel (void) {
+
+    if (kernel == KERNEL_AVX2) {
+        return "avx2";
+    }
+    
+    if (kernel == KERNEL_SSE2) {
+        return "sse2";
+    }
+    
+    return "scalar";
+
+}
+
+/**
+ * Count the free and bad entries among count FAT entries starting at
+ * cluster first, and find the longest run of free ones.  FAT16 and FAT32
+ * tables are compared a vector at a time where the processor allows;
+ * FAT12 tables are too small for it to matter.
+ */
+void fatscan (const unsigned char *fat, int size_fat, unsigned int first, unsigned long count, struct fatscan_stats *stats) {
+
+    struct scan_state s;
+    int k;
+    
+    memset (stats, 0, sizeof (*stats));
+    memset (&s, 0, sizeof (s));
+    
+    stats->first = first;
+    stats->count = count;
+    
+    s.stats = stats;
+    s.cluster = first;
+    s.head = 1;
+    
+    k = (size_fat == 12 ? KERNEL_SCALAR : kernel);
+
+#if     defined (FATSCAN_X86)
+
+    if (k == KERNEL_AVX2) {
+    
+        if (size_fat == 16) {
+            scan16_avx2 (fat, count, &s);
+        } else {
+            scan32_avx2 (fat, count, &s);
+        }
+    
+    } else if (k == KERNEL_SSE2) {
+    
+        if (size_fat == 16) {
+            scan16_sse2 (fat, count, &s);
+        } else {
+            scan32_sse2 (fat, count, &s);
+        }
+    
+    } else {
+        scan_scalar (fat, size_fat, count, &s);
+    }
+
+#else
+
+    scan_scalar (fat, size_fat, count, &s);
+
+#endif
+
+    stats->tail_free = s.run;
+    end_run (&s);
+
+}
+
+/** Fold next, scanned from the cluster after the range stats covers, into stats. */
+void fatscan_merge (struct fatscan_stats *stats, const struct fatscan_stats *next) {
+
+    unsigned long joined = stats->tail_free + next->head_free;
+    
+    if (joined > stats->largest_free) {
+    
+        stats->largest_free = joined;
+        stats->largest_start = (unsigned int) (stats->first + stats->count - stats->tail_free);
+    
+    }
+    
+    if (next->largest_free > stats->largest_free) {
+    
+        stats->largest_free = next->largest_free;
+        stats->largest_start = next->largest_start;
+    
+    }
+    
+    if (!stats->first_free) {
+        stats->first_free = next->first_free;
+    }
+    
+    if (stats->head_free == stats->count) {
+        stats->head_free += next->head_free;
+    }
+    
+    if (next->tail_free == next->count) {
+        stats->tail_free += next->count;
+    } else {
+        stats->tail_free = next->tail_free;
+    }
+    
+    stats->free_clusters += next->free_clusters;
+    stats->bad_clusters += next->bad_clusters;
+    
+    stats->count += next->count;
+
+}
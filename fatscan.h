@@ -0,0 +1,33 @@
+/******************************************************************************
+ * @file            fatscan.h
+ *****************************************************************************/
+#ifndef     _FATSCAN_H
+#define     _FATSCAN_H
+
+/**
+ * What fatscan found in count entries starting at cluster first.  head_free
+ * and tail_free are the free runs touching either end of the range, which
+ * fatscan_merge joins when ranges scanned separately are put back together.
+ * first_free and largest_start are 0 when there is no free cluster.
+ */
+struct fatscan_stats {
+
+    unsigned int first;
+    unsigned long count;
+    
+    unsigned long free_clusters, bad_clusters;
+    unsigned int first_free;
+    
+    unsigned long largest_free;
+    unsigned int largest_start;
+    
+    unsigned long head_free, tail_free;
+
+};
+
+void fatscan (const unsigned char *fat, int size_fat, unsigned int first, unsigned long count, struct fatscan_stats *stats);
+void fatscan_merge (struct fatscan_stats *stats, const struct fatscan_stats *next);
+
+const char *fatscan_kernel (void);
+
+#endif      /* _FATSCAN_H */
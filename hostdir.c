@@ -0,0 +1,248 @@
+/******************************************************************************
+ * @file            hostdir.c
+ *****************************************************************************/
+#if     !defined (__PDOS__) && !defined (_WIN32)
+# define    _POSIX_C_SOURCE             200112L
+#endif
+
+#include    <stddef.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+
+#ifndef     __PDOS__
+# if     defined (_WIN32)
+#  include  <io.h>
+# else
+#  include  <dirent.h>
+#  include  <sys/stat.h>
+# endif
+#endif
+
+#include    "hostdir.h"
+
+#ifndef     __PDOS__
+static int add_entry (struct hostdir_entry **pentries, size_t *pnb_entries, size_t *pnb_alloc, const char *name, int is_dir, unsigned long size, time_t mtime) {
+
+    struct hostdir_entry *entries = *pentries;
+    
+    if (*pnb_entries == *pnb_alloc) {
+    
+        *pnb_alloc = (*pnb_alloc ? *pnb_alloc * 2 : 16);
+        
+        if (!(entries = realloc (entries, *pnb_alloc * sizeof (*entries)))) {
+            return -1;
+        }
+        
+        *pentries = entries;
+    
+    }
+    
+    if (!(entries[*pnb_entries].name = malloc (strlen (name) + 1))) {
+        return -1;
+    }
+    
+    strcpy (entries[*pnb_entries].name, name);
+    
+    entries[*pnb_entries].is_dir = is_dir;
+    entries[*pnb_entries].size = size;
+    entries[*pnb_entries].mtime = mtime;
+    
+    (*pnb_entries)++;
+    return 0;
+
+}
+
+static int compare_entries (const void *a, const void *b) {
+    return strcmp (((const struct hostdir_entry *) a)->name, ((const struct hostdir_entry *) b)->name);
+}
+#endif
+
+/**
+ * Read the files and directories directly inside path, sorted by name so
+ * callers see the same order on every host.  "." and "..", and anything
+ * that is neither a regular file nor a directory, are left out.
+ */
+int hostdir_read (const char *path, struct hostdir_entry **pentries, size_t *pnb_entries) {
+
+#if     defined (__PDOS__)
+
+    (void) path;
+    
+    *pentries = 0;
+    *pnb_entries = 0;
+    
+    return -1;
+
+#else
+
+    size_t nb_alloc = 0;
+    char *pattern;
+    
+# if    defined (_WIN32)
+    
+    struct _finddata_t fd;
+    intptr_t handle;
+    
+# else
+    
+    struct dirent *de;
+    struct stat sb;
+    
+    DIR *dp;
+    
+# endif
+    
+    *pentries = 0;
+    *pnb_entries = 0;
+    
+    if (!(pattern = malloc (strlen (path) + 258))) {
+        return -1;
+    }
+
+# if    defined (_WIN32)
+
+    sprintf (pattern, "%s\\*", path);
+    
+    if ((handle = _findfirst (pattern, &fd)) == -1) {
+    
+        free (pattern);
+        return -1;
+    
+    }
+    
+    do {
+    
+        if (!strcmp (fd.name, ".") || !strcmp (fd.name, "..")) {
+            continue;
+        }
+        
+        if (add_entry (pentries, pnb_entries, &nb_alloc, fd.name, (fd.attrib & _A_SUBDIR) != 0, (unsigned long) fd.size, fd.time_write) < 0) {
+        
+            _findclose (handle);
+            goto _error;
+        
+        }
+    
+    } while (_findnext (handle, &fd) == 0);
+    
+    _findclose (handle);
+
+# else
+
+    if (!(dp = opendir (path))) {
+    
+        free (pattern);
+        return -1;
+    
+    }
+    
+    while ((de = readdir (dp))) {
+    
+        if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, "..")) {
+            continue;
+        }
+        
+        if (strlen (de->d_name) > 256) {
+            continue;
+        }
+        
+        sprintf (pattern, "%s/%s", path, de->d_name);
+        
+        if (stat (pattern, &sb) || !(S_ISDIR (sb.st_mode) || S_ISREG (sb.st_mode))) {
+            continue;
+        }
+        
+        if (add_entry (pentries, pnb_entries, &nb_alloc, de->d_name, S_ISDIR (sb.st_mode), (unsigned long) sb.st_size, sb.st_mtime) < 0) {
+        
+            closedir (dp);
+            goto _error;
+        
+        }
+    
+    }
+    
+    closedir (dp);
+
+# endif
+
+    free (pattern);
+    
+    if (*pnb_entries > 1) {
+        qsort (*pentries, *pnb_entries, sizeof (**pentries), compare_entries);
+    }
+    
+    return 0;
+
+_error:
+
+    free (pattern);
+    hostdir_free (*pentries, *pnb_entries);
+    
+    *pentries = 0;
+    *pnb_entries = 0;
+    
+    return -1;
+
+#endif
+
+}
+
+void hostdir_free (struct hostdir_entry *entries, size_t nb_entries) {
+
+    size_t i;
+    
+    for (i = 0; i < nb_entries; i++) {
+        free (entries[i].name);
+    }
+    
+    free (entries);
+
+}
+
+int hostdir_stat (const char *path, struct hostdir_entry *entry) {
+
+#if     defined (__PDOS__)
+
+    (void) path;
+    (void) entry;
+    
+    return -1;
+
+#else
+
+# if    defined (_WIN32)
+    
+    struct _finddata_t fd;
+    intptr_t handle;
+    
+    if ((handle = _findfirst (path, &fd)) == -1) {
+        return -1;
+    }
+    
+    _findclose (handle);
+    
+    entry->is_dir = (fd.attrib & _A_SUBDIR) != 0;
+    entry->size = (unsigned long) fd.size;
+    entry->mtime = fd.time_write;
+
+# else
+    
+    struct stat sb;
+    
+    if (stat (path, &sb)) {
+        return -1;
+    }
+    
+    entry->is_dir = S_ISDIR (sb.st_mode);
+    entry->size = (unsigned long) sb.st_size;
+    entry->mtime = sb.st_mtime;
+
+# endif
+
+    entry->name = 0;
+    return 0;
+
+#endif
+
+}
@@ -0,0 +1,25 @@
+/******************************************************************************
+ * @file            hostdir.h
+ *****************************************************************************/
+#ifndef     _HOSTDIR_H
+#define     _HOSTDIR_H
+
+#include    <stddef.h>
+#include    <time.h>
+
+struct hostdir_entry {
+
+    char *name;
+    int is_dir;
+    
+    unsigned long size;
+    time_t mtime;
+
+};
+
+int hostdir_read (const char *path, struct hostdir_entry **pentries, size_t *pnb_entries);
+void hostdir_free (struct hostdir_entry *entries, size_t nb_entries);
+
+int hostdir_stat (const char *path, struct hostdir_entry *entry);
+
+#endif      /* _HOSTDIR_H */
@@ -0,0 +1,342 @@
+/******************************************************************************
+ * @file            hosttree.c
+ *****************************************************************************/
+#if     !defined (__PDOS__) && !defined (_WIN32)
+# define    _POSIX_C_SOURCE             200112L
+#endif
+
+#include    <stddef.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+
+#if     defined (__GNUC__) && !defined (__PDOS__) && !defined (_WIN32)
+# define    HOSTTREE_THREADS
+# include   <pthread.h>
+#endif
+
+#include    "hostdir.h"
+#include    "hosttree.h"
+
+/**
+ * Directories still to be read.  Workers take one at a time, read it and
+ * queue its subdirectories; pending counts the directories queued or being
+ * read, so the scan is over when it drops to zero.
+ */
+struct scan_item {
+
+    struct hosttree_node *node;
+    int depth;
+
+};
+
+struct scan_state {
+
+    struct scan_item *queue;
+    size_t nb_queue, nb_alloc;
+    
+    size_t pending;
+    int failed;
+
+#if     defined (HOSTTREE_THREADS)
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+
+};
+
+static char *join_path (const char *dir, const char *name) {
+
+    char *path;
+    
+    if ((path = malloc (strlen (dir) + strlen (name) + 2))) {
+        sprintf (path, "%s/%s", dir, name);
+    }
+    
+    return path;
+
+}
+
+/** Fill in node's children from the host directory; returns the subdirectories found, or -1. */
+static long read_node (struct hosttree_node *node) {
+
+    struct hostdir_entry *entries;
+    size_t nb_entries, i;
+    
+    long subdirs = 0;
+    
+    if (hostdir_read (node->path, &entries, &nb_entries) < 0) {
+        return -1;
+    }
+    
+    if (nb_entries && !(node->children = malloc (nb_entries * sizeof (*node->children)))) {
+    
+        hostdir_free (entries, nb_entries);
+        return -1;
+    
+    }
+    
+    for (i = 0; i < nb_entries; i++) {
+    
+        struct hosttree_node *child = &node->children[i];
+        memset (child, 0, sizeof (*child));
+        
+        /** The entry's name is handed over rather than copied. */
+        child->name = entries[i].name;
+        entries[i].name = 0;
+        
+        child->is_dir = entries[i].is_dir;
+        child->size = (entries[i].is_dir ? 0 : entries[i].size);
+        child->mtime = entries[i].mtime;
+        
+        node->nb_children++;
+        
+        if (!(child->path = join_path (node->path, child->name))) {
+        
+            hostdir_free (entries, nb_entries);
+            return -1;
+        
+        }
+        
+        if (child->is_dir) {
+            subdirs++;
+        }
+    
+    }
+    
+    hostdir_free (entries, nb_entries);
+    return subdirs;
+
+}
+
+static int queue_children (struct scan_state *scan, struct hosttree_node *node, int depth) {
+
+    struct scan_item *queue;
+    size_t i;
+    
+    for (i = 0; i < node->nb_children; i++) {
+    
+        if (!node->children[i].is_dir) {
+            continue;
+        }
+        
+        if (scan->nb_queue == scan->nb_alloc) {
+        
+            scan->nb_alloc = (scan->nb_alloc ? scan->nb_alloc * 2 : 64);
+            
+            if (!(queue = realloc (scan->queue, scan->nb_alloc * sizeof (*queue)))) {
+                return -1;
+            }
+            
+            scan->queue = queue;
+        
+        }
+        
+        scan->queue[scan->nb_queue].node = &node->children[i];
+        scan->queue[scan->nb_queue++].depth = depth;
+        
+        scan->pending++;
+    
+    }
+    
+    return 0;
+
+}
+
+static void *scan_worker (void *arg) {
+
+    struct scan_state *scan = arg;
+    struct scan_item item;
+    
+    long subdirs;
+    
+    for (;;) {
+
+#if     defined (HOSTTREE_THREADS)
+        pthread_mutex_lock (&scan->lock);
+        
+        while (!scan->nb_queue && scan->pending) {
+            pthread_cond_wait (&scan->cond, &scan->lock);
+        }
+#endif
+
+        if (!scan->nb_queue) {
+
+#if     defined (HOSTTREE_THREADS)
+            pthread_mutex_unlock (&scan->lock);
+#endif
+
+            break;
+        
+        }
+        
+        item = scan->queue[--scan->nb_queue];
+
+#if     defined (HOSTTREE_THREADS)
+        pthread_mutex_unlock (&scan->lock);
+#endif
+
+        if (item.depth > HOSTTREE_DEPTH || (subdirs = read_node (item.node)) < 0) {
+            subdirs = -1;
+        }
+
+#if     defined (HOSTTREE_THREADS)
+        pthread_mutex_lock (&scan->lock);
+#endif
+
+        if (subdirs < 0 || (subdirs > 0 && queue_children (scan, item.node, item.depth + 1) < 0)) {
+        
+            scan->failed = 1;
+            
+            /** Stop handing out work; what is being read now is still freed with the tree. */
+            scan->pending -= scan->nb_queue;
+            scan->nb_queue = 0;
+        
+        }
+        
+        scan->pending--;
+
+#if     defined (HOSTTREE_THREADS)
+        pthread_cond_broadcast (&scan->cond);
+        pthread_mutex_unlock (&scan->lock);
+#endif
+
+    }
+    
+    return 0;
+
+}
+
+static void free_children (struct hosttree_node *node) {
+
+    size_t i;
+    
+    for (i = 0; i < node->nb_children; i++) {
+    
+        free_children (&node->children[i]);
+        
+        free (node->children[i].name);
+        free (node->children[i].path);
+    
+    }
+    
+    free (node->children);
+
+}
+
+/**
+ * Read the whole tree below path into memory, sharing the directories out
+ * among up to jobs threads.  Returns 0 if any directory cannot be read or
+ * the tree is nested deeper than HOSTTREE_DEPTH.
+ */
+struct hosttree_node *hosttree_scan (const char *path, int jobs) {
+
+    struct hosttree_node *root;
+    struct scan_state scan;
+    
+    if (!(root = malloc (sizeof (*root)))) {
+        return 0;
+    }
+    
+    memset (root, 0, sizeof (*root));
+    memset (&scan, 0, sizeof (scan));
+    
+    root->is_dir = 1;
+    
+    if (!(root->name = malloc (1)) || !(root->path = malloc (strlen (path) + 1))) {
+    
+        hosttree_free (root);
+        return 0;
+    
+    }
+    
+    root->name[0] = '\0';
+    strcpy (root->path, path);
+    
+    if (!(scan.queue = malloc (sizeof (*scan.queue)))) {
+    
+        hosttree_free (root);
+        return 0;
+    
+    }
+    
+    scan.queue[0].node = root;
+    scan.queue[0].depth = 0;
+    
+    scan.nb_queue = scan.nb_alloc = scan.pending = 1;
+
+#if     defined (HOSTTREE_THREADS)
+
+    pthread_mutex_init (&scan.lock, 0);
+    pthread_cond_init (&scan.cond, 0);
+    
+    if (jobs > 1) {
+    
+        pthread_t *threads;
+        int i, started = 0;
+        
+        if ((threads = malloc (jobs * sizeof (*threads)))) {
+        
+            for (i = 0; i < jobs; i++) {
+            
+                if (pthread_create (&threads[i], 0, scan_worker, &scan)) {
+                    break;
+                }
+                
+                started++;
+            
+            }
+            
+            for (i = 0; i < started; i++) {
+                pthread_join (threads[i], 0);
+            }
+            
+            free (threads);
+        
+        }
+        
+        /** With no thread started the queue is untouched; scan it here instead. */
+        if (!started) {
+            scan_worker (&scan);
+        }
+    
+    } else {
+        scan_worker (&scan);
+    }
+    
+    pthread_cond_destroy (&scan.cond);
+    pthread_mutex_destroy (&scan.lock);
+
+#else
+
+    (void) jobs;
+    scan_worker (&scan);
+
+#endif
+
+    free (scan.queue);
+    
+    if (scan.failed) {
+    
+        hosttree_free (root);
+        return 0;
+    
+    }
+    
+    return root;
+
+}
+
+void hosttree_free (struct hosttree_node *root) {
+
+    if (!root) {
+        return;
+    }
+    
+    free_children (root);
+    
+    free (root->name);
+    free (root->path);
+    free (root);
+
+}
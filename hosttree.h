@@ -0,0 +1,33 @@
+/******************************************************************************
+ * @file            hosttree.h
+ *****************************************************************************/
+#ifndef     _HOSTTREE_H
+#define     _HOSTTREE_H
+
+#include    <stddef.h>
+#include    <time.h>
+
+#define     HOSTTREE_DEPTH              64
+
+/**
+ * A host file or directory read into memory.  A directory's children are
+ * sorted by name, as hostdir_read returns them; path is the host path
+ * the node was read from.
+ */
+struct hosttree_node {
+
+    char *name, *path;
+    int is_dir;
+    
+    unsigned long size;
+    time_t mtime;
+    
+    struct hosttree_node *children;
+    size_t nb_children;
+
+};
+
+struct hosttree_node *hosttree_scan (const char *path, int jobs);
+void hosttree_free (struct hosttree_node *root);
+
+#endif      /* _HOSTTREE_H */
@@ -29,26 +29,46 @@ enum options {
     OPTION_IGNORED = 0,
     OPTION_BLOCKS,
     OPTION_BOOT,
+    OPTION_CHECK,
+    OPTION_DIRECT,
+    OPTION_DIRECTORY,
     OPTION_FAT,
+    OPTION_FIT,
     OPTION_HELP,
+    OPTION_JOBS,
     OPTION_NAME,
     OPTION_OFFSET,
+    OPTION_PATTERN,
+    OPTION_PLAN,
     OPTION_SECTORS,
-    OPTION_VERBOSE
+    OPTION_TEMPLATE,
+    OPTION_TIMESTAMP,
+    OPTION_VERBOSE,
+    OPTION_VOLUME_ID
 
 };
 
 static struct option opts[] = {
 
     { "F",          OPTION_FAT,         OPTION_HAS_ARG  },
+    { "c",          OPTION_CHECK,       OPTION_NO_ARG   },
+    { "d",          OPTION_DIRECTORY,   OPTION_HAS_ARG  },
     { "n",          OPTION_NAME,        OPTION_HAS_ARG  },
     { "s",          OPTION_SECTORS,     OPTION_HAS_ARG  },
     { "v",          OPTION_VERBOSE,     OPTION_NO_ARG   },
     
     { "-boot",      OPTION_BOOT,        OPTION_HAS_ARG  },
     { "-blocks",    OPTION_BLOCKS,      OPTION_HAS_ARG  },
+    { "-direct",    OPTION_DIRECT,      OPTION_NO_ARG   },
+    { "-fit",       OPTION_FIT,         OPTION_HAS_ARG  },
     { "-help",      OPTION_HELP,        OPTION_NO_ARG   },
+    { "-jobs",      OPTION_JOBS,        OPTION_HAS_ARG  },
     { "-offset",    OPTION_OFFSET,      OPTION_HAS_ARG  },
+    { "-pattern",   OPTION_PATTERN,     OPTION_NO_ARG   },
+    { "-plan",      OPTION_PLAN,        OPTION_HAS_ARG  },
+    { "-template",  OPTION_TEMPLATE,    OPTION_HAS_ARG  },
+    { "-timestamp", OPTION_TIMESTAMP,   OPTION_HAS_ARG  },
+    { "-volume-id", OPTION_VOLUME_ID,   OPTION_HAS_ARG  },
     
     { 0,            0,                  0               }
 
@@ -86,6 +106,8 @@ static void print_help (void) {
     
     fprintf (stderr, "    Short options:\n\n");
     fprintf (stderr, "        -F BITS           Select FAT size BITS (12, 16, or 32).\n");
+    fprintf (stderr, "        -c                Check the data area for bad clusters and mark them in the FAT.\n");
+    fprintf (stderr, "        -d DIR            Fill the filesystem with the contents of DIR.\n");
     fprintf (stderr, "        -n LABEL          Set volume label as LABEL (max 11 characters).\n");
     fprintf (stderr, "        -v                Verbose execution.\n");
     
@@ -94,8 +116,19 @@ static void print_help (void) {
     fprintf (stderr, "    Long options:\n\n");
     fprintf (stderr, "        --blocks BLOCKS   Make the filesystem the size of BLOCKS * 1024.\n");
     fprintf (stderr, "        --boot FILE       Use FILE as the boot sector.\n");
+    fprintf (stderr, "        --direct          Bypass the system cache (O_DIRECT) while checking.\n");
+    fprintf (stderr, "        --fit DIR         Size the filesystem to hold the contents of DIR.\n");
     fprintf (stderr, "        --help            Show this help information then exit.\n");
+    fprintf (stderr, "        --jobs N          Scan host directories using N threads.\n");
     fprintf (stderr, "        --offset SECTOR   Write the filesystem starting at SECTOR.\n");
+    fprintf (stderr, "        --pattern         Like -c, but write a test pattern first (destroys the data area).\n");
+    fprintf (stderr, "        --plan DIR        Print the layout --fit would choose for DIR then exit.\n");
+    fprintf (stderr, "        --template DIR    Cache formatted metadata in DIR and reuse it for the same geometry.\n");
+    fprintf (stderr, "        --timestamp SECS  Stamp everything with SECS since the epoch (default: $SOURCE_DATE_EPOCH).\n");
+    fprintf (stderr, "        --volume-id ID    Use the hexadecimal ID (e.g. 1234-ABCD) as the volume id.\n");
+    
+    fprintf (stderr, "\n");
+    fprintf (stderr, "A file of - writes the image to standard output, which may be a pipe.\n");
     
 _exit:
     
@@ -311,6 +344,27 @@ void parse_args (int *pargc, char ***pargv, int optind) {
             
             }
             
+            case OPTION_CHECK: {
+            
+                state->check = 1;
+                break;
+            
+            }
+            
+            case OPTION_DIRECT: {
+            
+                state->check_direct = 1;
+                break;
+            
+            }
+            
+            case OPTION_DIRECTORY: {
+            
+                state->source_dir = xstrdup (optarg);
+                break;
+            
+            }
+            
             case OPTION_FAT: {
             
                 long conversion;
@@ -348,6 +402,13 @@ void parse_args (int *pargc, char ***pargv, int optind) {
             
             }
             
+            case OPTION_FIT: {
+            
+                state->fit_dir = xstrdup (optarg);
+                break;
+            
+            }
+            
             case OPTION_HELP: {
             
                 print_help ();
@@ -355,6 +416,33 @@ void parse_args (int *pargc, char ***pargv, int optind) {
             
             }
             
+            case OPTION_JOBS: {
+            
+                long conversion;
+                char *temp;
+                
+                errno = 0;
+                conversion = strtol (optarg, &temp, 0);
+                
+                if (!*optarg || isspace ((int) *optarg) || *temp || errno) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "bad number for jobs");
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                if (conversion < 1 || conversion > 256) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "jobs must be between 1 and 256");
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->jobs = (int) conversion;
+                break;
+            
+            }
+            
             case OPTION_NAME: {
             
                 int n;
@@ -410,6 +498,24 @@ void parse_args (int *pargc, char ***pargv, int optind) {
             
             }
             
+            case OPTION_PATTERN: {
+            
+                state->check = 1;
+                state->check_write = 1;
+                
+                break;
+            
+            }
+            
+            case OPTION_PLAN: {
+            
+                state->fit_dir = xstrdup (optarg);
+                state->plan_only = 1;
+                
+                break;
+            
+            }
+            
             case OPTION_SECTORS: {
             
                 long conversion;
@@ -437,6 +543,27 @@ void parse_args (int *pargc, char ***pargv, int optind) {
             
             }
             
+            case OPTION_TEMPLATE: {
+            
+                state->template_dir = xstrdup (optarg);
+                break;
+            
+            }
+            
+            case OPTION_TIMESTAMP: {
+            
+                if (parse_source_date (optarg, &state->source_date) < 0) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "bad number for timestamp (%s)", optarg);
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->source_date_set = 1;
+                break;
+            
+            }
+            
             case OPTION_VERBOSE: {
             
                 state->verbose++;
@@ -444,6 +571,44 @@ void parse_args (int *pargc, char ***pargv, int optind) {
             
             }
             
+            case OPTION_VOLUME_ID: {
+            
+                const char *p;
+                char hex[9], *temp;
+                int n = 0;
+                
+                /** Accept the id as DIR prints it (1234-ABCD) as well as plain hexadecimal. */
+                for (p = optarg; *p != '\0' && n < 9; p++) {
+                
+                    if (*p != '-' || p - optarg != 4) {
+                        hex[n++] = *p;
+                    }
+                
+                }
+                
+                hex[n < 9 ? n : 8] = '\0';
+                
+                if (n == 0 || n > 8 || *p != '\0' || !isxdigit ((int) hex[0])) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "bad volume id (%s)", optarg);
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->volume_id = (unsigned int) strtoul (hex, &temp, 16);
+                
+                if (*temp) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "bad volume id (%s)", optarg);
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->volume_id_set = 1;
+                break;
+            
+            }
+            
             default: {
             
                 report_at (program_name, 0, REPORT_ERROR, "unsupported option '%s'", r);
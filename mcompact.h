@@ -0,0 +1,24 @@
+/******************************************************************************
+ * @file            mcompact.h
+ *****************************************************************************/
+#ifndef     _MCOMPACT_H
+#define     _MCOMPACT_H
+
+#include    <stddef.h>
+
+struct mcompact_state {
+
+    char **paths;
+    size_t nb_paths;
+    
+    char **hot;
+    size_t nb_hot;
+    
+    const char *outfile;
+    unsigned long offset;
+    
+    int index, recursive, sort, verbose;
+
+};
+
+#endif      /* _MCOMPACT_H */
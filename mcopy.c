@@ -23,61 +23,20 @@
 #endif
 
 #include    "common.h"
+#include    "dosfs.h"
 #include    "mcopy.h"
 #include    "msdos.h"
 #include    "report.h"
-#include    "write7x.h"
 
 #ifndef     PATH_MAX
 # define    PATH_MAX                    2048
 #endif
 
-static FILE *ofp;
-
-struct dir_info {
-
-    unsigned int current_cluster;
-    
-    unsigned char current_sector;
-    unsigned char current_entry;
-    unsigned char *scratch;
-    unsigned char flags;
-
-};
-
-struct file_info {
-
-    unsigned char dir_offset;
-    unsigned int dir_sector;
-    
-    unsigned char *scratch;
-    unsigned int filelen;
-    
-    unsigned int cluster;
-    unsigned int pointer;
-    
-    unsigned long bytes;
-
-};
+#define     COPY_BUFFER_SIZE            65536
 
 static struct mcopy_state *state = 0;
 static const char *program_name = 0;
 
-static struct msdos_boot_sector bs;
-static int size_fat = 0;
-
-static unsigned int cluster_count = 0;
-static unsigned int data_area = 0;
-static unsigned int info_sector = 0;
-static unsigned int number_of_fats = 0;
-static unsigned int reserved_sectors = 0;
-static unsigned int root_cluster = 0;
-static unsigned int root_dir = 0;
-static unsigned int root_entries = 0;
-static unsigned int sectors_per_cluster = 0;
-static unsigned int sectors_per_fat = 0;
-static unsigned int total_sectors = 0;
-
 struct option {
 
     const char *name;
@@ -91,10 +50,15 @@ struct option {
 enum options {
 
     OPTION_IGNORED = 1,
+    OPTION_APPEND,
     OPTION_HELP,
+    OPTION_INDEX,
+    OPTION_IN_PLACE,
     OPTION_INPUT,
     OPTION_OFFSET,
-    OPTION_STATUS
+    OPTION_RANGE,
+    OPTION_STATUS,
+    OPTION_TIMESTAMP
 
 };
 
@@ -102,9 +66,14 @@ static struct option opts[] = {
 
     { "i",          OPTION_INPUT,       OPTION_HAS_ARG  },
     
+    { "-append",    OPTION_APPEND,      OPTION_NO_ARG   },
     { "-help",      OPTION_HELP,        OPTION_NO_ARG   },
+    { "-index",     OPTION_INDEX,       OPTION_NO_ARG   },
+    { "-in-place",  OPTION_IN_PLACE,    OPTION_NO_ARG   },
     { "-offset",    OPTION_OFFSET,      OPTION_HAS_ARG  },
+    { "-range",     OPTION_RANGE,       OPTION_HAS_ARG  },
     { "-status",    OPTION_STATUS,      OPTION_NO_ARG   },
+    { "-timestamp", OPTION_TIMESTAMP,   OPTION_HAS_ARG  },
     
     { 0,            0,                  0               }
 
@@ -146,8 +115,13 @@ static void print_help (int exitval) {
     fprintf (stderr, "\n");
     
     fprintf (stderr, "    Long options:\n\n");
+    fprintf (stderr, "        --append          Append to existing files in the image instead of replacing them.\n");
     fprintf (stderr, "        --help            Show this help information then exit.\n");
+    fprintf (stderr, "        --index           Keep a sidecar index next to the image for fast reopening.\n");
+    fprintf (stderr, "        --in-place        Replace files by rewriting their existing clusters, skipping unchanged ones.\n");
     fprintf (stderr, "        --offset SECTOR   Write the filesystem starting at SECTOR.\n");
+    fprintf (stderr, "        --range OFF:LEN   Only copy LEN bytes starting at OFF out of the image.\n");
+    fprintf (stderr, "        --timestamp SECS  Stamp new entries with SECS since the epoch, for reproducible images.\n");
        
 _exit:
     
@@ -287,6 +261,13 @@ static void parse_args (int *pargc, char ***pargv, int optind) {
         
         switch (popt->index) {
         
+            case OPTION_APPEND: {
+            
+                state->append = 1;
+                break;
+            
+            }
+            
             case OPTION_HELP: {
             
                 print_help (EXIT_SUCCESS);
@@ -294,6 +275,20 @@ static void parse_args (int *pargc, char ***pargv, int optind) {
             
             }
             
+            case OPTION_INDEX: {
+            
+                state->index = 1;
+                break;
+            
+            }
+            
+            case OPTION_IN_PLACE: {
+            
+                state->in_place = 1;
+                break;
+            
+            }
+            
             case OPTION_INPUT: {
             
                 if (state->outfile) {
@@ -335,6 +330,44 @@ static void parse_args (int *pargc, char ***pargv, int optind) {
             
             }
             
+            case OPTION_RANGE: {
+            
+                char *temp;
+                
+                /** OFF:LEN, where a missing LEN means up to the end of the file. */
+                errno = 0;
+                state->range_offset = strtoul (optarg, &temp, 0);
+                
+                if (!*optarg || isspace ((int) *optarg) || *optarg == '-' || errno || (*temp && *temp != ':')) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "bad range (%s)", optarg);
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->range_length = ULONG_MAX;
+                
+                if (*temp == ':' && temp[1]) {
+                
+                    const char *len = temp + 1;
+                    
+                    errno = 0;
+                    state->range_length = strtoul (len, &temp, 0);
+                    
+                    if (isspace ((int) *len) || *len == '-' || errno || *temp) {
+                    
+                        report_at (program_name, 0, REPORT_ERROR, "bad range (%s)", optarg);
+                        exit (EXIT_FAILURE);
+                    
+                    }
+                
+                }
+                
+                state->range = 1;
+                break;
+            
+            }
+            
             case OPTION_STATUS: {
             
                 state->status = 1;
@@ -342,6 +375,20 @@ static void parse_args (int *pargc, char ***pargv, int optind) {
             
             }
             
+            case OPTION_TIMESTAMP: {
+            
+                if (parse_source_date (optarg, &state->source_date) < 0) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "bad number for timestamp (%s)", optarg);
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->source_date_set = 1;
+                break;
+            
+            }
+            
             default: {
             
                 report_at (program_name, 0, REPORT_ERROR, "unsupported option '%s'", r);
@@ -615,1259 +662,257 @@ static int check_overwrite (const char *fn) {
 
 }
 
+static void print_status (unsigned long copied, unsigned long flen, const char *fname) {
 
-static int seekto (long offset) {
-    return fseek (ofp, (state->offset * 512) + offset, SEEK_SET);
-}
-
-
-static int get_next_entry (struct dir_info *di, struct msdos_dirent *de);
-static int open_dir (const char *target, struct dir_info *di);
+    double percent = (flen ? (double) copied / (double) flen : 1);
+    printf ("\rcopied %lu bytes (%.2f%%) to %s", copied, percent * 100, fname);
 
-static unsigned int get_fat_entry (unsigned char *scratch, unsigned int cluster);
-static int set_fat_entry (unsigned char *scratch, unsigned int cluster, unsigned int value);
-
-static unsigned int get_free_fat (unsigned char *scratch);
+}
 
-static int canonical_to_dir (char *dest, const char *src) {
+static int copy_file (struct dosfs_image *img, const char *source, const char *target, const char *fname) {
 
-    static const char invalid_chars[] = "\"*+,./:;<=>?[\\]|";
+    struct dosfs_file *f;
+    struct dosfs_stat st;
     
-    int i, j;
-    int namelen = 0, dots = 0, extlen = 0;
+    unsigned char *buffer;
+    unsigned long flen, needed, existing, copied = 0;
     
-    memset (dest, ' ', 11);
+    size_t bytes;
+    FILE *ifp;
     
-    if (*src == '\0' || *src == '.') {
+    if ((ifp = fopen (source, "rb")) == NULL) {
         return -1;
     }
     
-    for (j = i = 0; *src != '\0'; i++) {
+    fseek (ifp, 0, SEEK_END);
     
-        int c = (unsigned char) *src++;
-        
-        if (c == '/' || c == '\\') {
-            break;
-        }
+    if ((flen = ftell (ifp)) > UINT_MAX) {
+    
+        fclose (ifp);
+        return -1;
+    
+    }
+    
+    fseek (ifp, 0, SEEK_SET);
+    needed = (flen + img->cluster_size - 1) / img->cluster_size;
+    
+    if (dosfs_stat (img, target, &st) == 0) {
+    
+        if (st.attr & ATTR_DIR) {
         
-        if (i >= 12) {
+            fclose (ifp);
             return -1;
-        }
-        
-        if (i == 0 && c == 0xE5) {
-        
-            /**
-             * 0xE5 in the first character of the name is a marker for delected files,
-             * it needs to be translated to 0x05.
-             */
-            c = 0x05;
-        
-        } else if (c == '.') {
-        
-            if (dots++) {
-                return -1;
-            }
-            
-            j = 8;
-            continue;
         
         }
         
-        if (c <= 0x20 || strchr (invalid_chars, c)) {
-            return -1;
-        }
+        existing = (st.size + img->cluster_size - 1) / img->cluster_size;
         
-        if (dots) {
+        if (state->append) {
         
-            if (++extlen > 3) {
+            /** Only the data past the slack in the last cluster needs new clusters. */
+            if (st.size + flen < st.size || st.size + flen > 0xFFFFFFFFUL) {
+            
+                report_at (program_name, 0, REPORT_ERROR, "%s would grow beyond 4GB", target);
+                
+                fclose (ifp);
                 return -1;
+            
             }
+            
+            needed = (st.size + flen + img->cluster_size - 1) / img->cluster_size - existing;
         
         } else {
         
-            if (++namelen > 8) {
-                return -1;
+            /** --in-place asks to write over the file, so there is nothing to confirm. */
+            if (!state->in_place && !check_overwrite (target)) {
+            
+                fclose (ifp);
+                return 0;
+            
             }
+            
+            needed = (needed > existing ? needed - existing : 0);
         
         }
-        
-        if (c >= 'a' && c <= 'z') {
-            c -= 'a' - 'A';
-        }
-        
-        dest[j++] = c;
     
     }
     
-    return 0;
-
-}
-
-static int copy_file (const char *source, struct file_info *fi, const char *fname) {
-
-    struct msdos_dirent de;
-    struct fat32_fsinfo *info;
-    
-    unsigned int free_clusters;
-    unsigned int next_cluster;
+    if (needed > img->free_clusters) {
     
-    FILE *ifp;
-    long bytes;
-    
-    unsigned char *buffer, *temp;
-    unsigned int i, j, sector;
+        report_at (program_name, 0, REPORT_ERROR, "Not enough free space available");
+        
+        fclose (ifp);
+        return -1;
     
-    unsigned int clust_size = sectors_per_cluster * 512;
-    unsigned int start_cluster = 0, prev_cluster = 0, size = 0;
+    }
     
-    unsigned long flen, copied = 0;
-    unsigned int num_clusters = 0, *cluster_chain;
+    if (!(buffer = (unsigned char *) malloc (COPY_BUFFER_SIZE))) {
     
-    if ((ifp = fopen (source, "rb")) == NULL) {
+        fclose (ifp);
         return -1;
-    }
     
-    fseek (ifp, 0, SEEK_END);
+    }
     
-    if ((flen = ftell (ifp)) > UINT_MAX) {
+    if (!(f = dosfs_fopen (img, target, DOSFS_O_WRITE | DOSFS_O_CREAT | (state->append ? DOSFS_O_APPEND : (state->in_place ? DOSFS_O_OVERWRITE : DOSFS_O_TRUNC))))) {
     
+        free (buffer);
+        
         fclose (ifp);
         return -1;
     
     }
     
-    if (!(cluster_chain = malloc (cluster_count * sizeof (unsigned int)))) {
+    while ((bytes = fread (buffer, 1, COPY_BUFFER_SIZE, ifp)) > 0) {
+    
+        if (dosfs_fwrite (f, buffer, bytes) != (long) bytes) {
+        
+            dosfs_fclose (f);
+            free (buffer);
+            
+            fclose (ifp);
+            return -1;
+        
+        }
+        
+        copied += bytes;
+        
+        if (state->status) {
+            print_status (copied, flen, fname);
+        }
+    
+    }
+    
+    /** Anything of the old file past the new data is dropped. */
+    if (state->in_place && !state->append && dosfs_ftruncate (f, copied) < 0) {
     
+        dosfs_fclose (f);
+        free (buffer);
+        
         fclose (ifp);
         return -1;
     
     }
     
-    num_clusters = (flen + clust_size -  1) / clust_size;
-    memset (cluster_chain, 0, cluster_count * sizeof (unsigned int));
+    dosfs_fclose (f);
+    free (buffer);
+    
+    fclose (ifp);
+    return 0;
+
+}
+
+static int copy_from_image (struct dosfs_image *img, const char *source, const char *target, const char *fname) {
+
+    struct dosfs_file *f;
+    unsigned char *buffer;
+    
+    unsigned long copied = 0, remaining;
+    long bytes;
+    
+    FILE *tfp;
     
-    for (i = 2, j = 0; i < cluster_count && j < num_clusters; i++) {
+    if ((tfp = fopen (target, "rb")) != NULL) {
     
-        if (get_fat_entry (fi->scratch, i) == 0) {
-            cluster_chain[j++] = i;
+        fclose (tfp);
+        
+        if (!check_overwrite ((char *) target)) {
+            return 0;
         }
     
     }
     
-    if (j < num_clusters) {
+    if (!(f = dosfs_fopen (img, source, DOSFS_O_READ))) {
+        return -1;
+    }
     
-        report_at (program_name, 0, REPORT_ERROR, "Not enough free space available");
-        free (cluster_chain);
-        
-        fclose (ifp);
+    if (!(buffer = (unsigned char *) malloc (COPY_BUFFER_SIZE))) {
+    
+        dosfs_fclose (f);
         return -1;
     
     }
     
-    fseek (ifp, 0, SEEK_SET);
-    
-    if (!(buffer = (unsigned char *) malloc (clust_size))) {
+    if ((tfp = fopen (target, "wb")) == NULL) {
     
-        free (cluster_chain);
+        dosfs_fclose (f);
+        free (buffer);
         
-        fclose (ifp);
         return -1;
     
     }
     
-    memset (buffer, 0, clust_size);
-    j = 0;
+    remaining = f->size;
     
-    while ((bytes = fread (buffer, 1, clust_size, ifp)) > 0) {
+    if (state->range) {
     
-        size += bytes;
-        i = cluster_chain[j++];
-        
-        if (i == cluster_count) {
-        
-            free (cluster_chain);
-            free (buffer);
-            
-            fclose (ifp);
-            return -1;
-        
-        }
-        
-        if (start_cluster == 0) {
-        
-            start_cluster = i;
-            
-            if (seekto ((unsigned long) fi->dir_sector * 512) || fread (fi->scratch, 512, 1, ofp) != 1) {
-            
-                free (cluster_chain);
-                free (buffer);
-                
-                fclose (ifp);
-                return -1;
-            
-            }
-            
-            de = (((struct msdos_dirent *) fi->scratch)[fi->dir_offset]);
-            
-            write721_to_byte_array (de.startlo, start_cluster);
-            write721_to_byte_array (de.starthi, start_cluster >> 16);
-            
-            memcpy (&(((struct msdos_dirent *) fi->scratch)[fi->dir_offset]), &de, sizeof (de));
-            
-            if (seekto ((unsigned long) fi->dir_sector * 512) || fwrite (fi->scratch, 512, 1, ofp) != 1) {
-                
-                free (cluster_chain);
-                free (buffer);
-                
-                fclose (ifp);
-                return -1;
-            
-            }
-        
-        } else {
+        if (state->range_offset > f->size) {
         
-            if (prev_cluster == 0) {
-                
-                free (cluster_chain);
-                free (buffer);
-                
-                fclose (ifp);
-                return -1;
+            report_at (program_name, 0, REPORT_ERROR, "range starts beyond the end of %s", source);
             
-            }
+            dosfs_fclose (f);
+            free (buffer);
             
-            if (set_fat_entry (fi->scratch, prev_cluster, i) < 0) {
-                
-                free (cluster_chain);
-                free (buffer);
-                
-                fclose (ifp);
-                return -1;
+            fclose (tfp);
+            remove (target);
             
-            }
+            return -1;
         
         }
         
-        sector = data_area + ((i - 2) * sectors_per_cluster);
-        
-        if (seekto ((unsigned long) sector * 512)) {
-        
-            free (cluster_chain);
-            free (buffer);
-            
-            fclose (ifp);
-            return -1;
+        remaining = f->size - state->range_offset;
         
+        if (remaining > state->range_length) {
+            remaining = state->range_length;
         }
         
-        temp = buffer;
+        dosfs_fseek (f, state->range_offset);
+    
+    }
+    
+    bytes = 0;
+    
+    while (remaining > 0 && (bytes = dosfs_fread (f, buffer, remaining < COPY_BUFFER_SIZE ? remaining : COPY_BUFFER_SIZE)) > 0) {
+    
+        remaining -= bytes;
         
-        while (bytes > 0) {
+        if (fwrite (buffer, bytes, 1, tfp) != 1) {
         
-            if (fwrite (temp, 512, 1, ofp) != 1) {
-                
-                free (cluster_chain);
-                free (buffer);
-                
-                fclose (ifp);
-                return -1;
-            
-            }
-            
-            if (bytes > 512) {
-                copied += 512;
-            } else {
-                copied += bytes;
-            }
-            
-            if (state->status) {
-            
-                double percent = (double) copied / (double) flen;
-                printf ("\rcopied %lu bytes (%.2f%%) to %s", copied, percent * 100, fname);
-            
-            }
-            
-            bytes -= 512;
-            temp += 512;
+            bytes = -1;
+            break;
         
         }
         
-        memset (buffer, 0, clust_size);
-        
-        if (set_fat_entry (fi->scratch, i, 0x0FFFFFF8) < 0) {
-        
-            free (cluster_chain);
-            free (buffer);
-            
-            fclose (ifp);
-            return -1;
+        copied += bytes;
         
+        if (state->status) {
+            print_status (copied, state->range ? copied + remaining : f->size, fname);
         }
-        
-        prev_cluster = i;
-        if (feof (ifp)) { break; }
     
     }
     
-    free (cluster_chain);
+    dosfs_fclose (f);
     free (buffer);
     
-    fclose (ifp);
+    if (fclose (tfp) || bytes < 0) {
     
-    if (seekto ((unsigned long) fi->dir_sector * 512) || fread (fi->scratch, 512, 1, ofp) != 1) {
+        remove (target);
         return -1;
+    
     }
     
-    if (size_fat == 32) {
+    return 0;
+
+}
+
+int main (int argc, char **argv) {
+
+    struct dosfs_image *img;
+    struct dosfs_stat st;
     
-        if (seekto ((unsigned long) info_sector * 512) || fread (fi->scratch, 512, 1, ofp) != 1) {
-            return -1;
-        }
-        
-        info = (struct fat32_fsinfo *) (fi->scratch + 0x1e0);
-        
-        free_clusters = (unsigned int) info->free_clusters[0] | (((unsigned int) info->free_clusters[1]) << 8) | (((unsigned int) info->free_clusters[2]) << 16) | (((unsigned int) info->free_clusters[3]) << 24);
-        next_cluster = (unsigned int) info->next_cluster[0] | (((unsigned int) info->next_cluster[1]) << 8) | (((unsigned int) info->next_cluster[2]) << 16) | (((unsigned int) info->next_cluster[3]) << 24);
-        
-        free_clusters -= num_clusters;
-        next_cluster += num_clusters;
-        
-        write741_to_byte_array (info->free_clusters, free_clusters);
-        write741_to_byte_array (info->next_cluster, next_cluster);
-        
-        if (seekto ((unsigned long) info_sector * 512) || fwrite (fi->scratch, 512, 1, ofp) != 1) {
-            return -1;
-        }
-    
-    }
-    
-    if (seekto ((unsigned long) fi->dir_sector * 512) || fread (fi->scratch, 512, 1, ofp) != 1) {
-        return -1;
-    }
-    
-    de = (((struct msdos_dirent *) fi->scratch)[fi->dir_offset]);
-    
-    write741_to_byte_array (de.size, size);
-    memcpy (&(((struct msdos_dirent *) fi->scratch)[fi->dir_offset]), &de, sizeof (de));
-    
-    if (seekto ((unsigned long) fi->dir_sector * 512) || fwrite (fi->scratch, 512, 1, ofp) != 1) {
-        return -1;
-    }
-    
-    return 0;
-
-}
-
-static int get_free_dirent (const char *path, struct dir_info *di, struct msdos_dirent *de) {
-
-    int entry;
-    unsigned int i, tempclust;
-    
-    if (open_dir (path, di) < 0) {
-        return -1;
-    }
-    
-    entry = 0;
-    di->flags |= 0x01;
-    
-    do {
-    
-        entry = get_next_entry (di, de);
-        
-        /*if (entry == 0 && (!de->name[0] || de->name[0] == 0xE5 || (de->attr & ATTR_LONG_NAME) == ATTR_LONG_NAME)) {*/
-        if (entry == 0 && (!de->name[0] || de->name[0] == 0xE5)) {
-        
-            /*if (de->name[0] == 0xE5 || (de->attr & ATTR_LONG_NAME) == ATTR_LONG_NAME) {*/
-            if (de->name[0] == 0xE5) {
-                di->current_entry--;
-            }
-            
-            return 0;
-        
-        } else if (entry == -1) {
-            return -1;
-        } else if (entry == 1) {
-        
-            if ((tempclust = get_free_fat (di->scratch) == 0x0FFFFFF7)) {
-                return -1;
-            }
-            
-            memset (di->scratch, 0, 512);
-            
-            for (i = 0; i < sectors_per_cluster; i++) {
-            
-                unsigned long offset = (unsigned long) (data_area + ((tempclust - 2) * sectors_per_cluster) + i);
-                
-                if (seekto (offset * 512)) {
-                    return -1;
-                }
-                
-                if (fwrite (di->scratch, 512, 1, ofp) != 1) {
-                    return -1;
-                }
-            
-            }
-            
-            if (set_fat_entry (di->scratch, di->current_cluster, tempclust) < 0) {
-                return -1;
-            }
-            
-            di->current_cluster = tempclust;
-            di->current_entry = 0;
-            di->current_sector = 0;
-            
-            if (size_fat == 12) {
-                tempclust = 0x0FF8;
-            } else if (size_fat == 16) {
-                tempclust = 0xFFF8;
-            } else if (size_fat == 32) {
-            
-                struct fat32_fsinfo *info;
-                
-                unsigned int free_clusters;
-                unsigned int next_cluster;
-                
-                tempclust = 0x0ffffff8;
-                
-                if (seekto ((unsigned long) info_sector * 512) || fread (di->scratch, 512, 1, ofp) != 1) {
-                    return -1;
-                }
-                
-                info = (struct fat32_fsinfo *) (di->scratch + 0x1e0);
-                
-                free_clusters = (unsigned int) info->free_clusters[0] | (((unsigned int) info->free_clusters[1]) << 8) | (((unsigned int) info->free_clusters[2]) << 16) | (((unsigned int) info->free_clusters[3]) << 24);
-                next_cluster = (unsigned int) info->next_cluster[0] | (((unsigned int) info->next_cluster[1]) << 8) | (((unsigned int) info->next_cluster[2]) << 16) | (((unsigned int) info->next_cluster[3]) << 24);
-                
-                free_clusters--;
-                next_cluster++;
-                
-                write741_to_byte_array (info->free_clusters, free_clusters);
-                write741_to_byte_array (info->next_cluster, next_cluster);
-                
-                if (seekto ((unsigned long) info_sector * 512) || fwrite (di->scratch, 512, 1, ofp) != 1) {
-                    return -1;
-                }
-            
-            } else {
-                return -1;
-            }
-        
-        }
-    
-    } while (!entry);
-    
-    /* We should't get here! */
-    return -1;
-
-}
-
-static int get_next_entry (struct dir_info *di, struct msdos_dirent *de) {
-
-    unsigned long offset;
-    
-    if (di->current_entry >= 512 / sizeof (*de)) {
-    
-        di->current_entry = 0;
-        di->current_sector++;
-        
-        if (di->current_cluster == 0) {
-        
-            unsigned long offset;
-            
-            if (di->current_sector * (512 / sizeof (*de)) >= root_entries) {
-                return -1;
-            }
-            
-            offset = (unsigned long) root_dir + di->current_sector;
-            
-            if (seekto (offset * 512) || fread (di->scratch, 512, 1, ofp) != 1) {
-                return -1;
-            }
-        
-        } else {
-        
-            if (di->current_sector >= sectors_per_cluster) {
-            
-                di->current_sector = 0;
-                
-                if ((size_fat == 12 && di->current_cluster >= 0x0FF7) || (size_fat == 16 && di->current_cluster >= 0xFFF7) || (size_fat == 32 && di->current_cluster >= 0x0FFFFFF7)) {
-                
-                    if (!(di->flags & 0x01)) {
-                        return -1;
-                    }
-                    
-                    return 1;
-                
-                }
-                
-                di->current_cluster = get_fat_entry (di->scratch, di->current_cluster);
-            
-            }
-            
-            offset = (unsigned long) data_area;
-            offset += ((di->current_cluster - 2) * sectors_per_cluster);
-            offset += di->current_sector;
-            
-            if (seekto (offset * 512) || fread (di->scratch, 512, 1, ofp) != 1) {
-                return -1;
-            }
-        
-        }
-    
-    }
-    
-    memcpy (de, &(((struct msdos_dirent *) di->scratch)[di->current_entry]), sizeof (*de));
-    
-    if (de->name[0] == 0) {
-    
-        if (di->flags & 0x01) {
-            return 0;
-        }
-        
-        return -1;
-    
-    }
-    
-    if (de->name[0] == 0x05) {
-    
-        de->name[0] = 0xE5;
-        return 0;
-    
-    }
-    
-    di->current_entry++;
-    return 0;
-
-}
-
-static int open_dir (const char *target, struct dir_info *di) {
-
-    di->flags = 0;
-    
-    if (!strlen ((char *) target) || (strlen ((char *) target) == 1 && (target[0] == '/' || target[0] == '\\'))) {
-    
-        unsigned long offset;
-        
-        if (size_fat == 32) {
-        
-            di->current_cluster = root_cluster;
-            di->current_entry = 0;
-            di->current_sector = 0;
-            
-            offset = (unsigned long) data_area + ((di->current_cluster - 2) * sectors_per_cluster);
-        
-        } else {
-        
-            di->current_cluster = 0;
-            di->current_entry = 0;
-            di->current_sector = 0;
-            
-            offset = (unsigned long) root_dir;
-        
-        }
-        
-        if (seekto (offset * 512) || fread (di->scratch, 512, 1, ofp) != 1) {
-            return -1;
-        }
-    
-    } else {
-    
-        unsigned char tmpfn[12];
-        unsigned char *ptr;
-        
-        struct msdos_dirent de;
-        unsigned int result;
-        
-        unsigned long offset;
-        
-        if (size_fat == 32) {
-        
-            di->current_cluster = root_cluster;
-            di->current_entry = 0;
-            di->current_sector = 0;
-            
-            offset = (unsigned long) data_area + ((di->current_cluster - 2) * sectors_per_cluster);
-        
-        } else {
-        
-            di->current_cluster = 0;
-            di->current_entry = 0;
-            di->current_sector = 0;
-            
-            offset = (unsigned long) root_dir;
-        
-        }
-        
-        if (seekto (offset * 512) || fread (di->scratch, 512, 1, ofp) != 1) {
-            return -1;
-        }
-        
-        ptr = (unsigned char *) target;
-        
-        while ((*ptr == '/' || *ptr == '\\') && *ptr) {
-            ptr++;
-        }
-        
-        while (*ptr) {
-        
-            if (canonical_to_dir ((char *) tmpfn, (char *) ptr) < 0) {
-            
-                fprintf (stderr, "Failed to convert to 8:3\n");
-                return -1;
-            
-            }
-            
-            de.name[0] = 0;
-            
-            do {
-                result = get_next_entry (di, &de);
-            } while (!result && memcmp (de.name, tmpfn, 11));
-            
-            if (!memcmp (de.name, tmpfn, 11) && (de.attr & ATTR_DIR) == ATTR_DIR) {
-            
-                unsigned long offset;
-                
-                di->current_cluster = (unsigned int) de.startlo[0] | ((unsigned int) de.startlo[1]) << 8 | ((unsigned int) de.starthi[0]) << 16 | ((unsigned int) de.starthi[1]) << 24;
-                di->current_entry = 0;
-                di->current_sector = 0;
-                
-                offset = (unsigned long) (data_area + ((di->current_cluster - 2) * sectors_per_cluster));
-                
-                if (seekto (offset * 512)) {
-                    return -1;
-                }
-                
-                if (fread (di->scratch, 512, 1, ofp) != 1) {
-                    return -1;
-                }
-            
-            } else if (!memcmp (de.name, tmpfn, 11) && !(de.attr & ATTR_DIR)) {
-                return -1;
-            }
-            
-            while (*ptr != '/' && *ptr != '\\' && *ptr) {
-                ptr++;
-            }
-            
-            if (*ptr == '/' || *ptr == '\\') {
-                ptr++;
-            }
-        
-        }
-        
-        if (!di->current_cluster) {
-            return -1;
-        }
-    
-    }
-    
-    return 0;
-
-}
-
-static int open_file (const char *target, unsigned char *scratch, struct file_info *fi) {
-
-    unsigned char tmppath[PATH_MAX];
-    unsigned char filename[12];
-    unsigned char *p;
-    
-    struct dir_info di;
-    struct msdos_dirent de;
-    
-    unsigned short date;
-    unsigned short time;
-    
-    unsigned int tempclust;
-    
-    /* Zero out file structure. */
-    memset (fi, 0, sizeof (*fi));
-    
-    /* Get a local copy of the target.  If it's larger than PATH_MAX, abort. */
-    strncpy ((char *) tmppath, (char *) target, PATH_MAX);
-    tmppath[PATH_MAX - 1] = 0;
-    
-    if (strcmp ((char *) target, (char *) tmppath)) {
-        return -1;
-    }
-    
-    /* Strip leading seperators. */
-    while (tmppath[0] == '/' || tmppath[0] == '\\') {
-        strcpy ((char *) tmppath, (char *) tmppath + 1);
-    }
-    
-    /* Parse filename off the end of the suppiled target. */
-    p = tmppath;
-    
-    while (*(p++));
-    
-    p--;
-    
-    while (p > tmppath && *p != '/' && *p != '\\') {
-        p--;
-    }
-    
-    if (*p == '/' || *p == '\\') {
-        p++;
-    }
-    
-    if (canonical_to_dir ((char *) filename, (char *) p) < 0) {
-    
-        fprintf (stderr, "Failed to convert to 8:3\n");
-        return -1;
-    
-    }
-    
-    if (p > tmppath) {
-        p--;
-    }
-    
-    if (*p == '/' || *p == '\\' || p == tmppath) {
-        *p = 0;
-    }
-    
-    di.scratch = scratch;
-    
-    if (open_dir ((char *) tmppath, &di) < 0) {
-    
-        fprintf (stderr, "Failed to open directory\n");
-        return -1;
-    
-    }
-    
-    while (!get_next_entry (&di, &de)) {
-    
-        if (!memcmp (de.name, filename, 11)) {
-        
-            di.current_entry--;
-            
-            if (de.attr & ATTR_DIR) {
-                return -1;
-            }
-            
-            if (!check_overwrite ((char *) target)) {
-                return 0;
-            }
-            
-            fi->cluster = (unsigned int) de.startlo[0] | ((unsigned int) de.startlo[1]) << 8 | ((unsigned int) de.starthi[0]) << 16 | ((unsigned int) de.starthi[1]) << 24;
-            
-            for (;;) {
-            
-                if (size_fat == 12 && fi->cluster >= 0x0FF8) {
-                    break;
-                } else if (size_fat == 16 && fi->cluster >= 0xFFF8) {
-                    break;
-                } else if (size_fat == 32 && fi->cluster >= 0x0FFFFFF8) {
-                    break;
-                }
-                
-                tempclust = get_fat_entry (scratch, fi->cluster);
-                
-                if (set_fat_entry (scratch, fi->cluster, 0) < 0) {
-                    return -1;
-                }
-                
-                fi->cluster = tempclust;
-                
-                if (!fi->cluster || fi->cluster == 0x0FFFFFFF7) {
-                    break;
-                }
-            
-            }
-            
-            fi->cluster = 0;
-            
-            if (seekto ((unsigned long) fi->dir_sector * 512) || fread (scratch, 512, 1, ofp) != 1) {
-                return -1;
-            }
-            
-            date = generate_datestamp ();
-            time = generate_timestamp ();
-            
-            memset (&de, 0, sizeof (de));
-            memcpy (de.name, filename, 11);
-            
-            de.attr = ATTR_ARCHIVE;
-            
-            write721_to_byte_array (de.ctime, time);
-            write721_to_byte_array (de.cdate, date);
-            write721_to_byte_array (de.adate, date);
-            write721_to_byte_array (de.time, time);
-            write721_to_byte_array (de.date, date);
-            
-            fi->pointer = 0;
-            
-            if (di.current_cluster == 0) {
-                fi->dir_sector = root_dir + di.current_sector;
-            } else {
-                fi->dir_sector = data_area + ((di.current_cluster - 2) * sectors_per_cluster);
-            }
-            
-            /*fi->dir_offset = di.current_entry - 1;*/
-            fi->dir_offset = di.current_entry;
-            
-            if (seekto ((unsigned long) fi->dir_sector * 512) || fread (scratch, 512, 1, ofp) != 1) {
-                return -1;
-            }
-            
-            memcpy (&(((struct msdos_dirent *) scratch)[fi->dir_offset]), &de, sizeof (de));
-            
-            if (seekto ((unsigned long) fi->dir_sector * 512) || fwrite (scratch, 512, 1, ofp) != 1) {
-                return -1;
-            }
-            
-            return 0;
-        
-        }
-    
-    }
-    
-    if (get_free_dirent ((char *) tmppath, &di, &de) < 0) {
-        return -1;
-    }
-    
-    date = generate_datestamp ();
-    time = generate_timestamp ();
-    
-    memset (&de, 0, sizeof (de));
-    memcpy (de.name, filename, 11);
-    
-    de.attr = ATTR_ARCHIVE;
-    
-    write721_to_byte_array (de.ctime, time);
-    write721_to_byte_array (de.cdate, date);
-    write721_to_byte_array (de.adate, date);
-    write721_to_byte_array (de.time, time);
-    write721_to_byte_array (de.date, date);
-    
-    fi->pointer = 0;
-    
-    if (di.current_cluster == 0) {
-        fi->dir_sector = root_dir + di.current_sector;
-    } else {
-        fi->dir_sector = data_area + ((di.current_cluster - 2) * sectors_per_cluster)  + di.current_sector;
-    }
-    
-    /*fi->dir_offset = di.current_entry - 1;*/
-    fi->dir_offset = di.current_entry;
-    
-    if (seekto ((unsigned long) fi->dir_sector * 512) || fread (scratch, 512, 1, ofp) != 1) {
-        return -1;
-    }
-    
-    memcpy (&(((struct msdos_dirent *) scratch)[fi->dir_offset]), &de, sizeof (de));
-    
-    if (seekto ((unsigned long) fi->dir_sector * 512) || fwrite (scratch, 512, 1, ofp) != 1) {
-        return -1;
-    }
-    
-    return 0;
-
-}
-
-static int set_fat_entry (unsigned char *scratch, unsigned int cluster, unsigned int value) {
-
-    unsigned int i, offset, sector;
-    
-    if (size_fat == 12) {
-    
-        offset = cluster + (cluster / 2);
-        value &= 0x0fff;
-    
-    } else if (size_fat == 16) {
-    
-        offset = cluster * 2;
-        value &= 0xffff;
-    
-    } else if (size_fat == 32) {
-    
-        offset = cluster * 4;
-        value &= 0x0fffffff;
-    
-    } else {
-        return -1;
-    }
-    
-    /**
-     * At this point, offset is the BYTE offset of the desired sector from the start
-     * of the FAT.  Calculate the physical sector containing this FAT entry.
-     */
-    sector = (offset / 512) + reserved_sectors;
-    
-    if (seekto (sector * 512) || fread (scratch, 512, 1, ofp) != 1) {
-        return -1;
-    }
-    
-    /**
-     * At this point, we "merely" need to extract the relevant entry.  This is
-     * easy for FAT16 and FAT32, but a royal PITA for FAT12 as a single entry
-     * may span a sector boundary.  The normal way around this is always to
-     * read two FAT sectors, but luxary is (by design intent) unavailable.
-     */
-    offset %= 512;
-    
-    if (size_fat == 12) {
-    
-        if (offset == 511) {
-        
-            if (((cluster * 3) & 0x01) == 0) {
-                scratch[offset] = (unsigned char) (value & 0xFF);
-            } else {
-                scratch[offset] = (unsigned char) ((scratch[offset] & 0x0F) | ((value & 0x0F) << 4));
-            }
-            
-            for (i = 0; i < number_of_fats; i++) {
-            
-                unsigned long temp = sector + (i * sectors_per_fat);
-                
-                if (seekto (temp * 512) < 0 || fwrite (scratch, 512, 1, ofp) != 1) {
-                    return -1;
-                }
-            
-            }
-            
-            sector++;
-            
-            if (seekto (sector * 512) || fread (scratch, 512, 1, ofp) != 1) {
-                return -1;
-            }
-            
-            if (((cluster * 3) & 0x01) == 0) {
-                scratch[0] = (unsigned char) ((scratch[0] & 0xF0) | ((value & 0x0F00) >> 8));
-            } else {
-                scratch[0] = (unsigned char) ((value & 0x0FF0) >> 4);
-            }
-            
-            goto _write_fat;
-        
-        } else {
-        
-            if (((cluster * 3) & 0x01) == 0) {
-            
-                scratch[offset] = (unsigned char) (value & 0x00FF);
-                scratch[offset + 1] = (unsigned char) ((scratch[offset + 1] & 0x00F0) | ((value & 0x0F00) >> 8));
-            
-            } else {
-            
-                scratch[offset] = (unsigned char) ((scratch[offset] & 0x000F) | ((value & 0x000F) << 4));
-                scratch[offset + 1] = (unsigned char) ((value & 0x0FF0) >> 4);
-            
-            }
-            
-            goto _write_fat;
-        
-        }
-    
-    } else if (size_fat == 16) {
-    
-        scratch[offset] = (value & 0xFF);
-        scratch[offset + 1] = (value >> 8) & 0xFF;
-        
-        goto _write_fat;
-    
-    } else if (size_fat == 32) {
-    
-        scratch[offset] = (value & 0xFF);
-        scratch[offset + 1] = (value >> 8) & 0xFF;
-        scratch[offset + 2] = (value >> 16) & 0xFF;
-        scratch[offset + 3] = (scratch[offset + 3] & 0xF0) | ((value >> 24) & 0xFF);
-        
-        goto _write_fat;
-    
-    }
-    
-    return -1;
-
-_write_fat:
-
-    for (i = 0; i < number_of_fats; i++) {
-    
-        unsigned long temp = sector + (i * sectors_per_fat);
-        
-        if (seekto (temp * 512) || fwrite (scratch, 512, 1, ofp) != 1) {
-            return -1;
-        }
-    
-    }
-    
-    return 0;
-
-}
-
-static unsigned int get_fat_entry (unsigned char *scratch, unsigned int cluster) {
-
-    unsigned int offset, sector, result;
-    
-    if (size_fat == 12) {
-        offset = cluster + (cluster / 2);
-    } else if (size_fat == 16) {
-        offset = cluster * 2;
-    } else if (size_fat == 32) {
-        offset = cluster * 4;
-    } else {
-        return 0x0FFFFFF7;
-    }
-    
-    sector = (offset / 512) + reserved_sectors;
-    
-    if (seekto ((unsigned long) sector * 512) || fread (scratch, 512, 1, ofp) != 1) {
-        return 0x0FFFFFF7;
-    }
-    
-    offset %= 512;
-    
-    if (size_fat == 12) {
-    
-        if (offset == 511) {
-        
-            result = (unsigned int) scratch[offset];
-            sector++;
-            
-            if (seekto ((unsigned long) sector * 512) || fread (scratch, 512, 1, ofp) != 1) {
-                return 0x0FFFFFF7;
-            }
-            
-            result |= ((unsigned int) scratch[0]) << 8;
-        
-        } else {
-            result = (unsigned int) scratch[offset] | ((unsigned int) scratch[offset + 1]) << 8;
-        }
-        
-        if (cluster & 1) {
-            result = result >> 4;
-        } else {
-            result = result & 0x0FFF;
-        }
-    
-    } else if (size_fat == 16) {
-        result = (unsigned int) scratch[offset] | ((unsigned int) scratch[offset + 1]) << 8;
-    } else if (size_fat == 32) {
-        result = ((unsigned int) scratch[offset] | ((unsigned int) scratch[offset + 1]) << 8 | ((unsigned int) scratch[offset + 2]) << 16 | ((unsigned int) scratch[offset + 3]) << 24) & 0x0FFFFFFF;
-    } else {
-        result = 0x0FFFFFF7;
-    }
-    
-    return result;
-
-}
-
-static unsigned int get_free_fat (unsigned char *scratch) {
-
-    unsigned int i, result;
-    
-    for (i = 2; i < cluster_count; i++) {
-    
-        if (!(result = get_fat_entry (scratch, i))) {
-            return i;
-        }
-    
-    }
-    
-    return 0x0FFFFFF7;
-
-}
-
-
-int get_file (const char *source, unsigned char *scratch, struct file_info *fi) {
-
-    unsigned char tmppath[PATH_MAX];
-    unsigned char filename[12];
-    unsigned char *p;
-    
-    struct dir_info di;
-    struct msdos_dirent de;
-    
-    /* Zero out file structure. */
-    memset (fi, 0, sizeof (*fi));
-    
-    /* Get a local copy of the target.  If it's larger than PATH_MAX, abort. */
-    strncpy ((char *) tmppath, (char *) source, PATH_MAX);
-    tmppath[PATH_MAX - 1] = 0;
-    
-    if (strcmp ((char *) source, (char *) tmppath)) {
-        return -1;
-    }
-    
-    /* Strip leading seperators. */
-    while (tmppath[0] == '/' || tmppath[0] == '\\') {
-        strcpy ((char *) tmppath, (char *) tmppath + 1);
-    }
-    
-    /* Parse filename off the end of the suppiled target. */
-    p = tmppath;
-    
-    while (*(p++));
-    
-    p--;
-    
-    while (p > tmppath && *p != '/' && *p != '\\') {
-        p--;
-    }
-    
-    if (*p == '/' || *p == '\\') {
-        p++;
-    }
-    
-    if (canonical_to_dir ((char *) filename, (char *) p) < 0) {
-    
-        fprintf (stderr, "Failed to convert to 8:3\n");
-        return -1;
-    
-    }
-    
-    if (p > tmppath) {
-        p--;
-    }
-    
-    if (*p == '/' || *p == '\\' || p == tmppath) {
-        *p = 0;
-    }
-    
-    di.scratch = scratch;
-    
-    if (open_dir ((char *) tmppath, &di) < 0) {
-    
-        fprintf (stderr, "Failed to open directory\n");
-        return -1;
-    
-    }
-    
-    while (!get_next_entry (&di, &de)) {
-    
-        if (!memcmp (de.name, filename, 11)) {
-        
-            di.current_entry--;
-            
-            if (de.attr & ATTR_DIR) {
-                return -1;
-            }
-            
-            fi->cluster = (unsigned int) de.startlo[0] | ((unsigned int) de.startlo[1]) << 8 | ((unsigned int) de.starthi[0]) << 16 | ((unsigned int) de.starthi[1]) << 24;
-            fi->bytes = (unsigned int) de.size[0] | ((unsigned int) de.size[1]) << 8 | ((unsigned int) de.size[2]) << 16 | ((unsigned int) de.size[3]) << 24;
-            
-            fi->scratch = scratch;
-            return 0;
-        
-        }
-    
-    }
-    
-    return -1;
-
-}
-
-int copy_from_image (const char *target, struct file_info *fi, const char *fname) {
-
-    unsigned long sector, i, copied = 0;
-    FILE *tfp;
-    
-    unsigned long flen = (unsigned long) fi->bytes;
-    
-    if ((tfp = fopen (target, "rb")) == NULL) {
-    
-        if ((tfp = fopen (target, "wb")) == NULL) {
-            return -1;
-        }
-    
-    } else {
-    
-        if (!check_overwrite ((char *) target)) {
-            return 0;
-        }
-        
-        fclose (tfp);
-        
-        if ((fopen (target, "wb")) == NULL) {
-            return -1;
-        }
-    
-    }
-    
-    for (;;) {
-    
-        if (size_fat == 12 && fi->cluster >= 0x0FF8) {
-            break;
-        } else if (size_fat == 16 && fi->cluster >= 0xFFF8) {
-            break;
-        } else if (size_fat == 32 && fi->cluster >= 0x0FFFFFF8) {
-            break;
-        }
-        
-        sector = data_area + ((fi->cluster - 2) * sectors_per_cluster);
-        
-        for (i = 0; i < sectors_per_cluster; ++i) {
-        
-            if (seekto (sector * 512) || fread (fi->scratch, 512, 1, ofp) != 1) {
-            
-                fclose (tfp);
-                remove (target);
-                
-                return -1;
-            
-            }
-            
-            if (fi->bytes > 512) {
-            
-                if (fwrite (fi->scratch, 512, 1, tfp) != 1) {
-                
-                    fclose (tfp);
-                    remove (target);
-                    
-                    return -1;
-                
-                }
-                
-                copied += 512;
-                
-                if (state->status) {
-                
-                    double percent = (double) copied / (double) flen;
-                    printf ("\rcopied %lu bytes (%.2f%%) to %s", copied, percent * 100, fname);
-                
-                }
-                
-                fi->bytes -= 512;
-            
-            } else {
-            
-                if (fwrite (fi->scratch, fi->bytes, 1, tfp) != 1) {
-                
-                    fclose (tfp);
-                    remove (target);
-                    
-                    return -1;
-                
-                }
-                
-                fclose (tfp);
-                return 0;
-            
-            }
-            
-            sector++;
-        
-        }
-        
-        fi->cluster = get_fat_entry (fi->scratch, fi->cluster);
-        
-        if (!fi->cluster || fi->cluster == 0x0FFFFFFF7) {
-            break;
-        }
-    
-    }
-    
-    fclose (tfp);
-    return 0;
-
-}
-
-
-int main (int argc, char **argv) {
-
-    unsigned char *scratch;
     char *target, tmppath[PATH_MAX], *source;
     
     size_t i;
-    int copy_from = 1;
+    int copy_from = 1, error;
     
     if (argc && *argv) {
     
@@ -1907,183 +952,37 @@ int main (int argc, char **argv) {
         target = "/";
     }
     
-    if ((ofp = fopen (state->outfile, "r+b")) == NULL) {
-    
-        report_at (program_name, 0, REPORT_ERROR, "faild to open '%s' for writing", state->outfile);
-        return EXIT_FAILURE;
-    
-    }
-    
-    if (seekto ((unsigned long) 0) || fread (&bs, sizeof (bs), 1, ofp) != 1) {
-    
-        report_at (program_name, 0, REPORT_ERROR, "failed whilst reading boot sector");
-        fclose (ofp);
-        
-        return EXIT_FAILURE;
-    
-    }
-    
-    if (bs.boot_jump[0] != 0xEB || bs.boot_jump[1] < 0x16 || bs.boot_jump[2] != 0x90) {
+    if ((state->append || state->in_place) && copy_from) {
     
-        report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-        fclose (ofp);
-        
+        report_at (program_name, 0, REPORT_ERROR, "--append and --in-place only apply when copying into the image");
         return EXIT_FAILURE;
     
     }
     
-    sectors_per_cluster = (unsigned int) bs.sectors_per_cluster;
-    reserved_sectors = (unsigned int) bs.reserved_sectors[0] | (((unsigned int) bs.reserved_sectors[1]) << 8);
-    number_of_fats = (unsigned int) bs.no_fats;
-    root_entries = (unsigned int) bs.root_entries[0] | (((unsigned int) bs.root_entries[1]) << 8);
-    total_sectors = (unsigned int) bs.total_sectors16[0] | (((unsigned int) bs.total_sectors16[1]) << 8);
-    sectors_per_fat = (unsigned int) bs.sectors_per_fat16[0] | (((unsigned int) bs.sectors_per_fat16[1]) << 8);
-    
-    if (!sectors_per_cluster || !reserved_sectors || !number_of_fats) {
+    if (state->range && !copy_from) {
     
-        report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-        fclose (ofp);
-        
+        report_at (program_name, 0, REPORT_ERROR, "--range only applies when copying out of the image");
         return EXIT_FAILURE;
     
     }
     
-    if (!root_entries) {
-    
-        if (bs.boot_jump[1] < 0x58) {
-        
-            report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-            fclose (ofp);
-            
-            return EXIT_FAILURE;
-        
-        }
-        
-        root_cluster = (unsigned int) bs.fat32.root_cluster[0] | (((unsigned int) bs.fat32.root_cluster[1]) << 8) | (((unsigned int) bs.fat32.root_cluster[2]) << 16) | (((unsigned int) bs.fat32.root_cluster[3]) << 24);
-        
-        if (!root_cluster) {
-        
-            report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-            fclose (ofp);
-            
-            return EXIT_FAILURE;
-        
-        }
-    
-    }
-    
-    if (!total_sectors) {
-    
-        if (bs.boot_jump[1] < 0x22) {
-        
-            report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-            fclose (ofp);
-            
-            return EXIT_FAILURE;
-        
-        }
-        
-        total_sectors = (unsigned int) bs.total_sectors32[0] | (((unsigned int) bs.total_sectors32[1]) << 8) | (((unsigned int) bs.total_sectors32[2]) << 16) | (((unsigned int) bs.total_sectors32[3]) << 24);
-        
-        if (!total_sectors) {
-        
-            report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-            fclose (ofp);
-            
-            return EXIT_FAILURE;
-        
-        }
-    
-    }
-    
-    if (!sectors_per_fat) {
-    
-        if (bs.boot_jump[1] < 0x58) {
-        
-            report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-            fclose (ofp);
-            
-            return EXIT_FAILURE;
-        
-        }
-        
-        sectors_per_fat = (unsigned int) bs.fat32.sectors_per_fat32[0] | (((unsigned int) bs.fat32.sectors_per_fat32[1]) << 8) | (((unsigned int) bs.fat32.sectors_per_fat32[2]) << 16) | (((unsigned int) bs.fat32.sectors_per_fat32[3]) << 24);
-        
-        if (!sectors_per_fat) {
-        
-            report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-            fclose (ofp);
-            
-            return EXIT_FAILURE;
-        
-        }
-    
-    }
-    
-    if (root_entries) {
-    
-        root_dir = reserved_sectors + (sectors_per_fat * 2);
-        data_area = root_dir + (((root_entries * 32) + (512 - 1)) / 512);
-    
-    } else {
-    
-        data_area = reserved_sectors + (sectors_per_fat * 2);
-        
-        /*root_dir = data_area + ((root_cluster - 2) * sectors_per_cluster);*/
-        /*root_dir = root_cluster;*/
-    
-    }
-    
-    cluster_count = (total_sectors - data_area) / sectors_per_cluster;
-    
-    if (bs.boot_jump[1] == 0x58) {
+    if (!(img = dosfs_open (state->outfile, state->offset, (copy_from ? DOSFS_READONLY : 0) | (state->index ? DOSFS_INDEX : 0) | (state->source_date_set ? DOSFS_FIXED_ORDER : DOSFS_SOURCE_DATE), &error))) {
     
-        info_sector = (unsigned int) bs.fat32.info_sector[0] | (((unsigned int) bs.fat32.info_sector[1]) << 8);
-        
-        if (!info_sector) {
-        
+        if (error == DOSFS_ERR_INVALID) {
             report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-            fclose (ofp);
-            
-            return EXIT_FAILURE;
-        
+        } else if (error == DOSFS_ERR_SOURCE_DATE) {
+            report_at (program_name, 0, REPORT_ERROR, "%s", dosfs_strerror (error));
+        } else {
+            report_at (program_name, 0, REPORT_ERROR, "faild to open '%s' for writing", state->outfile);
         }
         
-        size_fat = 32;
-    
-    } else if (cluster_count <= MAX_CLUST_12) {
-        size_fat = 12;
-    } else if (cluster_count >= MIN_CLUST_16 && cluster_count <= MAX_CLUST_16) {
-        size_fat = 16;
-    } else {
-    
-        report_at (program_name, 0, REPORT_ERROR, "FAT is not 12, 16 or 32 bits");
-        fclose (ofp);
-        
         return EXIT_FAILURE;
     
     }
     
-    if (target && target[strlen (target) - 1] != '/' && target[strlen (target) - 1] != '\\') {
-    
-        if (state->nb_files > 1) {
-        
-            report_at (program_name, 0, REPORT_ERROR, "cannot copy multiple files to %s", target);
-            fclose (ofp);
-            
-            return EXIT_FAILURE;
-        
-        }
-    
-    }
-    
-    if (!(scratch = (unsigned char *) malloc (512))) {
-    
-        report_at (program_name, 0, REPORT_ERROR, "Out of memory");
-        fclose (ofp);
-        
-        return EXIT_FAILURE;
-    
+    /** --timestamp takes the place of SOURCE_DATE_EPOCH. */
+    if (state->source_date_set) {
+        dosfs_set_source_date (img, state->source_date);
     }
     
     for (i = 0; i < state->nb_files; ++i) {
@@ -2092,17 +991,13 @@ int main (int argc, char **argv) {
         int need_fn = 0;
         
         size_t pathlen;
-        struct file_info fi;
-        
         source = state->files[i];
         
         if (copy_from) {
         
             if (memcmp (source, "::", 2)) {
-        
-                fclose (ofp);
-                remove (state->outfile);
-                
+            
+                dosfs_close (img);
                 print_help (EXIT_FAILURE);
             
             }
@@ -2117,7 +1012,8 @@ int main (int argc, char **argv) {
         
         pathlen = strlen (target);
         
-        if (target[pathlen - 1] == '/' || target[pathlen - 1] == '\\') {
+        /** A target that is a directory in the image gets the source name appended. */
+        if (pathlen == 0 || target[pathlen - 1] == '/' || target[pathlen - 1] == '\\' || (!copy_from && dosfs_stat (img, target, &st) == 0 && (st.attr & ATTR_DIR))) {
         
             need_fn = 1;
             ptr = source;
@@ -2126,49 +1022,51 @@ int main (int argc, char **argv) {
                 ptr = (p + 1);
             }
             
-            pathlen += strlen (ptr);
+            pathlen += strlen (ptr) + 1;
         
         }
         
-        if (pathlen > PATH_MAX) {
+        if (pathlen >= PATH_MAX) {
         
             report_at (program_name, 0, REPORT_ERROR, "target too long");
-            free (scratch);
             
-            fclose (ofp);
+            dosfs_close (img);
             return EXIT_FAILURE;
         
         }
         
-        memset (tmppath, 0, PATH_MAX);
-        strncpy (tmppath, target, strlen (target));
+        strcpy (tmppath, target);
         
         if (need_fn) {
-            strncat (tmppath, ptr, strlen (ptr));
+        
+            if (*tmppath && tmppath[strlen (tmppath) - 1] != '/' && tmppath[strlen (tmppath) - 1] != '\\') {
+                strcat (tmppath, "/");
+            }
+            
+            strcat (tmppath, ptr);
+        
         }
         
         if (copy_from) {
         
-            if (get_file (source, scratch, &fi) < 0) {
+            if (dosfs_stat (img, source, &st) < 0) {
             
                 report_at (program_name, 0, REPORT_ERROR, "file '%s' does not exist", source);
-                free (scratch);
                 
-                fclose (ofp);
+                dosfs_close (img);
                 return EXIT_FAILURE;
             
             }
             
-            if (copy_from_image (target, &fi, tmppath) < 0) {
-                
+            if (copy_from_image (img, source, tmppath, tmppath) < 0) {
+            
                 if (state->status) {
                     printf ("\n");
                 }
                 
                 report_at (program_name, 0, REPORT_ERROR, "failed to copy %s", source);
-                free (scratch);
                 
-                fclose (ofp);
+                dosfs_close (img);
                 return EXIT_FAILURE;
             
             }
@@ -2181,28 +1079,15 @@ int main (int argc, char **argv) {
         
         }
         
-        if (open_file (tmppath, scratch, &fi) < 0) {
-        
-            report_at (program_name, 0, REPORT_ERROR, "failed to create %s", target);
-            free (scratch);
-            
-            fclose (ofp);
-            return EXIT_FAILURE;
-        
-        }
-        
-        fi.scratch = scratch;
-        
-        if (copy_file (source, &fi, tmppath) < 0) {
+        if (copy_file (img, source, tmppath, tmppath) < 0) {
         
             if (state->status) {
                 printf ("\n");
             }
             
             report_at (program_name, 0, REPORT_ERROR, "failed to copy %s", source);
-            free (scratch);
             
-            fclose (ofp);
+            dosfs_close (img);
             return EXIT_FAILURE;
         
         }
@@ -2213,8 +1098,12 @@ int main (int argc, char **argv) {
     
     }
     
-    free (scratch);
-    fclose (ofp);
+    if (dosfs_close (img) < 0) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "failed whilst writing '%s'", state->outfile);
+        return EXIT_FAILURE;
+    
+    }
     
     return EXIT_SUCCESS;
 
@@ -5,16 +5,23 @@
 #define     _MCOPY_H
 
 #include    <stddef.h>
+#include    <time.h>
 
 struct mcopy_state {
 
     char **files;
     size_t nb_files;
     
-    int status;
+    int append, in_place, index, status;
+    
+    int range;
+    unsigned long range_offset, range_length;
     
     const char *outfile;
     size_t offset;
+    
+    time_t source_date;
+    int source_date_set;
 
 };
 
@@ -0,0 +1,21 @@
+/******************************************************************************
+ * @file            mdefrag.h
+ *****************************************************************************/
+#ifndef     _MDEFRAG_H
+#define     _MDEFRAG_H
+
+#include    <stddef.h>
+
+struct mdefrag_state {
+
+    char **paths;
+    size_t nb_paths;
+    
+    const char *outfile;
+    unsigned long offset;
+    
+    int index, report, verbose;
+
+};
+
+#endif      /* _MDEFRAG_H */
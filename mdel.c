@@ -0,0 +1,429 @@
+/******************************************************************************
+ * @file            mdel.c
+ *****************************************************************************/
+#include    <ctype.h>
+#include    <errno.h>
+#include    <limits.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+
+#include    "dosfs.h"
+#include    "mdel.h"
+#include    "msdos.h"
+#include    "report.h"
+
+static struct mdel_state *state = 0;
+static const char *program_name = 0;
+
+struct option {
+
+    const char *name;
+    int index, flags;
+
+};
+
+#define     OPTION_NO_ARG               0x0001
+#define     OPTION_HAS_ARG              0x0002
+
+enum options {
+
+    OPTION_IGNORED = 1,
+    OPTION_HELP,
+    OPTION_INDEX,
+    OPTION_INPUT,
+    OPTION_OFFSET,
+    OPTION_RECURSIVE,
+    OPTION_VERBOSE
+
+};
+
+static struct option opts[] = {
+
+    { "i",          OPTION_INPUT,       OPTION_HAS_ARG  },
+    { "r",          OPTION_RECURSIVE,   OPTION_NO_ARG   },
+    { "v",          OPTION_VERBOSE,     OPTION_NO_ARG   },
+    
+    { "-help",      OPTION_HELP,        OPTION_NO_ARG   },
+    { "-index",     OPTION_INDEX,       OPTION_NO_ARG   },
+    { "-offset",    OPTION_OFFSET,      OPTION_HAS_ARG  },
+    { "-recursive", OPTION_RECURSIVE,   OPTION_NO_ARG   },
+    { "-verbose",   OPTION_VERBOSE,     OPTION_NO_ARG   },
+    
+    { 0,            0,                  0               }
+
+};
+
+static int strstart (const char *val, const char **str) {
+
+    const char *p = val;
+    const char *q = *str;
+    
+    while (*p != '\0') {
+    
+        if (*p != *q) {
+            return 0;
+        }
+        
+        ++p;
+        ++q;
+    
+    }
+    
+    *str = q;
+    return 1;
+
+}
+
+static void print_help (int exitval) {
+
+    if (!program_name) {
+        goto _exit;
+    }
+    
+    fprintf (stderr, "Usage: %s [options] [::]path...\n\n", program_name);
+    fprintf (stderr, "Options:\n\n");
+    
+    fprintf (stderr, "    Short options:\n\n");
+    fprintf (stderr, "        -i                Specify the input target.\n");
+    fprintf (stderr, "        -r                Remove directories and everything in them.\n");
+    fprintf (stderr, "        -v                Print each path as it is removed.\n");
+    
+    fprintf (stderr, "\n");
+    
+    fprintf (stderr, "    Long options:\n\n");
+    fprintf (stderr, "        --help            Show this help information then exit.\n");
+    fprintf (stderr, "        --index           Keep a sidecar index next to the image for fast reopening.\n");
+    fprintf (stderr, "        --offset SECTOR   Write the filesystem starting at SECTOR.\n");
+    fprintf (stderr, "        --recursive       Remove directories and everything in them.\n");
+    fprintf (stderr, "        --verbose         Print each path as it is removed.\n");
+       
+_exit:
+    
+    exit (exitval);
+
+}
+
+static void *xmalloc (size_t size) {
+
+    void *ptr = malloc (size);
+    
+    if (ptr == NULL && size) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "memory full (malloc)");
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    memset (ptr, 0, size);
+    return ptr;
+
+}
+
+static void *xrealloc (void *ptr, size_t size) {
+
+    void *new_ptr = realloc (ptr, size);
+    
+    if (new_ptr == NULL && size) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "memory full (realloc)");
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    return new_ptr;
+
+}
+
+static char *xstrdup (const char *str) {
+
+    char *ptr = xmalloc (strlen (str) + 1);
+    strcpy (ptr, str);
+    
+    return ptr;
+
+}
+
+static void dynarray_add (void *ptab, size_t *nb_ptr, void *data) {
+
+    int nb, nb_alloc;
+    void **pp;
+    
+    nb = *nb_ptr;
+    pp = *(void ***) ptab;
+    
+    if ((nb & (nb - 1)) == 0) {
+    
+        if (!nb) {
+            nb_alloc = 1;
+        } else {
+            nb_alloc = nb * 2;
+        }
+        
+        pp = xrealloc (pp, nb_alloc * sizeof (void *));
+        *(void ***) ptab = pp;
+    
+    }
+    
+    pp[nb++] = data;
+    *nb_ptr = nb;
+
+}
+
+static void parse_args (int *pargc, char ***pargv, int optind) {
+
+    char **argv = *pargv;
+    int argc = *pargc;
+    
+    struct option *popt;
+    const char *optarg, *r;
+    
+    if (argc == optind) {
+        print_help (EXIT_SUCCESS);
+    }
+    
+    while (optind < argc) {
+    
+        r = argv[optind++];
+        
+        if (r[0] != '-' || r[1] == '\0') {
+        
+            dynarray_add (&state->paths, &state->nb_paths, xstrdup (r));
+            continue;
+        
+        }
+        
+        for (popt = opts; popt; ++popt) {
+        
+            const char *p1 = popt->name;
+            const char *r1 = (r + 1);
+            
+            if (!p1) {
+            
+                report_at (program_name, 0, REPORT_ERROR, "invalid option -- '%s'", r);
+                exit (EXIT_FAILURE);
+            
+            }
+            
+            if (!strstart (p1, &r1)) {
+                continue;
+            }
+            
+            optarg = r1;
+            
+            if (popt->flags & OPTION_HAS_ARG) {
+            
+                if (*optarg == '\0') {
+                
+                    if (optind >= argc) {
+                    
+                        report_at (program_name, 0, REPORT_ERROR, "argument to '%s' is missing", r);
+                        exit (EXIT_FAILURE);
+                    
+                    }
+                    
+                    optarg = argv[optind++];
+                
+                }
+            
+            } else if (*optarg != '\0') {
+                continue;
+            }
+            
+            break;
+        
+        }
+        
+        switch (popt->index) {
+        
+            case OPTION_HELP: {
+            
+                print_help (EXIT_SUCCESS);
+                break;
+            
+            }
+            
+            case OPTION_INDEX: {
+            
+                state->index = 1;
+                break;
+            
+            }
+            
+            case OPTION_INPUT: {
+            
+                if (state->outfile) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "multiple output files provided");
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->outfile = xstrdup (optarg);
+                break;
+            
+            }
+            
+            case OPTION_OFFSET: {
+            
+                long conversion;
+                char *temp;
+                
+                errno = 0;
+                conversion = strtol (optarg, &temp, 0);
+                
+                if (!*optarg || isspace ((int) *optarg) || errno || *temp) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "bad number for offset (%s)", optarg);
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                if (conversion < 0 || (unsigned long) conversion > UINT_MAX) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "offset must be between 0 and %u", UINT_MAX);
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->offset = (unsigned long) conversion;
+                break;
+            
+            }
+            
+            case OPTION_RECURSIVE: {
+            
+                state->recursive = 1;
+                break;
+            
+            }
+            
+            case OPTION_VERBOSE: {
+            
+                state->verbose = 1;
+                break;
+            
+            }
+            
+            default: {
+            
+                report_at (program_name, 0, REPORT_ERROR, "unsupported option '%s'", r);
+                exit (EXIT_FAILURE);
+            
+            }
+        
+        }
+    
+    }
+
+}
+
+/**
+ * Remove one path.  Everything happens in the handle's copy of the FAT and
+ * directories: chains are freed a contiguous run at a time and entries are
+ * only marked deleted, so however much is removed, each changed directory
+ * sector, the changed part of the FAT and FSInfo are written once on close.
+ */
+static int remove_path (struct dosfs_image *img, const char *path) {
+
+    struct dosfs_stat st;
+    
+    if (!*path) {
+        st.attr = ATTR_DIR;
+    } else if (dosfs_stat (img, path, &st) < 0) {
+        return -1;
+    }
+    
+    if (!(st.attr & ATTR_DIR)) {
+        return dosfs_unlink (img, path);
+    }
+    
+    if (!state->recursive) {
+    
+        img->error = DOSFS_ERR_ISDIR;
+        return -1;
+    
+    }
+    
+    return dosfs_rmdir (img, path, DOSFS_RMDIR_RECURSIVE);
+
+}
+
+int main (int argc, char **argv) {
+
+    struct dosfs_image *img;
+    char *target;
+    
+    size_t i;
+    int error, status = EXIT_SUCCESS;
+    
+    if (argc && *argv) {
+    
+        char *p;
+        program_name = *argv;
+        
+        if ((p = strrchr (program_name, '/'))) {
+            program_name = (p + 1);
+        }
+    
+    }
+    
+    state = xmalloc (sizeof (*state));
+    parse_args (&argc, &argv, 1);
+    
+    if (!state->outfile || state->nb_paths == 0) {
+        print_help (EXIT_FAILURE);
+    }
+    
+    if (!(img = dosfs_open (state->outfile, state->offset, (state->index ? DOSFS_INDEX : 0) | DOSFS_SOURCE_DATE, &error))) {
+    
+        if (error == DOSFS_ERR_INVALID) {
+            report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
+        } else if (error == DOSFS_ERR_SOURCE_DATE) {
+            report_at (program_name, 0, REPORT_ERROR, "%s", dosfs_strerror (error));
+        } else {
+            report_at (program_name, 0, REPORT_ERROR, "faild to open '%s' for writing", state->outfile);
+        }
+        
+        return EXIT_FAILURE;
+    
+    }
+    
+    for (i = 0; i < state->nb_paths; ++i) {
+    
+        target = state->paths[i];
+        
+        if (target[0] == ':' && target[1] == ':') {
+            target += 2;
+        }
+        
+        while (*target == '/' || *target == '\\') {
+            target++;
+        }
+        
+        /** Like rm, carry on with the remaining paths and report failure at the end. */
+        if (remove_path (img, target) < 0) {
+        
+            report_at (program_name, 0, REPORT_ERROR, "failed to remove '%s': %s", state->paths[i], dosfs_strerror (img->error));
+            
+            status = EXIT_FAILURE;
+            continue;
+        
+        }
+        
+        if (state->verbose) {
+            printf ("removed %s\n", *target ? target : "/");
+        }
+    
+    }
+    
+    if (dosfs_close (img) < 0) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "failed whilst writing '%s'", state->outfile);
+        return EXIT_FAILURE;
+    
+    }
+    
+    return status;
+
+}
@@ -0,0 +1,21 @@
+/******************************************************************************
+ * @file            mdel.h
+ *****************************************************************************/
+#ifndef     _MDEL_H
+#define     _MDEL_H
+
+#include    <stddef.h>
+
+struct mdel_state {
+
+    char **paths;
+    size_t nb_paths;
+    
+    const char *outfile;
+    unsigned long offset;
+    
+    int index, recursive, verbose;
+
+};
+
+#endif      /* _MDEL_H */
@@ -0,0 +1,595 @@
+/******************************************************************************
+ * @file            minfo.c
+ *****************************************************************************/
+#if     !defined (__PDOS__) && !defined (_WIN32)
+# define    _POSIX_C_SOURCE             200112L
+#endif
+
+#include    <ctype.h>
+#include    <errno.h>
+#include    <limits.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+
+#if     defined (__GNUC__) && !defined (__PDOS__) && !defined (_WIN32)
+# define    MINFO_THREADS
+# include   <pthread.h>
+#endif
+
+#include    "dosfs.h"
+#include    "fatscan.h"
+#include    "minfo.h"
+#include    "msdos.h"
+#include    "report.h"
+
+/** FATs with fewer entries than this are scanned on one thread whatever --jobs says. */
+#define     MINFO_THREAD_CLUSTERS       (1UL << 20)
+#define     MINFO_JOBS                  4
+
+static struct minfo_state *state = 0;
+static const char *program_name = 0;
+
+struct option {
+
+    const char *name;
+    int index, flags;
+
+};
+
+#define     OPTION_NO_ARG               0x0001
+#define     OPTION_HAS_ARG              0x0002
+
+enum options {
+
+    OPTION_IGNORED = 1,
+    OPTION_FIX,
+    OPTION_HELP,
+    OPTION_INPUT,
+    OPTION_JOBS,
+    OPTION_OFFSET,
+    OPTION_VERBOSE
+
+};
+
+static struct option opts[] = {
+
+    { "i",          OPTION_INPUT,       OPTION_HAS_ARG  },
+    { "v",          OPTION_VERBOSE,     OPTION_NO_ARG   },
+    
+    { "-fix",       OPTION_FIX,         OPTION_NO_ARG   },
+    { "-help",      OPTION_HELP,        OPTION_NO_ARG   },
+    { "-jobs",      OPTION_JOBS,        OPTION_HAS_ARG  },
+    { "-offset",    OPTION_OFFSET,      OPTION_HAS_ARG  },
+    { "-verbose",   OPTION_VERBOSE,     OPTION_NO_ARG   },
+    
+    { 0,            0,                  0               }
+
+};
+
+static int strstart (const char *val, const char **str) {
+
+    const char *p = val;
+    const char *q = *str;
+    
+    while (*p != '\0') {
+    
+        if (*p != *q) {
+            return 0;
+        }
+        
+        ++p;
+        ++q;
+    
+    }
+    
+    *str = q;
+    return 1;
+
+}
+
+static void print_help (int exitval) {
+
+    if (!program_name) {
+        goto _exit;
+    }
+    
+    fprintf (stderr, "Usage: %s [options] -i image\n\n", program_name);
+    fprintf (stderr, "Options:\n\n");
+    
+    fprintf (stderr, "    Short options:\n\n");
+    fprintf (stderr, "        -i                Specify the input target.\n");
+    fprintf (stderr, "        -v                Also show how the FAT was scanned.\n");
+    
+    fprintf (stderr, "\n");
+    
+    fprintf (stderr, "    Long options:\n\n");
+    fprintf (stderr, "        --fix             Correct the FAT32 FSInfo sector if it disagrees with the FAT.\n");
+    fprintf (stderr, "        --help            Show this help information then exit.\n");
+    fprintf (stderr, "        --jobs N          Scan large FATs using N threads.\n");
+    fprintf (stderr, "        --offset SECTOR   Read the filesystem starting at SECTOR.\n");
+    fprintf (stderr, "        --verbose         Also show how the FAT was scanned.\n");
+       
+_exit:
+    
+    exit (exitval);
+
+}
+
+static void *xmalloc (size_t size) {
+
+    void *ptr = malloc (size);
+    
+    if (ptr == NULL && size) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "memory full (malloc)");
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    memset (ptr, 0, size);
+    return ptr;
+
+}
+
+static void *xrealloc (void *ptr, size_t size) {
+
+    void *new_ptr = realloc (ptr, size);
+    
+    if (new_ptr == NULL && size) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "memory full (realloc)");
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    return new_ptr;
+
+}
+
+static char *xstrdup (const char *str) {
+
+    char *ptr = xmalloc (strlen (str) + 1);
+    strcpy (ptr, str);
+    
+    return ptr;
+
+}
+
+static void dynarray_add (void *ptab, size_t *nb_ptr, void *data) {
+
+    int nb, nb_alloc;
+    void **pp;
+    
+    nb = *nb_ptr;
+    pp = *(void ***) ptab;
+    
+    if ((nb & (nb - 1)) == 0) {
+    
+        if (!nb) {
+            nb_alloc = 1;
+        } else {
+            nb_alloc = nb * 2;
+        }
+        
+        pp = xrealloc (pp, nb_alloc * sizeof (void *));
+        *(void ***) ptab = pp;
+    
+    }
+    
+    pp[nb++] = data;
+    *nb_ptr = nb;
+
+}
+
+static void parse_args (int *pargc, char ***pargv, int optind) {
+
+    char **argv = *pargv;
+    int argc = *pargc;
+    
+    struct option *popt;
+    const char *optarg, *r;
+    
+    if (argc == optind) {
+        print_help (EXIT_SUCCESS);
+    }
+    
+    while (optind < argc) {
+    
+        r = argv[optind++];
+        
+        if (r[0] != '-' || r[1] == '\0') {
+        
+            dynarray_add (&state->paths, &state->nb_paths, xstrdup (r));
+            continue;
+        
+        }
+        
+        for (popt = opts; popt; ++popt) {
+        
+            const char *p1 = popt->name;
+            const char *r1 = (r + 1);
+            
+            if (!p1) {
+            
+                report_at (program_name, 0, REPORT_ERROR, "invalid option -- '%s'", r);
+                exit (EXIT_FAILURE);
+            
+            }
+            
+            if (!strstart (p1, &r1)) {
+                continue;
+            }
+            
+            optarg = r1;
+            
+            if (popt->flags & OPTION_HAS_ARG) {
+            
+                if (*optarg == '\0') {
+                
+                    if (optind >= argc) {
+                    
+                        report_at (program_name, 0, REPORT_ERROR, "argument to '%s' is missing", r);
+                        exit (EXIT_FAILURE);
+                    
+                    }
+                    
+                    optarg = argv[optind++];
+                
+                }
+            
+            } else if (*optarg != '\0') {
+                continue;
+            }
+            
+            break;
+        
+        }
+        
+        switch (popt->index) {
+        
+            case OPTION_FIX: {
+            
+                state->fix = 1;
+                break;
+            
+            }
+            
+            case OPTION_HELP: {
+            
+                print_help (EXIT_SUCCESS);
+                break;
+            
+            }
+            
+            case OPTION_INPUT: {
+            
+                if (state->outfile) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "multiple output files provided");
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->outfile = xstrdup (optarg);
+                break;
+            
+            }
+            
+            case OPTION_JOBS: {
+            
+                long conversion;
+                char *temp;
+                
+                errno = 0;
+                conversion = strtol (optarg, &temp, 0);
+                
+                if (!*optarg || isspace ((int) *optarg) || errno || *temp || conversion < 1 || conversion > 256) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "jobs must be between 1 and 256");
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->jobs = (int) conversion;
+                break;
+            
+            }
+            
+            case OPTION_OFFSET: {
+            
+                long conversion;
+                char *temp;
+                
+                errno = 0;
+                conversion = strtol (optarg, &temp, 0);
+                
+                if (!*optarg || isspace ((int) *optarg) || errno || *temp) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "bad number for offset (%s)", optarg);
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                if (conversion < 0 || (unsigned long) conversion > UINT_MAX) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "offset must be between 0 and %u", UINT_MAX);
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->offset = (unsigned long) conversion;
+                break;
+            
+            }
+            
+            case OPTION_VERBOSE: {
+            
+                state->verbose = 1;
+                break;
+            
+            }
+            
+            default: {
+            
+                report_at (program_name, 0, REPORT_ERROR, "unsupported option '%s'", r);
+                exit (EXIT_FAILURE);
+            
+            }
+        
+        }
+    
+    }
+
+}
+
+struct scan_job {
+
+    struct dosfs_image *img;
+    unsigned int first;
+    unsigned long count;
+    
+    struct fatscan_stats stats;
+
+};
+
+static void *scan_worker (void *arg) {
+
+    struct scan_job *job = arg;
+    
+    fatscan (job->img->fat, job->img->size_fat, job->first, job->count, &job->stats);
+    return 0;
+
+}
+
+/**
+ * Scan the whole FAT.  Large tables are cut into one slice per job, each
+ * scanned on its own thread, and the slices merged back in order so free
+ * runs crossing a cut still count as one extent.
+ */
+static int scan_fat (struct dosfs_image *img, int jobs, struct fatscan_stats *stats) {
+
+    struct scan_job *slices;
+    unsigned long per;
+    
+    int i, nb_slices;
+    
+    if (jobs < 1 || img->size_fat != 32 || img->cluster_count < MINFO_THREAD_CLUSTERS) {
+        jobs = 1;
+    }
+    
+    per = (img->cluster_count + jobs - 1) / jobs;
+    nb_slices = 0;
+    
+    slices = xmalloc (jobs * sizeof (*slices));
+    
+    for (i = 0; i < jobs && per * i < img->cluster_count; i++) {
+    
+        slices[i].img = img;
+        slices[i].first = 2 + (unsigned int) (per * i);
+        slices[i].count = (per * (i + 1) <= img->cluster_count ? per : img->cluster_count - per * i);
+        
+        nb_slices++;
+    
+    }
+
+#if     defined (MINFO_THREADS)
+
+    if (nb_slices > 1) {
+    
+        pthread_t *threads = xmalloc (nb_slices * sizeof (*threads));
+        int *started = xmalloc (nb_slices * sizeof (*started));
+        
+        for (i = 1; i < nb_slices; i++) {
+            started[i] = (pthread_create (&threads[i], 0, scan_worker, &slices[i]) == 0);
+        }
+        
+        scan_worker (&slices[0]);
+        
+        /** A slice whose thread could not be started is scanned here instead. */
+        for (i = 1; i < nb_slices; i++) {
+        
+            if (started[i]) {
+                pthread_join (threads[i], 0);
+            } else {
+                scan_worker (&slices[i]);
+            }
+        
+        }
+        
+        free (started);
+        free (threads);
+    
+    } else {
+        scan_worker (&slices[0]);
+    }
+
+#else
+
+    for (i = 0; i < nb_slices; i++) {
+        scan_worker (&slices[i]);
+    }
+
+#endif
+
+    *stats = slices[0].stats;
+    
+    for (i = 1; i < nb_slices; i++) {
+        fatscan_merge (stats, &slices[i].stats);
+    }
+    
+    free (slices);
+    return nb_slices;
+
+}
+
+/** Sizes are given in KiB; a cluster count times sectors per cluster never exceeds the sector count. */
+static unsigned long cluster_kib (struct dosfs_image *img, unsigned long clusters) {
+    return (clusters * img->sectors_per_cluster) / 2;
+}
+
+static void print_geometry (struct dosfs_image *img) {
+
+    printf ("filesystem:            FAT%d\n", img->size_fat);
+    printf ("total sectors:         %u (%lu KiB)\n", img->total_sectors, (unsigned long) img->total_sectors / 2);
+    printf ("reserved sectors:      %u\n", img->reserved_sectors);
+    printf ("FATs:                  %u of %u sectors\n", img->number_of_fats, img->sectors_per_fat);
+    
+    if (img->size_fat == 32) {
+        printf ("root directory:        cluster %u\n", img->root_cluster);
+    } else {
+        printf ("root directory:        %u entries at sector %u\n", img->root_entries, img->root_dir);
+    }
+    
+    printf ("data area:             sector %u\n", img->data_area);
+    printf ("clusters:              %u of %u bytes\n", img->cluster_count, img->cluster_size);
+
+}
+
+static void print_usage (struct dosfs_image *img, const struct fatscan_stats *stats) {
+
+    unsigned long used = img->cluster_count - stats->free_clusters - stats->bad_clusters;
+    
+    printf ("free clusters:         %lu (%lu KiB)\n", stats->free_clusters, cluster_kib (img, stats->free_clusters));
+    printf ("used clusters:         %lu (%lu KiB)\n", used, cluster_kib (img, used));
+    printf ("bad clusters:          %lu\n", stats->bad_clusters);
+    
+    if (stats->largest_free) {
+        printf ("largest free extent:   %lu clusters at %u (%lu KiB)\n", stats->largest_free, stats->largest_start, cluster_kib (img, stats->largest_free));
+    } else {
+        printf ("largest free extent:   none\n");
+    }
+
+}
+
+/**
+ * Compare the FSInfo sector with the scan.  Returns 1 if it is stale, 0 if
+ * it agrees and -1 if there is none to compare.  Only the free count has to
+ * be right; the next free cluster is a hint and any free cluster will do.
+ */
+static int check_fsinfo (struct dosfs_image *img, const struct fatscan_stats *stats) {
+
+    unsigned char sector[512];
+    struct fat32_fsinfo *info = (struct fat32_fsinfo *) (sector + 0x1e0);
+    
+    unsigned long free_clusters, next;
+    
+    if (img->size_fat != 32 || !img->info_sector) {
+        return -1;
+    }
+    
+    if (fseek (img->fp, (long) ((img->offset + img->info_sector) * 512), SEEK_SET) || fread (sector, 512, 1, img->fp) != 1) {
+        return -1;
+    }
+    
+    if ((info->signature[0] | (info->signature[1] << 8) | ((unsigned long) info->signature[2] << 16) | ((unsigned long) info->signature[3] << 24)) != 0x61417272) {
+    
+        printf ("fsinfo:                invalid signature\n");
+        return -1;
+    
+    }
+    
+    free_clusters = info->free_clusters[0] | (info->free_clusters[1] << 8) | ((unsigned long) info->free_clusters[2] << 16) | ((unsigned long) info->free_clusters[3] << 24);
+    next = info->next_cluster[0] | (info->next_cluster[1] << 8) | ((unsigned long) info->next_cluster[2] << 16) | ((unsigned long) info->next_cluster[3] << 24);
+    
+    if (free_clusters == 0xFFFFFFFFUL) {
+        printf ("fsinfo:                free count unknown, next free %lu\n", next);
+    } else {
+        printf ("fsinfo:                %lu free, next free %lu%s\n", free_clusters, next, free_clusters != stats->free_clusters ? " (stale)" : "");
+    }
+    
+    return free_clusters != stats->free_clusters;
+
+}
+
+int main (int argc, char **argv) {
+
+    struct fatscan_stats stats;
+    struct dosfs_image *img;
+    
+    int error, slices, stale;
+    
+    if (argc && *argv) {
+    
+        char *p;
+        program_name = *argv;
+        
+        if ((p = strrchr (program_name, '/'))) {
+            program_name = (p + 1);
+        }
+    
+    }
+    
+    state = xmalloc (sizeof (*state));
+    parse_args (&argc, &argv, 1);
+    
+    if (!state->outfile || state->nb_paths > 0) {
+        print_help (EXIT_FAILURE);
+    }
+    
+    if (!(img = dosfs_open (state->outfile, state->offset, DOSFS_NO_COUNT | (state->fix ? 0 : DOSFS_READONLY), &error))) {
+    
+        if (error == DOSFS_ERR_INVALID) {
+            report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
+        } else {
+            report_at (program_name, 0, REPORT_ERROR, "faild to open '%s' for %s", state->outfile, state->fix ? "writing" : "reading");
+        }
+        
+        return EXIT_FAILURE;
+    
+    }
+    
+    /** The handle was opened without its own count; this scan supplies it. */
+    slices = scan_fat (img, state->jobs ? state->jobs : MINFO_JOBS, &stats);
+    
+    img->free_clusters = (unsigned int) stats.free_clusters;
+    img->next_free = stats.first_free;
+    
+    print_geometry (img);
+    print_usage (img, &stats);
+    
+    stale = check_fsinfo (img, &stats);
+    
+    if (state->verbose) {
+        printf ("scan:                  %s, %d thread%s\n", fatscan_kernel (), slices, slices > 1 ? "s" : "");
+    }
+    
+    /** Committing a writable handle rewrites FSInfo from the counts taken from the scan. */
+    if (state->fix && stale > 0) {
+    
+        if (dosfs_close (img) < 0) {
+        
+            report_at (program_name, 0, REPORT_ERROR, "failed whilst writing '%s'", state->outfile);
+            return EXIT_FAILURE;
+        
+        }
+        
+        printf ("fsinfo updated\n");
+        return EXIT_SUCCESS;
+    
+    }
+    
+    dosfs_close (img);
+    return EXIT_SUCCESS;
+
+}
@@ -0,0 +1,21 @@
+/******************************************************************************
+ * @file            minfo.h
+ *****************************************************************************/
+#ifndef     _MINFO_H
+#define     _MINFO_H
+
+#include    <stddef.h>
+
+struct minfo_state {
+
+    char **paths;
+    size_t nb_paths;
+    
+    const char *outfile;
+    unsigned long offset;
+    
+    int fix, jobs, verbose;
+
+};
+
+#endif      /* _MINFO_H */
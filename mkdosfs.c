@@ -0,0 +1,40 @@
+/******************************************************************************
+ * @file            mkdosfs.c
+ *****************************************************************************/
+#include    <stddef.h>
+#include    <stdlib.h>
+#include    <string.h>
+
+#include    "lib.h"
+#include    "mkfs.h"
+#include    "report.h"
+
+struct mkfs_state *state = 0;
+const char *program_name = 0;
+
+int main (int argc, char **argv) {
+
+    if (argc && *argv) {
+    
+        char *p;
+        program_name = *argv;
+        
+        if ((p = strrchr (program_name, '/'))) {
+            program_name = (p + 1);
+        }
+    
+    }
+    
+    state = xmalloc (sizeof (*state));
+    parse_args (&argc, &argv, 1);
+    
+    if (!state->outfile && !state->plan_only) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "no outfile file provided");
+        return EXIT_FAILURE;
+    
+    }
+    
+    return make_filesystem ();
+
+}
@@ -7,7 +7,9 @@
 #include    <stdlib.h>
 #include    <string.h>
 
+#include    "badblocks.h"
 #include    "common.h"
+#include    "hosttree.h"
 #include    "lib.h"
 #include    "mkfs.h"
 #include    "msdos.h"
@@ -23,9 +25,24 @@
 # endif
 #endif
 
+#if     defined (_WIN32)
+# include   <fcntl.h>
+# include   <io.h>
+#endif
+
 static int align_structures = 1;
 static int orphaned_sectors = 0;
 
+/** Set while plan_filesystem tries layouts, most of which are expected to fail. */
+static int planning = 0;
+
+/** Clusters check_surface found bad, as indices from cluster 2. */
+static unsigned long *bad_clusters = 0;
+static size_t nb_bad_clusters = 0;
+
+/** The tree plan_filesystem scanned, kept for build_filesystem when it is the source. */
+static struct hosttree_node *source_tree = 0;
+
 static FILE *ofp;
 static size_t image_size = 0;
 
@@ -46,9 +63,6 @@ static unsigned int root_entries = 512;
 static unsigned int sectors_per_cluster = 4;
 static unsigned int sectors_per_fat = 0;
 
-struct mkfs_state *state = 0;
-const char *program_name = 0;
-
 static unsigned char dummy_boot_code[] =
 
     "\x31\xC0"                                                                  /* xor ax, ax */
@@ -158,7 +172,7 @@ static int set_fat_entry (unsigned int cluster, unsigned int value) {
             if (((cluster * 3) & 0x01) == 0) {
                 scratch[offset] = (unsigned char) (value & 0xFF);
             } else {
-                scratch[offset] = (unsigned char) ((scratch[offset] & 0x0F) | (value & 0xF0));
+                scratch[offset] = (unsigned char) ((scratch[offset] & 0x0F) | ((value & 0x0F) << 4));
             }
             
             for (i = 0; i < number_of_fats; i++) {
@@ -184,9 +198,9 @@ static int set_fat_entry (unsigned int cluster, unsigned int value) {
             }
             
             if (((cluster * 3) & 0x01) == 0) {
-                scratch[0] = (unsigned char) ((scratch[0] & 0xF0) | (value & 0x0F));
+                scratch[0] = (unsigned char) ((scratch[0] & 0xF0) | ((value >> 8) & 0x0F));
             } else {
-                scratch[0] = (unsigned char) (value & 0xFF00);
+                scratch[0] = (unsigned char) ((value >> 4) & 0xFF);
             }
             
             goto _write_fat;
@@ -260,8 +274,22 @@ static unsigned int align_object (unsigned int sectors, unsigned int clustsize)
 
 }
 
+/** The time set with --timestamp or SOURCE_DATE_EPOCH, or null to stamp from the clock. */
+static const time_t *fixed_date (void) {
+    return (state->source_date_set ? &state->source_date : 0);
+}
+
 static unsigned int generate_volume_id (void) {
 
+    if (state->volume_id_set) {
+        return state->volume_id;
+    }
+    
+    /** A reproducible image takes its volume id from its timestamp. */
+    if (state->source_date_set) {
+        return (unsigned int) state->source_date;
+    }
+    
 #if     defined (__PDOS__)
 
     srand (time (NULL));
@@ -296,7 +324,7 @@ static unsigned int generate_volume_id (void) {
 
 }
 
-static void establish_bpb (void) {
+static int establish_bpb (void) {
 
     unsigned int maxclustsize, root_dir_sectors;
     
@@ -686,11 +714,7 @@ static void establish_bpb (void) {
         default:
         
             report_at (program_name, 0, REPORT_ERROR, "FAT not 12, 16 or 32 bits");
-            
-            fclose (ofp);
-            remove (state->outfile);
-            
-            exit (EXIT_FAILURE);
+            return -1;
     
     }
     
@@ -725,20 +749,12 @@ static void establish_bpb (void) {
             if (backup_boot == info_sector) {
             
                 report_at (program_name, 0, REPORT_ERROR, "Backup boot sector must not be the same as the info sector (%d)", info_sector);
-                
-                fclose (ofp);
-                remove (state->outfile);
-                
-                exit (EXIT_FAILURE);
+                return -1;
             
             } else if (backup_boot >= reserved_sectors) {
             
                 report_at (program_name, 0, REPORT_ERROR, "Backup boot sector must be a reserved sector");
-                
-                fclose (ofp);
-                remove (state->outfile);
-                
-                exit (EXIT_FAILURE);
+                return -1;
             
             }
         
@@ -752,14 +768,15 @@ static void establish_bpb (void) {
     
     if (!cluster_count) {
     
-        report_at (program_name, 0, REPORT_ERROR, "Not enough clusters to make a viable filesystem");
-        
-        fclose (ofp);
-        remove (state->outfile);
+        if (!planning) {
+            report_at (program_name, 0, REPORT_ERROR, "Not enough clusters to make a viable filesystem");
+        }
         
-        exit (EXIT_FAILURE);
+        return -1;
     
     }
+    
+    return 0;
 
 }
 
@@ -806,8 +823,8 @@ static void add_volume_label (void) {
     de = (struct msdos_dirent *) scratch;
     memset (de, 0, sizeof (*de));
     
-    date = generate_datestamp ();
-    time = generate_timestamp ();
+    date = generate_datestamp (fixed_date ());
+    time = generate_timestamp (fixed_date ());
     
     memcpy (de->name, state->label, 11);
     de->attr = ATTR_VOLUME_ID;
@@ -883,8 +900,15 @@ static void wipe_target (void) {
 
 }
 
-static void write_reserved (void) {
+/**
+ * Lay out the reserved sectors in memory: the boot sector and, for FAT32,
+ * the info sector (recording free_clusters and next_cluster) and the
+ * backup boot sector.  The other reserved sectors are left zeroed.
+ */
+static unsigned char *build_reserved (unsigned int free_clusters, unsigned int next_cluster) {
 
+    unsigned char *buffer;
+    
     struct msdos_boot_sector bs;
     struct msdos_volume_info *vi = (state->size_fat == 32 ? &bs.fstype._fat32.vi : &bs.fstype._oldfat.vi);
     
@@ -953,7 +977,7 @@ static void write_reserved (void) {
     }
     
     if (bs.boot_jump[0] != 0xEB || bs.boot_jump[1] < 0x16 || bs.boot_jump[2] != 0x90) {
-        goto _write_reserved;
+        goto _copy_reserved;
     }
     
     memcpy (bs.system_id, "MSWIN4.1", 8);
@@ -969,7 +993,7 @@ static void write_reserved (void) {
     write721_to_byte_array (bs.sectors_per_fat16, sectors_per_fat);
     
     if (bs.boot_jump[1] < 0x22) {
-        goto _write_reserved;
+        goto _copy_reserved;
     }
     
     write721_to_byte_array (bs.sectors_per_track, sectors_per_track);
@@ -986,7 +1010,7 @@ static void write_reserved (void) {
     if (state->size_fat == 32) {
     
         if (bs.boot_jump[1] < 0x58) {
-            goto _write_reserved;
+            goto _copy_reserved;
         }
         
         write721_to_byte_array (bs.sectors_per_fat16, 0);
@@ -1006,7 +1030,7 @@ static void write_reserved (void) {
     } else {
     
         if (bs.boot_jump[1] < 0x3C) {
-            goto _write_reserved;
+            goto _copy_reserved;
         }
         
         vi->drive_no = (media_descriptor == 0xF8 ? 0x80 : 0x00);
@@ -1023,241 +1047,1751 @@ static void write_reserved (void) {
     
     }
 
-_write_reserved:
+_copy_reserved:
 
-    seekto (0);
-    
-    if (fwrite (&bs, sizeof (bs), 1, ofp) != 1) {
-    
-        report_at (program_name, 0, REPORT_ERROR, "Failed whilst writing %s", state->outfile);
-        
-        fclose (ofp);
-        remove (state->outfile);
-        
-        exit (EXIT_FAILURE);
-    
-    }
+    buffer = xmalloc (reserved_sectors * 512);
+    memcpy (buffer, &bs, sizeof (bs));
     
     if (state->size_fat == 32) {
     
         if (info_sector) {
         
-            struct fat32_fsinfo *info;
-            unsigned char *buffer;
-            
-            if (seekto (info_sector * 512)) {
-            
-                report_at (program_name, 0, REPORT_ERROR, "Failed whilst seeking %s", state->outfile);
-                
-                fclose (ofp);
-                remove (state->outfile);
-                
-                exit (EXIT_FAILURE);
-            
-            }
-            
-            if (!(buffer = (unsigned char *) malloc (512))) {
-            
-                report_at (program_name, 0, REPORT_ERROR, "Failed to allocate memory");
-                
-                fclose (ofp);
-                remove (state->outfile);
-                
-                exit (EXIT_FAILURE);
-            
-            }
-            
-            memset (buffer, 0, 512);
+            unsigned char *sector = buffer + (info_sector * 512);
             
             /** fsinfo structure is at offset 0x1e0 in info sector by observation. */
-            info = (struct fat32_fsinfo *) (buffer + 0x1e0);
+            struct fat32_fsinfo *info = (struct fat32_fsinfo *) (sector + 0x1e0);
             
             /** Info sector magic. */
-            buffer[0] = 'R';
-            buffer[1] = 'R';
-            buffer[2] = 'a';
-            buffer[3] = 'A';
+            sector[0] = 'R';
+            sector[1] = 'R';
+            sector[2] = 'a';
+            sector[3] = 'A';
             
             /** Magic for fsinfo structure. */
             write741_to_byte_array (info->signature, 0x61417272);
             
-            /** We've allocated cluster 2 for the root directory. */
-            write741_to_byte_array (info->free_clusters, cluster_count - 1);
-            write741_to_byte_array (info->next_cluster, 2);
+            write741_to_byte_array (info->free_clusters, free_clusters);
+            write741_to_byte_array (info->next_cluster, next_cluster);
             
             /** Info sector also must have boot sign. */
-            write721_to_byte_array (buffer + 0x1fe, 0xAA55);
-            
-            if (fwrite (buffer, 512, 1, ofp) != 1) {
-            
-                report_at (program_name, 0, REPORT_ERROR, "Failed whilst writing info sector");
-                free (buffer);
-                
-                fclose (ofp);
-                remove (state->outfile);
-                
-                exit (EXIT_FAILURE);
-            
-            }
-            
-            free (buffer);
+            write721_to_byte_array (sector + 0x1fe, 0xAA55);
         
         }
         
         if (backup_boot) {
-        
-            if (seekto (backup_boot * 512) || fwrite (&bs, sizeof (bs), 1, ofp) != 1) {
-            
-                report_at (program_name, 0, REPORT_ERROR, "Failed whilst writing info sector");
-                
-                fclose (ofp);
-                remove (state->outfile);
-                
-                exit (EXIT_FAILURE);
-            
-            }
-        
+            memcpy (buffer + (backup_boot * 512), &bs, sizeof (bs));
         }
     
     }
+    
+    return buffer;
 
 }
 
-int main (int argc, char **argv) {
+static void write_reserved (void) {
 
-    if (argc && *argv) {
+    /** We've allocated cluster 2 for the root directory. */
+    unsigned char *buffer = build_reserved (cluster_count - 1 - (unsigned int) nb_bad_clusters, 2);
     
-        char *p;
-        program_name = *argv;
+    if (seekto (0) || fwrite (buffer, 512, reserved_sectors, ofp) != reserved_sectors) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "Failed whilst writing %s", state->outfile);
+        free (buffer);
         
-        if ((p = strrchr (program_name, '/'))) {
-            program_name = (p + 1);
-        }
+        fclose (ofp);
+        remove (state->outfile);
+        
+        exit (EXIT_FAILURE);
     
     }
     
-    state = xmalloc (sizeof (*state));
-    parse_args (&argc, &argv, 1);
+    free (buffer);
+
+}
+
+/** Start from the defaults so that several filesystems can be made in one process. */
+static void reset_defaults (void) {
+
+    free (bad_clusters);
+    
+    bad_clusters = 0;
+    nb_bad_clusters = 0;
+    
+    align_structures = 1;
+    orphaned_sectors = 0;
+    
+    total_sectors = 0;
+    heads_per_cylinder = 255;
+    sectors_per_track = 63;
+    
+    backup_boot = 0;
+    cluster_count = 0;
+    hidden_sectors = 0;
+    info_sector = 0;
+    media_descriptor = 0xf8;
+    number_of_fats = 2;
+    reserved_sectors = 0;
+    root_cluster = 2;
+    root_entries = 512;
+    sectors_per_cluster = 4;
+    sectors_per_fat = 0;
+
+}
+
+/**
+ * Work out the layout establish_bpb gives a filesystem of state->blocks
+ * kilobytes without touching any file.  The reserved sectors, number of FATs
+ * and root directory entries are taken from geom where they are non-zero so
+ * that an existing volume's layout can be carried over.
+ */
+int compute_geometry (struct mkfs_geometry *geom) {
+
+    reset_defaults ();
     
-    if (!state->outfile) {
+    if (geom->reserved_sectors) {
+        reserved_sectors = geom->reserved_sectors;
+    }
     
-        report_at (program_name, 0, REPORT_ERROR, "no outfile file provided");
-        return EXIT_FAILURE;
+    if (geom->number_of_fats) {
+        number_of_fats = geom->number_of_fats;
+    }
     
+    if (geom->root_entries) {
+        root_entries = geom->root_entries;
     }
     
     image_size = state->blocks * 1024;
-    image_size += state->offset * 512;
     
-    if ((ofp = fopen (state->outfile, "r+b")) == NULL) {
+    if (establish_bpb () < 0) {
+        return -1;
+    }
     
-        size_t len;
-        void *zero;
-        
-        if ((ofp = fopen (state->outfile, "w+b")) == NULL) {
-        
-            report_at (program_name, 0, REPORT_ERROR, "failed to open '%s' for writing", state->outfile);
-            return EXIT_FAILURE;
-        
-        }
-        
-        len = image_size;
-        zero = xmalloc (512);
+    geom->total_sectors = (unsigned long) total_sectors;
+    geom->reserved_sectors = reserved_sectors;
+    geom->number_of_fats = number_of_fats;
+    geom->root_entries = root_entries;
+    geom->sectors_per_cluster = sectors_per_cluster;
+    geom->sectors_per_fat = sectors_per_fat;
+    geom->cluster_count = cluster_count;
+    
+    return 0;
+
+}
+
+#define     PLAN_CLUSTER_SIZES          8
+#define     PLAN_JOBS                   4
+
+/**
+ * What a host tree needs at each cluster size, index n being clusters of
+ * 512 << n bytes: the clusters its files and its directories (the root
+ * excepted) take, and the sectors its files' data actually fills.
+ */
+struct plan_usage {
+
+    unsigned long files, dirs, sectors, root_entries;
+    
+    unsigned long file_clusters[PLAN_CLUSTER_SIZES];
+    unsigned long dir_clusters[PLAN_CLUSTER_SIZES];
+
+};
+
+static unsigned long plan_dir_clusters (unsigned long entries, int n) {
+
+    unsigned long clusters = ((entries * 32) + (512UL << n) - 1) / (512UL << n);
+    return (clusters ? clusters : 1);
+
+}
+
+static void add_usage (const struct hosttree_node *node, struct plan_usage *usage) {
+
+    const struct hosttree_node *child;
+    size_t i;
+    int n;
+    
+    for (i = 0; i < node->nb_children; i++) {
+    
+        child = &node->children[i];
         
-        while (len > 0) {
+        if (child->is_dir) {
         
-            if (fwrite (zero, 512, 1, ofp) != 1) {
-            
-                report_at (program_name, 0, REPORT_ERROR, "failed whilst writing '%s'", state->outfile);
-                fclose (ofp);
-                
-                free (zero);
-                remove (state->outfile);
-                
-                return EXIT_FAILURE;
+            usage->dirs++;
             
+            /** Every directory but the root starts with "." and "..". */
+            for (n = 0; n < PLAN_CLUSTER_SIZES; n++) {
+                usage->dir_clusters[n] += plan_dir_clusters (child->nb_children + 2, n);
             }
             
-            len -= 512;
+            add_usage (child, usage);
+            continue;
         
         }
         
-        free (zero);
+        usage->files++;
+        usage->sectors += (child->size + 511) / 512;
+        
+        for (n = 0; n < PLAN_CLUSTER_SIZES; n++) {
+            usage->file_clusters[n] += (child->size + (512UL << n) - 1) / (512UL << n);
+        }
     
     }
+
+}
+
+/**
+ * The smallest size, in blocks, that establish_bpb turns into at least
+ * needed clusters of the given size and FAT type with room for the root
+ * entries, or 0 if there is none.  The first guess leaves out the
+ * alignment establish_bpb adds, so it is grown until it fits.
+ */
+static size_t plan_blocks (int size_fat, unsigned int spc, unsigned long needed, unsigned long root_entries, struct mkfs_geometry *geom) {
+
+    unsigned long fat, sectors;
+    size_t blocks;
+    int i;
     
-    if (image_size == 0) {
-    
-        fseek (ofp, 0, SEEK_END);
-        image_size = ftell (ofp);
+    if ((size_fat == 12 && needed > MAX_CLUST_12 - 16) || (size_fat == 16 && needed > MAX_CLUST_16 - 16) || (size_fat == 32 && needed > MAX_CLUST_32)) {
+        return 0;
+    }
     
+    if ((size_fat != 32 && root_entries > 512) || needed > (UINT_MAX - 65536) / spc) {
+        return 0;
     }
     
-    seekto (0);
+    state->size_fat = size_fat;
+    state->size_fat_by_user = 1;
+    state->sectors_per_cluster = (unsigned char) spc;
     
-    if (state->offset * 512 > image_size) {
+    fat = (((needed + 2) * size_fat / 8) + 511) / 512;
+    sectors = (size_fat == 32 ? 32 : 1 + 32) + 2 * fat + needed * spc;
     
-        report_at (program_name, 0, REPORT_ERROR, "size (%lu) of %s is less than the requested offset (%lu)", image_size, state->outfile, state->offset * 512);
+    blocks = (sectors + 1) / 2;
+    
+    for (i = 0; i < 16; i++) {
+    
+        memset (geom, 0, sizeof (*geom));
+        state->blocks = blocks;
         
-        fclose (ofp);
-        remove (state->outfile);
+        if (compute_geometry (geom) < 0 || geom->sectors_per_cluster != spc) {
+            return 0;
+        }
         
-        return EXIT_FAILURE;
+        if (geom->cluster_count >= needed && (size_fat == 32 || geom->root_entries >= root_entries)) {
+            return blocks;
+        }
+        
+        if (geom->cluster_count < needed) {
+            blocks += ((needed - geom->cluster_count) * spc + 1) / 2;
+        } else {
+            blocks++;
+        }
     
     }
     
-    image_size -= state->offset * 512;
+    return 0;
+
+}
+
+/**
+ * Choose the size, FAT type and cluster size for the host tree at
+ * state->fit_dir.  The tree is scanned once (in parallel) and the clusters
+ * its files and directories need are added up for every cluster size; each
+ * cluster size and FAT type the user left open is then run through
+ * establish_bpb, and the smallest image wins, which is the one with the
+ * least slack plus FAT.  Ties go to the larger cluster for a smaller FAT.
+ */
+static int plan_filesystem (void) {
+
+    struct hosttree_node *root;
+    struct mkfs_geometry geom;
+    struct plan_usage usage;
+    
+    int user_fat = (state->size_fat_by_user ? state->size_fat : 0), user_spc = state->sectors_per_cluster, verbose = state->verbose;
+    int best_fat = 0, size_fat, n;
+    
+    unsigned int best_spc = 0, spc;
+    unsigned long needed;
+    
+    size_t best_blocks = 0, blocks;
     
     if (state->blocks) {
     
-        if (state->blocks * 1024 > image_size) {
-        
-            report_at (program_name, 0, REPORT_ERROR, "size (%lu) of %s is less than the requested size (%lu)", image_size, state->outfile, state->blocks * 1024);
-            
-            fclose (ofp);
-            remove (state->outfile);
-            
-            return EXIT_FAILURE;
-        
-        }
-        
-        image_size = state->blocks * 1024;
+        report_at (program_name, 0, REPORT_ERROR, "--blocks cannot be used with --fit or --plan");
+        return -1;
     
     }
     
-    orphaned_sectors = (image_size % 1024) / 512;
+    if (!(root = hosttree_scan (state->fit_dir, state->jobs ? state->jobs : PLAN_JOBS))) {
     
-    establish_bpb ();
-    wipe_target ();
+        report_at (program_name, 0, REPORT_ERROR, "failed to read '%s'", state->fit_dir);
+        return -1;
     
-    write_reserved ();
+    }
     
-    if (set_fat_entry (0, 0xFFFFFF00 | media_descriptor) < 0 || set_fat_entry (1, 0xFFFFFFFF) < 0) {
+    memset (&usage, 0, sizeof (usage));
+    add_usage (root, &usage);
     
-        report_at (program_name, 0, REPORT_ERROR, "Failed whilst setting FAT entry");
-        
-        fclose (ofp);
-        remove (state->outfile);
-        
-        return EXIT_FAILURE;
+    usage.root_entries = root->nb_children + (memcmp (state->label, "NO NAME    ", 11) != 0);
     
+    if (state->source_dir && strcmp (state->source_dir, state->fit_dir) == 0 && !state->plan_only) {
+        source_tree = root;
+    } else {
+        hosttree_free (root);
     }
     
-    if (state->size_fat == 32) {
+    if (state->plan_only) {
     
-        if (set_fat_entry (2, 0x0FFFFFF8) < 0) {
+        printf ("%s: %lu files, %lu directories, %lu KiB of data\n\n", state->fit_dir, usage.files, usage.dirs, (usage.sectors + 1) / 2);
+        printf ("    FAT   cluster    clusters   slack KiB     FAT KiB      blocks\n");
+    
+    }
+    
+    /** establish_bpb's own reasoning is noise while every layout is tried. */
+    state->verbose = 0;
+    planning = 1;
+    
+    for (n = 0; n < PLAN_CLUSTER_SIZES; n++) {
+    
+        spc = 1U << n;
         
-            report_at (program_name, 0, REPORT_ERROR, "Failed whilst setting FAT entry");
+        if (user_spc && (unsigned int) user_spc != spc) {
+            continue;
+        }
+        
+        for (size_fat = 12; size_fat <= 32; size_fat = (size_fat == 12 ? 16 : size_fat * 2)) {
+        
+            if (user_fat && user_fat != size_fat) {
+                continue;
+            }
             
-            fclose (ofp);
-            remove (state->outfile);
+            needed = usage.file_clusters[n] + usage.dir_clusters[n];
             
-            return EXIT_FAILURE;
+            if (size_fat == 32) {
+            
+                needed += plan_dir_clusters (usage.root_entries, n);
+                
+                /** Unless asked for, FAT32 is only used with as many clusters as the specification wants. */
+                if (!user_fat && needed < MIN_CLUST_32) {
+                    needed = MIN_CLUST_32;
+                }
+            
+            } else if (size_fat == 16 && needed < MIN_CLUST_16) {
+                needed = MIN_CLUST_16;
+            }
+            
+            if (!(blocks = plan_blocks (size_fat, spc, needed, usage.root_entries, &geom))) {
+                continue;
+            }
+            
+            if (state->plan_only) {
+                printf ("    %-2d  %7u  %10u  %10lu  %10lu  %10lu\n", size_fat, spc * 512, geom.cluster_count, (usage.file_clusters[n] * spc - usage.sectors) / 2, ((unsigned long) geom.sectors_per_fat * geom.number_of_fats + 1) / 2, (unsigned long) blocks);
+            }
+            
+            if (!best_blocks || blocks < best_blocks || (blocks == best_blocks && spc > best_spc)) {
+            
+                best_blocks = blocks;
+                best_fat = size_fat;
+                best_spc = spc;
+            
+            }
         
         }
     
     }
     
+    state->verbose = verbose;
+    planning = 0;
+    
+    if (!best_blocks) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "no FAT layout can hold '%s'", state->fit_dir);
+        return -1;
+    
+    }
+    
+    state->size_fat = best_fat;
+    state->size_fat_by_user = 1;
+    state->sectors_per_cluster = (unsigned char) best_spc;
+    state->blocks = best_blocks;
+    
+    if (state->plan_only) {
+        printf ("\nplan: -F %d -s %u --blocks %lu\n", best_fat, best_spc, (unsigned long) best_blocks);
+    } else if (state->verbose) {
+        fprintf (stderr, "Fitting %s: FAT%d, %u sectors per cluster, %lu blocks\n", state->fit_dir, best_fat, best_spc, (unsigned long) best_blocks);
+    }
+    
+    return 0;
+
+}
+
+#define     BUILD_BUFFER_SIZE           (1024UL * 1024)
+#define     BUILD_SPARSE_SIZE           (64UL * 1024)
+
+/**
+ * A directory or file of the source tree and the run of clusters it is
+ * given.  Items are kept in the order their clusters were handed out, so
+ * walking them writes the data area front to back.  A directory also keeps
+ * its parent's first cluster and the 8.3 name and first cluster of each of
+ * its children's entries.
+ */
+struct build_item {
+
+    const struct hosttree_node *node;
+    unsigned int first, count, parent;
+    
+    unsigned char *names;
+    unsigned int *firsts;
+
+};
+
+struct build_state {
+
+    struct build_item *items;
+    size_t nb_items, nb_alloc;
+    
+    unsigned int cluster_size, next_cluster, limit;
+    
+    unsigned char *buffer;
+    unsigned long fill, written;
+    
+    /**
+     * With sparse set the output is known to read back as zeros, so
+     * BUILD_SPARSE_SIZE blocks that are all zero are seeked over instead of
+     * written; hole records that the last block was.
+     */
+    int sparse, hole;
+
+};
+
+/** Turn a host name into its 8.3 directory form, failing for names that have none. */
+static int host_to_dir (unsigned char *dest, const char *src) {
+
+    static const char invalid_chars[] = "\"*+,./:;<=>?[\\]|";
+    
+    int c, i, j = 0, dots = 0, len = 0;
+    memset (dest, ' ', 11);
+    
+    if (*src == '\0' || *src == '.') {
+        return -1;
+    }
+    
+    for (i = 0; src[i] != '\0'; i++) {
+    
+        c = (unsigned char) src[i];
+        
+        if (c == '.') {
+        
+            if (dots++) {
+                return -1;
+            }
+            
+            j = 8;
+            len = 0;
+            
+            continue;
+        
+        }
+        
+        if (c <= 0x20 || strchr (invalid_chars, c) || ++len > (dots ? 3 : 8)) {
+            return -1;
+        }
+        
+        if (i == 0 && c == 0xE5) {
+            c = 0x05;
+        } else if (c >= 'a' && c <= 'z') {
+            c -= 'a' - 'A';
+        }
+        
+        dest[j++] = (unsigned char) c;
+    
+    }
+    
+    return 0;
+
+}
+
+static int compare_dir_names (const void *a, const void *b) {
+    return memcmp (*(const unsigned char *const *) a, *(const unsigned char *const *) b, 11);
+}
+
+static unsigned int build_dir_clusters (struct build_state *b, unsigned long entries) {
+
+    unsigned long clusters = ((entries * 32) + b->cluster_size - 1) / b->cluster_size;
+    return (unsigned int) (clusters ? clusters : 1);
+
+}
+
+/** Append an item, giving it the next count clusters. */
+static int add_item (struct build_state *b, const struct hosttree_node *node, unsigned long count, unsigned int parent) {
+
+    struct build_item *item;
+    
+    if (count > b->limit - b->next_cluster) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "'%s' does not fit in the filesystem", state->source_dir);
+        return -1;
+    
+    }
+    
+    if (b->nb_items == b->nb_alloc) {
+    
+        b->nb_alloc = (b->nb_alloc ? b->nb_alloc * 2 : 64);
+        b->items = xrealloc (b->items, b->nb_alloc * sizeof (*b->items));
+    
+    }
+    
+    item = &b->items[b->nb_items++];
+    memset (item, 0, sizeof (*item));
+    
+    item->node = node;
+    item->count = (unsigned int) count;
+    item->parent = parent;
+    
+    if (count) {
+    
+        item->first = b->next_cluster;
+        b->next_cluster += (unsigned int) count;
+    
+    }
+    
+    return 0;
+
+}
+
+/**
+ * Give the children of the directory at index their entries and clusters:
+ * the files first, straight after the directory itself, then each
+ * subdirectory followed by everything below it.
+ */
+static int layout_dir (struct build_state *b, size_t index) {
+
+    const struct hosttree_node *node = b->items[index].node, *child;
+    unsigned int parent = (index ? b->items[index].first : 0);
+    
+    unsigned char *names, **sorted;
+    unsigned int *firsts;
+    
+    size_t i;
+    
+    names = xmalloc (node->nb_children * 11 + 1);
+    firsts = xmalloc ((node->nb_children + 1) * sizeof (*firsts));
+    
+    b->items[index].names = names;
+    b->items[index].firsts = firsts;
+    
+    sorted = xmalloc ((node->nb_children + 1) * sizeof (*sorted));
+    
+    for (i = 0; i < node->nb_children; i++) {
+    
+        if (host_to_dir (names + (i * 11), node->children[i].name) < 0) {
+        
+            report_at (program_name, 0, REPORT_ERROR, "'%s' has no 8.3 name", node->children[i].path);
+            
+            free (sorted);
+            return -1;
+        
+        }
+        
+        sorted[i] = names + (i * 11);
+    
+    }
+    
+    /** Host names that differ only in case would end up as the same entry. */
+    qsort (sorted, node->nb_children, sizeof (*sorted), compare_dir_names);
+    
+    for (i = 1; i < node->nb_children; i++) {
+    
+        if (memcmp (sorted[i - 1], sorted[i], 11) == 0) {
+        
+            report_at (program_name, 0, REPORT_ERROR, "'%s' clashes with another name in the same directory", node->children[(sorted[i] - names) / 11].path);
+            
+            free (sorted);
+            return -1;
+        
+        }
+    
+    }
+    
+    free (sorted);
+    
+    for (i = 0; i < node->nb_children; i++) {
+    
+        child = &node->children[i];
+        
+        if (child->is_dir || child->size == 0) {
+            continue;
+        }
+        
+        if (child->size > 0xFFFFFFFFUL) {
+        
+            report_at (program_name, 0, REPORT_ERROR, "'%s' is too large for a FAT filesystem", child->path);
+            return -1;
+        
+        }
+        
+        if (add_item (b, child, (child->size + b->cluster_size - 1) / b->cluster_size, 0) < 0) {
+            return -1;
+        }
+        
+        firsts[i] = b->items[b->nb_items - 1].first;
+    
+    }
+    
+    for (i = 0; i < node->nb_children; i++) {
+    
+        child = &node->children[i];
+        
+        if (!child->is_dir) {
+            continue;
+        }
+        
+        if (child->nb_children + 2 > 65536) {
+        
+            report_at (program_name, 0, REPORT_ERROR, "'%s' has too many entries for a FAT directory", child->path);
+            return -1;
+        
+        }
+        
+        if (add_item (b, child, build_dir_clusters (b, child->nb_children + 2), parent) < 0) {
+            return -1;
+        }
+        
+        firsts[i] = b->items[b->nb_items - 1].first;
+        
+        if (layout_dir (b, b->nb_items - 1) < 0) {
+            return -1;
+        }
+    
+    }
+    
+    return 0;
+
+}
+
+static void put_fat (unsigned char *fat, unsigned int cluster, unsigned int value) {
+
+    unsigned long offset;
+    
+    if (state->size_fat == 12) {
+    
+        offset = cluster + (cluster / 2);
+        
+        if (cluster & 1) {
+        
+            fat[offset] = (unsigned char) ((fat[offset] & 0x0F) | ((value & 0x0F) << 4));
+            fat[offset + 1] = (unsigned char) ((value >> 4) & 0xFF);
+        
+        } else {
+        
+            fat[offset] = (unsigned char) (value & 0xFF);
+            fat[offset + 1] = (unsigned char) ((fat[offset + 1] & 0xF0) | ((value >> 8) & 0x0F));
+        
+        }
+    
+    } else if (state->size_fat == 16) {
+        write721_to_byte_array (fat + (cluster * 2), (unsigned short) (value & 0xFFFF));
+    } else {
+        write741_to_byte_array (fat + ((unsigned long) cluster * 4), value & 0x0FFFFFFF);
+    }
+
+}
+
+static void fill_entry (struct msdos_dirent *de, const unsigned char *name, unsigned char attr, unsigned int cluster, unsigned long size, time_t mtime) {
+
+    unsigned short date, time;
+    dos_stamp_from_time (mtime, fixed_date (), &date, &time);
+    
+    memcpy (de->name, name, 11);
+    de->attr = attr;
+    
+    write721_to_byte_array (de->startlo, (unsigned short) (cluster & 0xFFFF));
+    write721_to_byte_array (de->starthi, (unsigned short) (cluster >> 16));
+    write741_to_byte_array (de->size, (unsigned int) size);
+    
+    write721_to_byte_array (de->ctime, time);
+    write721_to_byte_array (de->cdate, date);
+    write721_to_byte_array (de->adate, date);
+    write721_to_byte_array (de->time, time);
+    write721_to_byte_array (de->date, date);
+
+}
+
+/** Write the entries of the directory at index into data, which is zeroed. */
+static void render_dir (struct build_state *b, size_t index, unsigned char *data) {
+
+    const struct build_item *item = &b->items[index];
+    const struct hosttree_node *node = item->node, *child;
+    
+    struct msdos_dirent *de = (struct msdos_dirent *) data;
+    size_t i;
+    
+    if (index) {
+    
+        fill_entry (de++, (const unsigned char *) ".          ", ATTR_DIR, item->first, 0, node->mtime);
+        fill_entry (de++, (const unsigned char *) "..         ", ATTR_DIR, item->parent, 0, node->mtime);
+    
+    } else if (memcmp (state->label, "NO NAME    ", 11) != 0) {
+    
+        unsigned short date = generate_datestamp (fixed_date ());
+        unsigned short time = generate_timestamp (fixed_date ());
+        
+        memcpy (de->name, state->label, 11);
+        de->attr = ATTR_VOLUME_ID;
+        
+        write721_to_byte_array (de->ctime, time);
+        write721_to_byte_array (de->cdate, date);
+        write721_to_byte_array (de->adate, date);
+        write721_to_byte_array (de->time, time);
+        write721_to_byte_array (de->date, date);
+        
+        de++;
+    
+    }
+    
+    for (i = 0; i < node->nb_children; i++) {
+    
+        child = &node->children[i];
+        fill_entry (de++, item->names + (i * 11), child->is_dir ? ATTR_DIR : ATTR_ARCHIVE, item->firsts[i], child->is_dir ? 0 : child->size, child->mtime);
+    
+    }
+
+}
+
+static int is_zero (const unsigned char *p, unsigned long len) {
+
+    while (len > 0 && *p == 0) {
+    
+        p++;
+        len--;
+    
+    }
+    
+    return (len == 0);
+
+}
+
+static int build_emit (struct build_state *b, const unsigned char *p, unsigned long len) {
+
+    unsigned long n;
+    
+    while (len > 0) {
+    
+        n = (b->sparse && len > BUILD_SPARSE_SIZE ? BUILD_SPARSE_SIZE : len);
+        
+        if (b->sparse && is_zero (p, n)) {
+        
+            if (fseek (ofp, (long) n, SEEK_CUR)) {
+                goto _error;
+            }
+            
+            b->hole = 1;
+        
+        } else {
+        
+            if (fwrite (p, 1, n, ofp) != n) {
+                goto _error;
+            }
+            
+            b->hole = 0;
+        
+        }
+        
+        b->written += n;
+        
+        p += n;
+        len -= n;
+    
+    }
+    
+    return 0;
+
+_error:
+
+    report_at (program_name, 0, REPORT_ERROR, "failed whilst writing '%s'", state->outfile);
+    return -1;
+
+}
+
+static int build_flush (struct build_state *b) {
+
+    if (b->fill && build_emit (b, b->buffer, b->fill) < 0) {
+        return -1;
+    }
+    
+    b->fill = 0;
+    return 0;
+
+}
+
+/**
+ * Queue len bytes (or zeros, if data is null) for the image.  Output goes
+ * out in BUILD_BUFFER_SIZE writes; anything that large is written directly
+ * when nothing is queued.
+ */
+static int build_write (struct build_state *b, const void *data, unsigned long len) {
+
+    const unsigned char *p = (const unsigned char *) data;
+    unsigned long n;
+    
+    if (p && !b->fill && len >= BUILD_BUFFER_SIZE) {
+        return build_emit (b, p, len);
+    }
+    
+    if (!p && b->sparse && len >= BUILD_BUFFER_SIZE) {
+    
+        if (build_flush (b) < 0) {
+            return -1;
+        }
+        
+        while (len > 0) {
+        
+            n = (len > BUILD_BUFFER_SIZE * 1024 ? BUILD_BUFFER_SIZE * 1024 : len);
+            
+            if (fseek (ofp, (long) n, SEEK_CUR)) {
+            
+                report_at (program_name, 0, REPORT_ERROR, "failed whilst writing '%s'", state->outfile);
+                return -1;
+            
+            }
+            
+            b->written += n;
+            b->hole = 1;
+            
+            len -= n;
+        
+        }
+        
+        return 0;
+    
+    }
+    
+    while (len > 0) {
+    
+        if ((n = BUILD_BUFFER_SIZE - b->fill) > len) {
+            n = len;
+        }
+        
+        if (p) {
+        
+            memcpy (b->buffer + b->fill, p, n);
+            p += n;
+        
+        } else {
+            memset (b->buffer + b->fill, 0, n);
+        }
+        
+        b->fill += n;
+        len -= n;
+        
+        if (b->fill == BUILD_BUFFER_SIZE && build_flush (b) < 0) {
+            return -1;
+        }
+    
+    }
+    
+    return 0;
+
+}
+
+/** Read the file at index straight into the output buffer and pad it to whole clusters. */
+static int build_file (struct build_state *b, size_t index) {
+
+    const struct build_item *item = &b->items[index];
+    unsigned long left = item->node->size, n;
+    
+    FILE *ifp;
+    
+    if (!(ifp = fopen (item->node->path, "rb"))) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "faild to open '%s' for reading", item->node->path);
+        return -1;
+    
+    }
+    
+    while (left > 0) {
+    
+        if ((n = BUILD_BUFFER_SIZE - b->fill) > left) {
+            n = left;
+        }
+        
+        if (fread (b->buffer + b->fill, 1, n, ifp) != n) {
+        
+            report_at (program_name, 0, REPORT_ERROR, "failed whilst reading '%s'", item->node->path);
+            
+            fclose (ifp);
+            return -1;
+        
+        }
+        
+        b->fill += n;
+        left -= n;
+        
+        if (b->fill == BUILD_BUFFER_SIZE && build_flush (b) < 0) {
+        
+            fclose (ifp);
+            return -1;
+        
+        }
+    
+    }
+    
+    fclose (ifp);
+    return build_write (b, 0, ((unsigned long) item->count * b->cluster_size) - item->node->size);
+
+}
+
+/**
+ * Start the output: a stream gets the leading --offset sectors as zeros,
+ * a file is positioned at the start of the filesystem.
+ */
+static int build_begin (struct build_state *b, int created, int streaming) {
+
+    b->buffer = xmalloc (BUILD_BUFFER_SIZE);
+    
+    if (streaming) {
+    
+        /** Output that can be seeked and is still empty reads back as zeros wherever it is not written. */
+        b->sparse = (fseek (ofp, 0, SEEK_END) == 0 && ftell (ofp) == 0);
+        return build_write (b, 0, state->offset * 512);
+    
+    }
+    
+    b->sparse = created;
+    
+    if (seekto (0)) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "failed whilst seeking '%s'", state->outfile);
+        return -1;
+    
+    }
+    
+    b->written = state->offset * 512;
+    return 0;
+
+}
+
+/** Carry a stream or a new file on to its full size and flush it. */
+static int build_finish (struct build_state *b, int created, int streaming) {
+
+    if (streaming || created) {
+    
+        if (build_write (b, 0, state->offset * 512 + image_size - (b->written + b->fill)) < 0 || build_flush (b) < 0) {
+            return -1;
+        }
+        
+        /** A hole at the very end does not make the file any longer. */
+        if (b->hole && (fseek (ofp, -1, SEEK_CUR) || fputc (0, ofp) == EOF)) {
+        
+            report_at (program_name, 0, REPORT_ERROR, "failed whilst writing '%s'", state->outfile);
+            return -1;
+        
+        }
+    
+    } else if (build_flush (b) < 0) {
+        return -1;
+    }
+    
+    if (fflush (ofp)) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "failed whilst writing '%s'", state->outfile);
+        return -1;
+    
+    }
+    
+    return 0;
+
+}
+
+/**
+ * Make the filesystem, holding a copy of state->source_dir if there is one.
+ * Every directory, FAT chain and file extent is laid out in memory first,
+ * with each file and directory given one contiguous run; the image is then
+ * written in a single sequential pass from the boot sector to the last
+ * used cluster.  Clusters past that are left as they are in an existing
+ * file, while a stream (or a file just created) is carried on to its full
+ * size, as holes where the output allows them.
+ */
+static int build_filesystem (int created, int streaming) {
+
+    struct hosttree_node empty, *root = &empty;
+    struct build_state b;
+    
+    unsigned char *fat = 0, *reserved = 0, *data;
+    unsigned long entries, size;
+    
+    size_t i, files = 0, dirs = 0;
+    unsigned int cluster;
+    
+    int result = -1;
+    
+    memset (&empty, 0, sizeof (empty));
+    empty.is_dir = 1;
+    
+    if (state->source_dir && !source_tree && !(source_tree = hosttree_scan (state->source_dir, state->jobs ? state->jobs : PLAN_JOBS))) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "failed to read '%s'", state->source_dir);
+        return -1;
+    
+    }
+    
+    if (source_tree) {
+        root = source_tree;
+    }
+    
+    memset (&b, 0, sizeof (b));
+    
+    b.cluster_size = sectors_per_cluster * 512;
+    b.next_cluster = 2;
+    b.limit = cluster_count + 2;
+    
+    entries = root->nb_children + (memcmp (state->label, "NO NAME    ", 11) != 0);
+    
+    if (state->size_fat != 32 && entries > root_entries) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "'%s' has more than the %u entries the root directory holds", state->source_dir, root_entries);
+        goto _done;
+    
+    }
+    
+    if (add_item (&b, root, state->size_fat == 32 ? build_dir_clusters (&b, entries) : 0, 0) < 0 || layout_dir (&b, 0) < 0) {
+        goto _done;
+    }
+    
+    fat = xmalloc (sectors_per_fat * 512);
+    
+    put_fat (fat, 0, 0xFFFFFF00 | media_descriptor);
+    put_fat (fat, 1, 0xFFFFFFFF);
+    
+    for (i = 0; i < b.nb_items; i++) {
+    
+        if (!b.items[i].count) {
+            continue;
+        }
+        
+        for (cluster = b.items[i].first; cluster < b.items[i].first + b.items[i].count - 1; cluster++) {
+            put_fat (fat, cluster, cluster + 1);
+        }
+        
+        put_fat (fat, cluster, 0x0FFFFFF8);
+    
+    }
+    
+    reserved = build_reserved (cluster_count - (b.next_cluster - 2), b.next_cluster - 1);
+    
+    if (build_begin (&b, created, streaming) < 0) {
+        goto _done;
+    }
+    
+    if (build_write (&b, reserved, reserved_sectors * 512) < 0) {
+        goto _done;
+    }
+    
+    for (i = 0; i < number_of_fats; i++) {
+    
+        if (build_write (&b, fat, sectors_per_fat * 512) < 0) {
+            goto _done;
+        }
+    
+    }
+    
+    if (state->size_fat != 32) {
+    
+        data = xmalloc (root_entries * 32);
+        render_dir (&b, 0, data);
+        
+        if (build_write (&b, data, root_entries * 32) < 0) {
+        
+            free (data);
+            goto _done;
+        
+        }
+        
+        free (data);
+    
+    }
+    
+    for (i = 0; i < b.nb_items; i++) {
+    
+        if (!b.items[i].count) {
+            continue;
+        }
+        
+        if (b.items[i].node->is_dir) {
+        
+            size = (unsigned long) b.items[i].count * b.cluster_size;
+            
+            data = xmalloc (size);
+            render_dir (&b, i, data);
+            
+            if (build_write (&b, data, size) < 0) {
+            
+                free (data);
+                goto _done;
+            
+            }
+            
+            free (data);
+            dirs++;
+        
+        } else {
+        
+            if (build_file (&b, i) < 0) {
+                goto _done;
+            }
+            
+            files++;
+        
+        }
+    
+    }
+    
+    if (build_finish (&b, created, streaming) < 0) {
+        goto _done;
+    }
+    
+    if (state->verbose && state->source_dir) {
+        fprintf (stderr, "Copied %lu files and %lu directories from %s into %u clusters\n", (unsigned long) files, (unsigned long) dirs, state->source_dir, b.next_cluster - 2);
+    }
+    
+    result = 0;
+
+_done:
+
+    for (i = 0; i < b.nb_items; i++) {
+    
+        free (b.items[i].names);
+        free (b.items[i].firsts);
+    
+    }
+    
+    free (b.items);
+    free (b.buffer);
+    
+    free (reserved);
+    free (fat);
+    
+    hosttree_free (source_tree);
+    source_tree = 0;
+    
+    return result;
+
+}
+
+#define     TEMPLATE_MAGIC              "MKFSTPL1"
+#define     TEMPLATE_HEADER_SIZE        64
+
+static unsigned int read741 (const unsigned char *src) {
+    return (unsigned int) src[0] | ((unsigned int) src[1] << 8) | ((unsigned int) src[2] << 16) | ((unsigned int) src[3] << 24);
+}
+
+/**
+ * The formatted metadata of an empty filesystem: the reserved sectors, the
+ * FATs and the root directory (the first cluster, for FAT32).  Nothing in
+ * it depends on the image it goes into except what stamp_metadata fills in.
+ */
+static unsigned char *format_metadata (unsigned long *psize) {
+
+    unsigned long fat_size = (unsigned long) sectors_per_fat * 512, size;
+    unsigned char *region, *reserved, *fat;
+    
+    unsigned int i;
+    
+    size = (reserved_sectors * 512) + (number_of_fats * fat_size);
+    size += (state->size_fat == 32 ? sectors_per_cluster * 512 : root_entries * 32);
+    
+    region = xmalloc (size);
+    
+    reserved = build_reserved (cluster_count - 1, 2);
+    memcpy (region, reserved, reserved_sectors * 512);
+    
+    free (reserved);
+    fat = region + (reserved_sectors * 512);
+    
+    put_fat (fat, 0, 0xFFFFFF00 | media_descriptor);
+    put_fat (fat, 1, 0xFFFFFFFF);
+    
+    if (state->size_fat == 32) {
+        put_fat (fat, 2, 0x0FFFFFF8);
+    }
+    
+    for (i = 1; i < number_of_fats; i++) {
+        memcpy (fat + (i * fat_size), fat, fat_size);
+    }
+    
+    *psize = size;
+    return region;
+
+}
+
+/** Fill in what differs from one image to the next: the hidden sectors, volume id and label, in the boot sectors and the root directory. */
+static void stamp_metadata (unsigned char *region) {
+
+    struct msdos_boot_sector *bs = (struct msdos_boot_sector *) region;
+    struct msdos_volume_info *vi = (state->size_fat == 32 ? &bs->fstype._fat32.vi : &bs->fstype._oldfat.vi);
+    
+    struct msdos_dirent *de = (struct msdos_dirent *) (region + ((reserved_sectors + (number_of_fats * sectors_per_fat)) * 512));
+    unsigned short date, time;
+    
+    write741_to_byte_array (bs->hidden_sectors, (unsigned int) state->offset);
+    
+    write741_to_byte_array (vi->volume_id, generate_volume_id ());
+    memcpy (vi->volume_label, state->label, 11);
+    
+    if (state->size_fat == 32 && backup_boot) {
+        memcpy (region + (backup_boot * 512), region, 512);
+    }
+    
+    memset (de, 0, sizeof (*de));
+    
+    if (memcmp (state->label, "NO NAME    ", 11) == 0) {
+        return;
+    }
+    
+    date = generate_datestamp (fixed_date ());
+    time = generate_timestamp (fixed_date ());
+    
+    memcpy (de->name, state->label, 11);
+    de->attr = ATTR_VOLUME_ID;
+    
+    write721_to_byte_array (de->ctime, time);
+    write721_to_byte_array (de->cdate, date);
+    write721_to_byte_array (de->adate, date);
+    write721_to_byte_array (de->time, time);
+    write721_to_byte_array (de->date, date);
+
+}
+
+/**
+ * The cache file for this format, named after what decides the layout:
+ * the size in sectors and the FAT type and cluster size asked for (0 when
+ * left to establish_bpb).
+ */
+static char *template_path (void) {
+
+    char *path = xmalloc (strlen (state->template_dir) + 64);
+    
+    sprintf (path, "%s/%lu-%d-%u.tpl", state->template_dir, (unsigned long) (image_size / 512) + orphaned_sectors, state->size_fat_by_user ? state->size_fat : 0, (unsigned int) state->sectors_per_cluster);
+    return path;
+
+}
+
+static void template_key (unsigned char *header) {
+
+    memset (header, 0, TEMPLATE_HEADER_SIZE);
+    memcpy (header, TEMPLATE_MAGIC, 8);
+    
+    write741_to_byte_array (header + 8, (unsigned int) ((image_size / 512) + orphaned_sectors));
+    write741_to_byte_array (header + 12, state->size_fat_by_user ? state->size_fat : 0);
+    write741_to_byte_array (header + 16, state->sectors_per_cluster);
+
+}
+
+/** Load a cached format and the geometry stamp_metadata needs, or return null. */
+static unsigned char *load_template (const char *path, unsigned long *psize) {
+
+    unsigned char header[TEMPLATE_HEADER_SIZE], key[TEMPLATE_HEADER_SIZE];
+    unsigned char *region;
+    
+    unsigned long size;
+    FILE *fp;
+    
+    if (!(fp = fopen (path, "rb"))) {
+        return 0;
+    }
+    
+    template_key (key);
+    
+    if (fread (header, TEMPLATE_HEADER_SIZE, 1, fp) != 1 || memcmp (header, key, 20) != 0) {
+    
+        fclose (fp);
+        return 0;
+    
+    }
+    
+    size = read741 (header + 40);
+    
+    /** A FAT32 region can be large; anything that does not fit in memory is simply rebuilt. */
+    if (!size || !(region = malloc (size))) {
+    
+        fclose (fp);
+        return 0;
+    
+    }
+    
+    if (fread (region, size, 1, fp) != 1) {
+    
+        free (region);
+        fclose (fp);
+        
+        return 0;
+    
+    }
+    
+    fclose (fp);
+    
+    state->size_fat = (int) read741 (header + 20);
+    sectors_per_cluster = read741 (header + 24);
+    reserved_sectors = read741 (header + 28);
+    number_of_fats = read741 (header + 32);
+    sectors_per_fat = read741 (header + 36);
+    backup_boot = read741 (header + 44);
+    cluster_count = read741 (header + 48);
+    total_sectors = (long) read741 (header + 52);
+    
+    *psize = size;
+    return region;
+
+}
+
+/**
+ * Save a format for later runs.  It is written under a name of its own and
+ * renamed into place, so formats running side by side never see half a
+ * template.  Failing to save only costs the next run the work.
+ */
+static void save_template (const char *path, const unsigned char *region, unsigned long size) {
+
+    unsigned char header[TEMPLATE_HEADER_SIZE];
+    char *temp = xmalloc (strlen (path) + 32);
+    
+    FILE *fp;
+    
+#if     defined (__GNUC__) && !defined (__PDOS__)
+    sprintf (temp, "%s.%ld", path, (long) getpid ());
+#else
+    sprintf (temp, "%s.new", path);
+#endif
+    
+    template_key (header);
+    
+    write741_to_byte_array (header + 20, state->size_fat);
+    write741_to_byte_array (header + 24, sectors_per_cluster);
+    write741_to_byte_array (header + 28, reserved_sectors);
+    write741_to_byte_array (header + 32, number_of_fats);
+    write741_to_byte_array (header + 36, sectors_per_fat);
+    write741_to_byte_array (header + 40, size);
+    write741_to_byte_array (header + 44, backup_boot);
+    write741_to_byte_array (header + 48, cluster_count);
+    write741_to_byte_array (header + 52, total_sectors);
+    
+    if (!(fp = fopen (temp, "wb"))) {
+    
+        report_at (program_name, 0, REPORT_WARNING, "unable to save template '%s'", path);
+        
+        free (temp);
+        return;
+    
+    }
+    
+    if (fwrite (header, TEMPLATE_HEADER_SIZE, 1, fp) != 1 || fwrite (region, size, 1, fp) != 1 || fclose (fp) != 0) {
+    
+        report_at (program_name, 0, REPORT_WARNING, "unable to save template '%s'", path);
+        remove (temp);
+        
+        free (temp);
+        return;
+    
+    }
+    
+    remove (path);
+    
+    if (rename (temp, path) != 0) {
+        remove (temp);
+    }
+    
+    free (temp);
+
+}
+
+/**
+ * Format from the template cache in state->template_dir.  A hit skips
+ * establish_bpb and rebuilding the metadata altogether: the cached region
+ * is stamped with this image's volume id and label and written out in one
+ * go.  A miss formats as usual and saves the region for next time.
+ */
+static int template_format (int created, int streaming) {
+
+    struct build_state b;
+    
+    unsigned char *region;
+    unsigned long size;
+    
+    char *path = template_path ();
+    int result = -1;
+    
+    if ((region = load_template (path, &size))) {
+    
+        if (state->verbose) {
+            fprintf (stderr, "Using template %s\n", path);
+        }
+    
+    } else {
+    
+        if (establish_bpb () < 0) {
+        
+            free (path);
+            return -1;
+        
+        }
+        
+        region = format_metadata (&size);
+        save_template (path, region, size);
+    
+    }
+    
+    free (path);
+    stamp_metadata (region);
+    
+    memset (&b, 0, sizeof (b));
+    
+    if (build_begin (&b, created, streaming) == 0 && build_write (&b, region, size) == 0 && build_finish (&b, created, streaming) == 0) {
+        result = 0;
+    }
+    
+    free (b.buffer);
+    free (region);
+    
+    return result;
+
+}
+
+/**
+ * Look for bad clusters before anything is written: the data area is read
+ * (after a test pattern is written to it, with --pattern) in large
+ * sequential requests by badblocks_scan, and the clusters that fail are
+ * kept for mark_bad_clusters.
+ */
+static int check_surface (void) {
+
+    unsigned long start = (state->offset * 512) + ((unsigned long) (reserved_sectors + (number_of_fats * sectors_per_fat) + (root_entries * 32) / 512) * 512);
+    int flags = (state->check_write ? BADBLOCKS_WRITE : 0) | (state->check_direct ? BADBLOCKS_DIRECT : 0);
+    
+    if (fflush (ofp)) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "failed whilst writing '%s'", state->outfile);
+        return -1;
+    
+    }
+    
+    if (state->verbose) {
+        fprintf (stderr, "Checking %u clusters of %u bytes%s\n", cluster_count, sectors_per_cluster * 512, state->check_write ? " (writing a test pattern)" : "");
+    }
+    
+    if (badblocks_scan (state->outfile, start, cluster_count, sectors_per_cluster * 512, flags, &bad_clusters, &nb_bad_clusters) < 0) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "failed to check '%s'", state->outfile);
+        return -1;
+    
+    }
+    
+    if (nb_bad_clusters) {
+    
+        report_at (program_name, 0, REPORT_WARNING, "%lu bad cluster%s found", (unsigned long) nb_bad_clusters, nb_bad_clusters > 1 ? "s" : "");
+        
+        if (state->size_fat == 32 && bad_clusters[0] == 0) {
+        
+            report_at (program_name, 0, REPORT_ERROR, "the first data cluster, which holds the root directory, is bad");
+            return -1;
+        
+        }
+    
+    }
+    
+    /** The pattern is left in the data area; the FAT32 root directory has to start out empty. */
+    if (state->check_write && state->size_fat == 32) {
+    
+        unsigned char *zero = xmalloc (sectors_per_cluster * 512);
+        
+        if (seekto (start - (state->offset * 512)) || fwrite (zero, sectors_per_cluster * 512, 1, ofp) != 1) {
+        
+            report_at (program_name, 0, REPORT_ERROR, "failed whilst writing '%s'", state->outfile);
+            
+            free (zero);
+            return -1;
+        
+        }
+        
+        free (zero);
+    
+    }
+    
+    return 0;
+
+}
+
+static int mark_bad_clusters (void) {
+
+    size_t i;
+    
+    for (i = 0; i < nb_bad_clusters; i++) {
+    
+        if (set_fat_entry ((unsigned int) bad_clusters[i] + 2, 0x0FFFFFF7) < 0) {
+        
+            report_at (program_name, 0, REPORT_ERROR, "Failed whilst setting FAT entry");
+            return -1;
+        
+        }
+    
+    }
+    
+    return 0;
+
+}
+
+/**
+ * Write the filesystem to standard output, which need not be seekable, so
+ * the image can be piped straight into another program.
+ */
+static int stream_filesystem (void) {
+
+    if (!state->blocks) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "--blocks must be given to write to standard output");
+        return EXIT_FAILURE;
+    
+    }
+    
+#if     defined (_WIN32)
+    _setmode (_fileno (stdout), _O_BINARY);
+#endif
+    
+    ofp = stdout;
+    image_size = state->blocks * 1024;
+    
+    if (state->template_dir && !state->source_dir && !state->boot) {
+        return (template_format (0, 1) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    
+    if (establish_bpb () < 0 || build_filesystem (0, 1) < 0) {
+        return EXIT_FAILURE;
+    }
+    
+    return EXIT_SUCCESS;
+
+}
+
+int make_filesystem (void) {
+
+    FILE *fp;
+    
+    int created = 0, streaming = (state->outfile && strcmp (state->outfile, "-") == 0);
+    int use_template = (state->template_dir && !state->source_dir && !state->boot && !state->check);
+    
+    /** --timestamp takes the place of SOURCE_DATE_EPOCH. */
+    if (!state->source_date_set && (state->source_date_set = source_date_from_env (&state->source_date)) < 0) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "SOURCE_DATE_EPOCH is not a number of seconds");
+        return EXIT_FAILURE;
+    
+    }
+    
+    if (state->check && (streaming || state->source_dir)) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "-c cannot be used with -d or when writing to standard output");
+        return EXIT_FAILURE;
+    
+    }
+    
+    /** A source tree going into a new file with no size given decides the size. */
+    if (state->source_dir && !state->fit_dir && !state->blocks) {
+    
+        if (!streaming && (fp = fopen (state->outfile, "rb")) != NULL) {
+            fclose (fp);
+        } else {
+            state->fit_dir = state->source_dir;
+        }
+    
+    }
+    
+    if (state->fit_dir) {
+    
+        if (plan_filesystem () < 0) {
+            return EXIT_FAILURE;
+        }
+        
+        if (state->plan_only) {
+            return EXIT_SUCCESS;
+        }
+    
+    }
+    
+    reset_defaults ();
+    
+    if (streaming) {
+        return stream_filesystem ();
+    }
+    
+    image_size = state->blocks * 1024;
+    image_size += state->offset * 512;
+    
+    if ((ofp = fopen (state->outfile, "r+b")) == NULL) {
+    
+        size_t len;
+        void *zero;
+        
+        if ((ofp = fopen (state->outfile, "w+b")) == NULL) {
+        
+            report_at (program_name, 0, REPORT_ERROR, "failed to open '%s' for writing", state->outfile);
+            return EXIT_FAILURE;
+        
+        }
+        
+        created = 1;
+        
+        /** A populated or templated filesystem is written in one pass, so there is nothing to zero first. */
+        len = (state->source_dir || use_template ? 0 : image_size);
+        zero = xmalloc (512);
+        
+        while (len > 0) {
+        
+            if (fwrite (zero, 512, 1, ofp) != 1) {
+            
+                report_at (program_name, 0, REPORT_ERROR, "failed whilst writing '%s'", state->outfile);
+                fclose (ofp);
+                
+                free (zero);
+                remove (state->outfile);
+                
+                return EXIT_FAILURE;
+            
+            }
+            
+            len -= 512;
+        
+        }
+        
+        free (zero);
+    
+    }
+    
+    if (image_size == 0) {
+    
+        fseek (ofp, 0, SEEK_END);
+        image_size = ftell (ofp);
+    
+    }
+    
+    seekto (0);
+    
+    if (state->offset * 512 > image_size) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "size (%lu) of %s is less than the requested offset (%lu)", image_size, state->outfile, state->offset * 512);
+        
+        fclose (ofp);
+        remove (state->outfile);
+        
+        return EXIT_FAILURE;
+    
+    }
+    
+    image_size -= state->offset * 512;
+    
+    if (state->blocks) {
+    
+        if (state->blocks * 1024 > image_size) {
+        
+            report_at (program_name, 0, REPORT_ERROR, "size (%lu) of %s is less than the requested size (%lu)", image_size, state->outfile, state->blocks * 1024);
+            
+            fclose (ofp);
+            remove (state->outfile);
+            
+            return EXIT_FAILURE;
+        
+        }
+        
+        image_size = state->blocks * 1024;
+    
+    }
+    
+    orphaned_sectors = (image_size % 1024) / 512;
+    
+    if (use_template) {
+    
+        if (template_format (created, 0) < 0) {
+        
+            fclose (ofp);
+            remove (state->outfile);
+            
+            return EXIT_FAILURE;
+        
+        }
+        
+        fclose (ofp);
+        return EXIT_SUCCESS;
+    
+    }
+    
+    if (establish_bpb () < 0) {
+    
+        fclose (ofp);
+        remove (state->outfile);
+        
+        return EXIT_FAILURE;
+    
+    }
+    
+    if (state->source_dir) {
+    
+        if (build_filesystem (created, 0) < 0) {
+        
+            fclose (ofp);
+            remove (state->outfile);
+            
+            return EXIT_FAILURE;
+        
+        }
+        
+        fclose (ofp);
+        return EXIT_SUCCESS;
+    
+    }
+    
+    if (state->check && check_surface () < 0) {
+    
+        fclose (ofp);
+        remove (state->outfile);
+        
+        return EXIT_FAILURE;
+    
+    }
+    
+    wipe_target ();
+    
+    write_reserved ();
+    
+    if (set_fat_entry (0, 0xFFFFFF00 | media_descriptor) < 0 || set_fat_entry (1, 0xFFFFFFFF) < 0) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "Failed whilst setting FAT entry");
+        
+        fclose (ofp);
+        remove (state->outfile);
+        
+        return EXIT_FAILURE;
+    
+    }
+    
+    if (state->size_fat == 32) {
+    
+        if (set_fat_entry (2, 0x0FFFFFF8) < 0) {
+        
+            report_at (program_name, 0, REPORT_ERROR, "Failed whilst setting FAT entry");
+            
+            fclose (ofp);
+            remove (state->outfile);
+            
+            return EXIT_FAILURE;
+        
+        }
+    
+    }
+    
+    if (mark_bad_clusters () < 0) {
+    
+        fclose (ofp);
+        remove (state->outfile);
+        
+        return EXIT_FAILURE;
+    
+    }
+    
     if (memcmp (state->label, "NO NAME    ", 11) != 0) {
         add_volume_label ();
     }
@@ -5,6 +5,7 @@
 #define     _PARTED_H
 
 #include    <stddef.h>
+#include    <time.h>
 
 struct mkfs_state {
 
@@ -14,11 +15,44 @@ struct mkfs_state {
     int create, size_fat, size_fat_by_user, verbose;
     size_t blocks, offset;
     
+    /** With fit_dir the size and cluster size are chosen to hold that host tree. */
+    const char *fit_dir;
+    int jobs, plan_only;
+    
+    /** With source_dir the filesystem is made holding a copy of that host tree. */
+    const char *source_dir;
+    
+    unsigned int volume_id;
+    int volume_id_set;
+    
+    /** With source_date_set everything is stamped with source_date, for reproducible images. */
+    time_t source_date;
+    int source_date_set;
+    
+    /** With template_dir formatted metadata is cached there, keyed by geometry. */
+    const char *template_dir;
+    
+    /** With check the data area is scanned for bad clusters, which are marked in the FAT. */
+    int check, check_write, check_direct;
+    
     unsigned char sectors_per_cluster;
 
 };
 
+/** The layout establish_bpb settles on, as filled in by compute_geometry. */
+struct mkfs_geometry {
+
+    unsigned long total_sectors;
+    
+    unsigned int reserved_sectors, number_of_fats, root_entries;
+    unsigned int sectors_per_cluster, sectors_per_fat, cluster_count;
+
+};
+
 extern struct mkfs_state *state;
 extern const char *program_name;
 
+int compute_geometry (struct mkfs_geometry *geom);
+int make_filesystem (void);
+
 #endif      /* _PARTED_H */
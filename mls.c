@@ -8,14 +8,10 @@
 #include    <stdlib.h>
 #include    <string.h>
 
-#include    "common.h"
+#include    "dosfs.h"
 #include    "msdos.h"
 #include    "report.h"
 
-#ifndef     PATH_MAX
-# define    PATH_MAX                    2048
-#endif
-
 struct mls_state {
 
     char **dirs;
@@ -23,40 +19,14 @@ struct mls_state {
     
     const char *outfile;
     unsigned long offset;
-
-};
-
-static FILE *ifp;
-
-struct dir_info {
-
-    unsigned int current_cluster;
     
-    unsigned char current_sector;
-    unsigned char current_entry;
-    unsigned char *scratch;
-    unsigned char flags;
+    int extents, index;
 
 };
 
 static struct mls_state *state = 0;
 static const char *program_name = 0;
 
-static struct msdos_boot_sector bs;
-static int size_fat = 0;
-
-static unsigned int cluster_count = 0;
-static unsigned int data_area = 0;
-static unsigned int info_sector = 0;
-static unsigned int number_of_fats = 0;
-static unsigned int reserved_sectors = 0;
-static unsigned int root_cluster = 0;
-static unsigned int root_dir = 0;
-static unsigned int root_entries = 0;
-static unsigned int sectors_per_cluster = 0;
-static unsigned int sectors_per_fat = 0;
-static unsigned int total_sectors = 0;
-
 struct option {
 
     const char *name;
@@ -70,7 +40,9 @@ struct option {
 enum options {
 
     OPTION_IGNORED = 1,
+    OPTION_EXTENTS,
     OPTION_HELP,
+    OPTION_INDEX,
     OPTION_INPUT,
     OPTION_OFFSET
 
@@ -80,7 +52,9 @@ static struct option opts[] = {
 
     { "i",          OPTION_INPUT,       OPTION_HAS_ARG  },
     
+    { "-extents",   OPTION_EXTENTS,     OPTION_NO_ARG   },
     { "-help",      OPTION_HELP,        OPTION_NO_ARG   },
+    { "-index",     OPTION_INDEX,       OPTION_NO_ARG   },
     { "-offset",    OPTION_OFFSET,      OPTION_HAS_ARG  },
     
     { 0,            0,                  0               }
@@ -123,7 +97,9 @@ static void print_help (int exitval) {
     fprintf (stderr, "\n");
     
     fprintf (stderr, "    Long options:\n\n");
+    fprintf (stderr, "        --extents         Print where each named file lives within the image.\n");
     fprintf (stderr, "        --help            Show this help information then exit.\n");
+    fprintf (stderr, "        --index           Keep a sidecar index next to the image for fast reopening.\n");
     fprintf (stderr, "        --offset SECTOR   Read the filesystem starting at SECTOR.\n");
        
 _exit:
@@ -264,6 +240,13 @@ static void parse_args (int *pargc, char ***pargv, int optind) {
         
         switch (popt->index) {
         
+            case OPTION_EXTENTS: {
+            
+                state->extents = 1;
+                break;
+            
+            }
+            
             case OPTION_HELP: {
             
                 print_help (EXIT_SUCCESS);
@@ -271,6 +254,13 @@ static void parse_args (int *pargc, char ***pargv, int optind) {
             
             }
             
+            case OPTION_INDEX: {
+            
+                state->index = 1;
+                break;
+            
+            }
+            
             case OPTION_INPUT: {
             
                 if (state->outfile) {
@@ -326,360 +316,57 @@ static void parse_args (int *pargc, char ***pargv, int optind) {
 }
 
 
-static int seekto (long offset) {
-    return fseek (ifp, (state->offset * 512) + offset, SEEK_SET);
-}
-
-static int get_next_entry (struct dir_info *di, struct msdos_dirent *de);
-static int open_dir (const char *target, struct dir_info *di);
-
-static unsigned int get_fat_entry (unsigned char *scratch, unsigned int cluster);
-
-static int canonical_to_dir (char *dest, const char *src) {
-
-    static const char invalid_chars[] = "\"*+,./:;<=>?[\\]|";
-    
-    int i, j;
-    int namelen = 0, dots = 0, extlen = 0;
-    
-    memset (dest, ' ', 11);
-    
-    if (*src == '\0' || *src == '.') {
-        return -1;
-    }
-    
-    for (j = i = 0; *src != '\0'; i++) {
-    
-        int c = (unsigned char) *src++;
-        
-        if (c == '/' || c == '\\') {
-            break;
-        }
-        
-        if (i >= 12) {
-            return -1;
-        }
-        
-        if (i == 0 && c == 0xE5) {
-        
-            /**
-             * 0xE5 in the first character of the name is a marker for delected files,
-             * it needs to be translated to 0x05.
-             */
-            c = 0x05;
-        
-        } else if (c == '.') {
-        
-            if (dots++) {
-                return -1;
-            }
-            
-            j = 8;
-            continue;
-        
-        }
-        
-        if (c <= 0x20 || strchr (invalid_chars, c)) {
-            return -1;
-        }
-        
-        if (dots) {
-        
-            if (++extlen > 3) {
-                return -1;
-            }
-        
-        } else {
-        
-            if (++namelen > 8) {
-                return -1;
-            }
-        
-        }
-        
-        if (c >= 'a' && c <= 'z') {
-            c -= 'a' - 'A';
-        }
-        
-        dest[j++] = c;
-    
-    }
-    
-    return 0;
-
-}
-
-static int get_next_entry (struct dir_info *di, struct msdos_dirent *de) {
-
-    unsigned long offset;
-    
-    if (di->current_entry >= 512 / sizeof (*de)) {
-    
-        di->current_entry = 0;
-        di->current_sector++;
-        
-        if (di->current_cluster == 0) {
-        
-            unsigned long offset;
-            
-            if (di->current_sector * (512 / sizeof (*de)) >= root_entries) {
-                return -1;
-            }
-            
-            offset = (unsigned long) root_dir + di->current_sector;
-            
-            if (seekto (offset * 512) || fread (di->scratch, 512, 1, ifp) != 1) {
-                return -1;
-            }
-        
-        } else {
-        
-            if (di->current_sector >= sectors_per_cluster) {
-            
-                di->current_sector = 0;
-                
-                if ((size_fat == 12 && di->current_cluster >= 0x0FF7) || (size_fat == 16 && di->current_cluster >= 0xFFF7) || (size_fat == 32 && di->current_cluster >= 0x0FFFFFF7)) {
-                
-                    if (!(di->flags & 0x01)) {
-                        return -1;
-                    }
-                    
-                    return 1;
-                
-                }
-                
-                di->current_cluster = get_fat_entry (di->scratch, di->current_cluster);
-            
-            }
-            
-            offset = (unsigned long) data_area;
-            offset += ((di->current_cluster - 2) * sectors_per_cluster);
-            offset += di->current_sector;
-            
-            if (seekto (offset * 512) || fread (di->scratch, 512, 1, ifp) != 1) {
-                return -1;
-            }
-        
-        }
-    
-    }
-    
-    memcpy (de, &(((struct msdos_dirent *) di->scratch)[di->current_entry]), sizeof (*de));
-    
-    if (de->name[0] == 0) {
-    
-        if (di->flags & 0x01) {
-            return 0;
-        }
-        
-        return -1;
-    
-    }
-    
-    if (de->name[0] == 0x05) {
-    
-        de->name[0] = 0xE5;
-        return 0;
-    
-    }
-    
-    di->current_entry++;
-    return 0;
-
-}
-
-static int open_dir (const char *target, struct dir_info *di) {
+/**
+ * Print the physical layout of every named file as byte offsets within the
+ * image file: the offset in the file, the offset in the image, the length
+ * and the first cluster of each contiguous run.
+ */
+static int print_extents (struct dosfs_image *img) {
 
-    di->flags = 0;
+    struct dosfs_extent *extents;
+    size_t nb_extents, i, j;
     
-    if (!strlen ((char *) target) || (strlen ((char *) target) == 1 && (target[0] == '/' || target[0] == '\\'))) {
+    char *target;
     
-        unsigned long offset;
-        
-        if (size_fat == 32) {
-        
-            di->current_cluster = root_cluster;
-            di->current_entry = 0;
-            di->current_sector = 0;
-            
-            offset = (unsigned long) data_area + ((di->current_cluster - 2) * sectors_per_cluster);
-        
-        } else {
-        
-            di->current_cluster = 0;
-            di->current_entry = 0;
-            di->current_sector = 0;
-            
-            offset = (unsigned long) root_dir;
-        
-        }
-        
-        if (seekto (offset * 512) || fread (di->scratch, 512, 1, ifp) != 1) {
-            return -1;
-        }
-    
-    } else {
+    for (i = 0; i < state->nb_dirs; i++) {
     
-        unsigned char tmpfn[12];
-        unsigned char *ptr;
-        
-        struct msdos_dirent de;
-        unsigned int result;
-        
-        unsigned long offset;
-        
-        if (size_fat == 32) {
-        
-            di->current_cluster = root_cluster;
-            di->current_entry = 0;
-            di->current_sector = 0;
-            
-            offset = (unsigned long) data_area + ((di->current_cluster - 2) * sectors_per_cluster);
-        
-        } else {
-        
-            di->current_cluster = 0;
-            di->current_entry = 0;
-            di->current_sector = 0;
-            
-            offset = (unsigned long) root_dir;
-        
-        }
-        
-        if (seekto (offset * 512) || fread (di->scratch, 512, 1, ifp) != 1) {
-            return -1;
-        }
-        
-        ptr = (unsigned char *) target;
+        target = state->dirs[i];
         
-        while ((*ptr == '/' || *ptr == '\\') && *ptr) {
-            ptr++;
+        if (*target == '/' || *target == '\\') {
+            target++;
         }
         
-        while (*ptr) {
-        
-            if (canonical_to_dir ((char *) tmpfn, (char *) ptr) < 0) {
-            
-                fprintf (stderr, "Failed to convert to 8:3\n");
-                return -1;
-            
-            }
-            
-            de.name[0] = 0;
-            
-            do {
-                result = get_next_entry (di, &de);
-            } while (!result && memcmp (de.name, tmpfn, 11));
-            
-            if (!memcmp (de.name, tmpfn, 11) && (de.attr & ATTR_DIR) == ATTR_DIR) {
-            
-                unsigned long offset;
-                
-                di->current_cluster = (unsigned int) de.startlo[0] | ((unsigned int) de.startlo[1]) << 8 | ((unsigned int) de.starthi[0]) << 16 | ((unsigned int) de.starthi[1]) << 24;
-                di->current_entry = 0;
-                di->current_sector = 0;
-                
-                offset = (unsigned long) (data_area + ((di->current_cluster - 2) * sectors_per_cluster));
-                
-                if (seekto (offset * 512)) {
-                    return -1;
-                }
-                
-                if (fread (di->scratch, 512, 1, ifp) != 1) {
-                    return -1;
-                }
-            
-            } else if (!memcmp (de.name, tmpfn, 11) && !(de.attr & ATTR_DIR)) {
-                return -1;
-            }
-            
-            while (*ptr != '/' && *ptr != '\\' && *ptr) {
-                ptr++;
-            }
-            
-            if (*ptr == '/' || *ptr == '\\') {
-                ptr++;
-            }
+        if (dosfs_extents (img, target, &extents, &nb_extents) < 0) {
         
-        }
+            report_at (program_name, 0, REPORT_ERROR, "failed to map '%s': %s", state->dirs[i], dosfs_strerror (img->error));
+            return EXIT_FAILURE;
         
-        if (!di->current_cluster) {
-            return -1;
         }
-    
-    }
-    
-    return 0;
-
-}
-
-static unsigned int get_fat_entry (unsigned char *scratch, unsigned int cluster) {
-
-    unsigned int offset, sector, result;
-    
-    if (size_fat == 12) {
-        offset = cluster + (cluster / 2);
-    } else if (size_fat == 16) {
-        offset = cluster * 2;
-    } else if (size_fat == 32) {
-        offset = cluster * 4;
-    } else {
-        return 0x0FFFFFF7;
-    }
-    
-    sector = (offset / 512) + reserved_sectors;
-    
-    if (seekto ((unsigned long) sector * 512) || fread (scratch, 512, 1, ifp) != 1) {
-        return 0x0FFFFFF7;
-    }
-    
-    offset %= 512;
-    
-    if (size_fat == 12) {
-    
-        if (offset == 511) {
         
-            result = (unsigned int) scratch[offset];
-            sector++;
-            
-            if (seekto ((unsigned long) sector * 512) || fread (scratch, 512, 1, ifp) != 1) {
-                return 0x0FFFFFF7;
-            }
-            
-            result |= ((unsigned int) scratch[0]) << 8;
+        printf ("%s:\n", *target ? target : "/");
         
-        } else {
-            result = (unsigned int) scratch[offset] | ((unsigned int) scratch[offset + 1]) << 8;
+        for (j = 0; j < nb_extents; j++) {
+            printf ("    %12lu    %12lu    %12lu    %10u\n", extents[j].logical, extents[j].physical, extents[j].length, extents[j].cluster);
         }
         
-        if (cluster & 1) {
-            result = result >> 4;
-        } else {
-            result = result & 0x0FFF;
-        }
+        free (extents);
     
-    } else if (size_fat == 16) {
-        result = (unsigned int) scratch[offset] | ((unsigned int) scratch[offset + 1]) << 8;
-    } else if (size_fat == 32) {
-        result = ((unsigned int) scratch[offset] | ((unsigned int) scratch[offset + 1]) << 8 | ((unsigned int) scratch[offset + 2]) << 16 | ((unsigned int) scratch[offset + 3]) << 24) & 0x0FFFFFFF;
-    } else {
-        result = 0x0FFFFFF7;
     }
     
-    return result;
+    return EXIT_SUCCESS;
 
 }
 
 int main (int argc, char **argv) {
 
-    unsigned char *scratch;
-    char *target, filename[13];
+    struct dosfs_image *img;
+    struct dosfs_dirstream *ds;
+    struct dosfs_stat st;
     
-    struct dir_info di;
-    struct msdos_dirent de;
+    char *target;
+    size_t i, k;
     
-    unsigned int bytes, timestamp;
-    size_t i, j, k;
+    int error;
     
     if (argc && *argv) {
     
@@ -703,174 +390,27 @@ int main (int argc, char **argv) {
         dynarray_add (&state->dirs, &state->nb_dirs, "/");
     }
     
-    if ((ifp = fopen (state->outfile, "rb")) == NULL) {
-    
-        report_at (program_name, 0, REPORT_ERROR, "faild to open '%s' for reading", state->outfile);
-        return EXIT_FAILURE;
-    
-    }
-    
-    if (seekto ((unsigned long) 0) || fread (&bs, sizeof (bs), 1, ifp) != 1) {
-    
-        report_at (program_name, 0, REPORT_ERROR, "failed whilst reading boot sector");
-        fclose (ifp);
-        
-        return EXIT_FAILURE;
-    
-    }
-    
-    if (bs.boot_jump[0] != 0xEB || bs.boot_jump[1] < 0x16 || bs.boot_jump[2] != 0x90) {
-    
-        report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-        fclose (ifp);
-        
-        return EXIT_FAILURE;
-    
-    }
-    
-    sectors_per_cluster = (unsigned int) bs.sectors_per_cluster;
-    reserved_sectors = (unsigned int) bs.reserved_sectors[0] | (((unsigned int) bs.reserved_sectors[1]) << 8);
-    number_of_fats = (unsigned int) bs.no_fats;
-    root_entries = (unsigned int) bs.root_entries[0] | (((unsigned int) bs.root_entries[1]) << 8);
-    total_sectors = (unsigned int) bs.total_sectors16[0] | (((unsigned int) bs.total_sectors16[1]) << 8);
-    sectors_per_fat = (unsigned int) bs.sectors_per_fat16[0] | (((unsigned int) bs.sectors_per_fat16[1]) << 8);
-    
-    if (!sectors_per_cluster || !reserved_sectors || !number_of_fats) {
-    
-        report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-        fclose (ifp);
-        
-        return EXIT_FAILURE;
-    
-    }
-    
-    if (!root_entries) {
-    
-        if (bs.boot_jump[1] < 0x58) {
-        
-            report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-            fclose (ifp);
-            
-            return EXIT_FAILURE;
-        
-        }
-        
-        root_cluster = (unsigned int) bs.fat32.root_cluster[0] | (((unsigned int) bs.fat32.root_cluster[1]) << 8) | (((unsigned int) bs.fat32.root_cluster[2]) << 16) | (((unsigned int) bs.fat32.root_cluster[3]) << 24);
-        
-        if (!root_cluster) {
-        
-            report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-            fclose (ifp);
-            
-            return EXIT_FAILURE;
-        
-        }
-    
-    }
-    
-    if (!total_sectors) {
-    
-        if (bs.boot_jump[1] < 0x22) {
-        
-            report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-            fclose (ifp);
-            
-            return EXIT_FAILURE;
-        
-        }
-        
-        total_sectors = (unsigned int) bs.total_sectors32[0] | (((unsigned int) bs.total_sectors32[1]) << 8) | (((unsigned int) bs.total_sectors32[2]) << 16) | (((unsigned int) bs.total_sectors32[3]) << 24);
-        
-        if (!total_sectors) {
-        
-            report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-            fclose (ifp);
-            
-            return EXIT_FAILURE;
-        
-        }
-    
-    }
-    
-    if (!sectors_per_fat) {
+    if (!(img = dosfs_open (state->outfile, state->offset, DOSFS_READONLY | (state->index ? DOSFS_INDEX : 0), &error))) {
     
-        if (bs.boot_jump[1] < 0x58) {
-        
+        if (error == DOSFS_ERR_INVALID) {
             report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-            fclose (ifp);
-            
-            return EXIT_FAILURE;
-        
-        }
-        
-        sectors_per_fat = (unsigned int) bs.fat32.sectors_per_fat32[0] | (((unsigned int) bs.fat32.sectors_per_fat32[1]) << 8) | (((unsigned int) bs.fat32.sectors_per_fat32[2]) << 16) | (((unsigned int) bs.fat32.sectors_per_fat32[3]) << 24);
-        
-        if (!sectors_per_fat) {
-        
-            report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-            fclose (ifp);
-            
-            return EXIT_FAILURE;
-        
-        }
-    
-    }
-    
-    if (root_entries) {
-    
-        root_dir = reserved_sectors + (sectors_per_fat * 2);
-        data_area = root_dir + (((root_entries * 32) + (512 - 1)) / 512);
-    
-    } else {
-    
-        data_area = reserved_sectors + (sectors_per_fat * 2);
-        
-        /*root_dir = data_area + ((root_cluster - 2) * sectors_per_cluster);*/
-        /*root_dir = root_cluster;*/
-    
-    }
-    
-    cluster_count = (total_sectors - data_area) / sectors_per_cluster;
-    
-    if (bs.boot_jump[1] == 0x58) {
-    
-        info_sector = (unsigned int) bs.fat32.info_sector[0] | (((unsigned int) bs.fat32.info_sector[1]) << 8);
-        
-        if (!info_sector) {
-        
-            report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
-            fclose (ifp);
-            
-            return EXIT_FAILURE;
-        
+        } else {
+            report_at (program_name, 0, REPORT_ERROR, "faild to open '%s' for reading", state->outfile);
         }
         
-        size_fat = 32;
-    
-    } else if (cluster_count <= MAX_CLUST_12) {
-        size_fat = 12;
-    } else if (cluster_count >= MIN_CLUST_16 && cluster_count <= MAX_CLUST_16) {
-        size_fat = 16;
-    } else {
-    
-        report_at (program_name, 0, REPORT_ERROR, "FAT is not 12, 16 or 32 bits");
-        fclose (ifp);
-        
         return EXIT_FAILURE;
     
     }
     
-    if (!(scratch = (unsigned char *) malloc (512))) {
+    if (state->extents) {
     
-        report_at (program_name, 0, REPORT_ERROR, "Out of memory");
-        fclose (ifp);
+        int result = print_extents (img);
         
-        return EXIT_FAILURE;
+        dosfs_close (img);
+        return result;
     
     }
     
-    di.scratch = scratch;
-    
     for (i = 0; i < state->nb_dirs; i++) {
     
         target = state->dirs[i];
@@ -879,10 +419,12 @@ int main (int argc, char **argv) {
             target++;
         }
         
-        if (open_dir ((char *) target, &di) < 0) {
+        if (!(ds = dosfs_opendir (img, target))) {
         
             fprintf (stderr, "failed to open directory\n");
-            return -1;
+            
+            dosfs_close (img);
+            return EXIT_FAILURE;
         
         }
         
@@ -896,86 +438,46 @@ int main (int argc, char **argv) {
         
         }
         
-        while (!get_next_entry (&di, &de)) {
+        while (dosfs_readdir (ds, &st) > 0) {
         
-            /*if (!de.name[0] || de.name[0] == 0xE5 || (de.attr & ATTR_LONG_NAME) == ATTR_LONG_NAME) {*/
-            if (!de.name[0] || de.name[0] == 0xE5) {
-                continue;
-            }
-            
-            if ((de.attr & ATTR_VOLUME_ID) == ATTR_VOLUME_ID) {
-                continue;
-            }
-            
-            memset (filename, 0, 13);
-            
-            for (j = 0, k = 0; j < 11; ++j) {
-            
-                if (j < 8 && de.name[j] == ' ') {
-                
-                    if ((de.attr & ATTR_DIR) != ATTR_DIR && k > 0 && filename[k - 1] != '.') {
-                        filename[k++] = '.';
-                    }
-                
-                } else {
-                
-                    if (j == 8 && (de.attr & ATTR_DIR) != ATTR_DIR && filename[k - 1] != '.') {
-                        filename[k++] = '.';
-                    }
-                    
-                    filename[k++] = de.name[j];
-                
-                }
-            
-            }
-            
             if (state->nb_dirs > 1) {
                 printf ("    ");
             }
             
-            printf ("%s", filename);
-            
-            while (k < 12) {
+            printf ("%s", st.name);
             
+            for (k = strlen (st.name); k < 12; k++) {
                 printf (" ");
-                k++;
-            
             }
             
-            if ((de.attr & ATTR_DIR) == ATTR_DIR) {
-                printf ("    <DIR>    "); 
+            if ((st.attr & ATTR_DIR) == ATTR_DIR) {
+                printf ("    <DIR>    ");
             } else {
                 printf ("             ");
             }
             
-            if ((de.attr & ATTR_DIR) == ATTR_DIR) {
+            if ((st.attr & ATTR_DIR) == ATTR_DIR) {
                 printf ("          ");
             } else {
-            
-                bytes = (unsigned int) de.size[0] | (((unsigned int) de.size[1]) << 8) | (((unsigned int) de.size[2]) << 16) | (((unsigned int) de.size[3]) << 24);
-                printf ("%10u", bytes);
-            
+                printf ("%10lu", st.size);
             }
             
-            timestamp = (unsigned short) de.date[0] | (((unsigned short) de.date[1]) << 8);
-            printf ("    %04d-%02d-%02d", ((timestamp >> 9) & 0x3f) + 1980, (timestamp >> 5) & 0x0f, timestamp & 0x1f);
-            
-            timestamp = (unsigned short) de.time[0] | (((unsigned short) de.time[1]) << 8);
-            printf ("    %02d:%02d:%02d", (timestamp >> 11) & 0x3f, (timestamp >> 5) & 0x3f, (timestamp & 0x1f) << 1);
+            printf ("    %04d-%02d-%02d", ((st.date >> 9) & 0x3f) + 1980, (st.date >> 5) & 0x0f, st.date & 0x1f);
+            printf ("    %02d:%02d:%02d", (st.time >> 11) & 0x3f, (st.time >> 5) & 0x3f, (st.time & 0x1f) << 1);
             
             printf ("\n");
         
         }
         
+        dosfs_closedir (ds);
+        
         if (state->nb_dirs > 1 && i < state->nb_dirs - 1) {
             printf ("\n");
         }
     
     }
     
-    free (scratch);
-    fclose (ifp);
-    
+    dosfs_close (img);
     return EXIT_SUCCESS;
 
 }
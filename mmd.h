@@ -13,6 +13,9 @@ struct mmd_state {
     
     const char *outfile;
     unsigned long offset;
+    
+    unsigned long entries;
+    int index, parents;
 
 };
 
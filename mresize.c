@@ -0,0 +1,508 @@
+/******************************************************************************
+ * @file            mresize.c
+ *****************************************************************************/
+#if     !defined (__PDOS__) && !defined (_WIN32)
+# define    _POSIX_C_SOURCE             200112L
+#endif
+
+#include    <ctype.h>
+#include    <errno.h>
+#include    <limits.h>
+#include    <stddef.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+
+#include    "dosfs.h"
+#include    "lib.h"
+#include    "mkfs.h"
+#include    "mresize.h"
+#include    "msdos.h"
+#include    "report.h"
+
+#if     !defined (__PDOS__) && !defined (_WIN32)
+# include   <unistd.h>
+#endif
+
+static struct mresize_state *resize = 0;
+
+struct mkfs_state *state = 0;
+const char *program_name = 0;
+
+struct option {
+
+    const char *name;
+    int index, flags;
+
+};
+
+#define     OPTION_NO_ARG               0x0001
+#define     OPTION_HAS_ARG              0x0002
+
+enum options {
+
+    OPTION_IGNORED = 1,
+    OPTION_BLOCKS,
+    OPTION_CHECK,
+    OPTION_FIT,
+    OPTION_HELP,
+    OPTION_INDEX,
+    OPTION_INPUT,
+    OPTION_OFFSET,
+    OPTION_VERBOSE
+
+};
+
+static struct option opts[] = {
+
+    { "i",          OPTION_INPUT,       OPTION_HAS_ARG  },
+    { "n",          OPTION_CHECK,       OPTION_NO_ARG   },
+    { "v",          OPTION_VERBOSE,     OPTION_NO_ARG   },
+    
+    { "-blocks",    OPTION_BLOCKS,      OPTION_HAS_ARG  },
+    { "-check",     OPTION_CHECK,       OPTION_NO_ARG   },
+    { "-fit",       OPTION_FIT,         OPTION_NO_ARG   },
+    { "-help",      OPTION_HELP,        OPTION_NO_ARG   },
+    { "-index",     OPTION_INDEX,       OPTION_NO_ARG   },
+    { "-offset",    OPTION_OFFSET,      OPTION_HAS_ARG  },
+    { "-verbose",   OPTION_VERBOSE,     OPTION_NO_ARG   },
+    
+    { 0,            0,                  0               }
+
+};
+
+static int strstart (const char *val, const char **str) {
+
+    const char *p = val;
+    const char *q = *str;
+    
+    while (*p != '\0') {
+    
+        if (*p != *q) {
+            return 0;
+        }
+        
+        ++p;
+        ++q;
+    
+    }
+    
+    *str = q;
+    return 1;
+
+}
+
+static void print_help (int exitval) {
+
+    if (!program_name) {
+        goto _exit;
+    }
+    
+    fprintf (stderr, "Usage: %s [options] -i image --blocks BLOCKS\n", program_name);
+    fprintf (stderr, "       %s [options] -i image --fit\n\n", program_name);
+    fprintf (stderr, "Options:\n\n");
+    
+    fprintf (stderr, "    Short options:\n\n");
+    fprintf (stderr, "        -i                Specify the input target.\n");
+    fprintf (stderr, "        -n                Only show what the resize would do, change nothing.\n");
+    fprintf (stderr, "        -v                Show the new layout after resizing.\n");
+    
+    fprintf (stderr, "\n");
+    
+    fprintf (stderr, "    Long options:\n\n");
+    fprintf (stderr, "        --blocks BLOCKS   Resize the filesystem to BLOCKS * 1024 bytes.\n");
+    fprintf (stderr, "        --check           Only show what the resize would do, change nothing.\n");
+    fprintf (stderr, "        --fit             Shrink the filesystem to the smallest size that holds its data.\n");
+    fprintf (stderr, "        --help            Show this help information then exit.\n");
+    fprintf (stderr, "        --index           Keep a sidecar index next to the image for fast reopening.\n");
+    fprintf (stderr, "        --offset SECTOR   Write the filesystem starting at SECTOR.\n");
+    fprintf (stderr, "        --verbose         Show the new layout after resizing.\n");
+
+_exit:
+
+    exit (exitval);
+
+}
+
+static void parse_resize_args (int *pargc, char ***pargv, int optind) {
+
+    char **argv = *pargv;
+    int argc = *pargc;
+    
+    struct option *popt;
+    const char *optarg, *r;
+    
+    if (argc == optind) {
+        print_help (EXIT_SUCCESS);
+    }
+    
+    while (optind < argc) {
+    
+        r = argv[optind++];
+        
+        if (r[0] != '-' || r[1] == '\0') {
+        
+            dynarray_add (&resize->args, &resize->nb_args, xstrdup (r));
+            continue;
+        
+        }
+        
+        for (popt = opts; popt; ++popt) {
+        
+            const char *p1 = popt->name;
+            const char *r1 = (r + 1);
+            
+            if (!p1) {
+            
+                report_at (program_name, 0, REPORT_ERROR, "invalid option -- '%s'", r);
+                exit (EXIT_FAILURE);
+            
+            }
+            
+            if (!strstart (p1, &r1)) {
+                continue;
+            }
+            
+            optarg = r1;
+            
+            if (popt->flags & OPTION_HAS_ARG) {
+            
+                if (*optarg == '\0') {
+                
+                    if (optind >= argc) {
+                    
+                        report_at (program_name, 0, REPORT_ERROR, "argument to '%s' is missing", r);
+                        exit (EXIT_FAILURE);
+                    
+                    }
+                    
+                    optarg = argv[optind++];
+                
+                }
+            
+            } else if (*optarg != '\0') {
+                continue;
+            }
+            
+            break;
+        
+        }
+        
+        switch (popt->index) {
+        
+            case OPTION_BLOCKS: {
+            
+                long conversion;
+                char *temp;
+                
+                errno = 0;
+                conversion = strtol (optarg, &temp, 0);
+                
+                if (!*optarg || isspace ((int) *optarg) || errno || *temp) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "bad number for blocks");
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                if (conversion <= 0) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "blocks must be greater than zero");
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                resize->blocks = conversion;
+                break;
+            
+            }
+            
+            case OPTION_CHECK: {
+            
+                resize->check = 1;
+                break;
+            
+            }
+            
+            case OPTION_FIT: {
+            
+                resize->fit = 1;
+                break;
+            
+            }
+            
+            case OPTION_HELP: {
+            
+                print_help (EXIT_SUCCESS);
+                break;
+            
+            }
+            
+            case OPTION_INDEX: {
+            
+                resize->index = 1;
+                break;
+            
+            }
+            
+            case OPTION_INPUT: {
+            
+                if (resize->outfile) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "multiple output files provided");
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                resize->outfile = xstrdup (optarg);
+                break;
+            
+            }
+            
+            case OPTION_OFFSET: {
+            
+                long conversion;
+                char *temp;
+                
+                errno = 0;
+                conversion = strtol (optarg, &temp, 0);
+                
+                if (!*optarg || isspace ((int) *optarg) || errno || *temp) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "bad number for offset (%s)", optarg);
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                if (conversion < 0 || (unsigned long) conversion > UINT_MAX) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "offset must be between 0 and %u", UINT_MAX);
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                resize->offset = (unsigned long) conversion;
+                break;
+            
+            }
+            
+            case OPTION_VERBOSE: {
+            
+                resize->verbose = 1;
+                break;
+            
+            }
+            
+            default: {
+            
+                report_at (program_name, 0, REPORT_ERROR, "unsupported option '%s'", r);
+                exit (EXIT_FAILURE);
+            
+            }
+        
+        }
+    
+    }
+
+}
+
+/**
+ * Run establish_bpb for a volume of blocks kilobytes with the image's FAT
+ * type, cluster size and layout, so the FAT comes out the size mkdosfs
+ * would have made it.
+ */
+static int image_geometry (struct dosfs_image *img, size_t blocks, struct mkfs_geometry *geom) {
+
+    memset (state, 0, sizeof (*state));
+    memset (geom, 0, sizeof (*geom));
+    
+    state->outfile = resize->outfile;
+    state->offset = resize->offset;
+    state->blocks = blocks;
+    
+    state->size_fat = img->size_fat;
+    state->size_fat_by_user = 1;
+    state->sectors_per_cluster = (unsigned char) img->sectors_per_cluster;
+    
+    geom->reserved_sectors = img->reserved_sectors;
+    geom->number_of_fats = img->number_of_fats;
+    geom->root_entries = img->root_entries;
+    
+    if (compute_geometry (geom) < 0) {
+        return -1;
+    }
+    
+    if (geom->sectors_per_cluster != img->sectors_per_cluster) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "a FAT%d filesystem of %lu blocks needs %u sectors per cluster, not %u", img->size_fat, (unsigned long) blocks, geom->sectors_per_cluster, img->sectors_per_cluster);
+        return -1;
+    
+    }
+    
+    return 0;
+
+}
+
+/**
+ * The smallest size the data in use fits in.  The first guess keeps the
+ * current FAT, which can only be too big; the second sizes the data area
+ * from the FAT establish_bpb gives the first guess, with a little slack for
+ * its alignment.  The second is used if the resize accepts it.
+ */
+static size_t fit_blocks (struct dosfs_image *img) {
+
+    struct dosfs_resize_stats stats;
+    struct mkfs_geometry geom;
+    
+    unsigned long needed = img->cluster_count - img->free_clusters;
+    unsigned long metadata, sectors;
+    
+    size_t blocks;
+    
+    if (img->size_fat == 16 && needed < MIN_CLUST_16) {
+        needed = MIN_CLUST_16;
+    } else if (img->size_fat == 32 && needed < MIN_CLUST_32 && img->cluster_count >= MIN_CLUST_32) {
+        needed = MIN_CLUST_32;
+    } else if (!needed) {
+        needed = 1;
+    }
+    
+    metadata = img->reserved_sectors + ((img->root_entries * 32) + 511) / 512;
+    
+    sectors = metadata + (unsigned long) img->number_of_fats * img->sectors_per_fat + (needed + 2) * img->sectors_per_cluster;
+    blocks = (sectors + 1) / 2;
+    
+    if (image_geometry (img, blocks, &geom) < 0) {
+        return 0;
+    }
+    
+    sectors = metadata + (unsigned long) img->number_of_fats * geom.sectors_per_fat + (needed + 2) * img->sectors_per_cluster;
+    
+    if ((sectors + 1) / 2 < blocks) {
+    
+        size_t smaller = (sectors + 1) / 2;
+        
+        if (image_geometry (img, smaller, &geom) == 0 && dosfs_resize (img, geom.total_sectors, geom.sectors_per_fat, DOSFS_RESIZE_CHECK, &stats) == 0) {
+            return smaller;
+        }
+    
+    }
+    
+    return blocks;
+
+}
+
+int main (int argc, char **argv) {
+
+    struct dosfs_resize_stats stats;
+    struct dosfs_image *img;
+    struct mkfs_geometry geom;
+    
+    unsigned long old_sectors;
+    unsigned int old_count;
+    
+    int error;
+    
+    if (argc && *argv) {
+    
+        char *p;
+        program_name = *argv;
+        
+        if ((p = strrchr (program_name, '/'))) {
+            program_name = (p + 1);
+        }
+    
+    }
+    
+    resize = xmalloc (sizeof (*resize));
+    state = xmalloc (sizeof (*state));
+    
+    parse_resize_args (&argc, &argv, 1);
+    
+    if (!resize->outfile || resize->nb_args > 0 || (!resize->blocks == !resize->fit)) {
+        print_help (EXIT_FAILURE);
+    }
+    
+    if (!(img = dosfs_open (resize->outfile, resize->offset, (resize->check ? DOSFS_READONLY : 0) | (resize->index ? DOSFS_INDEX : 0) | DOSFS_SOURCE_DATE, &error))) {
+    
+        if (error == DOSFS_ERR_INVALID) {
+            report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", resize->outfile);
+        } else if (error == DOSFS_ERR_SOURCE_DATE) {
+            report_at (program_name, 0, REPORT_ERROR, "%s", dosfs_strerror (error));
+        } else {
+            report_at (program_name, 0, REPORT_ERROR, "faild to open '%s' for %s", resize->outfile, resize->check ? "reading" : "writing");
+        }
+        
+        return EXIT_FAILURE;
+    
+    }
+    
+    old_sectors = img->total_sectors;
+    old_count = img->cluster_count;
+    
+    if (resize->fit && !(resize->blocks = fit_blocks (img))) {
+    
+        dosfs_close (img);
+        return EXIT_FAILURE;
+    
+    }
+    
+    if (image_geometry (img, resize->blocks, &geom) < 0) {
+    
+        dosfs_close (img);
+        return EXIT_FAILURE;
+    
+    }
+    
+    if (dosfs_resize (img, geom.total_sectors, geom.sectors_per_fat, resize->check ? DOSFS_RESIZE_CHECK : 0, &stats) < 0) {
+    
+        if (img->error == DOSFS_ERR_NOSPC) {
+            report_at (program_name, 0, REPORT_ERROR, "the data in '%s' does not fit in %lu blocks", resize->outfile, (unsigned long) resize->blocks);
+        } else if (img->error == DOSFS_ERR_INVALID) {
+            report_at (program_name, 0, REPORT_ERROR, "'%s' cannot stay FAT%d at %lu blocks", resize->outfile, img->size_fat, (unsigned long) resize->blocks);
+        } else {
+            report_at (program_name, 0, REPORT_ERROR, "failed to resize '%s': %s", resize->outfile, dosfs_strerror (img->error));
+        }
+        
+        dosfs_close (img);
+        return EXIT_FAILURE;
+    
+    }
+    
+    if (resize->check || resize->verbose) {
+    
+        printf ("FAT%d, %lu -> %lu sectors, %u -> %u clusters of %u bytes\n", img->size_fat, old_sectors, geom.total_sectors, old_count, stats.cluster_count, img->cluster_size);
+        printf ("%u sectors per FAT, %u reserved sectors, %lu clusters free\n", geom.sectors_per_fat, stats.reserved_sectors, stats.free_clusters);
+        printf ("%lu clusters %s\n", stats.relocated, resize->check ? "to relocate" : "relocated");
+    
+    }
+    
+    if (dosfs_close (img) < 0) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "failed whilst writing '%s'", resize->outfile);
+        return EXIT_FAILURE;
+    
+    }
+
+#if     !defined (__PDOS__) && !defined (_WIN32)
+
+    /** A whole-file image gives back the space it no longer uses. */
+    if (!resize->check && !resize->offset && geom.total_sectors < old_sectors) {
+    
+        FILE *fp;
+        
+        if (!(fp = fopen (resize->outfile, "r+b")) || ftruncate (fileno (fp), (off_t) geom.total_sectors * 512) < 0) {
+            report_at (program_name, 0, REPORT_WARNING, "failed to truncate '%s'", resize->outfile);
+        }
+        
+        if (fp) {
+            fclose (fp);
+        }
+    
+    }
+
+#endif
+
+    return EXIT_SUCCESS;
+
+}
@@ -0,0 +1,22 @@
+/******************************************************************************
+ * @file            mresize.h
+ *****************************************************************************/
+#ifndef     _MRESIZE_H
+#define     _MRESIZE_H
+
+#include    <stddef.h>
+
+struct mresize_state {
+
+    char **args;
+    size_t nb_args;
+    
+    const char *outfile;
+    unsigned long offset;
+    
+    size_t blocks;
+    int check, fit, index, verbose;
+
+};
+
+#endif      /* _MRESIZE_H */
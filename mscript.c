@@ -0,0 +1,761 @@
+/******************************************************************************
+ * @file            mscript.c
+ *****************************************************************************/
+#include    <ctype.h>
+#include    <errno.h>
+#include    <limits.h>
+#include    <stddef.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+
+#include    "dosfs.h"
+#include    "lib.h"
+#include    "mkfs.h"
+#include    "mscript.h"
+#include    "report.h"
+
+#ifndef     PATH_MAX
+# define    PATH_MAX                    2048
+#endif
+
+#define     MAX_RESPONSE_DEPTH          16
+
+static struct mscript_state *script = 0;
+static struct dosfs_image *image = 0;
+
+struct mkfs_state *state = 0;
+const char *program_name = 0;
+
+struct option {
+
+    const char *name;
+    int index, flags;
+
+};
+
+#define     OPTION_NO_ARG               0x0001
+#define     OPTION_HAS_ARG              0x0002
+
+enum options {
+
+    OPTION_IGNORED = 1,
+    OPTION_HELP,
+    OPTION_INPUT,
+    OPTION_OFFSET
+
+};
+
+static struct option opts[] = {
+
+    { "i",          OPTION_INPUT,       OPTION_HAS_ARG  },
+    
+    { "-help",      OPTION_HELP,        OPTION_NO_ARG   },
+    { "-offset",    OPTION_OFFSET,      OPTION_HAS_ARG  },
+    
+    { 0,            0,                  0               }
+
+};
+
+static int strstart (const char *val, const char **str) {
+
+    const char *p = val;
+    const char *q = *str;
+    
+    while (*p != '\0') {
+    
+        if (*p != *q) {
+            return 0;
+        }
+        
+        ++p;
+        ++q;
+    
+    }
+    
+    *str = q;
+    return 1;
+
+}
+
+static void print_help (int exitval) {
+
+    if (!program_name) {
+        goto _exit;
+    }
+    
+    fprintf (stderr, "Usage: %s [options] -i image [script-file ...]\n\n", program_name);
+    fprintf (stderr, "Options:\n\n");
+    
+    fprintf (stderr, "    Short options:\n\n");
+    fprintf (stderr, "        -i                Specify the input target.\n");
+    
+    fprintf (stderr, "\n");
+    
+    fprintf (stderr, "    Long options:\n\n");
+    fprintf (stderr, "        --help            Show this help information then exit.\n");
+    fprintf (stderr, "        --offset SECTOR   Write the filesystem starting at SECTOR.\n");
+    
+    fprintf (stderr, "\n");
+    
+    fprintf (stderr, "Commands (one per line, read from stdin if no script is given):\n\n");
+    fprintf (stderr, "        format [mkdosfs options]\n");
+    fprintf (stderr, "        mkdir [-p] ::directory ...\n");
+    fprintf (stderr, "        copy source-file ... ::target\n");
+    fprintf (stderr, "        copy ::source-file ... target\n");
+    fprintf (stderr, "        label LABEL\n");
+    fprintf (stderr, "        commit\n");
+    
+    fprintf (stderr, "\n");
+    fprintf (stderr, "Any argument of the form @file is replaced by the words in file.\n");
+
+_exit:
+
+    exit (exitval);
+
+}
+
+static char *read_line (FILE *fp) {
+
+    char *line = 0;
+    size_t len = 0, size = 0;
+    
+    int ch;
+    
+    while ((ch = getc (fp)) != EOF) {
+    
+        if (len + 1 >= size) {
+        
+            size = (size ? size * 2 : 256);
+            line = xrealloc (line, size);
+        
+        }
+        
+        if (ch == '\n') {
+            break;
+        }
+        
+        line[len++] = (char) ch;
+    
+    }
+    
+    if (!line) {
+    
+        if (ch == EOF) {
+            return 0;
+        }
+        
+        line = xmalloc (1);
+    
+    }
+    
+    if (len && line[len - 1] == '\r') {
+        len--;
+    }
+    
+    line[len] = '\0';
+    return line;
+
+}
+
+static void expand_response_file (const char *filename, unsigned long lineno, const char *response, char ***ptokens, size_t *pnb, int depth);
+
+/**
+ * Split line into words.  Words are separated by white space, may be
+ * enclosed in double quotes and a word starting with '#' begins a comment.
+ */
+static void tokenize (const char *filename, unsigned long lineno, const char *line, char ***ptokens, size_t *pnb, int depth) {
+
+    const char *start;
+    char *token;
+    
+    size_t len;
+    
+    for (;;) {
+    
+        while (isspace ((int) *line)) {
+            line++;
+        }
+        
+        if (*line == '\0' || *line == '#') {
+            break;
+        }
+        
+        if (*line == '"') {
+        
+            start = ++line;
+            
+            while (*line && *line != '"') {
+                line++;
+            }
+            
+            if (*line != '"') {
+            
+                report_at (filename, lineno, REPORT_ERROR, "missing terminating \" character");
+                exit (EXIT_FAILURE);
+            
+            }
+            
+            len = line++ - start;
+        
+        } else {
+        
+            start = line;
+            
+            while (*line && !isspace ((int) *line)) {
+                line++;
+            }
+            
+            len = line - start;
+        
+        }
+        
+        token = xmalloc (len + 1);
+        memcpy (token, start, len);
+        
+        if (token[0] == '@' && token[1] != '\0') {
+        
+            expand_response_file (filename, lineno, token + 1, ptokens, pnb, depth + 1);
+            free (token);
+            
+            continue;
+        
+        }
+        
+        dynarray_add (ptokens, pnb, token);
+    
+    }
+
+}
+
+static void expand_response_file (const char *filename, unsigned long lineno, const char *response, char ***ptokens, size_t *pnb, int depth) {
+
+    unsigned long response_lineno = 0;
+    char *line;
+    
+    FILE *fp;
+    
+    if (depth > MAX_RESPONSE_DEPTH) {
+    
+        report_at (filename, lineno, REPORT_ERROR, "response files nested too deeply");
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    if ((fp = fopen (response, "r")) == NULL) {
+    
+        report_at (filename, lineno, REPORT_ERROR, "failed to open response file '%s'", response);
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    while ((line = read_line (fp))) {
+    
+        tokenize (response, ++response_lineno, line, ptokens, pnb, depth);
+        free (line);
+    
+    }
+    
+    fclose (fp);
+
+}
+
+static void parse_script_args (int *pargc, char ***pargv, int optind) {
+
+    char **argv = *pargv;
+    int argc = *pargc;
+    
+    struct option *popt;
+    const char *optarg, *r;
+    
+    if (argc == optind) {
+        print_help (EXIT_SUCCESS);
+    }
+    
+    while (optind < argc) {
+    
+        r = argv[optind++];
+        
+        if (r[0] != '-' || r[1] == '\0') {
+        
+            dynarray_add (&script->files, &script->nb_files, xstrdup (r));
+            continue;
+        
+        }
+        
+        for (popt = opts; popt; ++popt) {
+        
+            const char *p1 = popt->name;
+            const char *r1 = (r + 1);
+            
+            if (!p1) {
+            
+                report_at (program_name, 0, REPORT_ERROR, "invalid option -- '%s'", r);
+                exit (EXIT_FAILURE);
+            
+            }
+            
+            if (!strstart (p1, &r1)) {
+                continue;
+            }
+            
+            optarg = r1;
+            
+            if (popt->flags & OPTION_HAS_ARG) {
+            
+                if (*optarg == '\0') {
+                
+                    if (optind >= argc) {
+                    
+                        report_at (program_name, 0, REPORT_ERROR, "argument to '%s' is missing", r);
+                        exit (EXIT_FAILURE);
+                    
+                    }
+                    
+                    optarg = argv[optind++];
+                
+                }
+            
+            } else if (*optarg != '\0') {
+                continue;
+            }
+            
+            break;
+        
+        }
+        
+        switch (popt->index) {
+        
+            case OPTION_HELP: {
+            
+                print_help (EXIT_SUCCESS);
+                break;
+            
+            }
+            
+            case OPTION_INPUT: {
+            
+                if (script->outfile) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "multiple output files provided");
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                script->outfile = xstrdup (optarg);
+                break;
+            
+            }
+            
+            case OPTION_OFFSET: {
+            
+                long conversion;
+                char *temp;
+                
+                errno = 0;
+                conversion = strtol (optarg, &temp, 0);
+                
+                if (!*optarg || isspace ((int) *optarg) || errno || *temp) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "bad number for offset (%s)", optarg);
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                if (conversion < 0 || (unsigned long) conversion > UINT_MAX) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "offset must be between 0 and %u", UINT_MAX);
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                script->offset = (unsigned long) conversion;
+                break;
+            
+            }
+            
+            default: {
+            
+                report_at (program_name, 0, REPORT_ERROR, "unsupported option '%s'", r);
+                exit (EXIT_FAILURE);
+            
+            }
+        
+        }
+    
+    }
+
+}
+
+static struct dosfs_image *get_image (const char *filename, unsigned long lineno) {
+
+    int error;
+    
+    if (image) {
+        return image;
+    }
+    
+    if (!(image = dosfs_open (script->outfile, script->offset, DOSFS_SOURCE_DATE, &error))) {
+    
+        report_at (filename, lineno, REPORT_ERROR, "failed to open '%s': %s", script->outfile, dosfs_strerror (error));
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    return image;
+
+}
+
+static const char *image_path (const char *path) {
+
+    if (path[0] == ':' && path[1] == ':') {
+        path += 2;
+    }
+    
+    return (*path ? path : "/");
+
+}
+
+static const char *basename_of (const char *path) {
+
+    const char *p = path + strlen (path);
+    
+    while (p > path && p[-1] != '/' && p[-1] != '\\') {
+        p--;
+    }
+    
+    return p;
+
+}
+
+static void do_format (const char *filename, unsigned long lineno, char **args, size_t nb_args) {
+
+    if (image) {
+    
+        if (dosfs_close (image) < 0) {
+        
+            report_at (filename, lineno, REPORT_ERROR, "failed to commit '%s'", script->outfile);
+            exit (EXIT_FAILURE);
+        
+        }
+        
+        image = 0;
+    
+    }
+    
+    memset (state, 0, sizeof (*state));
+    
+    state->outfile = script->outfile;
+    state->offset = script->offset;
+    
+    if (nb_args > 1) {
+    
+        int argc = (int) nb_args;
+        parse_args (&argc, &args, 1);
+    
+    } else {
+        memcpy (state->label, "NO NAME    ", 11);
+    }
+    
+    if (make_filesystem () != EXIT_SUCCESS) {
+    
+        report_at (filename, lineno, REPORT_ERROR, "failed to format '%s'", script->outfile);
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    script->offset = state->offset;
+
+}
+
+static void do_mkdir (const char *filename, unsigned long lineno, char **args, size_t nb_args) {
+
+    struct dosfs_image *img = get_image (filename, lineno);
+    
+    int flags = 0;
+    size_t i = 1;
+    
+    if (i < nb_args && strcmp (args[i], "-p") == 0) {
+    
+        flags |= DOSFS_MKDIR_PARENTS;
+        i++;
+    
+    }
+    
+    if (i >= nb_args) {
+    
+        report_at (filename, lineno, REPORT_ERROR, "mkdir: missing operand");
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    for (; i < nb_args; i++) {
+    
+        if (dosfs_mkdir (img, image_path (args[i]), flags) < 0) {
+        
+            report_at (filename, lineno, REPORT_ERROR, "failed to create '%s': %s", args[i], dosfs_strerror (img->error));
+            exit (EXIT_FAILURE);
+        
+        }
+    
+    }
+
+}
+
+static void do_copy (const char *filename, unsigned long lineno, char **args, size_t nb_args) {
+
+    struct dosfs_image *img = get_image (filename, lineno);
+    
+    char tmppath[PATH_MAX];
+    const char *target;
+    
+    size_t i;
+    
+    if (nb_args < 3) {
+    
+        report_at (filename, lineno, REPORT_ERROR, "copy: missing operand");
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    target = args[nb_args - 1];
+    
+    if (target[0] == ':' && target[1] == ':') {
+    
+        for (i = 1; i < nb_args - 1; i++) {
+        
+            if (args[i][0] == ':' && args[i][1] == ':') {
+            
+                report_at (filename, lineno, REPORT_ERROR, "copy: cannot copy within the image");
+                exit (EXIT_FAILURE);
+            
+            }
+            
+            if (dosfs_copy_in (img, args[i], image_path (target)) < 0) {
+            
+                report_at (filename, lineno, REPORT_ERROR, "failed to copy '%s': %s", args[i], dosfs_strerror (img->error));
+                exit (EXIT_FAILURE);
+            
+            }
+        
+        }
+        
+        return;
+    
+    }
+    
+    for (i = 1; i < nb_args - 1; i++) {
+    
+        const char *dest = target;
+        
+        if (args[i][0] != ':' || args[i][1] != ':') {
+        
+            report_at (filename, lineno, REPORT_ERROR, "copy: either the source or target must be in the image");
+            exit (EXIT_FAILURE);
+        
+        }
+        
+        /** Several sources or a trailing separator means target is a directory. */
+        if (nb_args > 3 || target[strlen (target) - 1] == '/' || target[strlen (target) - 1] == '\\') {
+        
+            if (strlen (target) + strlen (basename_of (args[i])) + 2 > sizeof (tmppath)) {
+            
+                report_at (filename, lineno, REPORT_ERROR, "target too long");
+                exit (EXIT_FAILURE);
+            
+            }
+            
+            strcpy (tmppath, target);
+            
+            if (target[strlen (target) - 1] != '/' && target[strlen (target) - 1] != '\\') {
+                strcat (tmppath, "/");
+            }
+            
+            strcat (tmppath, basename_of (args[i]));
+            dest = tmppath;
+        
+        }
+        
+        if (dosfs_copy_out (img, image_path (args[i]), dest) < 0) {
+        
+            report_at (filename, lineno, REPORT_ERROR, "failed to copy '%s': %s", args[i], dosfs_strerror (img->error));
+            exit (EXIT_FAILURE);
+        
+        }
+    
+    }
+
+}
+
+static void do_label (const char *filename, unsigned long lineno, char **args, size_t nb_args) {
+
+    struct dosfs_image *img = get_image (filename, lineno);
+    
+    if (nb_args != 2) {
+    
+        report_at (filename, lineno, REPORT_ERROR, "label: expected a single volume label");
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    if (dosfs_set_label (img, args[1]) < 0) {
+    
+        report_at (filename, lineno, REPORT_ERROR, "failed to set label: %s", dosfs_strerror (img->error));
+        exit (EXIT_FAILURE);
+    
+    }
+
+}
+
+static void do_commit (const char *filename, unsigned long lineno, char **args, size_t nb_args) {
+
+    (void) args;
+    (void) nb_args;
+    
+    if (image && dosfs_commit (image) < 0) {
+    
+        report_at (filename, lineno, REPORT_ERROR, "failed to commit '%s': %s", script->outfile, dosfs_strerror (image->error));
+        exit (EXIT_FAILURE);
+    
+    }
+
+}
+
+struct command {
+
+    const char *name;
+    void (*handler) (const char *filename, unsigned long lineno, char **args, size_t nb_args);
+
+};
+
+static struct command commands[] = {
+
+    { "commit",     &do_commit      },
+    { "copy",       &do_copy        },
+    { "format",     &do_format      },
+    { "label",      &do_label       },
+    { "mkdir",      &do_mkdir       },
+    
+    { 0,            0               }
+
+};
+
+static void run_script (const char *filename) {
+
+    unsigned long lineno = 0;
+    char *line;
+    
+    struct command *cmd;
+    FILE *fp;
+    
+    if (strcmp (filename, "-") == 0) {
+    
+        filename = "<stdin>";
+        fp = stdin;
+    
+    } else if ((fp = fopen (filename, "r")) == NULL) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "failed to open '%s'", filename);
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    while ((line = read_line (fp))) {
+    
+        char **tokens = 0;
+        size_t i, nb_tokens = 0;
+        
+        tokenize (filename, ++lineno, line, &tokens, &nb_tokens, 0);
+        free (line);
+        
+        if (!nb_tokens) {
+            continue;
+        }
+        
+        for (cmd = commands; cmd->name; cmd++) {
+        
+            if (strcmp (cmd->name, tokens[0]) == 0) {
+                break;
+            }
+        
+        }
+        
+        if (!cmd->name) {
+        
+            report_at (filename, lineno, REPORT_ERROR, "unknown command '%s'", tokens[0]);
+            exit (EXIT_FAILURE);
+        
+        }
+        
+        cmd->handler (filename, lineno, tokens, nb_tokens);
+        
+        for (i = 0; i < nb_tokens; i++) {
+            free (tokens[i]);
+        }
+        
+        free (tokens);
+    
+    }
+    
+    if (fp != stdin) {
+        fclose (fp);
+    }
+
+}
+
+int main (int argc, char **argv) {
+
+    char **args = 0;
+    size_t i, nb_args = 0;
+    
+    if (argc && *argv) {
+    
+        char *p;
+        program_name = *argv;
+        
+        if ((p = strrchr (program_name, '/'))) {
+            program_name = (p + 1);
+        }
+    
+    }
+    
+    script = xmalloc (sizeof (*script));
+    state = xmalloc (sizeof (*state));
+    
+    for (i = 0; i < (size_t) argc; i++) {
+    
+        if (i && argv[i][0] == '@' && argv[i][1] != '\0') {
+            expand_response_file (program_name, 0, argv[i] + 1, &args, &nb_args, 0);
+        } else {
+            dynarray_add (&args, &nb_args, xstrdup (argv[i]));
+        }
+    
+    }
+    
+    argc = (int) nb_args;
+    argv = args;
+    
+    parse_script_args (&argc, &argv, 1);
+    
+    if (!script->outfile) {
+        print_help (EXIT_FAILURE);
+    }
+    
+    if (!script->nb_files) {
+        run_script ("-");
+    }
+    
+    for (i = 0; i < script->nb_files; i++) {
+        run_script (script->files[i]);
+    }
+    
+    if (image && dosfs_close (image) < 0) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "failed to commit '%s'", script->outfile);
+        return EXIT_FAILURE;
+    
+    }
+    
+    return EXIT_SUCCESS;
+
+}
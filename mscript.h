@@ -0,0 +1,19 @@
+/******************************************************************************
+ * @file            mscript.h
+ *****************************************************************************/
+#ifndef     _MSCRIPT_H
+#define     _MSCRIPT_H
+
+#include    <stddef.h>
+
+struct mscript_state {
+
+    char **files;
+    size_t nb_files;
+    
+    const char *outfile;
+    size_t offset;
+
+};
+
+#endif      /* _MSCRIPT_H */
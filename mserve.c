@@ -0,0 +1,1009 @@
+/******************************************************************************
+ * @file            mserve.c
+ *****************************************************************************/
+#if     !defined (__PDOS__) && !defined (_WIN32)
+# define    _POSIX_C_SOURCE             200112L
+#endif
+
+#include    <ctype.h>
+#include    <errno.h>
+#include    <limits.h>
+#include    <signal.h>
+#include    <stddef.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+
+#if     !defined (__PDOS__) && !defined (_WIN32)
+# include   <sys/socket.h>
+# include   <sys/stat.h>
+# include   <sys/un.h>
+# include   <unistd.h>
+#endif
+
+#include    "dosfs.h"
+#include    "mserve.h"
+#include    "msdos.h"
+#include    "report.h"
+
+#ifndef     PATH_MAX
+# define    PATH_MAX                    2048
+#endif
+
+#define     MAX_REQUEST_SIZE            (1024L * 1024L)
+
+static struct mserve_state *state = 0;
+static const char *program_name = 0;
+
+struct option {
+
+    const char *name;
+    int index, flags;
+
+};
+
+#define     OPTION_NO_ARG               0x0001
+#define     OPTION_HAS_ARG              0x0002
+
+enum options {
+
+    OPTION_IGNORED = 1,
+    OPTION_CLIENT,
+    OPTION_HELP,
+    OPTION_INPUT,
+    OPTION_OFFSET,
+    OPTION_SOCKET
+
+};
+
+static struct option opts[] = {
+
+    { "c",          OPTION_CLIENT,      OPTION_NO_ARG   },
+    { "i",          OPTION_INPUT,       OPTION_HAS_ARG  },
+    
+    { "-client",    OPTION_CLIENT,      OPTION_NO_ARG   },
+    { "-help",      OPTION_HELP,        OPTION_NO_ARG   },
+    { "-offset",    OPTION_OFFSET,      OPTION_HAS_ARG  },
+    { "-socket",    OPTION_SOCKET,      OPTION_HAS_ARG  },
+    
+    { 0,            0,                  0               }
+
+};
+
+static int strstart (const char *val, const char **str) {
+
+    const char *p = val;
+    const char *q = *str;
+    
+    while (*p != '\0') {
+    
+        if (*p != *q) {
+            return 0;
+        }
+        
+        ++p;
+        ++q;
+    
+    }
+    
+    *str = q;
+    return 1;
+
+}
+
+static void print_help (int exitval) {
+
+    if (!program_name) {
+        goto _exit;
+    }
+    
+    fprintf (stderr, "Usage: %s [options] -i image --socket path\n", program_name);
+    fprintf (stderr, "       %s --socket path -c command [arguments]\n\n", program_name);
+    fprintf (stderr, "Options:\n\n");
+    
+    fprintf (stderr, "    Short options:\n\n");
+    fprintf (stderr, "        -c                Send a single command to a running server.\n");
+    fprintf (stderr, "        -i                Specify the input target.\n");
+    
+    fprintf (stderr, "\n");
+    
+    fprintf (stderr, "    Long options:\n\n");
+    fprintf (stderr, "        --client          Send a single command to a running server.\n");
+    fprintf (stderr, "        --help            Show this help information then exit.\n");
+    fprintf (stderr, "        --offset SECTOR   Write the filesystem starting at SECTOR.\n");
+    fprintf (stderr, "        --socket PATH     Listen on (or connect to) the socket PATH.\n");
+    
+    fprintf (stderr, "\n");
+    
+    fprintf (stderr, "Commands:\n\n");
+    fprintf (stderr, "        mkdir [-p] ::directory ...\n");
+    fprintf (stderr, "        copy source-file ... ::target\n");
+    fprintf (stderr, "        copy ::source-file ... target\n");
+    fprintf (stderr, "        list [::directory]\n");
+    fprintf (stderr, "        stat ::file\n");
+    fprintf (stderr, "        commit\n");
+    fprintf (stderr, "        shutdown\n");
+
+_exit:
+
+    exit (exitval);
+
+}
+
+static void *xmalloc (size_t size) {
+
+    void *ptr = malloc (size);
+    
+    if (ptr == NULL && size) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "memory full (malloc)");
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    memset (ptr, 0, size);
+    return ptr;
+
+}
+
+static void *xrealloc (void *ptr, size_t size) {
+
+    void *new_ptr = realloc (ptr, size);
+    
+    if (new_ptr == NULL && size) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "memory full (realloc)");
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    return new_ptr;
+
+}
+
+static char *xstrdup (const char *str) {
+
+    char *ptr = xmalloc (strlen (str) + 1);
+    strcpy (ptr, str);
+    
+    return ptr;
+
+}
+
+static void dynarray_add (void *ptab, size_t *nb_ptr, void *data) {
+
+    int nb, nb_alloc;
+    void **pp;
+    
+    nb = *nb_ptr;
+    pp = *(void ***) ptab;
+    
+    if ((nb & (nb - 1)) == 0) {
+    
+        if (!nb) {
+            nb_alloc = 1;
+        } else {
+            nb_alloc = nb * 2;
+        }
+        
+        pp = xrealloc (pp, nb_alloc * sizeof (void *));
+        *(void ***) ptab = pp;
+    
+    }
+    
+    pp[nb++] = data;
+    *nb_ptr = nb;
+
+}
+
+static void parse_args (int *pargc, char ***pargv, int optind) {
+
+    char **argv = *pargv;
+    int argc = *pargc;
+    
+    struct option *popt;
+    const char *optarg, *r;
+    
+    if (argc == optind) {
+        print_help (EXIT_SUCCESS);
+    }
+    
+    while (optind < argc) {
+    
+        r = argv[optind++];
+        
+        if (r[0] != '-' || r[1] == '\0') {
+        
+            if (!state->client) {
+            
+                report_at (program_name, 0, REPORT_ERROR, "unexpected argument '%s'", r);
+                exit (EXIT_FAILURE);
+            
+            }
+            
+            /** Everything from the command name on is passed to the server untouched. */
+            dynarray_add (&state->args, &state->nb_args, xstrdup (r));
+            
+            while (optind < argc) {
+                dynarray_add (&state->args, &state->nb_args, xstrdup (argv[optind++]));
+            }
+            
+            break;
+        
+        }
+        
+        for (popt = opts; popt; ++popt) {
+        
+            const char *p1 = popt->name;
+            const char *r1 = (r + 1);
+            
+            if (!p1) {
+            
+                report_at (program_name, 0, REPORT_ERROR, "invalid option -- '%s'", r);
+                exit (EXIT_FAILURE);
+            
+            }
+            
+            if (!strstart (p1, &r1)) {
+                continue;
+            }
+            
+            optarg = r1;
+            
+            if (popt->flags & OPTION_HAS_ARG) {
+            
+                if (*optarg == '\0') {
+                
+                    if (optind >= argc) {
+                    
+                        report_at (program_name, 0, REPORT_ERROR, "argument to '%s' is missing", r);
+                        exit (EXIT_FAILURE);
+                    
+                    }
+                    
+                    optarg = argv[optind++];
+                
+                }
+            
+            } else if (*optarg != '\0') {
+                continue;
+            }
+            
+            break;
+        
+        }
+        
+        switch (popt->index) {
+        
+            case OPTION_CLIENT: {
+            
+                state->client = 1;
+                break;
+            
+            }
+            
+            case OPTION_HELP: {
+            
+                print_help (EXIT_SUCCESS);
+                break;
+            
+            }
+            
+            case OPTION_INPUT: {
+            
+                if (state->outfile) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "multiple output files provided");
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->outfile = xstrdup (optarg);
+                break;
+            
+            }
+            
+            case OPTION_OFFSET: {
+            
+                long conversion;
+                char *temp;
+                
+                errno = 0;
+                conversion = strtol (optarg, &temp, 0);
+                
+                if (!*optarg || isspace ((int) *optarg) || errno || *temp) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "bad number for offset (%s)", optarg);
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                if (conversion < 0 || (unsigned long) conversion > UINT_MAX) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "offset must be between 0 and %u", UINT_MAX);
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->offset = (unsigned long) conversion;
+                break;
+            
+            }
+            
+            case OPTION_SOCKET: {
+            
+                state->socket = xstrdup (optarg);
+                break;
+            
+            }
+            
+            default: {
+            
+                report_at (program_name, 0, REPORT_ERROR, "unsupported option '%s'", r);
+                exit (EXIT_FAILURE);
+            
+            }
+        
+        }
+    
+    }
+
+}
+
+#if     !defined (__PDOS__) && !defined (_WIN32)
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_signal (int sig) {
+
+    (void) sig;
+    stop_requested = 1;
+
+}
+
+/**
+ * Every message in either direction is a frame: a four byte big-endian
+ * length followed by that many bytes of payload.  A request payload is the
+ * command and its arguments, each terminated by a NUL byte.  A response
+ * payload is a status byte (zero on success) followed by text.
+ */
+static int read_full (int fd, void *buffer, size_t len) {
+
+    unsigned char *p = buffer;
+    ssize_t bytes;
+    
+    while (len > 0) {
+    
+        if ((bytes = read (fd, p, len)) < 0) {
+        
+            if (errno == EINTR && !stop_requested) {
+                continue;
+            }
+            
+            return -1;
+        
+        }
+        
+        if (bytes == 0) {
+            return -1;
+        }
+        
+        p += bytes;
+        len -= bytes;
+    
+    }
+    
+    return 0;
+
+}
+
+static int write_full (int fd, const void *buffer, size_t len) {
+
+    const unsigned char *p = buffer;
+    ssize_t bytes;
+    
+    while (len > 0) {
+    
+        if ((bytes = write (fd, p, len)) < 0) {
+        
+            if (errno == EINTR) {
+                continue;
+            }
+            
+            return -1;
+        
+        }
+        
+        p += bytes;
+        len -= bytes;
+    
+    }
+    
+    return 0;
+
+}
+
+static int send_frame (int fd, const void *data, unsigned long len) {
+
+    unsigned char header[4];
+    
+    header[0] = (unsigned char) (len >> 24);
+    header[1] = (unsigned char) (len >> 16);
+    header[2] = (unsigned char) (len >> 8);
+    header[3] = (unsigned char) len;
+    
+    if (write_full (fd, header, 4) < 0) {
+        return -1;
+    }
+    
+    return write_full (fd, data, len);
+
+}
+
+static int recv_frame (int fd, char **data, unsigned long *len, unsigned long max) {
+
+    unsigned char header[4];
+    
+    if (read_full (fd, header, 4) < 0) {
+        return -1;
+    }
+    
+    *len = ((unsigned long) header[0] << 24) | ((unsigned long) header[1] << 16) | ((unsigned long) header[2] << 8) | (unsigned long) header[3];
+    
+    if (*len > max) {
+        return -1;
+    }
+    
+    *data = xmalloc (*len + 1);
+    
+    if (read_full (fd, *data, *len) < 0) {
+    
+        free (*data);
+        return -1;
+    
+    }
+    
+    return 0;
+
+}
+
+struct reply {
+
+    char *data;
+    unsigned long len, size;
+
+};
+
+static void reply_append (struct reply *r, const char *text) {
+
+    size_t len = strlen (text);
+    
+    if (r->len + len > r->size) {
+    
+        while (r->len + len > r->size) {
+            r->size = (r->size ? r->size * 2 : 256);
+        }
+        
+        r->data = xrealloc (r->data, r->size);
+    
+    }
+    
+    memcpy (r->data + r->len, text, len);
+    r->len += len;
+
+}
+
+static void reply_error (struct reply *r, const char *what, const char *path, int error) {
+
+    const char *message = (error == DOSFS_OK ? "" : dosfs_strerror (error));
+    char *text = xmalloc (strlen (what) + strlen (path) + strlen (message) + 8);
+    
+    /** The first byte of a response is the status. */
+    r->data[0] = 1;
+    
+    if (*message) {
+        sprintf (text, "%s '%s': %s", what, path, message);
+    } else if (*path) {
+        sprintf (text, "%s '%s'", what, path);
+    } else {
+        strcpy (text, what);
+    }
+    
+    reply_append (r, text);
+    
+    free (text);
+
+}
+
+static const char *image_path (const char *path) {
+
+    if (path[0] == ':' && path[1] == ':') {
+        path += 2;
+    }
+    
+    return (*path ? path : "/");
+
+}
+
+static void reply_stat (struct reply *r, struct dosfs_stat *st) {
+
+    char line[128];
+    
+    sprintf (line, "%s\t%c\t%lu\t%04d-%02d-%02d %02d:%02d:%02d\n", st->name, (st->attr & ATTR_DIR) ? 'd' : 'f', st->size,
+        ((st->date >> 9) & 0x7f) + 1980, (st->date >> 5) & 0x0f, st->date & 0x1f, (st->time >> 11) & 0x1f, (st->time >> 5) & 0x3f, (st->time & 0x1f) << 1);
+    
+    reply_append (r, line);
+
+}
+
+static int do_commit (struct dosfs_image *img, char **args, size_t nb_args, struct reply *r) {
+
+    (void) args;
+    (void) nb_args;
+    
+    if (dosfs_commit (img) < 0) {
+        reply_error (r, "failed to commit", state->outfile, img->error);
+    }
+    
+    return 0;
+
+}
+
+static int do_copy (struct dosfs_image *img, char **args, size_t nb_args, struct reply *r) {
+
+    char tmppath[PATH_MAX];
+    const char *target;
+    
+    size_t i;
+    
+    if (nb_args < 3) {
+    
+        reply_error (r, "copy: missing operand", "", DOSFS_OK);
+        return 0;
+    
+    }
+    
+    target = args[nb_args - 1];
+    
+    for (i = 1; i < nb_args - 1; i++) {
+    
+        int to_image = (target[0] == ':' && target[1] == ':');
+        int from_image = (args[i][0] == ':' && args[i][1] == ':');
+        
+        if (to_image == from_image) {
+        
+            reply_error (r, "copy: exactly one side must be in the image", args[i], DOSFS_OK);
+            return 0;
+        
+        }
+        
+        if (to_image) {
+        
+            if (dosfs_copy_in (img, args[i], image_path (target)) < 0) {
+            
+                reply_error (r, "failed to copy", args[i], img->error);
+                return 0;
+            
+            }
+            
+            continue;
+        
+        }
+        
+        strcpy (tmppath, target);
+        
+        /** Several sources or a trailing separator means target is a directory. */
+        if (nb_args > 3 || target[strlen (target) - 1] == '/') {
+        
+            const char *base = args[i] + strlen (args[i]);
+            
+            while (base > args[i] + 2 && base[-1] != '/' && base[-1] != '\\') {
+                base--;
+            }
+            
+            if (strlen (target) + strlen (base) + 2 > sizeof (tmppath)) {
+            
+                reply_error (r, "target too long", target, DOSFS_OK);
+                return 0;
+            
+            }
+            
+            if (target[strlen (target) - 1] != '/') {
+                strcat (tmppath, "/");
+            }
+            
+            strcat (tmppath, base);
+        
+        }
+        
+        if (dosfs_copy_out (img, image_path (args[i]), tmppath) < 0) {
+        
+            reply_error (r, "failed to copy", args[i], img->error);
+            return 0;
+        
+        }
+    
+    }
+    
+    return 0;
+
+}
+
+static int do_list (struct dosfs_image *img, char **args, size_t nb_args, struct reply *r) {
+
+    struct dosfs_dirstream *ds;
+    struct dosfs_stat st;
+    
+    const char *path = (nb_args > 1 ? image_path (args[1]) : "/");
+    
+    if (!(ds = dosfs_opendir (img, path))) {
+    
+        reply_error (r, "failed to open directory", path, img->error);
+        return 0;
+    
+    }
+    
+    while (dosfs_readdir (ds, &st) > 0) {
+        reply_stat (r, &st);
+    }
+    
+    dosfs_closedir (ds);
+    return 0;
+
+}
+
+static int do_mkdir (struct dosfs_image *img, char **args, size_t nb_args, struct reply *r) {
+
+    int flags = 0;
+    size_t i = 1;
+    
+    if (i < nb_args && strcmp (args[i], "-p") == 0) {
+    
+        flags |= DOSFS_MKDIR_PARENTS;
+        i++;
+    
+    }
+    
+    for (; i < nb_args; i++) {
+    
+        if (dosfs_mkdir (img, image_path (args[i]), flags) < 0) {
+        
+            reply_error (r, "failed to create", args[i], img->error);
+            return 0;
+        
+        }
+    
+    }
+    
+    return 0;
+
+}
+
+static int do_shutdown (struct dosfs_image *img, char **args, size_t nb_args, struct reply *r) {
+
+    do_commit (img, args, nb_args, r);
+    return 1;
+
+}
+
+static int do_stat (struct dosfs_image *img, char **args, size_t nb_args, struct reply *r) {
+
+    struct dosfs_stat st;
+    
+    if (nb_args != 2) {
+    
+        reply_error (r, "stat: expected a single path", "", DOSFS_OK);
+        return 0;
+    
+    }
+    
+    if (dosfs_stat (img, image_path (args[1]), &st) < 0) {
+    
+        reply_error (r, "failed to stat", args[1], img->error);
+        return 0;
+    
+    }
+    
+    reply_stat (r, &st);
+    return 0;
+
+}
+
+struct command {
+
+    const char *name;
+    int (*handler) (struct dosfs_image *img, char **args, size_t nb_args, struct reply *r);
+
+};
+
+static struct command commands[] = {
+
+    { "commit",     &do_commit      },
+    { "copy",       &do_copy        },
+    { "list",       &do_list        },
+    { "mkdir",      &do_mkdir       },
+    { "shutdown",   &do_shutdown    },
+    { "stat",       &do_stat        },
+    
+    { 0,            0               }
+
+};
+
+/** Serve requests on one connection until it closes; returns 1 on shutdown. */
+static int serve_connection (struct dosfs_image *img, int fd) {
+
+    struct command *cmd;
+    struct reply r;
+    
+    char *request, *p, **args;
+    unsigned long len;
+    
+    size_t nb_args;
+    int done = 0;
+    
+    while (!done && !stop_requested && recv_frame (fd, &request, &len, MAX_REQUEST_SIZE) == 0) {
+    
+        args = 0;
+        nb_args = 0;
+        
+        for (p = request; p < request + len; p += strlen (p) + 1) {
+            dynarray_add (&args, &nb_args, p);
+        }
+        
+        memset (&r, 0, sizeof (r));
+        reply_append (&r, " ");
+        
+        r.data[0] = 0;
+        
+        if (!nb_args) {
+            reply_error (&r, "empty request", "", DOSFS_OK);
+        } else {
+        
+            for (cmd = commands; cmd->name; cmd++) {
+            
+                if (strcmp (cmd->name, args[0]) == 0) {
+                    break;
+                }
+            
+            }
+            
+            if (!cmd->name) {
+                reply_error (&r, "unknown command", args[0], DOSFS_OK);
+            } else {
+                done = cmd->handler (img, args, nb_args, &r);
+            }
+        
+        }
+        
+        /** A client that went away is noticed by the next recv_frame. */
+        send_frame (fd, r.data, r.len);
+        
+        free (r.data);
+        free (args);
+        free (request);
+    
+    }
+    
+    return done;
+
+}
+
+static int run_server (void) {
+
+    struct dosfs_image *img;
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct stat sb;
+    
+    int error, fd, client;
+    
+    if (strlen (state->socket) >= sizeof (addr.sun_path)) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "socket path '%s' is too long", state->socket);
+        return EXIT_FAILURE;
+    
+    }
+    
+    if (!(img = dosfs_open (state->outfile, state->offset, DOSFS_SOURCE_DATE, &error))) {
+    
+        if (error == DOSFS_ERR_INVALID) {
+            report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
+        } else if (error == DOSFS_ERR_SOURCE_DATE) {
+            report_at (program_name, 0, REPORT_ERROR, "%s", dosfs_strerror (error));
+        } else {
+            report_at (program_name, 0, REPORT_ERROR, "faild to open '%s' for writing", state->outfile);
+        }
+        
+        return EXIT_FAILURE;
+    
+    }
+    
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = handle_signal;
+    
+    sigemptyset (&sa.sa_mask);
+    sigaction (SIGINT, &sa, 0);
+    sigaction (SIGTERM, &sa, 0);
+    
+    signal (SIGPIPE, SIG_IGN);
+    
+    /** Only replace a stale socket, never some other file that happens to be there. */
+    if (stat (state->socket, &sb) == 0 && S_ISSOCK (sb.st_mode)) {
+        unlink (state->socket);
+    }
+    
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    
+    strcpy (addr.sun_path, state->socket);
+    
+    if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0 || bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 || listen (fd, 8) < 0) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "failed to listen on '%s'", state->socket);
+        
+        dosfs_close (img);
+        return EXIT_FAILURE;
+    
+    }
+    
+    while (!stop_requested) {
+    
+        if ((client = accept (fd, 0, 0)) < 0) {
+        
+            if (errno == EINTR) {
+                continue;
+            }
+            
+            report_at (program_name, 0, REPORT_ERROR, "failed to accept a connection");
+            break;
+        
+        }
+        
+        if (serve_connection (img, client)) {
+            stop_requested = 1;
+        }
+        
+        close (client);
+    
+    }
+    
+    close (fd);
+    unlink (state->socket);
+    
+    if (dosfs_close (img) < 0) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "failed whilst writing '%s'", state->outfile);
+        return EXIT_FAILURE;
+    
+    }
+    
+    return EXIT_SUCCESS;
+
+}
+
+static int run_client (void) {
+
+    struct sockaddr_un addr;
+    
+    char cwd[PATH_MAX], *request = 0, *response;
+    unsigned long len = 0, response_len;
+    
+    size_t i;
+    int fd;
+    
+    if (strlen (state->socket) >= sizeof (addr.sun_path)) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "socket path '%s' is too long", state->socket);
+        return EXIT_FAILURE;
+    
+    }
+    
+    if (!getcwd (cwd, sizeof (cwd))) {
+        cwd[0] = '\0';
+    }
+    
+    for (i = 0; i < state->nb_args; i++) {
+    
+        const char *arg = state->args[i];
+        size_t arglen = strlen (arg) + 1;
+        
+        /** The server has its own working directory, so host paths are made absolute. */
+        int relative = (i > 0 && strcmp (state->args[0], "copy") == 0 && arg[0] != '/' && !(arg[0] == ':' && arg[1] == ':'));
+        
+        if (relative) {
+            arglen += strlen (cwd) + 1;
+        }
+        
+        request = xrealloc (request, len + arglen);
+        
+        if (relative) {
+            sprintf (request + len, "%s/%s", cwd, arg);
+        } else {
+            strcpy (request + len, arg);
+        }
+        
+        len += arglen;
+    
+    }
+    
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    
+    strcpy (addr.sun_path, state->socket);
+    
+    if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0 || connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "failed to connect to '%s'", state->socket);
+        return EXIT_FAILURE;
+    
+    }
+    
+    if (send_frame (fd, request, len) < 0 || recv_frame (fd, &response, &response_len, ULONG_MAX - 1) < 0 || response_len == 0) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "no response from '%s'", state->socket);
+        
+        close (fd);
+        return EXIT_FAILURE;
+    
+    }
+    
+    close (fd);
+    
+    if (response[0]) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "%s", response + 1);
+        return EXIT_FAILURE;
+    
+    }
+    
+    fwrite (response + 1, response_len - 1, 1, stdout);
+    return EXIT_SUCCESS;
+
+}
+#endif
+
+int main (int argc, char **argv) {
+
+    if (argc && *argv) {
+    
+        char *p;
+        program_name = *argv;
+        
+        if ((p = strrchr (program_name, '/'))) {
+            program_name = (p + 1);
+        }
+    
+    }
+    
+    state = xmalloc (sizeof (*state));
+    parse_args (&argc, &argv, 1);
+    
+    if (!state->socket) {
+        print_help (EXIT_FAILURE);
+    }
+
+#if     defined (__PDOS__) || defined (_WIN32)
+
+    report_at (program_name, 0, REPORT_ERROR, "unix domain sockets are not supported on this platform");
+    return EXIT_FAILURE;
+
+#else
+
+    if (state->client) {
+    
+        if (!state->nb_args) {
+            print_help (EXIT_FAILURE);
+        }
+        
+        return run_client ();
+    
+    }
+    
+    if (!state->outfile) {
+        print_help (EXIT_FAILURE);
+    }
+    
+    return run_server ();
+
+#endif
+
+}
@@ -0,0 +1,21 @@
+/******************************************************************************
+ * @file            mserve.h
+ *****************************************************************************/
+#ifndef     _MSERVE_H
+#define     _MSERVE_H
+
+#include    <stddef.h>
+
+struct mserve_state {
+
+    char **args;
+    size_t nb_args;
+    
+    const char *outfile, *socket;
+    size_t offset;
+    
+    int client;
+
+};
+
+#endif      /* _MSERVE_H */
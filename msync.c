@@ -0,0 +1,1432 @@
+/******************************************************************************
+ * @file            msync.c
+ *****************************************************************************/
+#if     !defined (__PDOS__) && !defined (_WIN32)
+# define    _POSIX_C_SOURCE             200112L
+#endif
+
+#include    <ctype.h>
+#include    <errno.h>
+#include    <limits.h>
+#include    <stddef.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+
+#if     defined (__GNUC__) && !defined (__PDOS__) && !defined (_WIN32)
+# define    MSYNC_THREADS
+# include   <pthread.h>
+#endif
+
+#if     defined (__linux__)
+# define    MSYNC_WATCH
+# include   <poll.h>
+# include   <signal.h>
+# include   <sys/inotify.h>
+# include   <time.h>
+# include   <unistd.h>
+#endif
+
+#include    "common.h"
+#include    "dosfs.h"
+#include    "hostdir.h"
+#include    "msdos.h"
+#include    "msync.h"
+#include    "report.h"
+
+#ifndef     PATH_MAX
+# define    PATH_MAX                    2048
+#endif
+
+#define     COPY_BUFFER_SIZE            65536
+#define     MAX_SYNC_DEPTH              64
+
+static struct msync_state *state = 0;
+static const char *program_name = 0;
+
+struct option {
+
+    const char *name;
+    int index, flags;
+
+};
+
+#define     OPTION_NO_ARG               0x0001
+#define     OPTION_HAS_ARG              0x0002
+
+enum options {
+
+    OPTION_IGNORED = 1,
+    OPTION_CONTENT,
+    OPTION_DEBOUNCE,
+    OPTION_ENTRIES,
+    OPTION_HELP,
+    OPTION_INDEX,
+    OPTION_INPUT,
+    OPTION_JOBS,
+    OPTION_OFFSET,
+    OPTION_VERBOSE,
+    OPTION_WATCH
+
+};
+
+static struct option opts[] = {
+
+    { "i",          OPTION_INPUT,       OPTION_HAS_ARG  },
+    { "j",          OPTION_JOBS,        OPTION_HAS_ARG  },
+    { "v",          OPTION_VERBOSE,     OPTION_NO_ARG   },
+    { "w",          OPTION_WATCH,       OPTION_NO_ARG   },
+    
+    { "-content",   OPTION_CONTENT,     OPTION_NO_ARG   },
+    { "-debounce",  OPTION_DEBOUNCE,    OPTION_HAS_ARG  },
+    { "-entries",   OPTION_ENTRIES,     OPTION_HAS_ARG  },
+    { "-help",      OPTION_HELP,        OPTION_NO_ARG   },
+    { "-index",     OPTION_INDEX,       OPTION_NO_ARG   },
+    { "-jobs",      OPTION_JOBS,        OPTION_HAS_ARG  },
+    { "-offset",    OPTION_OFFSET,      OPTION_HAS_ARG  },
+    { "-verbose",   OPTION_VERBOSE,     OPTION_NO_ARG   },
+    { "-watch",     OPTION_WATCH,       OPTION_NO_ARG   },
+    
+    { 0,            0,                  0               }
+
+};
+
+/**
+ * A host file that may need copying.  differs is 1 when the file has to be
+ * copied, 0 when the image already holds the same data and -1 until the
+ * contents have been compared.
+ */
+struct sync_file {
+
+    char *host, *image;
+    int differs;
+    
+    unsigned long size;
+    unsigned short date, time;
+    
+    int stamp_differs;
+
+};
+
+static struct sync_file **files = 0;
+static size_t nb_files = 0;
+
+static unsigned long nb_copied = 0, nb_created = 0, nb_deleted = 0, nb_stamped = 0;
+
+static int strstart (const char *val, const char **str) {
+
+    const char *p = val;
+    const char *q = *str;
+    
+    while (*p != '\0') {
+    
+        if (*p != *q) {
+            return 0;
+        }
+        
+        ++p;
+        ++q;
+    
+    }
+    
+    *str = q;
+    return 1;
+
+}
+
+static void print_help (int exitval) {
+
+    if (!program_name) {
+        goto _exit;
+    }
+    
+    fprintf (stderr, "Usage: %s [options] -i image hostdir [::directory]\n\n", program_name);
+    fprintf (stderr, "Options:\n\n");
+    
+    fprintf (stderr, "    Short options:\n\n");
+    fprintf (stderr, "        -i                Specify the input target.\n");
+    fprintf (stderr, "        -j N              Compare contents using N threads.\n");
+    fprintf (stderr, "        -v                Print each change as it is made.\n");
+    fprintf (stderr, "        -w                Keep running and apply host changes as they happen.\n");
+    
+    fprintf (stderr, "\n");
+    
+    fprintf (stderr, "    Long options:\n\n");
+    fprintf (stderr, "        --content         Compare the contents of same-sized files instead of timestamps.\n");
+    fprintf (stderr, "        --debounce MS     With --watch, commit once the host has been quiet for MS milliseconds.\n");
+    fprintf (stderr, "        --entries N       Make new directories big enough for at least N entries.\n");
+    fprintf (stderr, "        --help            Show this help information then exit.\n");
+    fprintf (stderr, "        --index           Keep a sidecar index next to the image for fast reopening.\n");
+    fprintf (stderr, "        --jobs N          Compare contents using N threads.\n");
+    fprintf (stderr, "        --offset SECTOR   Write the filesystem starting at SECTOR.\n");
+    fprintf (stderr, "        --verbose         Print each change as it is made.\n");
+    fprintf (stderr, "        --watch           Keep running and apply host changes as they happen.\n");
+
+_exit:
+
+    exit (exitval);
+
+}
+
+static void *xmalloc (size_t size) {
+
+    void *ptr = malloc (size);
+    
+    if (ptr == NULL && size) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "memory full (malloc)");
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    memset (ptr, 0, size);
+    return ptr;
+
+}
+
+static void *xrealloc (void *ptr, size_t size) {
+
+    void *new_ptr = realloc (ptr, size);
+    
+    if (new_ptr == NULL && size) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "memory full (realloc)");
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    return new_ptr;
+
+}
+
+static char *xstrdup (const char *str) {
+
+    char *ptr = xmalloc (strlen (str) + 1);
+    strcpy (ptr, str);
+    
+    return ptr;
+
+}
+
+static int xstrcasecmp (const char *s1, const char *s2) {
+
+    const unsigned char *p1 = (const unsigned char *) s1;
+    const unsigned char *p2 = (const unsigned char *) s2;
+    
+    while (*p1 != '\0' && toupper (*p1) == toupper (*p2)) {
+    
+        p1++;
+        p2++;
+    
+    }
+    
+    return toupper (*p1) - toupper (*p2);
+
+}
+
+static void dynarray_add (void *ptab, size_t *nb_ptr, void *data) {
+
+    int nb, nb_alloc;
+    void **pp;
+    
+    nb = *nb_ptr;
+    pp = *(void ***) ptab;
+    
+    if ((nb & (nb - 1)) == 0) {
+    
+        if (!nb) {
+            nb_alloc = 1;
+        } else {
+            nb_alloc = nb * 2;
+        }
+        
+        pp = xrealloc (pp, nb_alloc * sizeof (void *));
+        *(void ***) ptab = pp;
+    
+    }
+    
+    pp[nb++] = data;
+    *nb_ptr = nb;
+
+}
+
+static void parse_args (int *pargc, char ***pargv, int optind) {
+
+    char **argv = *pargv;
+    int argc = *pargc;
+    
+    struct option *popt;
+    const char *optarg, *r;
+    
+    if (argc == optind) {
+        print_help (EXIT_SUCCESS);
+    }
+    
+    while (optind < argc) {
+    
+        r = argv[optind++];
+        
+        if (r[0] != '-' || r[1] == '\0') {
+        
+            dynarray_add (&state->args, &state->nb_args, xstrdup (r));
+            continue;
+        
+        }
+        
+        for (popt = opts; popt; ++popt) {
+        
+            const char *p1 = popt->name;
+            const char *r1 = (r + 1);
+            
+            if (!p1) {
+            
+                report_at (program_name, 0, REPORT_ERROR, "invalid option -- '%s'", r);
+                exit (EXIT_FAILURE);
+            
+            }
+            
+            if (!strstart (p1, &r1)) {
+                continue;
+            }
+            
+            optarg = r1;
+            
+            if (popt->flags & OPTION_HAS_ARG) {
+            
+                if (*optarg == '\0') {
+                
+                    if (optind >= argc) {
+                    
+                        report_at (program_name, 0, REPORT_ERROR, "argument to '%s' is missing", r);
+                        exit (EXIT_FAILURE);
+                    
+                    }
+                    
+                    optarg = argv[optind++];
+                
+                }
+            
+            } else if (*optarg != '\0') {
+                continue;
+            }
+            
+            break;
+        
+        }
+        
+        switch (popt->index) {
+        
+            case OPTION_CONTENT: {
+            
+                state->content = 1;
+                break;
+            
+            }
+            
+            case OPTION_DEBOUNCE: {
+            
+                long conversion;
+                char *temp;
+                
+                errno = 0;
+                conversion = strtol (optarg, &temp, 0);
+                
+                if (!*optarg || isspace ((int) *optarg) || errno || *temp || conversion < 0 || conversion > 60000) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "debounce must be between 0 and 60000 milliseconds");
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->debounce = (unsigned long) conversion;
+                break;
+            
+            }
+            
+            case OPTION_ENTRIES: {
+            
+                long conversion;
+                char *temp;
+                
+                errno = 0;
+                conversion = strtol (optarg, &temp, 0);
+                
+                if (!*optarg || isspace ((int) *optarg) || errno || *temp || conversion < 0 || conversion > 65536) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "entries must be between 0 and 65536");
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->entries = (unsigned long) conversion;
+                break;
+            
+            }
+            
+            case OPTION_HELP: {
+            
+                print_help (EXIT_SUCCESS);
+                break;
+            
+            }
+            
+            case OPTION_INDEX: {
+            
+                state->index = 1;
+                break;
+            
+            }
+            
+            case OPTION_INPUT: {
+            
+                if (state->outfile) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "multiple output files provided");
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->outfile = xstrdup (optarg);
+                break;
+            
+            }
+            
+            case OPTION_JOBS: {
+            
+                long conversion;
+                char *temp;
+                
+                errno = 0;
+                conversion = strtol (optarg, &temp, 0);
+                
+                if (!*optarg || isspace ((int) *optarg) || errno || *temp || conversion < 1 || conversion > 256) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "jobs must be between 1 and 256");
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->jobs = (int) conversion;
+                break;
+            
+            }
+            
+            case OPTION_OFFSET: {
+            
+                long conversion;
+                char *temp;
+                
+                errno = 0;
+                conversion = strtol (optarg, &temp, 0);
+                
+                if (!*optarg || isspace ((int) *optarg) || errno || *temp) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "bad number for offset (%s)", optarg);
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                if (conversion < 0 || (unsigned long) conversion > UINT_MAX) {
+                
+                    report_at (program_name, 0, REPORT_ERROR, "offset must be between 0 and %u", UINT_MAX);
+                    exit (EXIT_FAILURE);
+                
+                }
+                
+                state->offset = (unsigned long) conversion;
+                break;
+            
+            }
+            
+            case OPTION_VERBOSE: {
+            
+                state->verbose = 1;
+                break;
+            
+            }
+            
+            case OPTION_WATCH: {
+            
+                state->watch = 1;
+                break;
+            
+            }
+            
+            default: {
+            
+                report_at (program_name, 0, REPORT_ERROR, "unsupported option '%s'", r);
+                exit (EXIT_FAILURE);
+            
+            }
+        
+        }
+    
+    }
+
+}
+
+static char *join_path (const char *dir, const char *name, int sep) {
+
+    char *path = xmalloc (strlen (dir) + strlen (name) + 2);
+    
+    if (*dir) {
+        sprintf (path, "%s%c%s", dir, sep, name);
+    } else {
+        strcpy (path, name);
+    }
+    
+    return path;
+
+}
+
+static void fail (struct dosfs_image *img, const char *what, const char *path) {
+
+    report_at (program_name, 0, REPORT_ERROR, "failed to %s '%s': %s", what, path, dosfs_strerror (img->error));
+    
+    /** Nothing is committed, so the image is left as it was. */
+    exit (EXIT_FAILURE);
+
+}
+
+/**
+ * Walk one directory of the host tree against the matching image directory.
+ * Image entries with no host counterpart are deleted and missing directories
+ * are created straight away, in memory; files that may need copying are
+ * queued so their contents can be compared before anything is written.
+ * Without recurse only directories new to the image are descended into.
+ * A directory that was only just created (fresh) is first sized to hold all
+ * of its entries so filling it never has to extend it a cluster at a time.
+ */
+static void sync_dir (struct dosfs_image *img, const char *host, const char *image, int depth, int recurse, int fresh) {
+
+    struct hostdir_entry *entries;
+    size_t nb_entries, i, j;
+    
+    struct dosfs_stat *stats = 0, st;
+    size_t nb_stats = 0, nb_alloc = 0;
+    
+    struct dosfs_dirstream *ds;
+    struct sync_file *file;
+    
+    char *hpath, *ipath;
+    
+    if (depth > MAX_SYNC_DEPTH) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "'%s' is nested too deeply", host);
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    if (hostdir_read (host, &entries, &nb_entries) < 0) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "failed to read directory '%s'", host);
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    if (fresh && dosfs_reserve_dir (img, image, nb_entries > state->entries ? nb_entries : state->entries) < 0) {
+        fail (img, "size", image);
+    }
+    
+    if (!(ds = dosfs_opendir (img, *image ? image : "/"))) {
+        fail (img, "open directory", image);
+    }
+    
+    while (dosfs_readdir (ds, &st) > 0) {
+    
+        if (!strcmp (st.name, ".") || !strcmp (st.name, "..")) {
+            continue;
+        }
+        
+        if (nb_stats == nb_alloc) {
+        
+            nb_alloc = (nb_alloc ? nb_alloc * 2 : 16);
+            stats = xrealloc (stats, nb_alloc * sizeof (*stats));
+        
+        }
+        
+        stats[nb_stats++] = st;
+    
+    }
+    
+    dosfs_closedir (ds);
+    
+    /** Remove whatever the host no longer has, or has as the other kind of entry. */
+    for (i = 0; i < nb_stats; i++) {
+    
+        for (j = 0; j < nb_entries; j++) {
+        
+            if (!xstrcasecmp (entries[j].name, stats[i].name)) {
+                break;
+            }
+        
+        }
+        
+        if (j < nb_entries && !entries[j].is_dir == !(stats[i].attr & ATTR_DIR)) {
+            continue;
+        }
+        
+        ipath = join_path (image, stats[i].name, '/');
+        
+        if ((stats[i].attr & ATTR_DIR) ? dosfs_rmdir (img, ipath, DOSFS_RMDIR_RECURSIVE) : dosfs_unlink (img, ipath)) {
+            fail (img, "delete", ipath);
+        }
+        
+        if (state->verbose) {
+            printf ("delete %s\n", ipath);
+        }
+        
+        stats[i].name[0] = '\0';
+        nb_deleted++;
+        
+        free (ipath);
+    
+    }
+    
+    for (i = 0; i < nb_entries; i++) {
+    
+        for (j = 0; j < nb_stats; j++) {
+        
+            if (stats[j].name[0] && !xstrcasecmp (entries[i].name, stats[j].name)) {
+                break;
+            }
+        
+        }
+        
+        hpath = join_path (host, entries[i].name, '/');
+        ipath = join_path (image, entries[i].name, '/');
+        
+        if (entries[i].is_dir) {
+        
+            if (j == nb_stats) {
+            
+                if (dosfs_mkdir (img, ipath, 0) < 0) {
+                    fail (img, "create", ipath);
+                }
+                
+                if (state->verbose) {
+                    printf ("mkdir %s\n", ipath);
+                }
+                
+                nb_created++;
+            
+            }
+            
+            if (recurse || j == nb_stats) {
+                sync_dir (img, hpath, ipath, depth + 1, recurse, j == nb_stats);
+            }
+            
+            free (hpath);
+            free (ipath);
+            
+            continue;
+        
+        }
+        
+        file = xmalloc (sizeof (*file));
+        
+        file->host = hpath;
+        file->image = ipath;
+        file->size = entries[i].size;
+        
+        dos_stamp_from_time (entries[i].mtime, dosfs_source_date (img), &file->date, &file->time);
+        
+        if (j == nb_stats || stats[j].size != entries[i].size) {
+            file->differs = 1;
+        } else {
+        
+            file->stamp_differs = (stats[j].date != file->date || stats[j].time != file->time);
+            
+            if (state->content) {
+                file->differs = -1;
+            } else if (file->stamp_differs) {
+                file->differs = 1;
+            } else {
+            
+                free (file->host);
+                free (file->image);
+                free (file);
+                
+                continue;
+            
+            }
+        
+        }
+        
+        dynarray_add (&files, &nb_files, file);
+    
+    }
+    
+    hostdir_free (entries, nb_entries);
+    free (stats);
+
+}
+
+static int compare_file (struct dosfs_image *img, struct sync_file *file, unsigned char *hbuf, unsigned char *ibuf) {
+
+    struct dosfs_file *f;
+    FILE *ifp;
+    
+    size_t bytes;
+    int differs = 0;
+    
+    if (!(ifp = fopen (file->host, "rb"))) {
+        return 1;
+    }
+    
+    if (!(f = dosfs_fopen (img, file->image, DOSFS_O_READ))) {
+    
+        fclose (ifp);
+        return 1;
+    
+    }
+    
+    while (!differs && (bytes = fread (hbuf, 1, COPY_BUFFER_SIZE, ifp)) > 0) {
+    
+        if (dosfs_fread (f, ibuf, bytes) != (long) bytes || memcmp (hbuf, ibuf, bytes)) {
+            differs = 1;
+        }
+    
+    }
+    
+    if (ferror (ifp) || dosfs_ftell (f) != f->size) {
+        differs = 1;
+    }
+    
+    dosfs_fclose (f);
+    fclose (ifp);
+    
+    return differs;
+
+}
+
+#if     defined (MSYNC_THREADS)
+static pthread_mutex_t compare_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static size_t compare_next = 0;
+
+/**
+ * Compare queued files until none are left.  Every worker reads through its
+ * own read-only handle; nothing has been written to the image yet, so each
+ * one sees the same state as the handle doing the sync.
+ */
+static void *compare_worker (void *arg) {
+
+    struct dosfs_image *img;
+    struct sync_file *file;
+    
+    unsigned char *hbuf, *ibuf;
+    int error;
+    
+    (void) arg;
+    
+    hbuf = xmalloc (COPY_BUFFER_SIZE);
+    ibuf = xmalloc (COPY_BUFFER_SIZE);
+    
+    img = dosfs_open (state->outfile, state->offset, DOSFS_READONLY, &error);
+    
+    for (;;) {
+
+#if     defined (MSYNC_THREADS)
+        pthread_mutex_lock (&compare_lock);
+#endif
+
+        file = (compare_next < nb_files ? files[compare_next++] : 0);
+
+#if     defined (MSYNC_THREADS)
+        pthread_mutex_unlock (&compare_lock);
+#endif
+
+        if (!file) {
+            break;
+        }
+        
+        if (file->differs < 0) {
+            file->differs = (img ? compare_file (img, file, hbuf, ibuf) : 1);
+        }
+    
+    }
+    
+    if (img) {
+        dosfs_close (img);
+    }
+    
+    free (hbuf);
+    free (ibuf);
+    
+    return 0;
+
+}
+
+static void compare_files (void) {
+
+#if     defined (MSYNC_THREADS)
+
+    pthread_t *threads;
+    int i, started = 0;
+    
+    if (state->jobs > 1) {
+    
+        threads = xmalloc (state->jobs * sizeof (*threads));
+        
+        for (i = 0; i < state->jobs; i++) {
+        
+            if (pthread_create (&threads[i], 0, compare_worker, 0)) {
+                break;
+            }
+            
+            started++;
+        
+        }
+        
+        for (i = 0; i < started; i++) {
+            pthread_join (threads[i], 0);
+        }
+        
+        free (threads);
+        
+        if (started) {
+            return;
+        }
+    
+    }
+
+#endif
+
+    compare_worker (0);
+
+}
+
+static int copy_file (struct dosfs_image *img, struct sync_file *file, unsigned char *buffer) {
+
+    struct dosfs_file *f;
+    FILE *ifp;
+    
+    unsigned long copied = 0;
+    size_t bytes;
+    
+    if (!(ifp = fopen (file->host, "rb"))) {
+    
+        /** When watching, a file removed since it was queued is picked up by the next pass. */
+        if (state->watch) {
+            return -1;
+        }
+        
+        report_at (program_name, 0, REPORT_ERROR, "failed to open '%s'", file->host);
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    /** Existing files are rewritten over their own chain, skipping unchanged clusters. */
+    if (!(f = dosfs_fopen (img, file->image, DOSFS_O_WRITE | DOSFS_O_CREAT | DOSFS_O_OVERWRITE))) {
+        fail (img, "create", file->image);
+    }
+    
+    while ((bytes = fread (buffer, 1, COPY_BUFFER_SIZE, ifp)) > 0) {
+    
+        if (dosfs_fwrite (f, buffer, bytes) != (long) bytes) {
+            fail (img, "write", file->image);
+        }
+        
+        copied += bytes;
+    
+    }
+    
+    if (ferror (ifp)) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "failed to read '%s'", file->host);
+        exit (EXIT_FAILURE);
+    
+    }
+    
+    if (dosfs_ftruncate (f, copied) < 0) {
+        fail (img, "truncate", file->image);
+    }
+    
+    dosfs_fclose (f);
+    fclose (ifp);
+    
+    return 0;
+
+}
+
+/**
+ * Compare and copy everything sync_dir queued, then empty the queue ready
+ * for the next pass.
+ */
+static void apply_changes (struct dosfs_image *img, unsigned char *buffer) {
+
+    struct sync_file *file;
+    size_t i;
+    
+    if (state->content) {
+        compare_files ();
+    }
+    
+    for (i = 0; i < nb_files; i++) {
+    
+        file = files[i];
+        
+        if (file->differs) {
+        
+            if (copy_file (img, file, buffer) < 0) {
+                continue;
+            }
+            
+            if (state->verbose) {
+                printf ("copy %s\n", file->image);
+            }
+            
+            nb_copied++;
+        
+        } else if (file->stamp_differs) {
+            nb_stamped++;
+        } else {
+            continue;
+        }
+        
+        /** Stamp the entry with the host time so the next run sees it as unchanged. */
+        if (dosfs_set_time (img, file->image, file->date, file->time) < 0) {
+            fail (img, "stamp", file->image);
+        }
+    
+    }
+    
+    for (i = 0; i < nb_files; i++) {
+    
+        free (files[i]->host);
+        free (files[i]->image);
+        free (files[i]);
+    
+    }
+    
+    nb_files = 0;
+    compare_next = 0;
+
+}
+
+#if     defined (MSYNC_WATCH)
+#define     WATCH_MASK                  (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF | IN_ONLYDIR)
+
+/**
+ * A watched host directory and the image directory it is mirrored to.
+ * dirty is set by any event in the directory and cleared once the next
+ * pass has synced it.
+ */
+struct watch {
+
+    int wd, depth, dirty;
+    char *host, *image;
+
+};
+
+static struct watch **watches = 0;
+static size_t nb_watches = 0;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_signal (int sig) {
+
+    (void) sig;
+    stop_requested = 1;
+
+}
+
+static unsigned long now_ms (void) {
+
+    struct timespec ts;
+    
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ((unsigned long) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+
+}
+
+static struct watch *find_watch (int wd) {
+
+    size_t i;
+    
+    for (i = 0; i < nb_watches; i++) {
+    
+        if (watches[i]->wd == wd) {
+            return watches[i];
+        }
+    
+    }
+    
+    return 0;
+
+}
+
+static void drop_watch (size_t i) {
+
+    free (watches[i]->host);
+    free (watches[i]->image);
+    free (watches[i]);
+    
+    watches[i] = watches[--nb_watches];
+
+}
+
+static void watch_tree (int fd, const char *host, const char *image, int depth);
+
+/** Make sure every subdirectory of a watched directory has a watch of its own. */
+static void watch_children (int fd, const char *host, const char *image, int depth) {
+
+    struct hostdir_entry *entries;
+    size_t nb_entries, i;
+    
+    char *hpath, *ipath;
+    
+    if (depth >= MAX_SYNC_DEPTH || hostdir_read (host, &entries, &nb_entries) < 0) {
+        return;
+    }
+    
+    for (i = 0; i < nb_entries; i++) {
+    
+        if (!entries[i].is_dir) {
+            continue;
+        }
+        
+        hpath = join_path (host, entries[i].name, '/');
+        ipath = join_path (image, entries[i].name, '/');
+        
+        watch_tree (fd, hpath, ipath, depth + 1);
+        
+        free (hpath);
+        free (ipath);
+    
+    }
+    
+    hostdir_free (entries, nb_entries);
+
+}
+
+/**
+ * Watch a directory and, if it was not already being watched, everything
+ * below it.  A directory that vanished in the meantime is simply skipped;
+ * its parent's next pass removes it from the image.
+ */
+static void watch_tree (int fd, const char *host, const char *image, int depth) {
+
+    struct watch *w;
+    int wd;
+    
+    if ((wd = inotify_add_watch (fd, host, WATCH_MASK)) < 0) {
+    
+        if (errno == ENOSPC) {
+            report_at (program_name, 0, REPORT_WARNING, "out of inotify watches, '%s' will not be followed", host);
+        }
+        
+        return;
+    
+    }
+    
+    if (find_watch (wd)) {
+        return;
+    }
+    
+    w = xmalloc (sizeof (*w));
+    w->wd = wd;
+    w->depth = depth;
+    w->host = xstrdup (host);
+    w->image = xstrdup (image);
+    
+    dynarray_add (&watches, &nb_watches, w);
+    watch_children (fd, host, image, depth);
+
+}
+
+/**
+ * A directory moved away keeps its watch under the old name, so forget it
+ * and everything below it; the destination's parent watches it afresh.
+ */
+static void forget_tree (int fd, struct watch *w) {
+
+    size_t len = strlen (w->host), i;
+    char *prefix = xstrdup (w->host);
+    
+    for (i = 0; i < nb_watches; ) {
+    
+        if (!strncmp (watches[i]->host, prefix, len) && (watches[i]->host[len] == '\0' || watches[i]->host[len] == '/')) {
+        
+            inotify_rm_watch (fd, watches[i]->wd);
+            drop_watch (i);
+            
+            continue;
+        
+        }
+        
+        i++;
+    
+    }
+    
+    free (prefix);
+
+}
+
+static int read_events (int fd) {
+
+    char buf[4096];
+    
+    struct inotify_event *ev;
+    struct watch *w;
+    
+    ssize_t bytes, i;
+    size_t j;
+    
+    if ((bytes = read (fd, buf, sizeof (buf))) <= 0) {
+        return (bytes < 0 && errno == EINTR) ? 0 : -1;
+    }
+    
+    for (i = 0; i < bytes; i += sizeof (*ev) + ev->len) {
+    
+        ev = (struct inotify_event *) (buf + i);
+        
+        if (ev->mask & IN_Q_OVERFLOW) {
+        
+            /** Events were lost, so resync every directory we know about. */
+            for (j = 0; j < nb_watches; j++) {
+                watches[j]->dirty = 1;
+            }
+            
+            continue;
+        
+        }
+        
+        if (!(w = find_watch (ev->wd))) {
+            continue;
+        }
+        
+        if (ev->mask & IN_IGNORED) {
+        
+            for (j = 0; watches[j] != w; j++) {
+                ;
+            }
+            
+            drop_watch (j);
+            continue;
+        
+        }
+        
+        if (ev->mask & IN_MOVE_SELF) {
+        
+            forget_tree (fd, w);
+            continue;
+        
+        }
+        
+        w->dirty = 1;
+    
+    }
+    
+    return 0;
+
+}
+
+static int compare_depth (const void *a, const void *b) {
+
+    return (*(struct watch * const *) a)->depth - (*(struct watch * const *) b)->depth;
+
+}
+
+/**
+ * Sync every directory that saw events since the last pass, parents first so
+ * a removed or renamed tree is dealt with before anything inside it, then
+ * commit.  Only the dirty directories are read from the host; everything on
+ * the image side comes from the handle's resident FAT and directory caches.
+ */
+static int sync_dirty (struct dosfs_image *img, int fd, unsigned char *buffer) {
+
+    struct hostdir_entry st;
+    struct watch **dirty = 0, *w;
+    
+    size_t nb_dirty = 0, i;
+    
+    for (i = 0; i < nb_watches; i++) {
+    
+        if (watches[i]->dirty) {
+        
+            watches[i]->dirty = 0;
+            dynarray_add (&dirty, &nb_dirty, watches[i]);
+        
+        }
+    
+    }
+    
+    qsort (dirty, nb_dirty, sizeof (*dirty), compare_depth);
+    
+    for (i = 0; i < nb_dirty; i++) {
+    
+        w = dirty[i];
+        
+        if (hostdir_stat (w->host, &st) < 0 || !st.is_dir) {
+            continue;
+        }
+        
+        /** Watch new subdirectories before reading them so nothing created meanwhile is missed. */
+        watch_children (fd, w->host, w->image, w->depth);
+        sync_dir (img, w->host, w->image, w->depth, 0, 0);
+    
+    }
+    
+    free (dirty);
+    apply_changes (img, buffer);
+    
+    if (dosfs_commit (img) < 0) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "failed whilst writing '%s'", state->outfile);
+        return -1;
+    
+    }
+    
+    fflush (stdout);
+    return 0;
+
+}
+
+/**
+ * Apply host changes until interrupted.  The image stays open throughout, so
+ * its FAT and directories are only ever read once.  Events are gathered until
+ * the host has been quiet for the debounce interval, or for at most four
+ * intervals while it stays busy, and then applied in a single commit.
+ */
+static int watch_loop (struct dosfs_image *img, int fd, unsigned char *buffer) {
+
+    struct sigaction sa;
+    struct pollfd pfd;
+    
+    unsigned long first = 0, last = 0, now, deadline;
+    int pending = 0, timeout, ready;
+    
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = handle_signal;
+    
+    sigemptyset (&sa.sa_mask);
+    sigaction (SIGINT, &sa, 0);
+    sigaction (SIGTERM, &sa, 0);
+    
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    
+    while (!stop_requested) {
+    
+        timeout = -1;
+        
+        if (pending) {
+        
+            now = now_ms ();
+            deadline = last + state->debounce;
+            
+            if (deadline > first + state->debounce * 4) {
+                deadline = first + state->debounce * 4;
+            }
+            
+            timeout = (deadline > now ? (int) (deadline - now) : 0);
+        
+        }
+        
+        if ((ready = poll (&pfd, 1, timeout)) < 0) {
+        
+            if (errno == EINTR) {
+                continue;
+            }
+            
+            report_at (program_name, 0, REPORT_ERROR, "failed to wait for changes");
+            return -1;
+        
+        }
+        
+        if (ready) {
+        
+            if (read_events (fd) < 0) {
+            
+                report_at (program_name, 0, REPORT_ERROR, "failed to read change events");
+                return -1;
+            
+            }
+            
+            last = now_ms ();
+            
+            if (!pending) {
+                first = last;
+            }
+            
+            pending = 1;
+            continue;
+        
+        }
+        
+        if (pending) {
+        
+            if (sync_dirty (img, fd, buffer) < 0) {
+                return -1;
+            }
+            
+            pending = 0;
+        
+        }
+    
+    }
+    
+    /** Anything still waiting on the debounce is applied before exiting. */
+    return (pending ? sync_dirty (img, fd, buffer) : 0);
+
+}
+#endif
+
+int main (int argc, char **argv) {
+
+    struct dosfs_image *img;
+    struct hostdir_entry root;
+    
+    unsigned char *buffer;
+    const char *image = "";
+    
+    int error;
+    
+#if     defined (MSYNC_WATCH)
+    int fd = -1;
+#endif
+    
+    if (argc && *argv) {
+    
+        char *p;
+        program_name = *argv;
+        
+        if ((p = strrchr (program_name, '/'))) {
+            program_name = (p + 1);
+        }
+    
+    }
+    
+    state = xmalloc (sizeof (*state));
+    
+    state->jobs = 4;
+    state->debounce = 200;
+    
+    parse_args (&argc, &argv, 1);
+    
+    if (!state->outfile || state->nb_args < 1 || state->nb_args > 2) {
+        print_help (EXIT_FAILURE);
+    }
+    
+#if     !defined (MSYNC_WATCH)
+    
+    if (state->watch) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "--watch is not supported on this host");
+        return EXIT_FAILURE;
+    
+    }
+
+#endif
+    
+    if (state->nb_args > 1) {
+    
+        image = state->args[1];
+        
+        if (image[0] == ':' && image[1] == ':') {
+            image += 2;
+        }
+        
+        while (*image == '/' || *image == '\\') {
+            image++;
+        }
+    
+    }
+    
+    if (hostdir_stat (state->args[0], &root) < 0 || !root.is_dir) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "'%s' is not a directory", state->args[0]);
+        return EXIT_FAILURE;
+    
+    }
+    
+    if (!(img = dosfs_open (state->outfile, state->offset, (state->index ? DOSFS_INDEX : 0) | DOSFS_SOURCE_DATE, &error))) {
+    
+        if (error == DOSFS_ERR_INVALID) {
+            report_at (program_name, 0, REPORT_ERROR, "%s does not have a valid FAT boot sector", state->outfile);
+        } else if (error == DOSFS_ERR_SOURCE_DATE) {
+            report_at (program_name, 0, REPORT_ERROR, "%s", dosfs_strerror (error));
+        } else {
+            report_at (program_name, 0, REPORT_ERROR, "faild to open '%s' for writing", state->outfile);
+        }
+        
+        return EXIT_FAILURE;
+    
+    }
+    
+    if (*image && dosfs_mkdir (img, image, DOSFS_MKDIR_PARENTS) < 0) {
+        fail (img, "create", image);
+    }
+    
+#if     defined (MSYNC_WATCH)
+    
+    if (state->watch) {
+    
+        if ((fd = inotify_init ()) < 0) {
+        
+            report_at (program_name, 0, REPORT_ERROR, "failed to watch '%s'", state->args[0]);
+            return EXIT_FAILURE;
+        
+        }
+        
+        /** Watch first so that nothing changed during the initial sync is missed. */
+        watch_tree (fd, state->args[0], image, 0);
+    
+    }
+
+#endif
+    
+    sync_dir (img, state->args[0], image, 0, 1, 0);
+    
+    buffer = xmalloc (COPY_BUFFER_SIZE);
+    apply_changes (img, buffer);
+    
+#if     defined (MSYNC_WATCH)
+    
+    if (state->watch) {
+    
+        if (dosfs_commit (img) < 0) {
+        
+            report_at (program_name, 0, REPORT_ERROR, "failed whilst writing '%s'", state->outfile);
+            return EXIT_FAILURE;
+        
+        }
+        
+        if (state->verbose) {
+            printf ("watching %s\n", state->args[0]);
+        }
+        
+        fflush (stdout);
+        
+        if (watch_loop (img, fd, buffer) < 0) {
+        
+            /** Whatever was committed by earlier passes stays in the image. */
+            return EXIT_FAILURE;
+        
+        }
+        
+        close (fd);
+    
+    }
+
+#endif
+    
+    free (buffer);
+    
+    if (dosfs_close (img) < 0) {
+    
+        report_at (program_name, 0, REPORT_ERROR, "failed whilst writing '%s'", state->outfile);
+        return EXIT_FAILURE;
+    
+    }
+    
+    if (state->verbose) {
+        printf ("%lu copied, %lu deleted, %lu directories created, %lu timestamps updated\n", nb_copied, nb_deleted, nb_created, nb_stamped);
+    }
+    
+    return EXIT_SUCCESS;
+
+}
@@ -0,0 +1,22 @@
+/******************************************************************************
+ * @file            msync.h
+ *****************************************************************************/
+#ifndef     _MSYNC_H
+#define     _MSYNC_H
+
+#include    <stddef.h>
+
+struct msync_state {
+
+    char **args;
+    size_t nb_args;
+    
+    const char *outfile;
+    unsigned long offset;
+    
+    int content, index, jobs, verbose, watch;
+    unsigned long debounce, entries;
+
+};
+
+#endif      /* _MSYNC_H */
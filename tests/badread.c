@@ -0,0 +1,64 @@
+/******************************************************************************
+ * @file            tests/badread.c
+ *
+ * LD_PRELOAD shim for the surface-scan tests: pread fails with EIO for any
+ * range that covers one of the byte offsets listed in BAD_OFFSETS.
+ *****************************************************************************/
+#define     _GNU_SOURCE
+
+#include    <dlfcn.h>
+#include    <errno.h>
+#include    <stdlib.h>
+#include    <unistd.h>
+
+static int is_bad (off_t offset, size_t count) {
+
+    const char *p = getenv ("BAD_OFFSETS");
+    char *end;
+    
+    long long bad;
+    
+    while (p && *p) {
+    
+        bad = strtoll (p, &end, 10);
+        
+        if (end == p) {
+            break;
+        }
+        
+        if (bad >= offset && bad < offset + (off_t) count) {
+            return 1;
+        }
+        
+        p = (*end ? end + 1 : end);
+    
+    }
+    
+    return 0;
+
+}
+
+static ssize_t forward (const char *name, int fd, void *buf, size_t count, off_t offset) {
+
+    ssize_t (*real) (int, void *, size_t, off_t);
+    
+    if (is_bad (offset, count)) {
+    
+        errno = EIO;
+        return -1;
+    
+    }
+    
+    *(void **) &real = dlsym (RTLD_NEXT, name);
+    return real (fd, buf, count, offset);
+
+}
+
+/** Builds with a 64-bit off_t may call either name. */
+ssize_t pread (int fd, void *buf, size_t count, off_t offset) {
+    return forward ("pread", fd, buf, count, offset);
+}
+
+ssize_t pread64 (int fd, void *buf, size_t count, off_t offset) {
+    return forward ("pread64", fd, buf, count, offset);
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+#******************************************************************************
+# @file             tests/check.sh
+#
+# Run every tests/t-*.sh against the tools built in the directory given as
+# the first argument (default: the current directory).  Each script runs in
+# a scratch directory of its own and fails by exiting non-zero.
+#******************************************************************************
+BIN=$(cd "${1:-.}" && pwd) || exit 1
+TESTS=$(cd "$(dirname "$0")" && pwd) || exit 1
+
+export BIN TESTS
+
+passed=0
+failed=0
+
+for t in "$TESTS"/t-*.sh; do
+
+    name=$(basename "$t" .sh)
+    work=$(mktemp -d "${TMPDIR:-/tmp}/dosfs-$name.XXXXXX") || exit 1
+    
+    if (cd "$work" && sh "$t") > "$work.log" 2>&1; then
+    
+        echo "PASS: $name"
+        passed=$((passed + 1))
+    
+    else
+    
+        echo "FAIL: $name"
+        sed 's/^/    /' "$work.log"
+        
+        failed=$((failed + 1))
+    
+    fi
+    
+    rm -rf "$work" "$work.log"
+
+done
+
+echo "$passed passed, $failed failed"
+[ "$failed" -eq 0 ]
@@ -0,0 +1,85 @@
+#******************************************************************************
+# @file             tests/common.sh
+#
+# Sourced by each test.  Host paths given to the tools are kept relative to
+# the scratch directory the test runs in.
+#******************************************************************************
+set -e
+
+fail () {
+
+    echo "$*" >&2
+    exit 1
+
+}
+
+# Copy a file out of an image and compare it with the host file it came from.
+same_file () {
+
+    rm -f out.tmp
+    "$BIN/mcopy" -i "$1" "::$2" out.tmp < /dev/null
+    cmp out.tmp "$3" || fail "$2 in $1 differs from $3"
+    rm -f out.tmp
+
+}
+
+# An unsigned little-endian field of $3 bytes at byte $2 of image $1.
+field () {
+
+    set -- $(od -An -tu1 -j "$2" -N "$3" "$1")
+    
+    value=0
+    shift_by=0
+    
+    for byte in "$@"; do
+    
+        value=$((value + (byte << shift_by)))
+        shift_by=$((shift_by + 8))
+    
+    done
+    
+    echo $value
+
+}
+
+# The number of data clusters the boot sector of an image describes.
+clusters () {
+
+    sectors=$(field "$1" 19 2)
+    per_fat=$(field "$1" 22 2)
+    
+    [ "$sectors" -ne 0 ] || sectors=$(field "$1" 32 4)
+    [ "$per_fat" -ne 0 ] || per_fat=$(field "$1" 36 4)
+    
+    data=$(($(field "$1" 14 2) + $(field "$1" 16 1) * per_fat + ($(field "$1" 17 2) * 32 + 511) / 512))
+    echo $(((sectors - data) / $(field "$1" 13 1)))
+
+}
+
+# The FAT type of an image: 32 when the boot sector has no 16-bit FAT size,
+# otherwise whichever of 12 and 16 the cluster count makes it.
+fat_type () {
+
+    if [ "$(field "$1" 22 2)" -eq 0 ]; then
+        echo 32
+    elif [ "$(clusters "$1")" -lt 4085 ]; then
+        echo 12
+    else
+        echo 16
+    fi
+
+}
+
+# Some host files of different sizes to copy in.
+make_files () {
+
+    i=1
+    
+    while [ $i -le "$1" ]; do
+    
+        head -c $((i * 4099 + 17)) "$TESTS/../dosfs.c" > "f$i.txt"
+        i=$((i + 1))
+    
+    done
+
+}
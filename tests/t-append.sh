@@ -0,0 +1,17 @@
+#!/bin/sh
+# mcopy --append adds to the end of an image file, creating it if need be,
+# and keeps what was already there.
+. "$TESTS/common.sh"
+
+make_files 3
+"$BIN/mkdosfs" --blocks 2000 a.img > /dev/null
+
+"$BIN/mcopy" -i a.img --append f1.txt ::LOG.TXT < /dev/null
+same_file a.img LOG.TXT f1.txt
+
+# f1 ends part way into a cluster, so the next append fills its slack first.
+"$BIN/mcopy" -i a.img --append f2.txt ::LOG.TXT < /dev/null
+"$BIN/mcopy" -i a.img --append f3.txt ::LOG.TXT < /dev/null
+
+cat f1.txt f2.txt f3.txt > all.txt
+same_file a.img LOG.TXT all.txt
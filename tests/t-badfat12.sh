@@ -0,0 +1,34 @@
+#!/bin/sh
+# Clusters the surface scan cannot read are marked bad in the FAT, including
+# FAT12 entries that straddle a FAT sector boundary.
+. "$TESTS/common.sh"
+
+${CC:-cc} -shared -fPIC -o badread.so "$TESTS/badread.c" -ldl || fail "cannot build the pread shim"
+
+# 1400 KiB FAT12: data area at sector 39, four sectors per cluster.  Entries
+# 341 and 682 both start on the last byte of a FAT sector.
+bad="$(( (39 + (341 - 2) * 4) * 512 + 100 )),$(( (39 + (682 - 2) * 4) * 512 ))"
+
+BAD_OFFSETS=$bad LD_PRELOAD=./badread.so "$BIN/mkdosfs" -F 12 -c --blocks 1400 bad.img
+"$BIN/minfo" -i bad.img | grep '^bad clusters: *2$' > /dev/null || fail "expected two bad clusters"
+
+# The 12-bit entry for a cluster in the first FAT.
+entry () {
+
+    set -- $1 $(od -An -tu1 -j $((512 + $1 * 3 / 2)) -N 2 bad.img)
+    
+    if [ $(($1 % 2)) -eq 0 ]; then
+        echo $(($2 | (($3 & 15) << 8)))
+    else
+        echo $((($2 >> 4) | ($3 << 4)))
+    fi
+
+}
+
+for c in 341 682; do
+    [ "$(entry $c)" -eq 4087 ] || fail "cluster $c is $(entry $c), not 0xFF7"
+done
+
+for c in 340 342 681 683; do
+    [ "$(entry $c)" -eq 0 ] || fail "cluster $c was disturbed"
+done
@@ -0,0 +1,50 @@
+#!/bin/sh
+# mcompact drops deleted entries, frees the clusters a directory no longer
+# needs, and with -s and --hot puts the entries in the order asked for.
+. "$TESTS/common.sh"
+
+"$BIN/mkdosfs" --blocks 2000 c.img > /dev/null
+"$BIN/mmd" -i c.img D
+
+# 80 small files copied in reverse name order, then all but ten deleted.
+i=80
+names=
+
+while [ $i -ge 1 ]; do
+
+    echo $i > n$i.txt
+    names="$names n$i.txt"
+    
+    i=$((i - 1))
+
+done
+
+"$BIN/mcopy" -i c.img $names ::D < /dev/null
+
+i=1
+doomed=
+
+while [ $i -le 70 ]; do
+
+    doomed="$doomed ::D/N$i.TXT"
+    i=$((i + 1))
+
+done
+
+"$BIN/mdel" -i c.img $doomed
+
+"$BIN/mls" -i c.img --extents D | grep -c '^ ' > before.txt
+echo D/N75.TXT > hot.txt
+
+"$BIN/mcompact" -i c.img -s --hot hot.txt D > /dev/null || fail "mcompact failed"
+
+"$BIN/mls" -i c.img --extents D | grep -c '^ ' > after.txt
+[ "$(cat after.txt)" -lt "$(cat before.txt)" ] || fail "no cluster of D was freed"
+
+"$BIN/mls" -i c.img D | awk '$1 ~ /^N/ { print $1 }' > order.txt
+printf 'N75.TXT\nN71.TXT\nN72.TXT\nN73.TXT\nN74.TXT\nN76.TXT\nN77.TXT\nN78.TXT\nN79.TXT\nN80.TXT\n' > want.txt
+
+cmp order.txt want.txt || fail "D is not in hot-then-sorted order"
+
+same_file c.img D/N75.TXT n75.txt
+same_file c.img D/N80.TXT n80.txt
@@ -0,0 +1,46 @@
+#!/bin/sh
+# --entries sizes a new directory up front: it is one extent big enough for
+# the entries asked for, and filling it does not move or grow it.
+. "$TESTS/common.sh"
+
+"$BIN/mkdosfs" --blocks 2000 n.img > /dev/null
+"$BIN/mmd" -i n.img X
+"$BIN/mmd" -i n.img --entries 300 BIG
+
+"$BIN/mls" -i n.img --extents BIG | grep '^ ' > before.txt
+
+[ "$(wc -l < before.txt)" -eq 1 ] || fail "BIG is not a single extent"
+[ "$(awk '{ print $3 }' before.txt)" -ge $((300 * 32)) ] || fail "BIG is too small for 300 entries"
+
+i=1
+rm -f list.txt
+
+while [ $i -le 250 ]; do
+
+    echo "BIG/D$i" >> list.txt
+    i=$((i + 1))
+
+done
+
+"$BIN/mmd" -i n.img -f list.txt
+
+"$BIN/mls" -i n.img --extents BIG | grep '^ ' > after.txt
+cmp before.txt after.txt || fail "filling BIG moved or grew it"
+
+# msync makes directories big enough for their host contents.
+mkdir -p tree/many
+
+i=1
+
+while [ $i -le 100 ]; do
+
+    echo $i > tree/many/f$i.txt
+    i=$((i + 1))
+
+done
+
+"$BIN/msync" -i n.img tree ::T > /dev/null
+"$BIN/mls" -i n.img --extents T/MANY | grep '^ ' > many.txt
+
+[ "$(wc -l < many.txt)" -eq 1 ] || fail "msync split T/MANY"
+[ "$(awk '{ print $3 }' many.txt)" -ge $((102 * 32)) ] || fail "T/MANY is too small"
@@ -0,0 +1,31 @@
+#!/bin/sh
+# mls --extents gives where a file's bytes lie in the image: reading those
+# ranges straight from the image file gives the file back, even when it is
+# fragmented.
+. "$TESTS/common.sh"
+
+make_files 6
+"$BIN/mkdosfs" --blocks 2000 e.img > /dev/null
+
+# Replacing a file with a smaller one leaves a hole before the file after
+# it, and a later, larger file starts in that hole.
+"$BIN/mcopy" -i e.img f4.txt ::HOLE.TXT < /dev/null
+"$BIN/mcopy" -i e.img f1.txt ::KEEP.TXT < /dev/null
+echo o | "$BIN/mcopy" -i e.img f1.txt ::HOLE.TXT > /dev/null
+"$BIN/mcopy" -i e.img f6.txt ::SPLIT.TXT < /dev/null
+
+"$BIN/mls" -i e.img --extents SPLIT.TXT > map.txt
+
+[ "$(grep -c '^ ' map.txt)" -ge 2 ] || fail "SPLIT.TXT was expected to be fragmented"
+
+rm -f joined.txt
+touch joined.txt
+
+grep '^ ' map.txt | while read logical offset length cluster; do
+
+    [ "$logical" -eq "$(wc -c < joined.txt)" ] || fail "extent at $logical is out of order"
+    dd if=e.img bs=1 skip="$offset" count="$length" 2> /dev/null >> joined.txt
+
+done
+
+cmp joined.txt f6.txt || fail "the extents do not hold the file"
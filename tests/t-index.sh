@@ -0,0 +1,53 @@
+#!/bin/sh
+# With --index, listings and copies come from a sidecar index, and a write
+# made without it makes the index stale rather than wrong.
+. "$TESTS/common.sh"
+
+make_files 3
+
+"$BIN/mkdosfs" --blocks 2000 t.img > /dev/null
+"$BIN/mcopy" -i t.img --index f1.txt f2.txt :: < /dev/null
+
+[ -f t.img.idx ] || fail "no index was written"
+
+"$BIN/mls" -i t.img --index > indexed.txt
+"$BIN/mls" -i t.img > plain.txt
+
+cmp indexed.txt plain.txt || fail "the index lists something other than the image"
+
+rm -f out.tmp
+"$BIN/mcopy" -i t.img --index ::F2.TXT out.tmp < /dev/null
+cmp out.tmp f2.txt || fail "copying out through the index gave the wrong bytes"
+
+# A later plain write changes the image behind the index's back.
+sleep 1
+"$BIN/mcopy" -i t.img f3.txt :: < /dev/null
+
+"$BIN/mls" -i t.img --index > indexed.txt
+"$BIN/mls" -i t.img > plain.txt
+
+cmp indexed.txt plain.txt || fail "the index missed a plain write"
+
+# The same must hold when the plain write lands in the second the index was
+# written in, which leaves the image mtime where the index recorded it.
+for round in 1 2 3; do
+
+    rm -f t.img t.img.idx
+    
+    "$BIN/mkdosfs" --blocks 2000 t.img > /dev/null
+    "$BIN/mmd" -i t.img --index SUB
+    "$BIN/mcopy" -i t.img f1.txt f2.txt ::SUB < /dev/null
+    
+    "$BIN/mls" -i t.img --index SUB > /dev/null
+    "$BIN/mcopy" -i t.img f3.txt ::SUB < /dev/null
+    
+    "$BIN/mls" -i t.img --index SUB > indexed.txt
+    "$BIN/mls" -i t.img SUB > plain.txt
+    
+    cmp indexed.txt plain.txt || fail "round $round: the index missed a plain write"
+
+done
+
+# A valid index still gives the same answers as the image.
+"$BIN/mls" -i t.img --index SUB > indexed.txt
+cmp indexed.txt plain.txt || fail "the rewritten index differs from the image"
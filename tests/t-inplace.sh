@@ -0,0 +1,26 @@
+#!/bin/sh
+# mcopy --in-place rewrites an image file over its own clusters: it can
+# shrink or grow the file, and leaves the file where it was.  It does not
+# ask before overwriting.
+. "$TESTS/common.sh"
+
+make_files 6
+"$BIN/mkdosfs" --blocks 2000 p.img > /dev/null
+
+"$BIN/mcopy" -i p.img f4.txt ::FILE.TXT < /dev/null
+"$BIN/mls" -i p.img --extents FILE.TXT | grep '^ ' | head -1 > before.txt
+
+# Same size, different bytes.
+head -c $(wc -c < f4.txt) f6.txt > same.txt
+"$BIN/mcopy" -i p.img --in-place same.txt ::FILE.TXT < /dev/null
+same_file p.img FILE.TXT same.txt
+
+"$BIN/mls" -i p.img --extents FILE.TXT | grep '^ ' | head -1 > after.txt
+cmp before.txt after.txt || fail "--in-place moved the file"
+
+# Shorter and then longer.
+"$BIN/mcopy" -i p.img --in-place f1.txt ::FILE.TXT < /dev/null
+same_file p.img FILE.TXT f1.txt
+
+"$BIN/mcopy" -i p.img --in-place f6.txt ::FILE.TXT < /dev/null
+same_file p.img FILE.TXT f6.txt
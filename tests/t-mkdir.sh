@@ -0,0 +1,31 @@
+#!/bin/sh
+# mmd -p makes missing parents and accepts directories that already exist;
+# mmd -f takes the names from a list.
+. "$TESTS/common.sh"
+
+"$BIN/mkdosfs" --blocks 2000 d.img > /dev/null
+
+"$BIN/mmd" -i d.img -p A/B/C || fail "mmd -p failed"
+"$BIN/mmd" -i d.img -p A/B || fail "mmd -p failed on an existing directory"
+
+if "$BIN/mmd" -i d.img A/B 2> /dev/null; then
+    fail "mmd without -p accepted an existing directory"
+fi
+
+"$BIN/mls" -i d.img A/B | grep -q '^C ' || fail "A/B/C was not made"
+
+# Names from a file, children listed before their parents.
+i=1
+rm -f list.txt
+
+while [ $i -le 40 ]; do
+
+    echo "L/D$i" >> list.txt
+    i=$((i + 1))
+
+done
+
+echo L >> list.txt
+
+"$BIN/mmd" -i d.img -f list.txt || fail "mmd -f failed"
+[ "$("$BIN/mls" -i d.img L | grep -c '^D[0-9]')" -eq 40 ] || fail "mmd -f did not make every directory"
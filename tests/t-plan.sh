@@ -0,0 +1,23 @@
+#!/bin/sh
+# mkdosfs --plan takes no output file and only prints the layout; --fit
+# makes an image of that size which holds the tree.
+. "$TESTS/common.sh"
+
+mkdir -p tree/sub
+make_files 3
+cp f1.txt f2.txt tree/ && cp f3.txt tree/sub/
+
+"$BIN/mkdosfs" --plan tree > plan.txt || fail "--plan failed"
+blocks=$(sed -n 's/^plan: .*--blocks \([0-9]*\).*/\1/p' plan.txt)
+
+[ -n "$blocks" ] || fail "--plan printed no plan"
+
+"$BIN/mkdosfs" --fit tree fit.img > /dev/null || fail "--fit failed"
+[ "$(wc -c < fit.img)" -eq $((blocks * 1024)) ] || fail "--fit did not make the planned size"
+
+"$BIN/mcopy" -i fit.img f1.txt f2.txt :: < /dev/null
+"$BIN/mmd" -i fit.img SUB
+"$BIN/mcopy" -i fit.img f3.txt ::SUB < /dev/null
+
+same_file fit.img F1.TXT f1.txt
+same_file fit.img SUB/F3.TXT f3.txt
@@ -0,0 +1,29 @@
+#!/bin/sh
+# mcopy --range copies just the asked-for bytes of an image file, from
+# anywhere in it and in any order.
+. "$TESTS/common.sh"
+
+make_files 8
+"$BIN/mkdosfs" --blocks 2000 r.img > /dev/null
+"$BIN/mcopy" -i r.img f8.txt ::BIG.TXT < /dev/null
+
+# Offset and length pairs, some inside one cluster and some across several.
+for range in 0:1 5000:100 2047:2 12345:9000 30000:1; do
+
+    off=${range%:*}
+    len=${range#*:}
+    
+    rm -f part.txt
+    "$BIN/mcopy" -i r.img --range $range ::BIG.TXT part.txt < /dev/null
+    
+    dd if=f8.txt bs=1 skip=$off count=$len 2> /dev/null > want.txt
+    cmp part.txt want.txt || fail "--range $range copied the wrong bytes"
+
+done
+
+# Without a length the copy runs to the end of the file.
+rm -f part.txt
+"$BIN/mcopy" -i r.img --range 20000 ::BIG.TXT part.txt < /dev/null
+
+dd if=f8.txt bs=1 skip=20000 2> /dev/null > want.txt
+cmp part.txt want.txt || fail "--range without a length stopped early"
@@ -0,0 +1,65 @@
+#!/bin/sh
+# With SOURCE_DATE_EPOCH set, the same steps give the same image whenever
+# and in whichever time zone they are run.
+. "$TESTS/common.sh"
+
+make_files 3
+mkdir -p tree/sub && cp f1.txt tree/sub/
+
+SOURCE_DATE_EPOCH=1700000000
+export SOURCE_DATE_EPOCH
+
+build () {
+
+    "$BIN/mkdosfs" --blocks 4000 -d tree "$1" > /dev/null
+    "$BIN/mcopy" -i "$1" f2.txt f3.txt :: < /dev/null
+
+}
+
+TZ=UTC build first.img
+sleep 2
+TZ=Asia/Tokyo build second.img
+
+cmp first.img second.img || fail "the same build gave different images"
+same_file second.img F3.TXT f3.txt
+
+# --timestamp on the command line does the same without the environment.
+unset SOURCE_DATE_EPOCH
+
+"$BIN/mkdosfs" --timestamp 1700000000 --blocks 4000 -d tree third.img > /dev/null
+"$BIN/mcopy" -i third.img --timestamp 1700000000 f2.txt f3.txt :: < /dev/null
+
+cmp first.img third.img || fail "--timestamp gave a different image"
+
+# The other tools that write to an image follow it as well.
+SOURCE_DATE_EPOCH=1700000000
+export SOURCE_DATE_EPOCH
+
+tools () {
+
+    "$BIN/mkdosfs" --blocks 4000 "$1" > /dev/null
+    "$BIN/mmd" -i "$1" -p A/B
+    "$BIN/mcopy" -i "$1" f2.txt ::A/B < /dev/null
+    "$BIN/msync" -i "$1" tree ::SYNC > /dev/null
+    
+    printf 'mkdir ::S\ncopy f3.txt ::S/F3.TXT\n' | "$BIN/mscript" -i "$1"
+
+}
+
+tools fourth.img
+sleep 2
+tools fifth.img
+
+cmp fourth.img fifth.img || fail "the same build with every tool gave different images"
+same_file fifth.img S/F3.TXT f3.txt
+
+# A value that is not a count of seconds is refused rather than ignored.
+for tool in mmd mdel mcompact; do
+
+    if SOURCE_DATE_EPOCH=soon "$BIN/$tool" -i fifth.img X 2> err.txt; then
+        fail "$tool accepted a malformed SOURCE_DATE_EPOCH"
+    fi
+    
+    grep -q SOURCE_DATE_EPOCH err.txt || fail "$tool did not say what was wrong"
+
+done
@@ -0,0 +1,55 @@
+#!/bin/sh
+# mresize shrinks a volume to fit its data and grows it again without
+# losing files or changing the FAT type.
+. "$TESTS/common.sh"
+
+make_files 4
+
+"$BIN/mkdosfs" -F 16 --blocks 40000 f16.img > /dev/null
+"$BIN/mcopy" -i f16.img f1.txt f2.txt f3.txt f4.txt :: < /dev/null
+
+before=$(clusters f16.img)
+"$BIN/mresize" -i f16.img --fit > /dev/null || fail "FAT16 --fit failed"
+
+[ "$(fat_type f16.img)" = 16 ] || fail "FAT16 --fit changed the FAT type"
+[ "$(clusters f16.img)" -lt "$before" ] || fail "FAT16 --fit did not shrink the volume"
+
+same_file f16.img F2.TXT f2.txt
+
+"$BIN/mresize" -i f16.img --blocks 30000 > /dev/null || fail "FAT16 grow failed"
+
+[ "$(wc -c < f16.img)" -ge $((30000 * 1024)) ] || fail "the image did not grow"
+same_file f16.img F3.TXT f3.txt
+
+# --check only plans.
+cp f16.img copy.img
+"$BIN/mresize" -i f16.img --check --blocks 20000 > /dev/null || fail "--check failed"
+cmp f16.img copy.img || fail "--check changed the image"
+
+# FAT32 --fit stops at the smallest cluster count FAT32 allows, and an
+# explicit size below it is refused.
+"$BIN/mkdosfs" -F 32 --blocks 300000 f32.img > /dev/null
+"$BIN/mcopy" -i f32.img f1.txt f2.txt f3.txt f4.txt :: < /dev/null
+
+"$BIN/mresize" -i f32.img --fit > /dev/null || fail "FAT32 --fit failed"
+
+[ "$(fat_type f32.img)" = 32 ] || fail "FAT32 --fit changed the FAT type"
+[ "$(clusters f32.img)" -ge 65525 ] || fail "FAT32 --fit left $(clusters f32.img) clusters"
+
+same_file f32.img F4.TXT f4.txt
+
+if "$BIN/mresize" -i f32.img --blocks 100000 2> /dev/null; then
+    fail "FAT32 shrink below 65525 clusters was accepted"
+fi
+
+# A FAT32 volume made below that minimum can still be resized.
+mkdir tree && cp f1.txt f2.txt tree/
+
+"$BIN/mkdosfs" -F 32 --fit tree -d tree small.img > /dev/null
+[ "$(clusters small.img)" -lt 65525 ] || fail "the fitted FAT32 volume was expected to be small"
+
+"$BIN/mresize" -i small.img --blocks 3000 > /dev/null || fail "growing a small FAT32 volume failed"
+[ "$(fat_type small.img)" = 32 ] || fail "growing a small FAT32 volume changed the FAT type"
+
+"$BIN/mresize" -i small.img --fit > /dev/null || fail "--fit on a small FAT32 volume failed"
+same_file small.img F2.TXT f2.txt
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Files survive copying in, deleting around them, defragmenting and growing
+# the volume on every FAT type.
+. "$TESTS/common.sh"
+
+make_files 12
+
+for fat in 12 16 32; do
+
+    case $fat in
+        12) blocks=1400 ;;
+        16) blocks=40000 ;;
+        32) blocks=300000 ;;
+    esac
+    
+    img=f$fat.img
+    
+    "$BIN/mkdosfs" -F $fat --blocks $blocks $img > /dev/null
+    "$BIN/mcopy" -i $img f1.txt f2.txt f3.txt f4.txt f5.txt f6.txt f7.txt f8.txt :: < /dev/null
+    
+    "$BIN/mdel" -i $img ::F2.TXT ::F5.TXT ::F7.TXT
+    "$BIN/mcopy" -i $img f12.txt ::A.TXT < /dev/null
+    "$BIN/mcopy" -i $img f9.txt ::B.TXT < /dev/null
+    "$BIN/mdel" -i $img ::F3.TXT
+    "$BIN/mcopy" -i $img f10.txt ::C.TXT < /dev/null
+    
+    "$BIN/mdefrag" -i $img > /dev/null
+    "$BIN/mresize" -i $img --blocks $((blocks + blocks / 8)) > /dev/null
+    
+    [ "$(fat_type $img)" = $fat ] || fail "FAT$fat image changed type"
+    
+    same_file $img F1.TXT f1.txt
+    same_file $img F8.TXT f8.txt
+    same_file $img A.TXT f12.txt
+    same_file $img B.TXT f9.txt
+    same_file $img C.TXT f10.txt
+    
+    if "$BIN/mls" -i $img | grep -q '^F5.TXT'; then
+        fail "FAT$fat: a deleted file is still listed"
+    fi
+
+done
@@ -0,0 +1,34 @@
+#!/bin/sh
+# mscript formats an image and fills it from one script, committing once.
+. "$TESTS/common.sh"
+
+make_files 3
+
+cat > build.txt <<END
+format --blocks 2000 -n SCRIPTED
+mkdir -p ::A/B
+copy f1.txt ::A/B/ONE.TXT
+copy f2.txt f3.txt ::A
+label BUILT
+commit
+copy ::A/F2.TXT back.txt
+END
+
+"$BIN/mscript" -i s.img build.txt || fail "the script failed"
+
+same_file s.img A/B/ONE.TXT f1.txt
+same_file s.img A/F3.TXT f3.txt
+
+cmp back.txt f2.txt || fail "copying out of the image in the script failed"
+[ "$(dd if=s.img bs=1 skip=43 count=5 2> /dev/null)" = BUILT ] || fail "the label was not set"
+
+# A failing step stops the script before anything more is committed.
+printf 'mkdir ::LATE\ncopy missing.txt ::LATE\n' > bad.txt
+
+if "$BIN/mscript" -i s.img bad.txt 2> /dev/null; then
+    fail "a script with a missing file succeeded"
+fi
+
+if "$BIN/mls" -i s.img | grep -q '^LATE'; then
+    fail "a failed script committed its changes"
+fi
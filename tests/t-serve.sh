@@ -0,0 +1,46 @@
+#!/bin/sh
+# A client talks to an mserve holding the image open; the changes reach the
+# image when the server shuts down.
+. "$TESTS/common.sh"
+
+make_files 2
+"$BIN/mkdosfs" --blocks 2000 s.img > /dev/null
+
+"$BIN/mserve" -i s.img --socket sock &
+server=$!
+
+trap 'kill $server 2> /dev/null || true' EXIT
+
+tries=0
+
+while [ ! -S sock ]; do
+
+    tries=$((tries + 1))
+    [ $tries -le 50 ] || fail "the server never opened its socket"
+    
+    sleep 0.1
+
+done
+
+client () {
+    "$BIN/mserve" --socket sock -c "$@"
+}
+
+client mkdir -p ::A/B || fail "mkdir failed"
+client copy f1.txt f2.txt ::A/B || fail "copy in failed"
+
+client list ::A/B | grep -q '^F2.TXT' || fail "the listing misses a copied file"
+client stat ::A/B/F1.TXT | grep -q "$(($(wc -c < f1.txt)))" || fail "stat gave the wrong size"
+
+client copy ::A/B/F2.TXT back.txt || fail "copy out failed"
+cmp back.txt f2.txt || fail "the file copied out differs"
+
+if client stat ::MISSING 2> /dev/null; then
+    fail "stat of a missing file succeeded"
+fi
+
+client shutdown
+wait $server
+
+same_file s.img A/B/F1.TXT f1.txt
+same_file s.img A/B/F2.TXT f2.txt
@@ -0,0 +1,19 @@
+#!/bin/sh
+# mkdosfs writes a whole image to standard output when the output file is
+# -, whether that is a file or a pipe, empty or filled from a tree.
+. "$TESTS/common.sh"
+
+make_files 3
+mkdir -p tree/sub && cp f1.txt f2.txt tree/ && cp f3.txt tree/sub/
+
+"$BIN/mkdosfs" --blocks 1400 - > empty.img
+[ "$(wc -c < empty.img)" -eq $((1400 * 1024)) ] || fail "the streamed image has the wrong size"
+
+"$BIN/mcopy" -i empty.img f1.txt ::ONE.TXT < /dev/null
+same_file empty.img ONE.TXT f1.txt
+
+"$BIN/mkdosfs" --blocks 4000 -d tree - | cat > piped.img
+[ "$(wc -c < piped.img)" -eq $((4000 * 1024)) ] || fail "the piped image has the wrong size"
+
+same_file piped.img F2.TXT f2.txt
+same_file piped.img SUB/F3.TXT f3.txt
@@ -0,0 +1,39 @@
+#!/bin/sh
+# mkdosfs -c marks the clusters it cannot read as bad and leaves the rest
+# free.  Unreadable clusters are faked with a pread shim.
+. "$TESTS/common.sh"
+
+${CC:-cc} -shared -fPIC -o badread.so "$TESTS/badread.c" -ldl || fail "cannot build the pread shim"
+
+"$BIN/mkdosfs" -F 16 -c --blocks 40000 clean.img > /dev/null || fail "-c failed on a good image"
+
+# The byte offset in an image of data cluster $2.
+cluster_offset () {
+
+    data=$(($(field "$1" 14 2) + $(field "$1" 16 1) * $(field "$1" 22 2) + ($(field "$1" 17 2) * 32 + 511) / 512))
+    echo $(((data + ($2 - 2) * $(field "$1" 13 1)) * 512))
+
+}
+
+bad="$(cluster_offset clean.img 100),$(($(cluster_offset clean.img 5000) + 700))"
+cp clean.img bad.img
+
+BAD_OFFSETS=$bad LD_PRELOAD=./badread.so "$BIN/mkdosfs" -F 16 -c --blocks 40000 bad.img > /dev/null 2>&1
+
+for c in 99 100 101 4999 5000 5001; do
+
+    case $c in
+        100 | 5000) want=65527 ;;
+        *) want=0 ;;
+    esac
+    
+    [ "$(field bad.img $((512 * $(field bad.img 14 2) + c * 2)) 2)" -eq $want ] || fail "FAT16 entry $c is wrong"
+
+done
+
+# The good image has no bad cluster at all.
+[ "$(od -An -tx2 -v -j $((512 * $(field clean.img 14 2))) -N $((512 * $(field clean.img 22 2))) clean.img | grep -c fff7)" -eq 0 ] || fail "-c marked clusters bad on a good image"
+
+if "$BIN/mkdosfs" --blocks 1400 -c - > /dev/null 2>&1; then
+    fail "-c was accepted when writing to standard output"
+fi
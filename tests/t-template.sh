@@ -0,0 +1,31 @@
+#!/bin/sh
+# A format from the template cache is byte for byte the format mkdosfs
+# would have made without it, on a miss and on a hit, whatever the offset.
+. "$TESTS/common.sh"
+
+mkdir cache
+
+for fat in 12 16 32; do
+
+    case $fat in
+        12) blocks=1400 ;;
+        16) blocks=40000 ;;
+        32) blocks=300000 ;;
+    esac
+    
+    for offset in 0 63; do
+    
+        for pass in miss hit; do
+        
+            rm -f plain.img cached.img
+            
+            "$BIN/mkdosfs" -F $fat --timestamp 1000 --volume-id 1234-ABCD -n LABEL --offset $offset --blocks $blocks plain.img > /dev/null
+            "$BIN/mkdosfs" -F $fat --timestamp 1000 --volume-id 1234-ABCD -n LABEL --offset $offset --blocks $blocks --template cache cached.img > /dev/null
+            
+            cmp plain.img cached.img || fail "FAT$fat at offset $offset differs from the template on a $pass"
+        
+        done
+    
+    done
+
+done
@@ -0,0 +1,49 @@
+#!/bin/sh
+# msync --watch keeps the image in step with the host tree: files created,
+# changed and removed after the first sync show up in the image.
+. "$TESTS/common.sh"
+
+make_files 3
+mkdir tree && cp f1.txt tree/
+
+"$BIN/mkdosfs" --blocks 2000 w.img > /dev/null
+
+"$BIN/msync" -i w.img --watch --debounce 50 tree ::T > /dev/null &
+watcher=$!
+
+trap 'kill $watcher 2> /dev/null || true' EXIT
+
+# Poll the image until the shell condition given holds.
+wait_for () {
+
+    tries=0
+    
+    until eval "$1"; do
+    
+        tries=$((tries + 1))
+        [ $tries -le 100 ] || fail "timed out waiting for: $1"
+        
+        sleep 0.1
+    
+    done
+
+}
+
+listed () {
+    "$BIN/mls" -i w.img T 2> /dev/null | grep -q "^$1 "
+}
+
+wait_for "listed F1.TXT"
+
+cp f2.txt tree/
+mkdir tree/sub && cp f3.txt tree/sub/
+rm tree/f1.txt
+
+wait_for "listed F2.TXT && listed SUB && ! listed F1.TXT"
+wait_for "\"$BIN/mls\" -i w.img T/SUB 2> /dev/null | grep -q '^F3.TXT '"
+
+kill $watcher
+wait $watcher || true
+
+same_file w.img T/F2.TXT f2.txt
+same_file w.img T/SUB/F3.TXT f3.txt